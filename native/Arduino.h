@@ -0,0 +1,121 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+/**
+ * The subset of the Arduino and FreeRTOS API used by the control code, for the
+ * native build (GENSET_NATIVE). Time runs on the virtual clock of hal_native.h.
+ *
+ * There are no pin functions on purpose, the control code must use hal for them.
+ * Tasks do not exist, everything runs in the thread of the simulator.
+ */
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using std::max;
+using std::min;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLDOWN 0x09
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+#define IRAM_ATTR
+
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+inline size_t strlcpy(char* destination, const char* source, size_t size) {
+  size_t length = strlen(source);
+  if (size > 0) {
+    size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, copied);
+    destination[copied] = '\0';
+  }
+  return length;
+}
+#endif
+
+// Arduino String on top of std::string
+class String : public std::string {
+  public:
+    String(const char* text = "") : std::string(text ? text : "") {}
+    String(const std::string& text) : std::string(text) {}
+    explicit String(char c) : std::string(1, c) {}
+    explicit String(unsigned char value) : std::string(std::to_string(value)) {}
+    explicit String(int value) : std::string(std::to_string(value)) {}
+    explicit String(unsigned int value) : std::string(std::to_string(value)) {}
+    explicit String(long value) : std::string(std::to_string(value)) {}
+    explicit String(unsigned long value) : std::string(std::to_string(value)) {}
+    explicit String(long long value) : std::string(std::to_string(value)) {}
+    explicit String(unsigned long long value) : std::string(std::to_string(value)) {}
+    explicit String(float value, unsigned int decimals = 2) : std::string(format(value, decimals)) {}
+    explicit String(double value, unsigned int decimals = 2) : std::string(format(value, decimals)) {}
+
+    unsigned int length() const { return size(); }
+    bool isEmpty() const { return empty(); }
+    bool startsWith(const String& prefix) const { return compare(0, prefix.size(), prefix) == 0; }
+    bool endsWith(const String& suffix) const {
+      return size() >= suffix.size() && compare(size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    String substring(unsigned int from) const { return from < size() ? String(substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const {
+      return from < size() && from < to ? String(substr(from, to - from)) : String();
+    }
+    long toInt() const { return atol(c_str()); }
+
+  private:
+    static std::string format(double value, unsigned int decimals) {
+      char buffer[48];
+      snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, value);
+      return buffer;
+    }
+};
+
+inline String operator+(const String& a, const char* b) {
+  std::string result(a);
+  result += b;
+  return result;
+}
+inline String operator+(const String& a, const String& b) { return a + b.c_str(); }
+inline String operator+(const char* a, const String& b) { return String(a) + b.c_str(); }
+
+// Virtual clock, implemented in hal_native.cpp
+unsigned long millis();
+unsigned long micros();
+int64_t esp_timer_get_time();
+void delay(uint32_t ms);
+
+class EspClass {
+  public:
+    // Cycles of a 240 MHz CPU on the virtual clock, callbacks take no time
+    uint32_t getCycleCount() { return (uint32_t)(esp_timer_get_time() * 240); }
+    uint32_t getCpuFreqMHz() { return 240; }
+};
+extern EspClass ESP;
+
+// FreeRTOS, there is only one thread
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(lock) (void)(lock)
+#define portEXIT_CRITICAL(lock) (void)(lock)
+#define portENTER_CRITICAL_SAFE(lock) (void)(lock)
+#define portEXIT_CRITICAL_SAFE(lock) (void)(lock)
+#define portENTER_CRITICAL_ISR(lock) (void)(lock)
+#define portEXIT_CRITICAL_ISR(lock) (void)(lock)
+
+typedef void* TaskHandle_t;
+inline void xTaskNotifyGive(TaskHandle_t) {}
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
@@ -0,0 +1,13 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+// The native build keeps the settings in RAM, see hal_native.h
+#include "../src/memory_settings_store.h"
+
+using Preferences = MemorySettingsStore;
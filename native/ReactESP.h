@@ -0,0 +1,132 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <set>
+#include <vector>
+
+/**
+ * Timed events of ReactESP for the native build (GENSET_NATIVE), with the same
+ * semantics on the virtual clock: a delayed callback fires once at the first tick
+ * after its delay, a repeated callback every interval after the previous due time,
+ * unless it fell more than one interval behind. Events due at the same time fire
+ * in the order they were registered.
+ *
+ * nextDueMicros(), nextDelayMicros() and fastForward() are extensions, the simulator
+ * advances the clock straight to the next due event and skips the repeated events
+ * while the control code is idle, instead of ticking through idle time.
+ */
+namespace reactesp {
+
+class EventLoop;
+
+class TimedEvent {
+  public:
+    TimedEvent(uint64_t interval, std::function<void()> callback, bool repeat)
+        : interval(interval), callback(std::move(callback)), repeat(repeat) {}
+
+  private:
+    friend class EventLoop;
+    uint64_t interval;  // us
+    uint64_t dueAt = 0;
+    uint64_t order = 0;
+    std::function<void()> callback;
+    bool repeat;
+};
+
+class DelayEvent : public TimedEvent {
+  public:
+    using TimedEvent::TimedEvent;
+};
+
+class RepeatEvent : public TimedEvent {
+  public:
+    using TimedEvent::TimedEvent;
+};
+
+class EventLoop {
+  public:
+    DelayEvent* onDelay(uint32_t delay, std::function<void()> callback) {
+      auto* event = new DelayEvent((uint64_t)delay * 1000, std::move(callback), false);
+      schedule(event, esp_timer_get_time() + event->interval);
+      delays.insert(event->dueAt);
+      return event;
+    }
+
+    RepeatEvent* onRepeat(uint32_t interval, std::function<void()> callback) {
+      auto* event = new RepeatEvent((uint64_t)interval * 1000, std::move(callback), true);
+      schedule(event, esp_timer_get_time() + event->interval);
+      return event;
+    }
+
+    // Fires every event that is due
+    void tick() {
+      uint64_t now = esp_timer_get_time();
+      while (!queue.empty() && queue.top()->dueAt <= now) {
+        TimedEvent* event = queue.top();
+        queue.pop();
+        event->callback();
+        if (!event->repeat) {
+          delays.erase(delays.find(event->dueAt));
+          delete event;
+          continue;
+        }
+        // Like ReactESP, a repeated event more than one interval behind starts over from now
+        uint64_t next = event->dueAt + event->interval;
+        schedule(event, next < now ? now + event->interval : next);
+      }
+    }
+
+    // Due time of the next event in us on the virtual clock, UINT64_MAX if there is none
+    uint64_t nextDueMicros() const { return queue.empty() ? UINT64_MAX : queue.top()->dueAt; }
+
+    // Due time of the next delayed event in us, UINT64_MAX if there is none
+    uint64_t nextDelayMicros() const { return delays.empty() ? UINT64_MAX : *delays.begin(); }
+
+    /**
+     * Moves every repeated event forward by whole intervals to its first due time at or
+     * after the given time, as if it had fired in between without doing anything. The
+     * caller has to make sure the skipped calls would have had no effect and that no
+     * delayed event is due before the given time.
+     */
+    void fastForward(uint64_t to) {
+      // Popped in firing order, the moved events are rescheduled in that order like by tick()
+      std::vector<TimedEvent*> events;
+      for (; !queue.empty(); queue.pop()) events.push_back(queue.top());
+      for (TimedEvent* event : events) {
+        if (event->repeat && event->dueAt < to) {
+          schedule(event, event->dueAt + (to - event->dueAt + event->interval - 1) / event->interval * event->interval);
+        } else {
+          queue.push(event);
+        }
+      }
+    }
+
+  private:
+    struct Later {
+      bool operator()(const TimedEvent* a, const TimedEvent* b) const {
+        return a->dueAt != b->dueAt ? a->dueAt > b->dueAt : a->order > b->order;
+      }
+    };
+
+    void schedule(TimedEvent* event, uint64_t dueAt) {
+      event->dueAt = dueAt;
+      event->order = nextOrder++;
+      queue.push(event);
+    }
+
+    std::priority_queue<TimedEvent*, std::vector<TimedEvent*>, Later> queue;
+    uint64_t nextOrder = 0;
+    std::multiset<uint64_t> delays;  // Due times of the delayed events
+};
+
+}  // namespace reactesp
@@ -0,0 +1,156 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include "command.h"
+
+/**
+ * Decides which START or STOP intent is in effect when several command sources disagree.
+ *
+ * Every source owns one slot holding its latest intent. Hardwired intents are held as long
+ * as the input is active, all others expire after their TTL. The effective intent is the one
+ * with the highest priority, STOP beats START at equal priority and a newer intent beats an
+ * older one. With one slot per source, resolving always costs the same.
+ *
+ * The arbiter must only be used by the control task.
+ */
+class CommandArbiter {
+  public:
+    // Priorities, higher wins
+    static constexpr uint8_t PRIORITY_GPIO_STOP = 5;   // Hardwired STOP always wins
+    static constexpr uint8_t PRIORITY_HTTP = 4;        // Local operator overrides the hardwired START
+    static constexpr uint8_t PRIORITY_GPIO_START = 3;
+    static constexpr uint8_t PRIORITY_REMOTE = 2;      // Modbus and MQTT
+    static constexpr uint8_t PRIORITY_INTERNAL = 1;    // Timers of the control loop itself
+
+    static constexpr uint32_t NO_EXPIRY = 0;
+    static constexpr uint32_t OVERRIDE_TTL = 30 * 60 * 1000;  // 30 minutes for HTTP and remote intents
+
+    struct Intent {
+      Command command;
+      uint8_t priority;
+      uint32_t sequence;     // Increases with every submitted intent
+      uint32_t submittedAt;  // millis()
+      uint32_t ttl;          // ms, NO_EXPIRY for held intents
+      bool active;
+    };
+
+    static uint8_t priorityOf(const Command& command) {
+      switch (command.source) {
+        case COMMAND_SOURCE_GPIO: return command.type == COMMAND_STOP ? PRIORITY_GPIO_STOP : PRIORITY_GPIO_START;
+        case COMMAND_SOURCE_HTTP: return PRIORITY_HTTP;
+        case COMMAND_SOURCE_MODBUS:
+        case COMMAND_SOURCE_MQTT: return PRIORITY_REMOTE;
+        default: return PRIORITY_INTERNAL;
+      }
+    }
+
+    static uint32_t ttlOf(const Command& command) {
+      return command.source == COMMAND_SOURCE_GPIO ? NO_EXPIRY : OVERRIDE_TTL;
+    }
+
+    /**
+     * Replaces the intent of the command's source.
+     *
+     * @param command A COMMAND_START or COMMAND_STOP command.
+     * @param now Current millis().
+     */
+    void submit(const Command& command, uint32_t now) {
+      Intent& intent = slots[command.source];
+      intent.command = command;
+      intent.priority = priorityOf(command);
+      intent.sequence = ++sequence;
+      intent.submittedAt = now;
+      intent.ttl = ttlOf(command);
+      intent.active = true;
+    }
+
+    // Withdraws the intent of a source, e.g. when a hardwired input was released
+    void clear(CommandSource source) {
+      slots[source].active = false;
+    }
+
+    /**
+     * Expires old intents and returns the effective one.
+     *
+     * @param now Current millis().
+     * @return The effective intent or nullptr if no source has an active intent.
+     */
+    const Intent* resolve(uint32_t now) {
+      const Intent* winner = nullptr;
+      for (Intent& intent : slots) {
+        if (!intent.active) continue;
+        if (intent.ttl != NO_EXPIRY && now - intent.submittedAt >= intent.ttl) {
+          intent.active = false;
+          continue;
+        }
+        if (winner == nullptr || beats(intent, *winner)) winner = &intent;
+      }
+      return winner;
+    }
+
+    /**
+     * Returns the effective intent if it has to be executed, that is if it was submitted
+     * after the last executed intent. Falling back to an older intent, because the intent
+     * that overrode it was withdrawn or expired, causes no action: a held START must not
+     * start the generator once a web STOP expires. Expiring intents asking for the opposite
+     * of the effective one are dropped, so a web START overridden by a hardwired STOP does
+     * not come back when STOP is released. The source has to submit its intent again.
+     *
+     * @param now Current millis().
+     * @return The intent to execute or nullptr.
+     */
+    const Intent* nextAction(uint32_t now) {
+      const Intent* winner = resolve(now);
+      if (winner == nullptr) return nullptr;
+      for (Intent& intent : slots) {
+        if (intent.active && intent.ttl != NO_EXPIRY && intent.command.type != winner->command.type) intent.active = false;
+      }
+      if (hasActed && (int32_t)(winner->sequence - actedSequence) <= 0) return nullptr;
+      acknowledge(*winner);
+      return winner;
+    }
+
+    // Marks the intent as executed without executing it, e.g. for the initial input states
+    void acknowledge(const Intent& intent) {
+      hasActed = true;
+      actedSequence = intent.sequence;
+    }
+
+    const Intent& slot(CommandSource source) const { return slots[source]; }
+
+    /**
+     * Returns the time until the first active intent expires.
+     *
+     * @param now Current millis().
+     * @return ms until the expiry, UINT32_MAX if no active intent expires.
+     */
+    uint32_t msUntilExpiry(uint32_t now) const {
+      uint32_t next = UINT32_MAX;
+      for (const Intent& intent : slots) {
+        if (!intent.active || intent.ttl == NO_EXPIRY) continue;
+        uint32_t age = now - intent.submittedAt;
+        next = std::min(next, age >= intent.ttl ? 0u : intent.ttl - age);
+      }
+      return next;
+    }
+
+  private:
+    static bool beats(const Intent& a, const Intent& b) {
+      if (a.priority != b.priority) return a.priority > b.priority;
+      if (a.command.type != b.command.type) return a.command.type == COMMAND_STOP;
+      return (int32_t)(a.sequence - b.sequence) > 0;
+    }
+
+    Intent slots[COMMAND_SOURCE_COUNT] = {};
+    uint32_t sequence = 0;
+    bool hasActed = false;
+    uint32_t actedSequence = 0;
+};
@@ -0,0 +1,239 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#ifdef GENSET_BENCHMARK
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include "benchmark.h"
+#include "control.h"
+#include "crc16.h"
+#include "gpio_trace.h"
+#include "hal.h"
+#include "pins.h"
+#include "start_stats.h"
+#include "status.h"
+#ifdef GENSET_NATIVE
+#include <chrono>
+#include <new>
+#endif
+
+#if !(defined(AUTO_FW_VERSION))
+  #define AUTO_FW_VERSION "0.0.0-dev"
+#endif
+
+#ifdef GENSET_NATIVE
+// Drives the inputs of the GPIO model, which calls the interrupt handlers like the wiring
+static void setInputs(uint64_t levels) {
+  for (uint8_t pin : {START_SIGNAL, STOP_SIGNAL, RUNNING_SIGNAL}) hal::setInput(pin, (levels >> pin) & 1);
+}
+#else
+// Code under test, implemented in main.cpp
+String renderMainPage(const GensetStatus& status);
+String renderLog();
+
+namespace hal {
+  bool simulatePins = false;
+  uint64_t simulatedPins = 0;
+}
+
+static void setInputs(uint64_t levels) {
+  hal::simulatedPins = levels;
+}
+#endif
+
+// Heap allocations, counted by the wrappers below while enabled
+static std::atomic<bool> countAllocations{false};
+static std::atomic<uint32_t> allocations{0};
+static std::atomic<uint32_t> allocatedBytes{0};
+
+extern "C" {
+  void* __real_malloc(size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+
+  // Installed with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc in the esp32dev-bench and native-bench environments
+  void* __wrap_malloc(size_t size) {
+    if (countAllocations.load(std::memory_order_relaxed)) {
+      allocations.fetch_add(1, std::memory_order_relaxed);
+      allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    return __real_malloc(size);
+  }
+
+  void* __wrap_calloc(size_t count, size_t size) {
+    if (countAllocations.load(std::memory_order_relaxed)) {
+      allocations.fetch_add(1, std::memory_order_relaxed);
+      allocatedBytes.fetch_add(count * size, std::memory_order_relaxed);
+    }
+    return __real_calloc(count, size);
+  }
+
+  void* __wrap_realloc(void* ptr, size_t size) {
+    if (countAllocations.load(std::memory_order_relaxed)) {
+      allocations.fetch_add(1, std::memory_order_relaxed);
+      allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    return __real_realloc(ptr, size);
+  }
+}
+
+#ifdef GENSET_NATIVE
+// The wrap only covers calls from the firmware objects, not the ones inside libstdc++,
+// so String and the other containers allocate through malloc() of this file
+void* operator new(size_t size) {
+  void* ptr = malloc(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+#endif
+
+/**
+ * Runs a benchmark and prints its result as one JSON line.
+ *
+ * @param name Name of the benchmark, stable across firmware versions.
+ * @param iterations Number of times fn is called.
+ * @param fn Operation to measure, gets the iteration number.
+ */
+template <typename Fn>
+static void measure(const char* name, uint32_t iterations, Fn fn) {
+  allocations.store(0, std::memory_order_relaxed);
+  allocatedBytes.store(0, std::memory_order_relaxed);
+  countAllocations.store(true, std::memory_order_relaxed);
+#ifdef GENSET_NATIVE
+  // The virtual clock of hal does not move while the code runs, use the one of the host
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) fn(i);
+  double nsPerOp = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+  countAllocations.store(false, std::memory_order_relaxed);
+#else
+  uint32_t start = ESP.getCycleCount();
+  for (uint32_t i = 0; i < iterations; i++) fn(i);
+  uint32_t cycles = ESP.getCycleCount() - start;
+  countAllocations.store(false, std::memory_order_relaxed);
+
+  double nsPerOp = (double)cycles * 1000.0 / ESP.getCpuFreqMHz() / iterations;
+#endif
+  JsonDocument doc;
+  doc["version"] = AUTO_FW_VERSION;
+  doc["name"] = name;
+  doc["iterations"] = iterations;
+  doc["nsPerOp"] = (uint32_t)nsPerOp;
+  doc["opsPerSec"] = (uint32_t)(1e9 / std::max(nsPerOp, 1.0));
+  doc["allocsPerOp"] = (float)allocations.load(std::memory_order_relaxed) / iterations;
+  doc["bytesPerOp"] = allocatedBytes.load(std::memory_order_relaxed) / iterations;
+#ifdef GENSET_NATIVE
+  char line[256];
+  serializeJson(doc, line, sizeof(line));
+  printf("BENCH %s\n", line);
+#else
+  Serial.print("BENCH ");
+  serializeJson(doc, Serial);
+  Serial.println();
+  Serial.flush();
+#endif
+}
+
+void runBenchmarks() {
+  // logMessage() includes printing to Serial on the device, the native build only formats the message
+  measure("logMessage", 200, [](uint32_t i) {
+    logMessage("[BENCH] Benchmark log message number " + String(i));
+  });
+
+#ifndef GENSET_NATIVE
+  // The log buffer is full now
+  measure("renderLog", 100, [](uint32_t) {
+    String html = renderLog();
+  });
+
+  GensetStatus status = gensetStatus.read();
+  status.allowStart = true;
+  measure("renderMainPage", 100, [&status](uint32_t) {
+    String html = renderMainPage(status);
+  });
+#endif
+
+  // Inputs bouncing on every call never settle, so no intent is submitted and the
+  // real pin states take over again afterwards
+  checkForSignals();  // Initializes from the real pins
+#ifndef GENSET_NATIVE
+  hal::simulatePins = true;
+#endif
+  measure("checkForSignals.bouncing", 10000, [](uint32_t i) {
+    setInputs((i & 1) ? (1ULL << START_SIGNAL) | (1ULL << STOP_SIGNAL) : 0);
+    checkForSignals();
+  });
+  measure("checkRunningSignal.bouncing", 10000, [](uint32_t i) {
+    setInputs((i & 1) ? (1ULL << RUNNING_SIGNAL) : 0);
+    runningSignalChanged = true;
+    checkRunningSignal();
+  });
+#ifdef GENSET_NATIVE
+  setInputs(0);
+#else
+  hal::simulatePins = false;
+#endif
+
+  uint8_t retryCount = getRetryCount();
+  measure("nvs.setRetryCount", 1000, [](uint32_t i) {
+    setRetryCount(i % 10);
+  });
+  measure("nvs.getRetryCount", 1000, [](uint32_t) {
+    getRetryCount();
+  });
+  setRetryCount(retryCount);
+
+  // The start statistics are the largest blob in NVS, written after every start cycle.
+  // A separate instance in its own namespace keeps the statistics of the firmware intact.
+  static StartStats stats;
+  stats.begin("benchStats");
+  measure("nvs.startStats.save", 100, [](uint32_t) {
+    stats.beginCycle(100, hal::now());
+    stats.finish(START_OUTCOME_ABORTED);
+    stats.save();
+  });
+  measure("nvs.startStats.load", 100, [](uint32_t) {
+    stats.begin("benchStats");
+  });
+  stats.reset();
+
+  // Largest Modbus RTU frame
+  static uint8_t frame[256];
+  for (size_t i = 0; i < sizeof(frame); i++) frame[i] = i * 31;
+  volatile uint16_t crc = 0;
+  measure("crc16.bitwise.256", 1000, [&crc](uint32_t) {
+    crc = crc16::bitwise(frame, sizeof(frame));
+  });
+  measure("crc16.table.256", 1000, [&crc](uint32_t) {
+    crc = crc16::table(frame, sizeof(frame));
+  });
+  measure("crc16.sliced.256", 1000, [&crc](uint32_t) {
+    crc = crc16::sliced(frame, sizeof(frame));
+  });
+
+  // The benchmarks are not part of the trace to replay
+  gpioTrace.reset();
+}
+
+#ifdef GENSET_NATIVE
+int main() {
+  setupControl();
+  runBenchmarks();
+  return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#ifdef GENSET_BENCHMARK
+
+/**
+ * Measures the hot paths of the firmware on the target and prints one line per benchmark:
+ *
+ *   BENCH {"version":"...","name":"logMessage","iterations":200,"nsPerOp":...,"opsPerSec":...,
+ *          "allocsPerOp":...,"bytesPerOp":...}
+ *
+ * The lines can be collected from the serial monitor and compared across firmware versions
+ * with tools/bench_compare.py. Only available in the esp32dev-bench environment, which keeps
+ * the settings in RAM and counts heap allocations by wrapping malloc and friends.
+ *
+ * Must be called from setup() before WiFi, the web server and the control task are started,
+ * so nothing else allocates or touches the signal state in between.
+ *
+ * The native-bench environment runs the same benchmarks on the PC against the GPIO model
+ * of hal_native.h, without the page rendering of main.cpp. Its numbers are only comparable
+ * with other runs on the same PC.
+ */
+void runBenchmarks();
+
+#endif
@@ -0,0 +1,48 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+
+// Where a command came from
+enum CommandSource : uint8_t {
+  COMMAND_SOURCE_GPIO = 0,      // Hardwired START/STOP inputs
+  COMMAND_SOURCE_HTTP = 1,      // Web UI and HTTP API
+  COMMAND_SOURCE_MODBUS = 2,    // Modbus
+  COMMAND_SOURCE_MQTT = 3,      // MQTT
+  COMMAND_SOURCE_INTERNAL = 4,  // Retries and other decisions of the control loop itself
+  COMMAND_SOURCE_COUNT
+};
+
+// What a command asks for
+enum CommandType : uint8_t {
+  COMMAND_START = 0,
+  COMMAND_STOP = 1,
+  COMMAND_RESET_START_STATS = 2,
+  COMMAND_SET_SETTING = 3,  // Changes a control setting, see setting and value
+};
+
+// A command with the time it was issued at its source
+struct Command {
+  CommandType type;
+  CommandSource source;
+  uint32_t issuedAt;  // micros() at the source, e.g. in the GPIO ISR or the web handler
+  uint8_t setting = 0;  // TraceSetting changed by COMMAND_SET_SETTING
+  uint32_t value = 0;   // New value of the setting
+};
+
+inline const char* commandSourceName(CommandSource source) {
+  switch (source) {
+    case COMMAND_SOURCE_GPIO: return "gpio";
+    case COMMAND_SOURCE_HTTP: return "http";
+    case COMMAND_SOURCE_MODBUS: return "modbus";
+    case COMMAND_SOURCE_MQTT: return "mqtt";
+    case COMMAND_SOURCE_INTERNAL: return "internal";
+    default: return "unknown";
+  }
+}
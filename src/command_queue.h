@@ -0,0 +1,94 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Bounded lock-free multi-producer single-consumer queue.
+ *
+ * Every cell carries a sequence number that tells producers and the consumer
+ * whether the cell is free or filled for their position (D. Vyukov's bounded
+ * queue). Producers claim a position with a CAS and never wait for each other
+ * or the consumer, a full queue is reported immediately.
+ *
+ * The position a value was queued at is returned as ticket. Tickets increase in
+ * the order values are popped, so they can be used as IDs to check whether a
+ * value was already consumed.
+ *
+ * @tparam T Trivially copyable element type.
+ * @tparam SIZE Capacity, must be a power of two.
+ */
+template <typename T, size_t SIZE>
+class MpscQueue {
+  static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+  public:
+    MpscQueue() {
+      for (size_t i = 0; i < SIZE; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * Adds a value, safe to call from any number of tasks at once.
+     *
+     * @param value The value to add.
+     * @param ticket Receives the position of the value if not null.
+     * @return false if the queue is full.
+     */
+    bool push(const T& value, uint32_t* ticket = nullptr) {
+      uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = cells[pos & (SIZE - 1)];
+        int32_t diff = (int32_t)(cell.sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+          if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.data = value;
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            if (ticket) *ticket = pos;
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;  // Full
+        } else {
+          pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * Removes the oldest value, must only be called by the single consumer.
+     *
+     * @param value Receives the value.
+     * @param ticket Receives the position the value was queued at if not null.
+     * @return false if the queue is empty.
+     */
+    bool pop(T& value, uint32_t* ticket = nullptr) {
+      uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+      Cell& cell = cells[pos & (SIZE - 1)];
+      int32_t diff = (int32_t)(cell.sequence.load(std::memory_order_acquire) - (pos + 1));
+      if (diff < 0) return false;  // Empty, or the producer is still writing
+
+      value = cell.data;
+      cell.sequence.store(pos + SIZE, std::memory_order_release);
+      dequeuePos.store(pos + 1, std::memory_order_relaxed);
+      if (ticket) *ticket = pos;
+      return true;
+    }
+
+  private:
+    struct Cell {
+      std::atomic<uint32_t> sequence;
+      T data;
+    };
+
+    Cell cells[SIZE];
+    std::atomic<uint32_t> enqueuePos{0};
+    std::atomic<uint32_t> dequeuePos{0};
+};
@@ -0,0 +1,1151 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "control.h"
+#include "metrics.h"
+#include "perf_trace.h"
+#include "pins.h"
+
+const char* NVS_GENSET_CONTROL = "Genset";  // Name of the NVS namespace
+
+// NVS instance shared by all settings
+hal::SettingsStore preferences;
+
+// Configurable durations (default values)
+// defines how long the Relay should be turned on
+uint32_t powerUpDuration = 10000;  // 10 seconds
+uint32_t powerDownDuration = 10000; // 10 seconds
+
+uint8_t startMode = START_MODE_FIXED;
+uint32_t noStartTimeout = 15000;    // 15 seconds after K1 closed without RUNNING, a retry is triggered
+
+uint8_t stopMode = STOP_MODE_FIXED;
+uint32_t stopConfirmDuration = 2000;  // 2 seconds of RUNNING LOW confirm a stop
+uint8_t stopRetryCount = 2;           // Additional stop pulses if the generator keeps running
+
+uint32_t retryStartCount = 0;  // Amount of retries since the last state transition
+uint32_t startSequence = 0;    // Incremented on every start/stop, pending timers of older sequences are ignored
+unsigned long starterEngagedAt = 0;  // millis() when K1 was closed
+uint32_t retryStopCount = 0;   // Amount of stop retries since the last STOP request
+unsigned long stopperEngagedAt = 0;  // millis() when K2 was closed
+unsigned long runningStateSince = 0; // millis() of the last debounced RUNNING change
+
+// Start cycle analytics, persisted every START_STATS_SAVE_INTERVAL if changed
+StartStats startStats;
+const uint32_t START_STATS_SAVE_INTERVAL = 10 * 60 * 1000;  // 10 minutes
+
+// Latency in microseconds from a command at its source to the relay actuation, per source
+LogHistogram commandLatency[COMMAND_SOURCE_COUNT];
+
+// Variables for state tracking
+bool lastStartState = LOW; // START signal - request to start up the Generator
+bool lastStopState = LOW;  // STOP signal - request to stop the Generator
+bool runningState = LOW;   // RUNNING signal - status if the Generator is running
+bool ledState = LOW;       // State of the LED
+bool allowStart = true;    // Allow the generator to start
+uint8_t retryCount = 1;    // Retry count
+
+volatile bool runningSignalChanged = false;
+volatile uint32_t startEdgeAt = 0;      // micros() of the first START edge not yet handled
+volatile bool startEdgePending = false;
+volatile uint32_t stopEdgeAt = 0;       // micros() of the first STOP edge not yet handled
+volatile bool stopEdgePending = false;
+bool generatorStopping = false;
+bool generatorStarting = false;
+uint8_t relayActivity = 0;  // Relays closed since the last history sample, bit 0 K1, bit 1 K2
+
+// ReactESP event loop
+using namespace reactesp;
+EventLoop event_loop;
+
+// Tick duration and callback lateness of the event loop
+TickStats tickStats;
+
+// Commands of all other tasks for the control task
+MpscQueue<Command, CONTROL_QUEUE_LENGTH> controlQueue;
+std::atomic<uint32_t> lastAppliedCommandId{0};  // IDs are handed out in the order commands are applied
+TaskHandle_t controlTaskHandle = nullptr;
+
+// Status snapshot published by the control task for all readers
+Seqlock<GensetStatus> gensetStatus;
+
+// Decides which start/stop intent of all command sources is in effect
+CommandArbiter arbiter;
+
+/**
+ * Sets the power-up duration for the generator.
+ *
+ * Stores the specified duration in non-volatile storage (NVS) under the 
+ * "powerUpDuration" key and logs the operation.
+ *
+ * @param duration The duration in milliseconds for which the K1 relay should be turned on,
+ *                 must not be longer than the no-start timeout.
+ * @return true if the duration was successfully written to NVS, false otherwise.
+ */
+bool setPowerUpDuration(uint32_t duration) {
+  // The no-start check would release K1 before the end of the power up duration
+  if (duration > noStartTimeout) {
+    logMessage("[NVS] Power up duration " + String(duration) + " rejected, longer than the no-start timeout of " + String(noStartTimeout));
+    return false;
+  }
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUInt("powerUpDuration", duration);
+    powerUpDuration = duration;  // Move this BEFORE return
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_POWER_UP_DURATION, duration);
+    logMessage("[NVS] Power up duration set to " + String(duration));
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+/**
+ * Retrieves the power-up duration from non-volatile storage (NVS).
+ *
+ * This function accesses the NVS to obtain the stored duration for which the K1 relay should be 
+ * activated to start the generator. If no value has been stored previously, it returns the default
+ * power-up duration defined in the global variable `powerUpDuration`.
+ *
+ * @return The duration in milliseconds for which the K1 relay is to be turned on, or 0 if the 
+ *         NVS could not be accessed.
+ */
+uint32_t getPowerUpDuration() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    powerUpDuration = preferences.getUInt("powerUpDuration", powerUpDuration);
+    logMessage("[NVS] Loaded power up duration from NVS: " + String(powerUpDuration));
+    preferences.end();
+  }
+  return powerUpDuration;  // Always return the value
+}
+
+/**
+ * Sets the power-down duration for the generator.
+ *
+ * Stores the specified duration in non-volatile storage (NVS) under the
+ * "powerDownDuration" key and logs the operation.
+ *
+ * @param duration The duration in milliseconds for which the K2 relay should be turned on.
+ * @return true if the duration was successfully written to NVS, false otherwise.
+ */
+bool setPowerDownDuration(uint32_t duration) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUInt("powerDownDuration", duration);
+    powerDownDuration = duration;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_POWER_DOWN_DURATION, duration);
+    logMessage("[NVS] Power down duration set to " + String(duration));
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Retrieves the power-down duration from non-volatile storage (NVS).
+ *
+ * This function accesses the NVS to obtain the stored duration for which the K2 relay should be 
+ * activated to stop the generator. If no value has been stored previously, it returns the default
+ * power-down duration defined in the global variable `powerDownDuration`.
+ *
+ * @return The duration in milliseconds for which the K2 relay is to be turned on, or 0 if the 
+ *         NVS could not be accessed.
+ */
+uint32_t getPowerDownDuration() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    uint32_t duration = preferences.getUInt("powerDownDuration", powerDownDuration);
+    logMessage("[NVS] Loaded power down duration from NVS: " + String(duration));
+    preferences.end();
+    return duration;
+  } else {
+    return 0;
+  }
+}
+
+// Set whether the generator is allowed to start.
+//
+// This setting is stored in the non-volatile storage (NVS)
+//
+// @param state Whether the generator is allowed to start.
+// @return true if the setting was successfully written to NVS.
+bool setAllowStart(bool state) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putBool("allowStart", state);
+    logMessage("[NVS] Start allowance set to " + String(state));
+    allowStart = state;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_ALLOW_START, state);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+  /**
+   * Gets whether the generator is allowed to start from NVS, setting the 
+   * global allowStart variable to the result and returning it.
+   *
+   * @return true if the generator is allowed to start, false otherwise
+   */
+bool getAllowStart() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    allowStart = preferences.getBool("allowStart", true);
+    logMessage("[NVS] Loaded start allowance from NVS: " + String(allowStart));
+    preferences.end();
+    return allowStart;
+  } else {
+    return false;
+  }
+}
+
+  /**
+   * Sets the retry count of the generator to the given value.
+   *
+   * The retry count is the number of times the generator will be restarted after
+   * a failure before giving up. This value is stored in the non-volatile storage
+   * (NVS) and can be retrieved with getRetryCount.
+   *
+   * @param count The number of times the generator should be restarted before giving up.
+   * @return true if the setting was successfully written to NVS.
+   */
+bool setRetryCount(uint8_t count) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUInt("retryCount", count);
+    logMessage("[NVS] Retry count set to " + String(count));
+    retryCount = count;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_RETRY_COUNT, count);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+  /**
+   * Gets the retry count from NVS, setting the global retryCount variable to the result
+   * and returning it.
+   *
+   * The retry count is the number of times the generator will be restarted after
+   * a failure before giving up. This value can be changed with setRetryCount.
+   *
+   * @return The number of times the generator should be restarted before giving up.
+   */
+uint8_t getRetryCount() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    retryCount = (uint8_t)preferences.getUInt("retryCount", 3);
+    logMessage("[NVS] Loaded retry count from NVS: " + String(retryCount));
+    preferences.end();
+    return retryCount;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * Sets the start mode of the generator.
+ *
+ * START_MODE_FIXED holds K1 for the full power-up duration, START_MODE_UNTIL_RUNNING
+ * releases K1 as soon as the RUNNING signal goes HIGH. The value is stored in NVS.
+ *
+ * @param mode One of the StartMode values.
+ * @return true if the setting was successfully written to NVS.
+ */
+bool setStartMode(uint8_t mode) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUChar("startMode", mode);
+    logMessage("[NVS] Start mode set to " + String(mode));
+    startMode = mode;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_START_MODE, mode);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Gets the start mode from NVS, setting the global startMode variable to the result
+ * and returning it.
+ *
+ * @return The configured StartMode, START_MODE_FIXED if nothing was stored.
+ */
+uint8_t getStartMode() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    startMode = preferences.getUChar("startMode", START_MODE_FIXED);
+    logMessage("[NVS] Loaded start mode from NVS: " + String(startMode));
+    preferences.end();
+  }
+  return startMode;
+}
+
+/**
+ * Sets the no-start timeout.
+ *
+ * If the RUNNING signal did not go HIGH within this time after K1 was closed,
+ * the start attempt is considered failed and a retry is triggered.
+ *
+ * @param timeout The timeout in milliseconds, must not be shorter than the power up duration.
+ * @return true if the setting was successfully written to NVS.
+ */
+bool setNoStartTimeout(uint32_t timeout) {
+  // A shorter timeout would release K1 before the end of the power up duration
+  if (timeout < powerUpDuration) {
+    logMessage("[NVS] No-start timeout " + String(timeout) + " rejected, shorter than the power up duration of " + String(powerUpDuration));
+    return false;
+  }
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUInt("noStartTimeout", timeout);
+    logMessage("[NVS] No-start timeout set to " + String(timeout));
+    noStartTimeout = timeout;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_NO_START_TIMEOUT, timeout);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Gets the no-start timeout from NVS, setting the global noStartTimeout variable
+ * to the result and returning it.
+ *
+ * Must be loaded after the power up duration. A stored timeout shorter than the
+ * power up duration (stored by older firmware) is raised to it.
+ *
+ * @return The no-start timeout in milliseconds.
+ */
+uint32_t getNoStartTimeout() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    noStartTimeout = preferences.getUInt("noStartTimeout", noStartTimeout);
+    logMessage("[NVS] Loaded no-start timeout from NVS: " + String(noStartTimeout));
+    preferences.end();
+  }
+  if (noStartTimeout < powerUpDuration) {
+    noStartTimeout = powerUpDuration;
+    logMessage("[NVS] No-start timeout raised to the power up duration of " + String(powerUpDuration));
+  }
+  return noStartTimeout;
+}
+
+/**
+ * Sets the stop mode of the generator.
+ *
+ * STOP_MODE_FIXED holds K2 for the full power-down duration, STOP_MODE_UNTIL_STOPPED
+ * releases K2 once the RUNNING signal was LOW for the stop confirm duration and
+ * repeats the stop pulse if the generator keeps running. The value is stored in NVS.
+ *
+ * @param mode One of the StopMode values.
+ * @return true if the setting was successfully written to NVS.
+ */
+bool setStopMode(uint8_t mode) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUChar("stopMode", mode);
+    logMessage("[NVS] Stop mode set to " + String(mode));
+    stopMode = mode;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_MODE, mode);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Gets the stop mode from NVS, setting the global stopMode variable to the result
+ * and returning it.
+ *
+ * @return The configured StopMode, STOP_MODE_FIXED if nothing was stored.
+ */
+uint8_t getStopMode() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    stopMode = preferences.getUChar("stopMode", STOP_MODE_FIXED);
+    logMessage("[NVS] Loaded stop mode from NVS: " + String(stopMode));
+    preferences.end();
+  }
+  return stopMode;
+}
+
+/**
+ * Sets the stop confirm duration.
+ *
+ * The RUNNING signal has to be LOW for this time before a stop is confirmed.
+ *
+ * @param duration The duration in milliseconds.
+ * @return true if the setting was successfully written to NVS.
+ */
+bool setStopConfirmDuration(uint32_t duration) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUInt("stopConfirm", duration);
+    logMessage("[NVS] Stop confirm duration set to " + String(duration));
+    stopConfirmDuration = duration;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_CONFIRM_DURATION, duration);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Gets the stop confirm duration from NVS, setting the global stopConfirmDuration
+ * variable to the result and returning it.
+ *
+ * @return The stop confirm duration in milliseconds.
+ */
+uint32_t getStopConfirmDuration() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    stopConfirmDuration = preferences.getUInt("stopConfirm", stopConfirmDuration);
+    logMessage("[NVS] Loaded stop confirm duration from NVS: " + String(stopConfirmDuration));
+    preferences.end();
+  }
+  return stopConfirmDuration;
+}
+
+/**
+ * Sets the amount of additional stop pulses if the generator keeps running.
+ *
+ * @param count The number of stop retries.
+ * @return true if the setting was successfully written to NVS.
+ */
+bool setStopRetryCount(uint8_t count) {
+  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
+    bool success = preferences.putUChar("stopRetryCount", count);
+    logMessage("[NVS] Stop retry count set to " + String(count));
+    stopRetryCount = count;
+    gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_RETRY_COUNT, count);
+    preferences.end();
+    return success;
+  } else {
+    return false;
+  }
+}
+
+/**
+ * Gets the stop retry count from NVS, setting the global stopRetryCount variable
+ * to the result and returning it.
+ *
+ * @return The number of additional stop pulses.
+ */
+uint8_t getStopRetryCount() {
+  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
+    stopRetryCount = preferences.getUChar("stopRetryCount", stopRetryCount);
+    logMessage("[NVS] Loaded stop retry count from NVS: " + String(stopRetryCount));
+    preferences.end();
+  }
+  return stopRetryCount;
+}
+
+/**
+ * Records all settings relevant for the control logic in the GPIO trace,
+ * called once they were loaded from NVS. Later changes are recorded by the setters.
+ */
+void traceSettings() {
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_ALLOW_START, allowStart);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_START_MODE, startMode);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_MODE, stopMode);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_RETRY_COUNT, retryCount);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_RETRY_COUNT, stopRetryCount);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_POWER_UP_DURATION, powerUpDuration);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_POWER_DOWN_DURATION, powerDownDuration);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_NO_START_TIMEOUT, noStartTimeout);
+  gpioTrace.record(TRACE_SETTING, TRACE_SETTING_STOP_CONFIRM_DURATION, stopConfirmDuration);
+}
+
+/**
+ * Called once the no-start timeout after closing K1 has expired.
+ *
+ * If the generator is still not running, a still engaged starter is released and
+ * a new start attempt is made until retryCount is reached.
+ */
+void checkGeneratorStateAndRetry() {
+  if (runningState == HIGH) {
+    startStats.finish(START_OUTCOME_SUCCESS);  // Was already running, no time to RUNNING available
+    return;
+  }
+
+  if (generatorStarting) {
+    releaseStarter("no RUNNING signal within " + String(noStartTimeout) + " ms");
+  }
+
+  const CommandArbiter::Intent* intent = arbiter.resolve(hal::now());
+  if (allowStart && intent != nullptr && intent->command.type == COMMAND_START) {
+    // Generator should be running, but it's not. Retry until retryCount is reached
+    if (retryStartCount < retryCount) {
+      retryStartCount++;
+      metrics.startRetries.fetch_add(1, std::memory_order_relaxed);
+      logMessage("[CONTROL] Generator is not running. Retrying... (" + String(retryStartCount) + "/" + String(retryCount) + ")");
+      startGenerator({COMMAND_START, COMMAND_SOURCE_INTERNAL, hal::nowMicros()});
+      return;
+    }
+    logMessage("[ERROR] Generator failed to start after " + String(retryStartCount) + " retries");
+    fireEvent(WEBHOOK_START_FAILED, "No RUNNING signal after " + String(retryStartCount) + " retries");
+  }
+  startStats.finish(allowStart ? START_OUTCOME_FAILED : START_OUTCOME_ABORTED);
+}
+
+/**
+ * Turns off the K1 relay and ends the current start operation.
+ *
+ * @param reason Why the starter was released, used for logging.
+ */
+void releaseStarter(const String& reason) {
+  hal::writePin(RELAY_K1, LOW);  // Turn off K1 relay
+  generatorStarting = false;
+  unsigned long crankTime = hal::now() - starterEngagedAt;
+  startStats.addCrank(crankTime);
+  logMessage("[CONTROL] Starter released after " + String(crankTime) + " ms (" + reason + ")");
+}
+
+// Start the generator by turning on the K1 relay.
+//
+// In START_MODE_FIXED the relay is held for powerUpDuration. In START_MODE_UNTIL_RUNNING
+// checkRunningSignal() releases it as soon as the debounced RUNNING signal goes HIGH,
+// powerUpDuration only limits the maximum cranking time.
+//
+// @param command The command that caused the start, COMMAND_SOURCE_INTERNAL for retries.
+void startGenerator(const Command& command) {
+  PERF_SCOPE("startGenerator");
+  if (allowStart == false) {
+    logMessage("[CONTROL] Generator is not allowed to start. Ignoring START signal");
+    return;
+  }
+  
+  // Prevent starting while stopping
+  if (generatorStopping) {
+    logMessage("[CONTROL] Generator is currently shutting down. Ignoring START signal");
+    return;
+  }
+  
+  // Prevent multiple start operations
+  if (generatorStarting) {
+    logMessage("[CONTROL] Generator start already in progress, ignoring duplicate request");
+    return;
+  }
+    
+  generatorStarting = true;
+  uint32_t sequence = ++startSequence;
+  logMessage("[CONTROL] Starting generator...");
+  hal::writePin(RELAY_K1, HIGH); // Turn on K1 relay
+  starterEngagedAt = hal::now();
+  metrics.startAttempts.fetch_add(1, std::memory_order_relaxed);
+  if (command.source != COMMAND_SOURCE_INTERNAL) {
+    uint32_t latency = recordCommandLatency(command);
+    startStats.beginCycle(latency / 1000, starterEngagedAt);
+  } else {
+    startStats.addRetry();
+  }
+
+  tickStats.onDelay(event_loop, powerUpDuration, "powerUpElapsed", [sequence]() {
+    if (sequence != startSequence || !generatorStarting) return;
+    if (startMode == START_MODE_UNTIL_RUNNING) {
+      releaseStarter("maximum power up duration reached");
+      return;
+    }
+    hal::writePin(RELAY_K1, LOW);  // Turn off K1 relay
+    startStats.addCrank(hal::now() - starterEngagedAt);
+    logMessage("[CONTROL] Generator started");
+    generatorStarting = false;  // Reset flag after completion
+  });
+
+  // Retry if the generator is not running
+  tickStats.onDelay(event_loop, noStartTimeout, "noStartCheck", [sequence]() {
+    if (sequence == startSequence) checkGeneratorStateAndRetry();
+  });
+
+  hal::writePin(LED, HIGH);
+  tickStats.onDelay(event_loop, 2500, "ledOff", []() { hal::writePin(LED, LOW); });
+}
+
+// Stop the generator by turning on the K2 relay.
+//
+// In STOP_MODE_FIXED the relay is held for powerDownDuration. In STOP_MODE_UNTIL_STOPPED
+// checkStopConfirmation() releases it once RUNNING was LOW for stopConfirmDuration, and
+// the stop pulse is repeated up to stopRetryCount times if the generator keeps running.
+//
+// @param command The command that caused the stop.
+void stopGenerator(const Command& command) {
+  PERF_SCOPE("stopGenerator");
+  // Prevent multiple stop operations
+  if (generatorStopping) {
+    logMessage("[CONTROL] Generator stop already in progress, ignoring duplicate request");
+    return;
+  }
+
+  // Cancel any pending start operations
+  if (generatorStarting) {
+    generatorStarting = false;
+    hal::writePin(RELAY_K1, LOW);  // Ensure K1 is off
+    startStats.addCrank(hal::now() - starterEngagedAt);
+  }
+  startStats.finish(START_OUTCOME_ABORTED);
+
+  retryStopCount = 0;
+  metrics.stopCommands.fetch_add(1, std::memory_order_relaxed);
+  engageStopper();
+  recordCommandLatency(command);
+
+  hal::writePin(LED, HIGH);
+  tickStats.onDelay(event_loop, 2500, "ledOff", []() { hal::writePin(LED, LOW); });
+}
+
+/**
+ * Records the time from a command at its source until now, called right after
+ * the relay was actuated.
+ *
+ * @param command The command that caused the relay actuation.
+ * @return The latency in microseconds.
+ */
+uint32_t recordCommandLatency(const Command& command) {
+  uint32_t latency = hal::nowMicros() - command.issuedAt;
+  commandLatency[command.source].record(latency);
+  return latency;
+}
+
+/**
+ * Turns on the K2 relay for one stop pulse and schedules its end.
+ *
+ * Used for the initial stop pulse as well as for stop retries.
+ */
+void engageStopper() {
+  generatorStopping = true;
+  uint32_t sequence = ++startSequence;  // Invalidate pending start timers
+  logMessage("[CONTROL] Stopping generator...");
+  hal::writePin(RELAY_K2, HIGH); // Turn on K2 relay
+  hal::writePin(RELAY_K1, LOW);  // Turn off K1 relay (in case it was on)
+  stopperEngagedAt = hal::now();
+
+  tickStats.onDelay(event_loop, powerDownDuration, "powerDownElapsed", [sequence]() {
+    if (sequence != startSequence || !generatorStopping) return;
+
+    if (stopMode == STOP_MODE_FIXED) {
+      hal::writePin(RELAY_K2, LOW);  // Turn off K2 relay
+      logMessage("[CONTROL] Generator stopped");
+      generatorStopping = false;  // Reset flag after completion
+
+      // Verify the result, there is no retry in this mode
+      tickStats.onDelay(event_loop, stopConfirmDuration, "stopVerify", [sequence]() {
+        if (sequence == startSequence && runningState == HIGH) {
+          logMessage("[WARN] Generator still reports RUNNING after the stop pulse");
+          fireEvent(WEBHOOK_FAULT, "Still RUNNING after the stop pulse");
+        }
+      });
+      return;
+    }
+
+    // STOP_MODE_UNTIL_STOPPED and the stop was not confirmed in time
+    releaseStopper("no stop confirmation within " + String(powerDownDuration) + " ms");
+    if (retryStopCount < stopRetryCount) {
+      retryStopCount++;
+      metrics.stopRetries.fetch_add(1, std::memory_order_relaxed);
+      logMessage("[CONTROL] Generator is still running. Retrying stop... (" + String(retryStopCount) + "/" + String(stopRetryCount) + ")");
+      generatorStopping = true;  // Keep blocking starts during the pause
+      tickStats.onDelay(event_loop, STOP_RETRY_PAUSE, "stopRetry", [sequence]() {
+        if (sequence == startSequence) engageStopper();
+      });
+    } else {
+      logMessage("[ERROR] Generator failed to stop after " + String(retryStopCount) + " retries");
+      fireEvent(WEBHOOK_FAULT, "Still RUNNING after " + String(retryStopCount) + " stop retries");
+    }
+  });
+}
+
+/**
+ * Turns off the K2 relay and ends the current stop operation.
+ *
+ * @param reason Why the stopper was released, used for logging.
+ */
+void releaseStopper(const String& reason) {
+  hal::writePin(RELAY_K2, LOW);  // Turn off K2 relay
+  generatorStopping = false;
+  logMessage("[CONTROL] Stop relay released after " + String(hal::now() - stopperEngagedAt) + " ms (" + reason + ")");
+}
+
+/**
+ * Confirms a stop in STOP_MODE_UNTIL_STOPPED.
+ *
+ * Releases K2 once the debounced RUNNING signal was LOW for stopConfirmDuration
+ * while the stop relay was engaged. Meant to be called frequently, such as every 10ms.
+ */
+void checkStopConfirmation() {
+  if (!generatorStopping || stopMode != STOP_MODE_UNTIL_STOPPED) return;
+  if (runningState == HIGH) return;
+
+  unsigned long now = hal::now();
+  unsigned long lowSince = max(runningStateSince, stopperEngagedAt);
+  if (now - lowSince >= stopConfirmDuration) {
+    ++startSequence;  // Cancel a pending stop retry
+    releaseStopper("RUNNING LOW for " + String(now - lowSince) + " ms");
+    logMessage("[CONTROL] Generator stopped");
+  }
+}
+
+/**
+ * Hands a command over to the control task without blocking or locking,
+ * safe to call from any task.
+ *
+ * @param command The command to queue.
+ * @return The ID of the command, or 0 if the queue is full.
+ */
+uint32_t queueCommand(const Command& command) {
+  uint32_t ticket;
+  if (!controlQueue.push(command, &ticket)) {
+    return 0;
+  }
+  if (controlTaskHandle) xTaskNotifyGive(controlTaskHandle);  // Apply it right away
+  return ticket + 1;
+}
+
+/**
+ * Hands a setting change over to the control task, safe to call from any task.
+ *
+ * @param setting The setting to change.
+ * @param value The new value, validated by the caller.
+ * @param source Where the change came from.
+ * @return The ID of the command, or 0 if the queue is full.
+ */
+uint32_t queueSetting(TraceSetting setting, uint32_t value, CommandSource source) {
+  return queueCommand({COMMAND_SET_SETTING, source, hal::nowMicros(), setting, value});
+}
+
+/**
+ * Executes a command in the control task.
+ *
+ * @param command The command to execute.
+ */
+void applyCommand(const Command& command) {
+  switch (command.type) {
+    case COMMAND_START:
+    case COMMAND_STOP:
+      submitIntent(command);
+      break;
+    case COMMAND_RESET_START_STATS:
+      startStats.reset();
+      break;
+    case COMMAND_SET_SETTING:
+      applySetting((TraceSetting)command.setting, command.value);
+      break;
+  }
+}
+
+/**
+ * Changes a control setting and stores it in NVS. Must only be called by the
+ * control task, which owns the settings like the rest of the control state.
+ *
+ * @param setting The setting to change.
+ * @param value The new value.
+ * @return true if the setting was changed and stored.
+ */
+bool applySetting(TraceSetting setting, uint32_t value) {
+  switch (setting) {
+    case TRACE_SETTING_ALLOW_START: return setAllowStart(value != 0);
+    case TRACE_SETTING_START_MODE: return setStartMode(value);
+    case TRACE_SETTING_STOP_MODE: return setStopMode(value);
+    case TRACE_SETTING_RETRY_COUNT: return setRetryCount(value);
+    case TRACE_SETTING_STOP_RETRY_COUNT: return setStopRetryCount(value);
+    case TRACE_SETTING_POWER_UP_DURATION: return setPowerUpDuration(value);
+    case TRACE_SETTING_POWER_DOWN_DURATION: return setPowerDownDuration(value);
+    case TRACE_SETTING_NO_START_TIMEOUT: return setNoStartTimeout(value);
+    case TRACE_SETTING_STOP_CONFIRM_DURATION: return setStopConfirmDuration(value);
+    default: return false;
+  }
+}
+
+/**
+ * Submits a start or stop intent to the arbiter and logs if it is overridden
+ * by an intent with a higher priority.
+ *
+ * @param command The command of the intent.
+ */
+void submitIntent(const Command& command) {
+  arbiter.submit(command, hal::now());
+  gpioTrace.record(TRACE_INTENT, command.source, command.type);
+  const CommandArbiter::Intent* winner = arbiter.resolve(hal::now());
+  if (winner != nullptr && winner->command.source != command.source) {
+    logMessage("[ARBITER] " + String(command.type == COMMAND_START ? "START" : "STOP") + " from "
+               + commandSourceName(command.source) + " overridden by "
+               + (winner->command.type == COMMAND_START ? "START" : "STOP") + " from "
+               + commandSourceName(winner->command.source));
+  }
+}
+
+/**
+ * Executes the effective start or stop intent if it changed.
+ *
+ * Called by the control task on every iteration, this is the only place that
+ * starts or stops the generator on behalf of a command source.
+ */
+void arbitrateCommands() {
+  const CommandArbiter::Intent* intent = arbiter.nextAction(hal::now());
+  if (intent == nullptr) return;
+
+  if (intent->command.type == COMMAND_START) {
+    retryStartCount = 0;  // reset retry count
+    startGenerator(intent->command);
+  } else {
+    stopGenerator(intent->command);
+  }
+}
+
+void tickControl() {
+  Command command;
+  uint32_t ticket;
+  while (controlQueue.pop(command, &ticket)) {
+    applyCommand(command);
+    lastAppliedCommandId.store(ticket + 1, std::memory_order_release);
+  }
+  arbitrateCommands();
+
+  tickStats.beginTick();
+  {
+    PERF_SCOPE("eventLoop.tick");
+    event_loop.tick();
+  }
+  tickStats.endTick();
+}
+
+/**
+ * Publishes the control state to gensetStatus if anything changed since the
+ * last call. Must only be called by the control task.
+ *
+ * @return true if the state changed.
+ */
+bool publishStatus() {
+  static GensetStatus published = {};
+
+  GensetStatus status;
+  memset(&status, 0, sizeof(status));  // Padding has to compare equal as well
+  status.changedAt = published.changedAt;
+  status.lastCommandId = lastAppliedCommandId.load(std::memory_order_relaxed);
+  status.running = runningState;
+  status.startSignal = lastStartState;
+  status.stopSignal = lastStopState;
+  status.relayK1 = hal::readPin(RELAY_K1);
+  status.relayK2 = hal::readPin(RELAY_K2);
+  relayActivity |= status.relayK1 | (status.relayK2 << 1);
+  metrics.addRelayTime(status.relayK1, status.relayK2, hal::now());
+  status.starting = generatorStarting;
+  status.stopping = generatorStopping;
+  status.allowStart = allowStart;
+  status.retryStartCount = retryStartCount;
+  status.retryStopCount = retryStopCount;
+  status.startMode = startMode;
+  status.stopMode = stopMode;
+  status.retryCount = retryCount;
+  status.stopRetryCount = stopRetryCount;
+  status.powerUpDuration = powerUpDuration;
+  status.powerDownDuration = powerDownDuration;
+  status.noStartTimeout = noStartTimeout;
+  status.stopConfirmDuration = stopConfirmDuration;
+  const CommandArbiter::Intent* intent = arbiter.resolve(hal::now());
+  status.intentCommand = intent ? (uint8_t)intent->command.type : INTENT_NONE;
+  status.intentSource = intent ? (uint8_t)intent->command.source : INTENT_NONE;
+
+  if (memcmp(&status, &published, sizeof(status)) == 0) return false;
+  status.changedAt = hal::now();
+  memcpy(&published, &status, sizeof(status));
+  gensetStatus.write(status);
+  return true;
+}
+
+  /**
+   * This function is used to debounce the RUNNING_SIGNAL pin.
+   * It checks for state changes and after a short delay (DEBOUNCE_DELAY) will update the runningState variable.
+   * It also logs each state change to the serial console.
+   *
+   * In START_MODE_UNTIL_RUNNING the starter is released as soon as the debounced signal goes HIGH.
+   */
+void checkRunningSignal() {
+  static unsigned long lastChangeTime = 0;
+  static bool lastReading = LOW;
+  static bool stableState = LOW;
+  const unsigned long DEBOUNCE_DELAY = 50;
+  
+  // Keep evaluating while a change is still being debounced, not only on new interrupts
+  if (runningSignalChanged || stableState != lastReading) {
+    runningSignalChanged = false;
+    unsigned long currentTime = hal::now();
+    bool currentReading = hal::readPin(RUNNING_SIGNAL);
+    
+    if (currentReading != lastReading) {
+      lastChangeTime = currentTime;
+      lastReading = currentReading;
+    }
+    
+    if ((currentTime - lastChangeTime) > DEBOUNCE_DELAY) {
+      if (stableState != lastReading) {
+        stableState = lastReading;
+        runningState = stableState;
+        runningStateSince = currentTime;
+        metrics.runningTransitions.fetch_add(1, std::memory_order_relaxed);
+        gpioTrace.record(TRACE_DEBOUNCED, TRACE_CHANNEL_RUNNING, stableState);
+        PERF_INSTANT_VALUE("debounce.running", stableState);
+        
+        if (runningState == HIGH) {
+          logMessage("[SIGNAL] Genset is running - signal HIGH");
+          fireEvent(WEBHOOK_STARTED, "RUNNING signal HIGH");
+          startStats.running(currentTime);
+          if (generatorStarting && startMode == START_MODE_UNTIL_RUNNING) {
+            releaseStarter("RUNNING signal detected");
+          }
+        } else {
+          logMessage("[SIGNAL] Genset is not running - signal LOW");
+          fireEvent(WEBHOOK_STOPPED, "RUNNING signal LOW");
+        }
+      }
+    }
+  }
+}
+
+// Check for transitions on the START and STOP signals to control the generator.
+//
+// This function is meant to be called frequently, such as every 50ms.
+//
+// The debounced signals are turned into the intent of the hardwired source:
+//   - POWER-DOWN: STOP signal is HIGH (wins over a simultaneous START)
+//   - POWER-UP: only the START signal is HIGH
+//   - no intent: both signals are LOW
+//
+// The intent is submitted to the arbiter, arbitrateCommands() decides whether
+// startGenerator() or stopGenerator() is called.
+//
+// The last state of the START and STOP signals is stored in the variables
+// lastStartState and lastStopState, respectively.
+void checkForSignals() {
+  // Debounce variables
+  static unsigned long lastStartChangeTime = 0;
+  static unsigned long lastStopChangeTime = 0;
+  static bool lastStartReading = LOW;
+  static bool lastStopReading = LOW;
+  static bool stableStartState = LOW;
+  static bool stableStopState = LOW;
+  static bool initialized = false;
+  const unsigned long DEBOUNCE_DELAY = 50; // ms
+  
+  // Initialize static variables on first run
+  if (!initialized) {
+    initialized = true;
+    // Read current states to initialize properly
+    bool currentStart = hal::readPin(START_SIGNAL);
+    bool currentStop = hal::readPin(STOP_SIGNAL);
+    
+    lastStartReading = currentStart;
+    lastStopReading = currentStop;
+    stableStartState = currentStart;
+    stableStopState = currentStop;
+    
+    logMessage("[INIT] checkForSignals initialized with START: " + String(currentStart) + 
+               ", STOP: " + String(currentStop));
+    gpioTrace.record(TRACE_DEBOUNCED, TRACE_CHANNEL_START, currentStart);
+    gpioTrace.record(TRACE_DEBOUNCED, TRACE_CHANNEL_STOP, currentStop);
+
+    // Take over the initial intent without acting on it
+    if (currentStop == HIGH || currentStart == HIGH) {
+      CommandType type = currentStop == HIGH ? COMMAND_STOP : COMMAND_START;
+      arbiter.submit({type, COMMAND_SOURCE_GPIO, hal::nowMicros()}, hal::now());
+      arbiter.acknowledge(*arbiter.resolve(hal::now()));
+      gpioTrace.record(TRACE_INTENT, COMMAND_SOURCE_GPIO, type | TRACE_INTENT_ACKNOWLEDGED);
+    }
+    return; // Skip first iteration
+  }
+
+  unsigned long currentTime = hal::now();
+  bool currentStartState = hal::readPin(START_SIGNAL);
+  bool currentStopState = hal::readPin(STOP_SIGNAL);
+  
+  // Debounce START signal
+  if (currentStartState != lastStartReading) {
+    lastStartChangeTime = currentTime;
+    lastStartReading = currentStartState;
+  }
+  if ((currentTime - lastStartChangeTime) > DEBOUNCE_DELAY && stableStartState != lastStartReading) {
+    stableStartState = lastStartReading;
+    gpioTrace.record(TRACE_DEBOUNCED, TRACE_CHANNEL_START, stableStartState);
+    PERF_INSTANT_VALUE("debounce.start", stableStartState);
+  }
+  
+  // Debounce STOP signal  
+  if (currentStopState != lastStopReading) {
+    lastStopChangeTime = currentTime;
+    lastStopReading = currentStopState;
+  }
+  if ((currentTime - lastStopChangeTime) > DEBOUNCE_DELAY && stableStopState != lastStopReading) {
+    stableStopState = lastStopReading;
+    gpioTrace.record(TRACE_DEBOUNCED, TRACE_CHANNEL_STOP, stableStopState);
+    PERF_INSTANT_VALUE("debounce.stop", stableStopState);
+  }
+
+  // The first edge seen by the ISR is the time the command was issued. Once the
+  // input settled, the edge is consumed, whether it caused a transition or was a glitch.
+  Command startCommand = {COMMAND_START, COMMAND_SOURCE_GPIO, startEdgePending ? startEdgeAt : hal::nowMicros()};
+  Command stopCommand = {COMMAND_STOP, COMMAND_SOURCE_GPIO, stopEdgePending ? stopEdgeAt : hal::nowMicros()};
+  if ((currentTime - lastStartChangeTime) > DEBOUNCE_DELAY) startEdgePending = false;
+  if ((currentTime - lastStopChangeTime) > DEBOUNCE_DELAY) stopEdgePending = false;
+  
+  // Use stable states for the rest of the logic
+  currentStartState = stableStartState;
+  currentStopState = stableStopState;
+  
+  // The hardwired inputs hold one intent: STOP while STOP is HIGH (it has priority
+  // over a simultaneous START), START while only START is HIGH, nothing otherwise
+  if (currentStopState == HIGH && lastStopState == LOW) {
+    logMessage("[STATUS] STOP signal detected");
+    if (currentStartState == HIGH) {
+      logMessage("[WARN] Generator stopped by priority STOP signal, ignoring simultaneous START signal");
+    }
+    arbiter.submit(stopCommand, currentTime);
+    gpioTrace.record(TRACE_INTENT, COMMAND_SOURCE_GPIO, COMMAND_STOP);
+  } else if (currentStopState == LOW && currentStartState == HIGH && (lastStartState == LOW || lastStopState == HIGH)) {
+    logMessage("[STATUS] START signal detected");
+    arbiter.submit(startCommand, currentTime);
+    gpioTrace.record(TRACE_INTENT, COMMAND_SOURCE_GPIO, COMMAND_START);
+  } else if (currentStopState == LOW && currentStartState == LOW && (lastStartState == HIGH || lastStopState == HIGH)) {
+    arbiter.clear(COMMAND_SOURCE_GPIO);
+    gpioTrace.record(TRACE_INTENT, COMMAND_SOURCE_GPIO, TRACE_INTENT_CLEAR);
+  }
+  
+  // Always update states at the end
+  lastStartState = currentStartState;
+  lastStopState = currentStopState;
+}
+
+/**
+ * Interrupt service routine to read the current state of the RUNNING signal
+ * and log the state. Updates the runningState variable with the current
+ * digital reading from the RUNNING_SIGNAL pin.
+ */
+void IRAM_ATTR receiveRunningSignal() {
+  PERF_INSTANT("isr.running");
+  runningSignalChanged = true;
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_RUNNING, hal::readPin(RUNNING_SIGNAL));
+}
+
+// Interrupt service routines to timestamp the first edge of the START and STOP signals,
+// used to measure the latency until the relay is actuated.
+void IRAM_ATTR receiveStartSignal() {
+  PERF_INSTANT("isr.start");
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_START, hal::readPin(START_SIGNAL));
+  if (!startEdgePending) {
+    startEdgeAt = hal::nowMicros();
+    startEdgePending = true;
+  }
+}
+
+void IRAM_ATTR receiveStopSignal() {
+  PERF_INSTANT("isr.stop");
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_STOP, hal::readPin(STOP_SIGNAL));
+  if (!stopEdgePending) {
+    stopEdgeAt = hal::nowMicros();
+    stopEdgePending = true;
+  }
+}
+
+// Interrupt service routine to read the current state of the LED and log it.
+void IRAM_ATTR receiveLEDStatus() {
+  ledState = hal::readPin(LED);
+}
+
+/**
+ * This function monitors the state of the LED and logs any changes.
+ * It uses a static variable to track the last logged state of the LED.
+ * If the current state differs from the last logged state, it updates
+ * the last logged state and logs the new state to the serial console.
+ */
+
+void checkLEDStatus() {
+  static bool lastLoggedLedState = LOW;
+  
+  if (ledState != lastLoggedLedState) {
+    lastLoggedLedState = ledState;
+    logMessage("[LED] Current state: " + String(ledState));
+  }
+}
+
+void initializeStates() {
+  // Read actual pin states with debouncing
+  hal::sleep(100); // Allow pins to stabilize after boot
+  
+  // Read multiple times to ensure stable reading
+  bool startReading = LOW;
+  bool stopReading = LOW;
+  bool runningReading = LOW;
+  
+  for (int i = 0; i < 5; i++) {
+    startReading = hal::readPin(START_SIGNAL);
+    stopReading = hal::readPin(STOP_SIGNAL);
+    runningReading = hal::readPin(RUNNING_SIGNAL);
+    hal::sleep(10);
+  }
+  
+  // Initialize global states to match actual pin states
+  lastStartState = startReading;
+  lastStopState = stopReading;
+  runningState = runningReading;
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_START, startReading);
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_STOP, stopReading);
+  gpioTrace.record(TRACE_INPUT, TRACE_CHANNEL_RUNNING, runningReading);
+  
+  logMessage("[INIT] Initial states - START: " + String(lastStartState) + 
+             ", STOP: " + String(lastStopState) + 
+             ", RUNNING: " + String(runningState));
+}
+
+void setupControl() {
+  // Configure pins
+  hal::configurePin(RELAY_K1, OUTPUT);
+  hal::configurePin(RELAY_K2, OUTPUT);
+  hal::configurePin(LED, OUTPUT);
+  hal::configurePin(START_SIGNAL, INPUT_PULLDOWN);
+  hal::configurePin(STOP_SIGNAL, INPUT_PULLDOWN);
+  hal::configurePin(RUNNING_SIGNAL, INPUT_PULLDOWN);
+
+  // Initialize all relays and LED
+  hal::writePin(RELAY_K1, LOW);
+  hal::writePin(RELAY_K2, LOW);
+  hal::writePin(LED, HIGH);
+
+  initializeStates();
+}
+
+void startControl() {
+  hal::attachPinInterrupt(RUNNING_SIGNAL, receiveRunningSignal, CHANGE);
+  hal::attachPinInterrupt(START_SIGNAL, receiveStartSignal, CHANGE);
+  hal::attachPinInterrupt(STOP_SIGNAL, receiveStopSignal, CHANGE);
+  hal::attachPinInterrupt(LED, receiveLEDStatus, CHANGE);
+
+  // Load from NVS
+  allowStart = getAllowStart();
+  retryCount = getRetryCount();
+  powerUpDuration = getPowerUpDuration();
+  powerDownDuration = getPowerDownDuration();
+  startMode = getStartMode();
+  noStartTimeout = getNoStartTimeout();
+  stopMode = getStopMode();
+  stopConfirmDuration = getStopConfirmDuration();
+  stopRetryCount = getStopRetryCount();
+  startStats.begin(NVS_GENSET_CONTROL);
+  traceSettings();
+
+  // Check for START/STOP signals every 50ms
+  event_loop.onDelay(5, receiveRunningSignal);
+  tickStats.begin();
+  tickStats.onRepeat(event_loop, 50, "checkForSignals", checkForSignals);
+  tickStats.onRepeat(event_loop, 10, "checkRunningSignal", checkRunningSignal);
+  tickStats.onRepeat(event_loop, 10, "checkStopConfirmation", checkStopConfirmation);
+  tickStats.onRepeat(event_loop, 100, "checkLEDStatus", checkLEDStatus);
+  tickStats.onRepeat(event_loop, START_STATS_SAVE_INTERVAL, "saveStartStats", []() { startStats.save(); });
+
+  // Boot sequence, blinking the LED 3 times
+  for (uint8_t i = 0; i < 5; i++) {
+    auto delay = 100 + i * 500;
+    event_loop.onDelay(delay, []() { 
+      if(hal::readPin(LED) == LOW) {
+        hal::writePin(LED, HIGH); 
+      } else {
+        hal::writePin(LED, LOW); 
+      }
+    });
+  }
+}
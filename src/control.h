@@ -0,0 +1,160 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <ReactESP.h>
+#include <atomic>
+#include "arbiter.h"
+#include "command.h"
+#include "command_queue.h"
+#include "gpio_trace_format.h"
+#include "hal.h"
+#include "histogram.h"
+#include "start_stats.h"
+#include "status.h"
+#include "tick_stats.h"
+#include "webhook_event.h"
+
+/**
+ * The generator control: settings, start/stop state machine, signal debouncing and
+ * the command queue of the control task.
+ *
+ * Everything in here is owned by the control task (see tickControl()), other tasks
+ * only use queueCommand(), queueSetting() and gensetStatus. All hardware access goes
+ * through hal, so the same code runs on the ESP32 and in the native environment
+ * against a virtual clock and GPIO model (see simulator.h).
+ *
+ * The application implements logMessage() and fireEvent().
+ */
+
+// Start modes
+enum StartMode : uint8_t {
+  START_MODE_FIXED = 0,          // Hold K1 for the full powerUpDuration
+  START_MODE_UNTIL_RUNNING = 1,  // Release K1 as soon as RUNNING goes HIGH, powerUpDuration is the upper limit
+};
+
+// Stop modes
+enum StopMode : uint8_t {
+  STOP_MODE_FIXED = 0,           // Hold K2 for the full powerDownDuration
+  STOP_MODE_UNTIL_STOPPED = 1,   // Release K2 once RUNNING was LOW for stopConfirmDuration, retry if not
+};
+
+const uint32_t STOP_RETRY_PAUSE = 2000;  // Pause between two stop pulses
+const size_t CONTROL_QUEUE_LENGTH = 16;
+
+// Name of the NVS namespace
+extern const char* NVS_GENSET_CONTROL;
+
+// Create the NVS instance
+extern hal::SettingsStore preferences;
+
+// Settings
+extern uint32_t powerUpDuration;
+extern uint32_t powerDownDuration;
+extern uint8_t startMode;
+extern uint32_t noStartTimeout;
+extern uint8_t stopMode;
+extern uint32_t stopConfirmDuration;
+extern uint8_t stopRetryCount;
+extern bool allowStart;
+extern uint8_t retryCount;
+
+// Control state
+extern uint32_t retryStartCount;
+extern uint32_t retryStopCount;
+extern bool lastStartState;
+extern bool lastStopState;
+extern bool runningState;
+extern bool generatorStarting;
+extern bool generatorStopping;
+extern uint8_t relayActivity;
+extern volatile bool runningSignalChanged;
+
+extern reactesp::EventLoop event_loop;
+extern TickStats tickStats;
+extern StartStats startStats;
+extern LogHistogram commandLatency[COMMAND_SOURCE_COUNT];
+extern MpscQueue<Command, CONTROL_QUEUE_LENGTH> controlQueue;
+extern TaskHandle_t controlTaskHandle;
+extern Seqlock<GensetStatus> gensetStatus;
+extern CommandArbiter arbiter;
+
+// Implemented by the application
+void logMessage(const String& message);
+// Reports a transition of the generator, e.g. as webhook
+void fireEvent(WebhookEvent event, const String& detail);
+
+// Setters of the control settings, only called by the control task through applySetting()
+bool setPowerUpDuration(uint32_t duration);
+uint32_t getPowerUpDuration();
+bool setPowerDownDuration(uint32_t duration);
+uint32_t getPowerDownDuration();
+bool setAllowStart(bool state);
+bool getAllowStart();
+bool setRetryCount(uint8_t count);
+uint8_t getRetryCount();
+bool setStartMode(uint8_t mode);
+uint8_t getStartMode();
+bool setNoStartTimeout(uint32_t timeout);
+uint32_t getNoStartTimeout();
+bool setStopMode(uint8_t mode);
+uint8_t getStopMode();
+bool setStopConfirmDuration(uint32_t duration);
+uint32_t getStopConfirmDuration();
+bool setStopRetryCount(uint8_t count);
+uint8_t getStopRetryCount();
+void traceSettings();
+
+void checkGeneratorStateAndRetry();
+void releaseStarter(const String& reason);
+void startGenerator(const Command& command);
+void stopGenerator(const Command& command);
+uint32_t recordCommandLatency(const Command& command);
+void engageStopper();
+void releaseStopper(const String& reason);
+void checkStopConfirmation();
+void checkRunningSignal();
+void checkForSignals();
+void checkLEDStatus();
+void IRAM_ATTR receiveRunningSignal();
+void IRAM_ATTR receiveStartSignal();
+void IRAM_ATTR receiveStopSignal();
+void IRAM_ATTR receiveLEDStatus();
+
+uint32_t queueCommand(const Command& command);
+uint32_t queueSetting(TraceSetting setting, uint32_t value, CommandSource source);
+void applyCommand(const Command& command);
+bool applySetting(TraceSetting setting, uint32_t value);
+void submitIntent(const Command& command);
+void arbitrateCommands();
+
+/**
+ * Configures the pins and reads the initial levels of the inputs, called first by setup().
+ */
+void setupControl();
+
+/**
+ * Attaches the interrupts, loads the settings from NVS and registers the control
+ * callbacks with the event loop. Called by setup() after setupControl().
+ */
+void startControl();
+
+/**
+ * Applies the queued commands, executes the effective intent and ticks the event loop.
+ * Called by the control task on every iteration.
+ */
+void tickControl();
+
+/**
+ * Publishes the control state to gensetStatus if anything changed since the
+ * last call. Must only be called by the control task.
+ *
+ * @return true if the state changed.
+ */
+bool publishStatus();
@@ -0,0 +1,91 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CRC-16/MODBUS: polynomial 0x8005 reflected (0xA001), initial value 0xFFFF, no final XOR.
+ *
+ *   bitwise()  one bit per step, no table
+ *   table()    one byte per step with a 256 entry table
+ *   sliced()   four bytes per step with four tables (slicing-by-4)
+ *
+ * The tables are generated at compile time and live in flash. All variants give the same
+ * result and can be continued by passing the previous CRC.
+ */
+namespace crc16 {
+
+constexpr uint16_t POLYNOMIAL = 0xA001;
+constexpr uint16_t INITIAL = 0xFFFF;
+
+constexpr uint16_t bitwise(const uint8_t* data, size_t length, uint16_t crc = INITIAL) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+struct Tables {
+  uint16_t entries[4][256];
+};
+
+// entries[0] is the CRC of every byte value, entries[k] the same byte followed by k zero bytes
+constexpr Tables makeTables() {
+  Tables tables = {};
+  for (uint16_t value = 0; value < 256; value++) {
+    uint16_t crc = value;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+    }
+    tables.entries[0][value] = crc;
+  }
+  for (uint8_t k = 1; k < 4; k++) {
+    for (uint16_t value = 0; value < 256; value++) {
+      uint16_t previous = tables.entries[k - 1][value];
+      tables.entries[k][value] = (previous >> 8) ^ tables.entries[0][previous & 0xFF];
+    }
+  }
+  return tables;
+}
+
+inline constexpr Tables TABLES = makeTables();
+
+constexpr uint16_t table(const uint8_t* data, size_t length, uint16_t crc = INITIAL) {
+  for (size_t i = 0; i < length; i++) {
+    crc = (crc >> 8) ^ TABLES.entries[0][(crc ^ data[i]) & 0xFF];
+  }
+  return crc;
+}
+
+constexpr uint16_t sliced(const uint8_t* data, size_t length, uint16_t crc = INITIAL) {
+  size_t i = 0;
+  for (; i + 4 <= length; i += 4) {
+    crc ^= data[i] | (data[i + 1] << 8);
+    crc = TABLES.entries[3][crc & 0xFF] ^ TABLES.entries[2][crc >> 8]
+          ^ TABLES.entries[1][data[i + 2]] ^ TABLES.entries[0][data[i + 3]];
+  }
+  return table(data + i, length - i, crc);
+}
+
+namespace check {
+constexpr uint8_t DIGITS[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+constexpr uint8_t FRAME[] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x0A};
+}  // namespace check
+
+// Check value of the CRC catalogue and a read request of the Modbus specification
+static_assert(bitwise(check::DIGITS, sizeof(check::DIGITS)) == 0x4B37, "CRC-16/MODBUS check value");
+static_assert(table(check::DIGITS, sizeof(check::DIGITS)) == 0x4B37, "CRC-16/MODBUS check value");
+static_assert(sliced(check::DIGITS, sizeof(check::DIGITS)) == 0x4B37, "CRC-16/MODBUS check value");
+static_assert(sliced(check::FRAME, sizeof(check::FRAME)) == 0xCDC5, "CRC of 01 03 00 00 00 0A is C5 CD");
+
+}  // namespace crc16
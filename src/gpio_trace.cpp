@@ -0,0 +1,115 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "gpio_trace.h"
+#include "hal.h"
+#include "perf_trace.h"
+#include "pins.h"
+
+#if !(defined(AUTO_FW_VERSION))
+  #define AUTO_FW_VERSION "0.0.0-dev"
+#endif
+
+GpioTrace gpioTrace;
+
+void IRAM_ATTR GpioTrace::record(TraceEvent event, uint8_t arg, uint32_t value) {
+  portENTER_CRITICAL_SAFE(&lock);
+  TraceRecord& slot = records[written % CAPACITY];
+  if (count == CAPACITY) {
+    apply(slot, baseLevels, baseSettings);
+    dropped++;
+    sinceBoot = false;
+  } else {
+    count++;
+  }
+  // Timestamp under the lock, so the records stay in time order across cores
+  slot = {hal::nowMicros64(), event, arg, 0, value};
+  apply(slot, levels, settings);
+  written++;
+#ifdef GENSET_NATIVE
+  if (observer != nullptr) observer(slot);
+#endif
+  portEXIT_CRITICAL_SAFE(&lock);
+}
+
+void GpioTrace::output(uint8_t pin, bool level) {
+  uint8_t channel;
+  switch (pin) {
+    case RELAY_K1: channel = TRACE_CHANNEL_K1; break;
+    case RELAY_K2: channel = TRACE_CHANNEL_K2; break;
+    default: return;
+  }
+  // Only the control task writes the relays, no lock required to compare
+  if (((levels >> channel) & 1) == level) return;
+  record(TRACE_OUTPUT, channel, level);
+  PERF_INSTANT_VALUE(channel == TRACE_CHANNEL_K1 ? "relay.K1" : "relay.K2", level);
+}
+
+void IRAM_ATTR GpioTrace::apply(const TraceRecord& record, uint8_t& levels, uint32_t* settings) {
+  switch (record.event) {
+    case TRACE_INPUT:
+    case TRACE_OUTPUT:
+      levels = (levels & ~(1 << record.arg)) | ((record.value & 1) << record.arg);
+      break;
+    case TRACE_DEBOUNCED: {
+      uint8_t bit = record.arg + TRACE_DEBOUNCED_SHIFT;
+      levels = (levels & ~(1 << bit)) | ((record.value & 1) << bit);
+      break;
+    }
+    case TRACE_SETTING:
+      if (record.arg < TRACE_SETTING_COUNT) settings[record.arg] = record.value;
+      break;
+    default:
+      break;
+  }
+}
+
+GpioTrace::Export::Export(GpioTrace& trace) : trace(trace) {
+  TraceFileHeader header = {};
+  memcpy(header.magic, "GTRC", 4);
+  header.version = TRACE_FORMAT_VERSION;
+  header.recordSize = sizeof(TraceRecord);
+  strlcpy(header.firmware, AUTO_FW_VERSION, sizeof(header.firmware));
+
+  portENTER_CRITICAL(&trace.lock);
+  end = trace.written;
+  next = end - trace.count;
+  header.count = trace.count;
+  header.dropped = trace.dropped;
+  header.capturedAt = hal::nowMicros64();
+  header.baseLevels = trace.baseLevels;
+  header.flags = trace.sinceBoot ? TRACE_FLAG_SINCE_BOOT : 0;
+  memcpy(header.baseSettings, trace.baseSettings, sizeof(trace.baseSettings));
+  portEXIT_CRITICAL(&trace.lock);
+
+  memcpy(pending, &header, sizeof(header));
+  pendingLength = sizeof(header);
+}
+
+// Copies the next record into pending, returns false at the end or if it was overwritten
+bool GpioTrace::Export::renderNext() {
+  if (next == end) return false;
+  portENTER_CRITICAL(&trace.lock);
+  bool held = trace.written - next <= CAPACITY;
+  if (held) memcpy(pending, &trace.records[next % CAPACITY], sizeof(TraceRecord));
+  portEXIT_CRITICAL(&trace.lock);
+  if (!held) return false;
+  next++;
+  pendingLength = sizeof(TraceRecord);
+  pendingOffset = 0;
+  return true;
+}
+
+void GpioTrace::reset() {
+  portENTER_CRITICAL(&lock);
+  count = 0;
+  dropped = 0;
+  sinceBoot = false;
+  baseLevels = levels;
+  memcpy(baseSettings, settings, sizeof(settings));
+  portEXIT_CRITICAL(&lock);
+}
@@ -0,0 +1,85 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include "gpio_trace_format.h"
+#include "util.h"
+
+/**
+ * RAM ring of timestamped input edges, debounce decisions, intents, relay edges and
+ * setting changes, downloadable via /gpioTrace and replayed on a PC with tools/trace_replay.
+ *
+ * Records can be added from any task and from ISRs, a spinlock keeps them in time order.
+ * When the ring is full the oldest record is overwritten and folded into the base state,
+ * so a download always describes the complete input and output levels and settings.
+ */
+class GpioTrace {
+  public:
+    static constexpr size_t CAPACITY = 1024;  // 16 KiB
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "written has to wrap at a multiple of CAPACITY");
+
+    /**
+     * Appends a record.
+     *
+     * @param event What happened.
+     * @param arg TraceChannel, TraceSetting or CommandSource depending on the event.
+     * @param value Level, setting value or intent.
+     */
+    void IRAM_ATTR record(TraceEvent event, uint8_t arg, uint32_t value);
+
+    /**
+     * Records a relay edge, writes of an unchanged level and of untraced pins are ignored.
+     *
+     * @param pin The GPIO pin that was written.
+     * @param level The written level.
+     */
+    void output(uint8_t pin, bool level);
+
+    /**
+     * Renders the trace in file format (see gpio_trace_format.h) in pieces, so the web
+     * server can stream it without copying the ring. The header describes the trace when
+     * the export was created, records are read from the ring as they are sent. If a record
+     * was overwritten before it was sent, the export ends early with a truncated file.
+     */
+    class Export : public ChunkedExport<sizeof(TraceFileHeader)> {
+      public:
+        explicit Export(GpioTrace& trace);
+
+      private:
+        bool renderNext() override;
+
+        GpioTrace& trace;
+        uint32_t next;  // Index of the next record, counted like written
+        uint32_t end;
+    };
+
+    // Discards all records, the current state becomes the base state
+    void reset();
+
+#ifdef GENSET_NATIVE
+    // Called with every record in the native build, e.g. to collect the edges of a replay
+    void (*observer)(const TraceRecord& record) = nullptr;
+#endif
+
+  private:
+    void apply(const TraceRecord& record, uint8_t& levels, uint32_t* settings);
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    TraceRecord records[CAPACITY] = {};
+    uint32_t written = 0;  // Records added since boot, records[written % CAPACITY] is the next slot
+    size_t count = 0;
+    uint32_t dropped = 0;
+    bool sinceBoot = true;
+    uint8_t levels = 0;
+    uint8_t baseLevels = 0;
+    uint32_t settings[TRACE_SETTING_COUNT] = {};
+    uint32_t baseSettings[TRACE_SETTING_COUNT] = {};
+};
+
+extern GpioTrace gpioTrace;
@@ -0,0 +1,84 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Binary format of the GPIO trace, shared by the firmware and tools/trace_replay.cpp.
+ *
+ * A trace file is a TraceFileHeader followed by header.count TraceRecords, oldest first.
+ * All values are little endian. Bump TRACE_FORMAT_VERSION on every incompatible change.
+ */
+
+const uint16_t TRACE_FORMAT_VERSION = 2;
+
+// What a record describes
+enum TraceEvent : uint8_t {
+  TRACE_INPUT = 0,      // Raw input edge seen by the ISR, arg: TraceChannel, value: level
+  TRACE_DEBOUNCED = 1,  // Debounced input changed, arg: TraceChannel, value: level
+  TRACE_INTENT = 2,     // Intent submitted to the arbiter, arg: CommandSource, value: CommandType or TRACE_INTENT_CLEAR
+  TRACE_OUTPUT = 3,     // Relay output changed, arg: TraceChannel, value: level
+  TRACE_SETTING = 4,    // Setting changed, arg: TraceSetting, value: new value
+};
+
+enum TraceChannel : uint8_t {
+  TRACE_CHANNEL_START = 0,
+  TRACE_CHANNEL_STOP = 1,
+  TRACE_CHANNEL_RUNNING = 2,
+  TRACE_CHANNEL_K1 = 3,
+  TRACE_CHANNEL_K2 = 4,
+  TRACE_CHANNEL_COUNT
+};
+
+enum TraceSetting : uint8_t {
+  TRACE_SETTING_ALLOW_START = 0,
+  TRACE_SETTING_START_MODE = 1,
+  TRACE_SETTING_STOP_MODE = 2,
+  TRACE_SETTING_RETRY_COUNT = 3,
+  TRACE_SETTING_STOP_RETRY_COUNT = 4,
+  TRACE_SETTING_POWER_UP_DURATION = 5,
+  TRACE_SETTING_POWER_DOWN_DURATION = 6,
+  TRACE_SETTING_NO_START_TIMEOUT = 7,
+  TRACE_SETTING_STOP_CONFIRM_DURATION = 8,
+  TRACE_SETTING_COUNT
+};
+
+// TRACE_INTENT values besides the CommandType
+const uint32_t TRACE_INTENT_CLEAR = 0xFF;           // The source withdrew its intent
+const uint32_t TRACE_INTENT_ACKNOWLEDGED = 0x100;   // Flag, taken over without acting on it
+
+// TraceFileHeader::flags
+const uint8_t TRACE_FLAG_SINCE_BOOT = 0x01;  // Nothing was dropped or reset since boot
+
+// Bits of TraceFileHeader::baseLevels: raw levels by TraceChannel, debounced inputs above
+const uint8_t TRACE_DEBOUNCED_SHIFT = 5;
+
+struct TraceRecord {
+  uint64_t at;      // us since boot (esp_timer_get_time()), does not wrap
+  uint8_t event;    // TraceEvent
+  uint8_t arg;
+  uint16_t reserved;
+  uint32_t value;
+};
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord must stay 16 bytes");
+
+struct TraceFileHeader {
+  char magic[4];          // "GTRC"
+  uint16_t version;       // TRACE_FORMAT_VERSION
+  uint16_t recordSize;    // sizeof(TraceRecord)
+  uint32_t count;         // Number of records following the header
+  uint32_t dropped;       // Records overwritten since the last reset
+  uint64_t capturedAt;    // us since boot when the file was created
+  uint8_t baseLevels;     // Levels before the first record, see TRACE_DEBOUNCED_SHIFT
+  uint8_t flags;          // TRACE_FLAG_*
+  uint8_t reserved[2];
+  uint32_t baseSettings[TRACE_SETTING_COUNT];  // Settings before the first record
+  char firmware[32];      // Firmware version, zero terminated
+};
+static_assert(sizeof(TraceFileHeader) == 28 + 4 * TRACE_SETTING_COUNT + 32, "TraceFileHeader must not contain padding");
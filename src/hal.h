@@ -0,0 +1,91 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "gpio_trace.h"
+#ifdef GENSET_BENCHMARK
+#include "memory_settings_store.h"
+#endif
+#ifndef GENSET_NATIVE
+#include <esp_timer.h>
+#endif
+
+/**
+ * Thin hardware abstraction used by the generator control code.
+ *
+ * All pin access, time stamps and interrupt registrations of the control path go
+ * through these functions instead of the Arduino API, so there is exactly one place
+ * to observe relay edges (see GpioTrace) or to replace the hardware with a model, e.g. a virtual
+ * clock and GPIO simulation running faster than real time.
+ *
+ * The functions are always inlined, they are called from IRAM interrupt handlers.
+ *
+ * The native build (GENSET_NATIVE) replaces them with a virtual clock and a GPIO
+ * model, see hal_native.h.
+ */
+#ifdef GENSET_NATIVE
+#include "hal_native.h"
+#else
+namespace hal {
+
+#ifdef GENSET_BENCHMARK
+// Benchmarks must not wear out the flash, settings are kept in RAM
+using SettingsStore = MemorySettingsStore;
+
+// When simulatePins is set, readPin() returns the bit of the pin in simulatedPins
+extern bool simulatePins;
+extern uint64_t simulatedPins;
+#else
+// Non-volatile key/value store for the settings
+using SettingsStore = Preferences;
+#endif
+
+__attribute__((always_inline)) inline void configurePin(uint8_t pin, uint8_t mode) {
+  ::pinMode(pin, mode);
+}
+
+__attribute__((always_inline)) inline bool readPin(uint8_t pin) {
+#ifdef GENSET_BENCHMARK
+  if (simulatePins) return (simulatedPins >> pin) & 1;
+#endif
+  return ::digitalRead(pin);
+}
+
+__attribute__((always_inline)) inline void writePin(uint8_t pin, bool level) {
+  ::digitalWrite(pin, level);
+  gpioTrace.output(pin, level);
+}
+
+__attribute__((always_inline)) inline void attachPinInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+  ::attachInterrupt(pin, handler, mode);
+}
+
+// Milliseconds since boot
+__attribute__((always_inline)) inline uint32_t now() {
+  return ::millis();
+}
+
+// Microseconds since boot, wraps after about 71 minutes
+__attribute__((always_inline)) inline uint32_t nowMicros() {
+  return ::micros();
+}
+
+// Microseconds since boot, does not wrap
+__attribute__((always_inline)) inline uint64_t nowMicros64() {
+  return ::esp_timer_get_time();
+}
+
+// Blocks the calling task, only used during setup()
+inline void sleep(uint32_t ms) {
+  ::delay(ms);
+}
+
+}  // namespace hal
+#endif
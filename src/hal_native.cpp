@@ -0,0 +1,89 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#ifdef GENSET_NATIVE
+
+#include "hal.h"
+
+EspClass ESP;
+
+static const uint8_t PIN_COUNT = 40;
+
+static uint64_t virtualMicros = 0;
+static uint64_t pinLevels = 0;
+
+struct PinInterrupt {
+  void (*handler)(void);
+  int mode;
+};
+static PinInterrupt interrupts[PIN_COUNT] = {};
+
+// Changes the level of a pin and calls its interrupt handler if the edge matches
+static void changePin(uint8_t pin, bool level) {
+  if (pin >= PIN_COUNT || ((pinLevels >> pin) & 1) == level) return;
+  pinLevels = level ? pinLevels | (1ULL << pin) : pinLevels & ~(1ULL << pin);
+
+  const PinInterrupt& interrupt = interrupts[pin];
+  if (interrupt.handler == nullptr) return;
+  if (interrupt.mode == CHANGE || (interrupt.mode == RISING && level) || (interrupt.mode == FALLING && !level)) {
+    interrupt.handler();
+  }
+}
+
+namespace hal {
+
+void configurePin(uint8_t pin, uint8_t mode) {
+  // The pull-down holds an unconnected input LOW
+  if (mode == INPUT_PULLDOWN) changePin(pin, LOW);
+}
+
+bool readPin(uint8_t pin) {
+  return pin < PIN_COUNT && ((pinLevels >> pin) & 1);
+}
+
+void writePin(uint8_t pin, bool level) {
+  changePin(pin, level);
+  gpioTrace.output(pin, level);
+}
+
+void attachPinInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+  if (pin < PIN_COUNT) interrupts[pin] = {handler, mode};
+}
+
+uint32_t now() {
+  return virtualMicros / 1000;
+}
+
+uint32_t nowMicros() {
+  return (uint32_t)virtualMicros;
+}
+
+uint64_t nowMicros64() {
+  return virtualMicros;
+}
+
+void sleep(uint32_t ms) {
+  virtualMicros += (uint64_t)ms * 1000;
+}
+
+void advanceTo(uint64_t micros) {
+  if (micros > virtualMicros) virtualMicros = micros;
+}
+
+void setInput(uint8_t pin, bool level) {
+  changePin(pin, level);
+}
+
+}  // namespace hal
+
+// Arduino time functions of native/Arduino.h, on the virtual clock
+unsigned long millis() { return hal::now(); }
+unsigned long micros() { return hal::nowMicros(); }
+int64_t esp_timer_get_time() { return hal::nowMicros64(); }
+void delay(uint32_t ms) { hal::sleep(ms); }
+
+#endif
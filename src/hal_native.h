@@ -0,0 +1,60 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include "memory_settings_store.h"
+
+/**
+ * Host implementation of hal for the native build (GENSET_NATIVE), included by hal.h.
+ *
+ * Time is a virtual clock in microseconds that only moves when the simulator calls
+ * advanceTo() or the control code calls sleep(), so a run is deterministic and weeks
+ * of generator cycling take seconds. Pins are a GPIO model: inputs are set by the
+ * simulator with setInput(), outputs by the control code with writePin(). Every level
+ * change of a pin calls its attached interrupt handler right away, like an edge on
+ * the ESP32 interrupts the control task.
+ */
+namespace hal {
+
+// Settings are kept in RAM
+using SettingsStore = MemorySettingsStore;
+
+void configurePin(uint8_t pin, uint8_t mode);
+bool readPin(uint8_t pin);
+void writePin(uint8_t pin, bool level);
+void attachPinInterrupt(uint8_t pin, void (*handler)(void), int mode);
+
+// Milliseconds on the virtual clock
+uint32_t now();
+
+// Microseconds on the virtual clock, wraps after about 71 minutes like on the ESP32
+uint32_t nowMicros();
+
+// Microseconds on the virtual clock, does not wrap
+uint64_t nowMicros64();
+
+// Advances the virtual clock, nothing else runs in between
+void sleep(uint32_t ms);
+
+/**
+ * Moves the virtual clock forward, used by the simulator.
+ *
+ * @param micros The new time in us, earlier times are ignored.
+ */
+void advanceTo(uint64_t micros);
+
+/**
+ * Drives an input pin like the outside wiring, calls its interrupt handler on a change.
+ *
+ * @param pin The GPIO pin.
+ * @param level The new level.
+ */
+void setInput(uint8_t pin, bool level);
+
+}  // namespace hal
@@ -0,0 +1,139 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "heap_monitor.h"
+
+void logMessage(const String& message);
+
+HeapMonitor heapMonitor;
+
+static const uint32_t TASK_STACK_SIZE = 3072;
+static const UBaseType_t TASK_PRIORITY = 1;
+static const BaseType_t TASK_CORE = 0;  // Away from the control task
+
+// Too large for the monitor stack, only used by the monitor task
+static TaskStatus_t taskStatus[HeapMonitor::MAX_TASKS];
+
+void HeapMonitor::begin() {
+  sample();
+  xTaskCreatePinnedToCore(taskMain, "heapmon", TASK_STACK_SIZE, this, TASK_PRIORITY, &task, TASK_CORE);
+}
+
+void HeapMonitor::taskMain(void* parameter) {
+  static_cast<HeapMonitor*>(parameter)->run();
+}
+
+void HeapMonitor::run() {
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(SAMPLE_INTERVAL));
+    sample();
+    sampleTasks();
+  }
+}
+
+void HeapMonitor::sample() {
+  uint32_t uptime = esp_timer_get_time() / 1000000;
+  uint32_t freeHeap = ESP.getFreeHeap();
+  uint32_t largestBlock = ESP.getMaxAllocHeap();
+  uint8_t fragmentation = freeHeap > 0 && largestBlock < freeHeap ? 100 - (uint64_t)largestBlock * 100 / freeHeap : 0;
+  currentFragmentation.store(fragmentation, std::memory_order_relaxed);
+
+  portENTER_CRITICAL(&lock);
+  if (currentEmpty) {
+    current = {uptime, freeHeap, largestBlock, fragmentation};
+    currentEmpty = false;
+  } else {
+    current.uptime = uptime;
+    current.freeHeap = min(current.freeHeap, freeHeap);
+    current.largestBlock = min(current.largestBlock, largestBlock);
+    current.fragmentation = max(current.fragmentation, fragmentation);
+  }
+  // A row ends with the last sample before a multiple of the interval since boot
+  if (uptime / HISTORY_INTERVAL != (uptime + SAMPLE_INTERVAL / 1000) / HISTORY_INTERVAL) {
+    history[historyHead] = current;
+    historyHead = (historyHead + 1) % HISTORY_SIZE;
+    if (historySize < HISTORY_SIZE) historySize++;
+    currentEmpty = true;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if (!fragmentationWarned && fragmentation >= FRAGMENTATION_WARNING) {
+    fragmentationWarned = true;
+    logMessage("[HEAP] Fragmentation at " + String(fragmentation) + "%, largest free block " + String(largestBlock) +
+               " of " + String(freeHeap) + " bytes free");
+  } else if (fragmentationWarned && fragmentation < FRAGMENTATION_CLEAR) {
+    fragmentationWarned = false;
+    logMessage("[HEAP] Fragmentation back at " + String(fragmentation) + "%");
+  }
+}
+
+void HeapMonitor::sampleTasks() {
+  // uxTaskGetSystemState() fails if there are more tasks than entries
+  if (uxTaskGetNumberOfTasks() > MAX_TASKS) return;
+  UBaseType_t count = uxTaskGetSystemState(taskStatus, MAX_TASKS, nullptr);
+  if (count == 0) return;  // A task was created in between
+
+  TaskStack stacks[MAX_TASKS];
+  uint32_t lowest = UINT32_MAX;
+  for (UBaseType_t i = 0; i < count; i++) {
+    // Sorted by name, so the order does not change with every sample
+    TaskStack entry;
+    strlcpy(entry.name, taskStatus[i].pcTaskName, sizeof(entry.name));
+    entry.stackFree = taskStatus[i].usStackHighWaterMark;  // Bytes on the ESP32
+    UBaseType_t j = i;
+    for (; j > 0 && strcmp(stacks[j - 1].name, entry.name) > 0; j--) stacks[j] = stacks[j - 1];
+    stacks[j] = entry;
+    lowest = min(lowest, entry.stackFree);
+
+    if (entry.stackFree >= STACK_WARNING) continue;
+    bool warned = false;
+    for (uint8_t k = 0; k < stackWarnedCount && !warned; k++) warned = strcmp(stackWarned[k], entry.name) == 0;
+    if (!warned && stackWarnedCount < MAX_TASKS) {
+      strlcpy(stackWarned[stackWarnedCount++], entry.name, sizeof(stackWarned[0]));
+      logMessage("[HEAP] Task '" + String(entry.name) + "' has only " + String(entry.stackFree) + " bytes of stack left");
+    }
+  }
+  lowestStackFree.store(lowest, std::memory_order_relaxed);
+
+  portENTER_CRITICAL(&lock);
+  memcpy(tasks, stacks, count * sizeof(TaskStack));
+  taskCount = count;
+  portEXIT_CRITICAL(&lock);
+}
+
+void HeapMonitor::toJson(JsonObject json) const {
+  json["freeHeap"] = ESP.getFreeHeap();
+  json["minFreeHeap"] = ESP.getMinFreeHeap();
+  json["largestFreeBlock"] = ESP.getMaxAllocHeap();
+  json["fragmentation"] = fragmentation();
+  json["fragmentationWarning"] = fragmentation() >= FRAGMENTATION_WARNING;
+
+  TaskStack stacks[MAX_TASKS];
+  portENTER_CRITICAL(&lock);
+  uint8_t count = taskCount;
+  memcpy(stacks, tasks, count * sizeof(TaskStack));
+  portEXIT_CRITICAL(&lock);
+  JsonObject stackFree = json["stackFree"].to<JsonObject>();
+  for (uint8_t i = 0; i < count; i++) stackFree[stacks[i].name] = stacks[i].stackFree;
+
+  // [uptime, lowest free heap, lowest largest free block, highest fragmentation], oldest first
+  json["interval"] = HISTORY_INTERVAL;
+  JsonArray rows = json["history"].to<JsonArray>();
+  for (uint8_t i = 0; ; i++) {
+    Row row;
+    portENTER_CRITICAL(&lock);
+    bool any = i < historySize;
+    if (any) row = history[(historyHead + HISTORY_SIZE - historySize + i) % HISTORY_SIZE];
+    portEXIT_CRITICAL(&lock);
+    if (!any) break;
+    JsonArray entry = rows.add<JsonArray>();
+    entry.add(row.uptime);
+    entry.add(row.freeHeap);
+    entry.add(row.largestBlock);
+    entry.add(row.fragmentation);
+  }
+}
@@ -0,0 +1,89 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+/**
+ * Samples the heap and the stack high-water mark of every FreeRTOS task, so slow
+ * degradation over weeks of uptime becomes visible before it ends in a crash.
+ *
+ * A small task on core 0 takes a sample every SAMPLE_INTERVAL and keeps HISTORY_SIZE
+ * rows of HISTORY_INTERVAL each, with the lowest free heap, the lowest largest free
+ * block and the highest fragmentation of the interval (24 hours in total).
+ *
+ * Fragmentation is the share of the free heap that is not part of the largest free
+ * block. The internal RAM of the ESP32 consists of several regions, so it is never 0,
+ * only a rising trend matters. A warning is logged once it reaches
+ * FRAGMENTATION_WARNING and again after it fell below FRAGMENTATION_CLEAR, and once
+ * per task whose stack got within STACK_WARNING bytes of overflowing.
+ */
+class HeapMonitor {
+  public:
+    static constexpr uint32_t SAMPLE_INTERVAL = 10000;   // ms
+    static constexpr uint32_t HISTORY_INTERVAL = 900;    // s per history row
+    static constexpr uint8_t HISTORY_SIZE = 96;
+    static constexpr uint8_t MAX_TASKS = 32;
+    static constexpr uint8_t FRAGMENTATION_WARNING = 70; // %
+    static constexpr uint8_t FRAGMENTATION_CLEAR = 60;   // %
+    static constexpr uint32_t STACK_WARNING = 512;       // bytes
+
+    // One history row, the worst values of its interval
+    struct Row {
+      uint32_t uptime;        // s since boot at the end of the interval
+      uint32_t freeHeap;      // Lowest free heap
+      uint32_t largestBlock;  // Lowest largest free block
+      uint8_t fragmentation;  // Highest fragmentation in %
+    };
+
+    struct TaskStack {
+      char name[16];
+      uint32_t stackFree;     // Stack bytes never used since the task was created
+    };
+
+    // Starts the monitor task
+    void begin();
+
+    uint8_t fragmentation() const { return currentFragmentation.load(std::memory_order_relaxed); }
+    uint32_t minStackFree() const { return lowestStackFree.load(std::memory_order_relaxed); }
+
+    /**
+     * Adds the current values, the task stacks and the history to the given JSON
+     * object, can be called from any task.
+     */
+    void toJson(JsonObject json) const;
+
+  private:
+    static void taskMain(void* parameter);
+    void run();
+    void sample();
+    void sampleTasks();
+
+    TaskHandle_t task = nullptr;
+    mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;  // Guards everything below
+
+    TaskStack tasks[MAX_TASKS] = {};
+    uint8_t taskCount = 0;
+    Row history[HISTORY_SIZE] = {};
+    uint8_t historyHead = 0;  // Next row to write
+    uint8_t historySize = 0;
+    Row current = {};         // Interval in progress
+    bool currentEmpty = true;
+
+    // Only used by the monitor task
+    bool fragmentationWarned = false;
+    char stackWarned[MAX_TASKS][16] = {};
+    uint8_t stackWarnedCount = 0;
+
+    std::atomic<uint8_t> currentFragmentation{0};
+    std::atomic<uint32_t> lowestStackFree{0};
+};
+
+extern HeapMonitor heapMonitor;
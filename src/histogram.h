@@ -0,0 +1,156 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <atomic>
+
+/**
+ * Log-scale histogram with 4 buckets per power of two (max. 25% relative error).
+ *
+ * Values 0..3 have their own bucket, larger values share a bucket with all values
+ * of the same power of two and the same two bits following the most significant bit.
+ * The whole uint32_t range fits into 124 buckets.
+ *
+ * The histogram has a single writer and any number of readers. All fields are
+ * atomics, readers never block the writer but may see a count that is one record
+ * ahead of the buckets.
+ */
+class LogHistogram {
+  public:
+    static constexpr uint8_t SUB_BITS = 2;
+    static constexpr uint8_t BUCKETS = (32 - SUB_BITS + 1) << SUB_BITS;
+
+    // Plain copy of the histogram, used to persist or to render it
+    struct State {
+      uint32_t buckets[BUCKETS];
+      uint32_t count;
+      uint32_t min;
+      uint32_t max;
+      uint64_t sum;
+    };
+
+    LogHistogram() { reset(); }
+
+    /**
+     * Returns the bucket index for the given value.
+     */
+    static uint8_t bucketOf(uint32_t value) {
+      if (value < (1u << SUB_BITS)) return value;
+      uint8_t msb = 31 - __builtin_clz(value);
+      uint8_t sub = (value >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+      return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+
+    /**
+     * Returns the largest value that is counted in the given bucket.
+     */
+    static uint32_t bucketUpperBound(uint8_t bucket) {
+      if (bucket < (1u << SUB_BITS)) return bucket;
+      uint8_t msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+      uint32_t sub = bucket & ((1u << SUB_BITS) - 1);
+      uint32_t lower = (1u << msb) | (sub << (msb - SUB_BITS));
+      return lower + ((1u << (msb - SUB_BITS)) - 1);
+    }
+
+    void record(uint32_t value) {
+      buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+      if (value < min_.load(std::memory_order_relaxed)) min_.store(value, std::memory_order_relaxed);
+      if (value > max_.load(std::memory_order_relaxed)) max_.store(value, std::memory_order_relaxed);
+      uint64_t sum = sum_.load(std::memory_order_relaxed) + value;
+      sum_.store(sum, std::memory_order_relaxed);
+      uint32_t count = count_.load(std::memory_order_relaxed) + 1;
+      avg_.store(sum / count, std::memory_order_relaxed);
+      count_.store(count, std::memory_order_release);
+    }
+
+    void reset() {
+      for (auto& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+      min_.store(UINT32_MAX, std::memory_order_relaxed);
+      max_.store(0, std::memory_order_relaxed);
+      avg_.store(0, std::memory_order_relaxed);
+      sum_.store(0, std::memory_order_relaxed);
+      count_.store(0, std::memory_order_release);
+    }
+
+    uint32_t count() const { return count_.load(std::memory_order_acquire); }
+    uint32_t min() const { return count() ? min_.load(std::memory_order_relaxed) : 0; }
+    uint32_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint32_t avg() const { return avg_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint32_t bucketCount(uint8_t index) const { return buckets_[index].load(std::memory_order_relaxed); }
+
+    /**
+     * Returns the upper bound of the bucket holding the given percentile,
+     * limited to the largest recorded value.
+     *
+     * @param percent The percentile to look up, 0 to 100.
+     */
+    uint32_t percentile(float percent) const {
+      uint32_t total = count();
+      if (total == 0) return 0;
+      uint32_t rank = (uint32_t)ceilf(total * percent / 100.0f);
+      if (rank == 0) rank = 1;
+      uint32_t seen = 0;
+      for (uint8_t i = 0; i < BUCKETS; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return std::min(bucketUpperBound(i), max());
+      }
+      return max();
+    }
+
+    // Must only be called by the writer
+    void exportState(State& state) const {
+      for (uint8_t i = 0; i < BUCKETS; i++) state.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+      state.count = count();
+      state.min = min_.load(std::memory_order_relaxed);
+      state.max = max();
+      state.sum = sum();
+    }
+
+    // Must only be called by the writer
+    void importState(const State& state) {
+      for (uint8_t i = 0; i < BUCKETS; i++) buckets_[i].store(state.buckets[i], std::memory_order_relaxed);
+      min_.store(state.min, std::memory_order_relaxed);
+      max_.store(state.max, std::memory_order_relaxed);
+      sum_.store(state.sum, std::memory_order_relaxed);
+      avg_.store(state.count ? state.sum / state.count : 0, std::memory_order_relaxed);
+      count_.store(state.count, std::memory_order_release);
+    }
+
+    /**
+     * Adds count, min, avg, p50, p90, p99, max and the non-empty buckets
+     * (as [upper bound, count] pairs) to the given JSON object.
+     */
+    void toJson(JsonObject json) const {
+      json["count"] = count();
+      json["min"] = min();
+      json["avg"] = avg();
+      json["p50"] = percentile(50);
+      json["p90"] = percentile(90);
+      json["p99"] = percentile(99);
+      json["max"] = max();
+      JsonArray buckets = json["buckets"].to<JsonArray>();
+      for (uint8_t i = 0; i < BUCKETS; i++) {
+        uint32_t value = buckets_[i].load(std::memory_order_relaxed);
+        if (value == 0) continue;
+        JsonArray bucket = buckets.add<JsonArray>();
+        bucket.add(bucketUpperBound(i));
+        bucket.add(value);
+      }
+    }
+
+  private:
+    std::atomic<uint32_t> buckets_[BUCKETS];
+    std::atomic<uint32_t> count_;
+    std::atomic<uint32_t> min_;
+    std::atomic<uint32_t> max_;
+    std::atomic<uint32_t> avg_;
+    std::atomic<uint64_t> sum_;
+};
@@ -0,0 +1,245 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "history.h"
+
+History history;
+
+static void accumulate(History::Bucket& bucket, uint16_t value) {
+  if (bucket.count == 0 || value < bucket.min) bucket.min = value;
+  if (bucket.count == 0 || value > bucket.max) bucket.max = value;
+  bucket.count++;
+  bucket.sum += value;
+}
+
+uint32_t History::interval(Resolution resolution) {
+  switch (resolution) {
+    case RESOLUTION_MINUTE: return 60;
+    case RESOLUTION_HOUR: return 3600;
+    default: return 1;
+  }
+}
+
+uint32_t History::capacity(Resolution resolution) {
+  switch (resolution) {
+    case RESOLUTION_MINUTE: return MINUTE_CAPACITY;
+    case RESOLUTION_HOUR: return HOUR_CAPACITY;
+    default: return RAW_CAPACITY;
+  }
+}
+
+const char* History::resolutionName(Resolution resolution) {
+  switch (resolution) {
+    case RESOLUTION_RAW: return "raw";
+    case RESOLUTION_MINUTE: return "minute";
+    case RESOLUTION_HOUR: return "hour";
+    default: return "unknown";
+  }
+}
+
+int History::addChannel(const char* name) {
+  if (channels == MAX_CHANNELS) return -1;
+  names[channels] = name;
+  return channels++;
+}
+
+void History::clear(Resolution resolution, uint32_t index) {
+  switch (resolution) {
+    case RESOLUTION_RAW: memset(&raw[index % RAW_CAPACITY], 0, sizeof(RawSample)); break;
+    case RESOLUTION_MINUTE: memset(minutes[index % MINUTE_CAPACITY], 0, sizeof(minutes[0])); break;
+    case RESOLUTION_HOUR: memset(hours[index % HOUR_CAPACITY], 0, sizeof(hours[0])); break;
+    default: break;
+  }
+}
+
+void History::add(uint32_t second, const uint16_t* values, uint8_t present) {
+  portENTER_CRITICAL(&lock);
+  if (started && second <= latestSecond) {
+    portEXIT_CRITICAL(&lock);
+    return;
+  }
+
+  // Clear the rows this second opens, and the ones skipped since the last sample
+  for (uint8_t r = 0; r < RESOLUTION_COUNT; r++) {
+    Resolution resolution = (Resolution)r;
+    uint32_t last = second / interval(resolution);
+    uint32_t next = started ? latestSecond / interval(resolution) + 1 : last;
+    if (last >= next && last - next >= capacity(resolution)) next = last - capacity(resolution) + 1;
+    for (uint32_t index = next; index <= last; index++) clear(resolution, index);
+  }
+  if (!started) firstSecond = second;
+  started = true;
+  latestSecond = second;
+
+  RawSample& sample = raw[second % RAW_CAPACITY];
+  Bucket* minute = minutes[(second / 60) % MINUTE_CAPACITY];
+  Bucket* hour = hours[(second / 3600) % HOUR_CAPACITY];
+  for (uint8_t channel = 0; channel < channels; channel++) {
+    if (!(present & (1 << channel))) continue;
+    sample.present |= 1 << channel;
+    sample.values[channel] = values[channel];
+    accumulate(minute[channel], values[channel]);
+    accumulate(hour[channel], values[channel]);
+  }
+  portEXIT_CRITICAL(&lock);
+}
+
+// Rows currently held, the lock has to be taken
+bool History::held(Resolution resolution, uint32_t& first, uint32_t& last) const {
+  if (!started) return false;
+  last = latestSecond / interval(resolution);
+  first = firstSecond / interval(resolution);
+  if (last - first >= capacity(resolution)) first = last - capacity(resolution) + 1;
+  return true;
+}
+
+bool History::range(Resolution resolution, uint32_t& first, uint32_t& last) {
+  portENTER_CRITICAL(&lock);
+  bool any = held(resolution, first, last);
+  portEXIT_CRITICAL(&lock);
+  return any;
+}
+
+bool History::read(Resolution resolution, uint32_t index, Bucket* buckets) {
+  memset(buckets, 0, MAX_CHANNELS * sizeof(Bucket));
+  portENTER_CRITICAL(&lock);
+  uint32_t first, last;
+  bool found = held(resolution, first, last) && index >= first && index <= last;
+  if (found) {
+    switch (resolution) {
+      case RESOLUTION_RAW: {
+        const RawSample& sample = raw[index % RAW_CAPACITY];
+        for (uint8_t channel = 0; channel < channels; channel++) {
+          if (!(sample.present & (1 << channel))) continue;
+          uint16_t value = sample.values[channel];
+          buckets[channel] = {value, value, 1, 0, value};
+        }
+        break;
+      }
+      case RESOLUTION_MINUTE: memcpy(buckets, minutes[index % MINUTE_CAPACITY], sizeof(minutes[0])); break;
+      case RESOLUTION_HOUR: memcpy(buckets, hours[index % HOUR_CAPACITY], sizeof(hours[0])); break;
+      default: break;
+    }
+  }
+  portEXIT_CRITICAL(&lock);
+  return found;
+}
+
+History::Export::Export(History& history, Resolution resolution, uint32_t from, bool binary)
+    : history(history), resolution(resolution), binary(binary) {
+  uint32_t last = 0;
+  portENTER_CRITICAL(&history.lock);
+  bool any = history.held(resolution, first, last);
+  latest = history.latestSecond;
+  portEXIT_CRITICAL(&history.lock);
+
+  if (!any) return;
+  if (from / interval(resolution) > first) first = from / interval(resolution);
+  rows = first <= last ? last - first + 1 : 0;
+}
+
+// Renders the next fragment into pending, returns false once everything was rendered
+bool History::Export::renderNext() {
+  int length = 0;
+  switch (stage) {
+    case 0:  // Header
+      length = renderHeader();
+      stage++;
+      break;
+    case 1: {  // Channel names
+      if (index == history.channelCount()) {
+        index = 0;
+        stage++;
+        if (binary) return renderNext();
+        length = snprintf(pending, sizeof(pending), "],\"rows\":[");
+        break;
+      }
+      const char* name = history.channelName(index);
+      if (binary) {
+        length = min(strlen(name) + 1, sizeof(pending));
+        memcpy(pending, name, length);
+        pending[length - 1] = '\0';
+      } else {
+        length = snprintf(pending, sizeof(pending), "%s\"%s\"", index > 0 ? "," : "", name);
+      }
+      index++;
+      break;
+    }
+    case 2:  // Rows
+      if (index == rows) {
+        stage++;
+        if (binary) return false;
+        length = snprintf(pending, sizeof(pending), "]}");
+        break;
+      }
+      length = renderRow();
+      index++;
+      break;
+    default:
+      return false;
+  }
+  pendingLength = length < 0 ? 0 : min((size_t)length, sizeof(pending));
+  pendingOffset = 0;
+  return true;
+}
+
+size_t History::Export::renderHeader() {
+  if (binary) {
+    HistoryFileHeader header = {{'G', 'H', 'I', 'S'}, HISTORY_FILE_VERSION, resolution, history.channelCount(), 0,
+                                interval(resolution), latest, first * interval(resolution), rows};
+    memcpy(pending, &header, sizeof(header));
+    return sizeof(header);
+  }
+  int length = snprintf(pending, sizeof(pending),
+                        "{\"resolution\":\"%s\",\"interval\":%u,\"latest\":%u,\"from\":%u,\"channels\":[",
+                        resolutionName(resolution), (unsigned)interval(resolution), (unsigned)latest,
+                        (unsigned)(first * interval(resolution)));
+  return length < 0 ? 0 : min((size_t)length, sizeof(pending) - 1);
+}
+
+size_t History::Export::renderRow() {
+  Bucket buckets[MAX_CHANNELS];
+  history.read(resolution, first + index, buckets);
+  uint8_t channels = history.channelCount();
+
+  if (binary) {
+    if (resolution != RESOLUTION_RAW) {
+      memcpy(pending, buckets, channels * sizeof(Bucket));
+      return channels * sizeof(Bucket);
+    }
+    uint8_t present = 0;
+    uint16_t values[MAX_CHANNELS] = {};
+    for (uint8_t channel = 0; channel < channels; channel++) {
+      if (buckets[channel].count > 0) present |= 1 << channel;
+      values[channel] = buckets[channel].min;
+    }
+    pending[0] = present;
+    pending[1] = 0;
+    memcpy(pending + 2, values, channels * sizeof(uint16_t));
+    return 2 + channels * sizeof(uint16_t);
+  }
+
+  // [value, ...] for raw samples, [[min, max, avg, count], ...] for buckets, null without samples
+  size_t length = 0;
+  for (uint8_t channel = 0; channel < channels && length < sizeof(pending); channel++) {
+    const Bucket& bucket = buckets[channel];
+    const char* separator = channel == 0 ? (index > 0 ? ",[" : "[") : ",";
+    int part;
+    if (bucket.count == 0) {
+      part = snprintf(pending + length, sizeof(pending) - length, "%snull", separator);
+    } else if (resolution == RESOLUTION_RAW) {
+      part = snprintf(pending + length, sizeof(pending) - length, "%s%u", separator, bucket.min);
+    } else {
+      uint32_t avg = (uint64_t)bucket.sum * 1000 / bucket.count;
+      part = snprintf(pending + length, sizeof(pending) - length, "%s[%u,%u,%u.%03u,%u]", separator,
+                      bucket.min, bucket.max, (unsigned)(avg / 1000), (unsigned)(avg % 1000), bucket.count);
+    }
+    if (part > 0) length += part;
+  }
+  if (length < sizeof(pending)) pending[length++] = ']';
+  return min(length, sizeof(pending));
+}
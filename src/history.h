@@ -0,0 +1,166 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include "util.h"
+
+#define HISTORY_FILE_VERSION 1
+
+/**
+ * Binary export of the history, all values little endian.
+ *
+ * The header is followed by the channel names as NUL terminated strings and by
+ * header.rows rows, one every header.interval seconds starting at header.from:
+ *   raw rows      uint8 present (bit per channel), uint8 reserved, uint16 value per channel
+ *   bucket rows   History::Bucket per channel, a count of 0 means no samples
+ */
+struct HistoryFileHeader {
+  char magic[4];        // "GHIS"
+  uint8_t version;      // HISTORY_FILE_VERSION
+  uint8_t resolution;   // History::Resolution
+  uint8_t channels;
+  uint8_t reserved;
+  uint32_t interval;    // s per row
+  uint32_t latest;      // s since boot of the newest sample
+  uint32_t from;        // s since boot of the first row
+  uint32_t rows;
+};
+static_assert(sizeof(HistoryFileHeader) == 24, "history file header layout");
+
+/**
+ * Fixed-memory history of the run state, relay activity and polled values.
+ *
+ * Every channel is sampled once per second into a ring of raw samples. Each sample is
+ * also added to the bucket of its minute and of its hour, so the minute and hour rings
+ * always hold min, max, sum and count of the raw samples without keeping them. Older rows
+ * are overwritten, memory use does not grow however long the device runs.
+ *
+ * Rows are addressed by their index since boot (seconds, minutes or hours). Samples are
+ * added by the control task, readers copy single rows under a spinlock, so a download
+ * never stops the sampling.
+ */
+class History {
+  public:
+    static constexpr uint8_t MAX_CHANNELS = 8;
+    static constexpr uint16_t RAW_CAPACITY = 300;     // 5 minutes of samples, 5.4 KiB
+    static constexpr uint16_t MINUTE_CAPACITY = 120;  // 2 hours of minutes, 11.5 KiB
+    static constexpr uint16_t HOUR_CAPACITY = 168;    // 7 days of hours, 16.1 KiB
+
+    enum Resolution : uint8_t {
+      RESOLUTION_RAW = 0,
+      RESOLUTION_MINUTE = 1,
+      RESOLUTION_HOUR = 2,
+      RESOLUTION_COUNT
+    };
+
+    struct Bucket {
+      uint16_t min;
+      uint16_t max;
+      uint16_t count;     // Samples in the bucket
+      uint16_t reserved;
+      uint32_t sum;       // avg = sum / count
+    };
+    static_assert(sizeof(Bucket) == 12, "history bucket layout");
+
+    /**
+     * Adds a channel, must be called before the first sample.
+     *
+     * @param name Name of the channel, must stay valid.
+     * @return Index of the channel, or -1 if all channels are in use.
+     */
+    int addChannel(const char* name);
+
+    /**
+     * Adds the samples of one second. Seconds without samples are recorded as gaps,
+     * a second that is not newer than the last one is ignored.
+     *
+     * @param second Seconds since boot.
+     * @param values Value per channel.
+     * @param present Bit per channel that has a value.
+     */
+    void add(uint32_t second, const uint16_t* values, uint8_t present);
+
+    /**
+     * Returns the rows that are currently held.
+     *
+     * @param resolution The ring.
+     * @param first Receives the index of the oldest row.
+     * @param last Receives the index of the newest row, it may still be filling.
+     * @return false if there are no rows yet.
+     */
+    bool range(Resolution resolution, uint32_t& first, uint32_t& last);
+
+    /**
+     * Copies a row, raw samples are returned as buckets with a count of 0 or 1.
+     *
+     * @param resolution The ring.
+     * @param index Index of the row since boot.
+     * @param buckets Receives a bucket per channel.
+     * @return false if the row is not held (anymore), buckets are cleared then.
+     */
+    bool read(Resolution resolution, uint32_t index, Bucket* buckets);
+
+    uint8_t channelCount() const { return channels; }
+    const char* channelName(uint8_t channel) const { return names[channel]; }
+
+    static uint32_t interval(Resolution resolution);
+    static const char* resolutionName(Resolution resolution);
+
+    /**
+     * Streams rows of one ring as JSON or in the binary format of HistoryFileHeader,
+     * for chunked responses. The rows are fixed when the export is created.
+     */
+    class Export : public ChunkedExport<320> {
+      public:
+        /**
+         * @param history The history to export.
+         * @param resolution The ring.
+         * @param from Seconds since boot, older rows are skipped.
+         * @param binary Binary format instead of JSON.
+         */
+        Export(History& history, Resolution resolution, uint32_t from, bool binary);
+
+      private:
+        bool renderNext() override;
+        size_t renderHeader();
+        size_t renderRow();
+
+        History& history;
+        Resolution resolution;
+        bool binary;
+        uint32_t latest = 0;
+        uint32_t first = 0;
+        uint32_t rows = 0;
+        uint32_t index = 0;
+        uint8_t stage = 0;
+    };
+
+  private:
+    struct RawSample {
+      uint16_t values[MAX_CHANNELS];
+      uint8_t present;
+    };
+
+    static uint32_t capacity(Resolution resolution);
+    void clear(Resolution resolution, uint32_t index);
+    bool held(Resolution resolution, uint32_t& first, uint32_t& last) const;
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    const char* names[MAX_CHANNELS] = {};
+    uint8_t channels = 0;
+    bool started = false;
+    uint32_t firstSecond = 0;
+    uint32_t latestSecond = 0;
+
+    RawSample raw[RAW_CAPACITY] = {};
+    Bucket minutes[MINUTE_CAPACITY][MAX_CHANNELS] = {};
+    Bucket hours[HOUR_CAPACITY][MAX_CHANNELS] = {};
+};
+
+extern History history;
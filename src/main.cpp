@@ -17,30 +17,55 @@
 #include <ESPAsyncWebServer.h>
 #include <wifimanager.h>
 #include <deque>
+#include <memory>
+#include <new>
 #include <string>
 #include <mdns.h>
 #include <esp_event.h>
+#include <esp_timer.h>
 #include <ReactESP.h>
 #include <Preferences.h>
 #include <otaWebUpdater.h>
+#include <ArduinoJson.h>
+#include "arbiter.h"
+#include "benchmark.h"
+#include "control.h"
+#include "hal.h"
+#include "heap_monitor.h"
+#include "command.h"
+#include "command_queue.h"
+#include "gpio_trace.h"
+#include "histogram.h"
+#include "history.h"
+#include "metrics.h"
+#include "modbus_poller.h"
+#include "modbus_rtu.h"
+#include "modbus_tcp.h"
+#include "mqtt_client.h"
+#include "perf_trace.h"
+#include "pins.h"
+#include "remote_syslog.h"
+#include "start_stats.h"
+#include "status.h"
+#include "status_beacon.h"
+#include "tick_stats.h"
+#include "webhooks.h"
+
+// Polling of the generator controller via Modbus RTU, only with -D GENSET_MODBUS (see env:esp32dev-modbus)
+#ifdef GENSET_MODBUS
+#define MODBUS_ENABLED true
+#else
+#define MODBUS_ENABLED false
+#endif
+#define MODBUS_BAUDRATE 19200 // https://www.ccontrols.com/support/dp/modbus2300.pdf
+#define MODBUS_UNIT_ID 1
 
-// #include <ModbusMaster.h>
-
-// Pin definitions
-#define RELAY_K1 16
-#define RELAY_K2 17
-#define LED 23
-#define RUNNING_SIGNAL 25
-#define START_SIGNAL 26
-#define STOP_SIGNAL 27
-// #define MODBUS_ENABLED true
-// #define MODBUS_TX 32 // GPIO pin for MODBUS TX
-// #define MODBUS_RX 33 // GPIO pin for MODBUS RX
-// #define MODBUS_BAUDRATE 19200 // https://www.ccontrols.com/support/dp/modbus2300.pdf
+#define BEACON_ENABLED true
+#define BEACON_GROUP IPAddress(239, 255, 71, 83)  // Multicast group of the status beacon, see tools/beacon_listen.cpp
+#define BEACON_PORT 4783
 
 // Predefined Settings
 const char* MDNS_NAME = "genset-control";         // Name used for mDNS
-const char* NVS_GENSET_CONTROL = "Genset";        // Name of the NVS namespace
 const char* WIFI_SOFTAP_SSID = "Genset Control";  // Default name of the SoftAP
 const char* WIFI_SOFTAP_PASS = "";                // Default password of the SoftAP
 const char* OTA_BASE_URL = "";                    // Base URL for OTA updates (if empty, OTA updates are disabled)
@@ -65,106 +90,355 @@ protected:
 };
 MyOtaWebUpdater* otaWebUpdater = nullptr;
 
-// Create the NVS instance
-Preferences preferences;
-
-// Configurable durations (default values)
-// defines how long the Relay should be turned on
-uint32_t powerUpDuration = 10000;  // 10 seconds
-uint32_t powerDownDuration = 10000; // 10 seconds
-
-uint32_t retryStartCount = 0;  // Amount of retries since the last state transition
-
 // Web server
 AsyncWebServer webServer(80);
 
-// Variables for state tracking
-bool lastStartState = LOW; // START signal - request to start up the Generator
-bool lastStopState = LOW;  // STOP signal - request to stop the Generator
-bool runningState = LOW;   // RUNNING signal - status if the Generator is running
-bool ledState = LOW;       // State of the LED
-bool allowStart = true;    // Allow the generator to start
-uint8_t retryCount = 1;    // Retry count
-
-volatile bool runningSignalChanged = false;
-bool generatorStopping = false;
-bool generatorStarting = false;
+// Generator control runs in its own task, pinned to core 1 with a high priority.
+// WiFi, async_tcp (see CONFIG_ASYNC_TCP_RUNNING_CORE) and the UI stay on core 0
+// and only hand over commands through the lock-free controlQueue, see control.h.
+const uint32_t CONTROL_TASK_STACK_SIZE = 8192;
+const UBaseType_t CONTROL_TASK_PRIORITY = configMAX_PRIORITIES - 5;
+const BaseType_t CONTROL_TASK_CORE = 1;
 
 // Define maximum number of log entries
 const uint16_t LOG_BUFFER_MAX_SIZE = 100;
 
-// Use a deque to store log entries
+// Use a deque to store log entries, written by the log task and guarded by logMutex
 std::deque<String> logBuffer;
-
-// ReactESP event loop
-using namespace reactesp;
-EventLoop event_loop;
+SemaphoreHandle_t logMutex = nullptr;
+
+// Log lines are handed to the log task through a lock-free queue, so no task waits
+// for the log buffer, the UART or the syslog queue while it logs. Only the control
+// task drops a line if the queue is full, all other tasks wait for room.
+const size_t LOG_LINE_LENGTH = 192;
+const size_t LOG_QUEUE_LENGTH = 32;
+const uint32_t LOG_TASK_STACK_SIZE = 4096;
+struct LogLine {
+  char text[LOG_LINE_LENGTH];
+};
+MpscQueue<LogLine, LOG_QUEUE_LENGTH> logQueue;
+TaskHandle_t logTaskHandle = nullptr;
 
 // Functions
 void logMessage(const String& msg);
+void logTask(void* parameter);
 void setupWiFi();
-bool setPowerUpDuration(uint32_t duration);
-uint32_t getPowerUpDuration();
-bool setPowerDownDuration(uint32_t duration);
-uint32_t getPowerDownDuration();
-bool setAllowStart(bool state);
-bool getAllowStart();
-bool setRetryCount(uint8_t count);
-uint8_t getRetryCount();
-void checkGeneratorStateAndRetry();
-void startGenerator();
-void stopGenerator();
+bool setMqttSettings(const MqttSettings& settings);
+MqttSettings getMqttSettings();
+bool setSyslogSettings(const SyslogSettings& settings);
+SyslogSettings getSyslogSettings();
+bool setWebhookSettings(const WebhookSettings& settings);
+WebhookSettings getWebhookSettings();
+String renderMainPage(const GensetStatus& status);
+String renderLog();
 void setupWebServer();
-void checkForSignals();
-void IRAM_ATTR receiveRunningSignal();
-void IRAM_ATTR receiveLEDStatus();
+void sendQueued(AsyncWebServerRequest* request, uint32_t id, const String& what);
+void controlTask(void* parameter);
+void publishControlStatus();
+void publishModbusImage();
+void sampleHistory();
+void registerMetrics();
+void fillStatusBeacon(StatusBeaconPacket& packet);
 void setup();
 void loop();
 
-// MODBUS configuration and data structure
-// struct CumminsOnanData {
-//     uint16_t engine_hours;
-//     uint16_t battery_voltage;
-//     uint16_t engine_rpm;
-//     uint16_t generator_load;
-// };
-// CumminsOnanData gensetData;
-// ModbusMaster modbus;
+// MODBUS configuration and register map, every register is read at its own period
+const ModbusRegister gensetRegisters[] = {
+  // name, unit, function, address, period in ms
+  {"engine_hours", MODBUS_UNIT_ID, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1000, 3600000},
+  {"battery_voltage", MODBUS_UNIT_ID, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1001, 10000},
+  {"engine_rpm", MODBUS_UNIT_ID, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1002, 1000},
+  {"generator_load", MODBUS_UNIT_ID, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1003, 1000},
+};
+StreamModbusPort modbusPort(Serial1);
+ModbusRtuMaster modbus(modbusPort, MODBUS_BAUDRATE);
+ModbusPoller modbusPoller(modbus, gensetRegisters, sizeof(gensetRegisters) / sizeof(gensetRegisters[0]));
+bool modbusOnline = false;
+ModbusTcpServer modbusTcp;
+
+// MQTT broker connection, no broker is configured by default
+MqttSettings mqttSettings = {};
+
+// Syslog collector, no collector is configured by default
+SyslogSettings syslogSettings = {};
+
+// Webhook endpoint, no endpoint is configured by default
+WebhookSettings webhookSettings = {};
+
+/**
+ * Polls the MODBUS data from the generator without blocking.
+ *
+ * Called by the control task on every iteration and woken up by received bytes.
+ * The poller reads every register of gensetRegisters at its period, adjacent
+ * registers are read together. A transaction ends after about 200ms at the latest.
+ */
+void pollModbus() {
+  if (!modbusPoller.poll(hal::now(), hal::nowMicros())) return;
+
+  bool online = modbus.result() == MODBUS_OK;
+  if (online != modbusOnline) {
+    modbusOnline = online;
+    if (online) logMessage("[MODBUS] Generator controller is responding");
+    else logMessage("[MODBUS] Generator controller not responding: " + String(modbusResultName(modbus.result())));
+  }
+  publishModbusImage();
+}
+
+/**
+ * Encodes the generator state, settings and polled registers into the register
+ * image of the Modbus TCP server. Must only be called by the control task, when
+ * the state changed, after a Modbus poll and every second for the uptime and ages.
+ */
+void publishModbusImage() {
+  GensetStatus status = gensetStatus.read();
+  ModbusSnapshot telemetry = modbusPoller.snapshot();
+  uint32_t now = hal::now();
+
+  ModbusRegisterImage image = {};
+  image.setInput(0, status.running);
+  image.setInput(1, status.startSignal);
+  image.setInput(2, status.stopSignal);
+  image.setInput(3, status.relayK1);
+  image.setInput(4, status.relayK2);
+  image.setInput(5, status.starting);
+  image.setInput(6, status.stopping);
+  image.setInput(7, status.retryStartCount);
+  image.setInput(8, status.retryStopCount);
+  image.setInput(9, status.intentCommand == INTENT_NONE ? 0 : status.intentCommand + 1);
+  image.setInput(10, status.intentSource == INTENT_NONE ? 0xFFFF : status.intentSource);
+  image.setInput32(11, now / 1000);
+  for (uint8_t i = 0; i < modbusPoller.registerCount() && i < ModbusRegisterImage::TELEMETRY_REGISTERS; i++) {
+    uint32_t age = telemetry.updatedAt[i] != 0 ? (now - telemetry.updatedAt[i]) / 1000 : 0xFFFF;
+    image.setInput(ModbusRegisterImage::INPUT_TELEMETRY + i, telemetry.values[i]);
+    image.setInput(ModbusRegisterImage::INPUT_TELEMETRY_AGE + i, min(age, (uint32_t)0xFFFF));
+  }
+
+  image.setHolding(0, status.allowStart);
+  image.setHolding(1, status.startMode);
+  image.setHolding(2, status.stopMode);
+  image.setHolding(3, status.retryCount);
+  image.setHolding(4, status.stopRetryCount);
+  image.setHolding32(5, status.powerUpDuration);
+  image.setHolding32(7, status.powerDownDuration);
+  image.setHolding32(9, status.noStartTimeout);
+  image.setHolding32(11, status.stopConfirmDuration);
+
+  image.coils = (status.intentCommand == COMMAND_START ? 1 : 0) | (status.intentCommand == COMMAND_STOP ? 2 : 0);
+  modbusTcp.publish(image);
+}
+
+/**
+ * Whether a polled register was read recently enough to be shown.
+ *
+ * @param telemetry Snapshot of the poller.
+ * @param index Index of the register in gensetRegisters.
+ * @param now millis().
+ * @return true if the register was read within its last two periods.
+ */
+bool telemetryFresh(const ModbusSnapshot& telemetry, uint8_t index, uint32_t now) {
+  return telemetry.updatedAt[index] != 0 && now - telemetry.updatedAt[index] <= 2 * modbusPoller.registers()[index].period;
+}
 
+/**
+ * Adds the samples of the last second to the history, called every second by the control task.
+ * A relay counts as active if it was closed at any time since the last sample, so short pulses
+ * are not lost. Polled registers are left out once they are older than two periods.
+ */
+void sampleHistory() {
+  uint16_t values[History::MAX_CHANNELS] = {};
+  uint8_t present = 0b111;
+  values[0] = runningState;
+  values[1] = (relayActivity & 1) != 0;
+  values[2] = (relayActivity & 2) != 0;
+  relayActivity = hal::readPin(RELAY_K1) | (hal::readPin(RELAY_K2) << 1);
+
+  if (MODBUS_ENABLED) {
+    ModbusSnapshot telemetry = modbusPoller.snapshot();
+    uint32_t now = hal::now();
+    for (uint8_t i = 0; i < modbusPoller.registerCount() && 3 + i < History::MAX_CHANNELS; i++) {
+      if (!telemetryFresh(telemetry, i, now)) continue;
+      values[3 + i] = telemetry.values[i];
+      present |= 1 << (3 + i);
+    }
+  }
+  history.add(esp_timer_get_time() / 1000000, values, present);
+}
 
 /**
- * Polls the MODBUS data from the generator.
+ * Fills the state into a datagram of the status beacon, called by the beacon task.
  *
- * The function connects to the serial interface, sends a request to read
- * the holding registers starting at address 0x1000, and reads the response
- * into the gensetData struct.
+ * @param packet The datagram, its header is filled by the beacon.
+ */
+void fillStatusBeacon(StatusBeaconPacket& packet) {
+  GensetStatus status = gensetStatus.read();
+  uint32_t now = hal::now();
+  packet.flags = (status.running ? STATUS_BEACON_RUNNING : 0)
+                 | (status.startSignal ? STATUS_BEACON_START_SIGNAL : 0)
+                 | (status.stopSignal ? STATUS_BEACON_STOP_SIGNAL : 0)
+                 | (status.relayK1 ? STATUS_BEACON_RELAY_K1 : 0)
+                 | (status.relayK2 ? STATUS_BEACON_RELAY_K2 : 0)
+                 | (status.starting ? STATUS_BEACON_STARTING : 0)
+                 | (status.stopping ? STATUS_BEACON_STOPPING : 0)
+                 | (status.allowStart ? STATUS_BEACON_ALLOW_START : 0);
+  packet.uptime = esp_timer_get_time() / 1000000;
+  packet.changedAgo = now - status.changedAt;
+  packet.retryStartCount = status.retryStartCount;
+  packet.retryStopCount = status.retryStopCount;
+  packet.intentCommand = status.intentCommand;
+  packet.intentSource = status.intentSource;
+  packet.startMode = status.startMode;
+  packet.stopMode = status.stopMode;
+  packet.retryCount = status.retryCount;
+  packet.stopRetryCount = status.stopRetryCount;
+
+  if (MODBUS_ENABLED) {
+    ModbusSnapshot telemetry = modbusPoller.snapshot();
+    packet.telemetryCount = min(modbusPoller.registerCount(), STATUS_BEACON_TELEMETRY);
+    for (uint8_t i = 0; i < packet.telemetryCount; i++) {
+      packet.telemetry[i] = telemetry.values[i];
+      if (telemetryFresh(telemetry, i, now)) packet.telemetryFresh |= 1 << i;
+    }
+  }
+}
+
+/**
+ * Registers all values served by /metrics, the control path counters are
+ * incremented where they happen.
+ */
+void registerMetrics() {
+  metrics.add("genset_start_attempts_total", METRIC_COUNTER, "Times the starter relay K1 was closed, including retries.",
+              metrics.startAttempts);
+  metrics.add("genset_start_retries_total", METRIC_COUNTER, "Start retries after no RUNNING signal.", metrics.startRetries);
+  metrics.add("genset_start_cycles_total", METRIC_COUNTER, "Finished start cycles by outcome since the start statistics were reset.",
+              startStats.outcomeCount(START_OUTCOME_SUCCESS), "outcome=\"success\"");
+  metrics.add("genset_start_cycles_total", METRIC_COUNTER, "", startStats.outcomeCount(START_OUTCOME_FAILED), "outcome=\"failed\"");
+  metrics.add("genset_start_cycles_total", METRIC_COUNTER, "", startStats.outcomeCount(START_OUTCOME_ABORTED), "outcome=\"aborted\"");
+  metrics.add("genset_stop_commands_total", METRIC_COUNTER, "Stop commands that engaged the stop relay K2.", metrics.stopCommands);
+  metrics.add("genset_stop_retries_total", METRIC_COUNTER, "Stop retries while the generator kept running.", metrics.stopRetries);
+  metrics.add("genset_relay_on_seconds_total", METRIC_COUNTER, "Time the relays were closed.",
+              metrics.relayOnTime[0], "relay=\"k1\"", 1000);
+  metrics.add("genset_relay_on_seconds_total", METRIC_COUNTER, "", metrics.relayOnTime[1], "relay=\"k2\"", 1000);
+  metrics.add("genset_running_transitions_total", METRIC_COUNTER, "Debounced changes of the RUNNING signal.",
+              metrics.runningTransitions);
+  metrics.add("genset_running", METRIC_GAUGE, "1 if the generator reports RUNNING.",
+              []() -> uint32_t { return gensetStatus.read().running; });
+  metrics.add("genset_log_lines_total", METRIC_COUNTER, "Log lines written.", metrics.logLines);
+  metrics.add("genset_log_dropped_total", METRIC_COUNTER, "Log lines a queue had no room for.",
+              metrics.logDropped, "sink=\"log\"");
+  metrics.add("genset_log_dropped_total", METRIC_COUNTER, "",
+              []() -> uint32_t { return remoteSyslog.dropped(); }, "sink=\"syslog\"");
+  metrics.add("genset_heap_free_bytes", METRIC_GAUGE, "Free heap.", []() -> uint32_t { return ESP.getFreeHeap(); });
+  metrics.add("genset_heap_min_free_bytes", METRIC_GAUGE, "Lowest free heap since boot.",
+              []() -> uint32_t { return ESP.getMinFreeHeap(); });
+  metrics.add("genset_heap_largest_free_block_bytes", METRIC_GAUGE, "Largest heap block that can be allocated.",
+              []() -> uint32_t { return ESP.getMaxAllocHeap(); });
+  metrics.add("genset_heap_fragmentation_percent", METRIC_GAUGE, "Share of the free heap outside of the largest free block.",
+              []() -> uint32_t { return heapMonitor.fragmentation(); });
+  metrics.add("genset_task_stack_min_free_bytes", METRIC_GAUGE, "Lowest stack high-water mark of all tasks, see /heap.",
+              []() -> uint32_t { return heapMonitor.minStackFree(); });
+  metrics.add("genset_uptime_seconds", METRIC_GAUGE, "Time since boot.",
+              []() -> uint32_t { return esp_timer_get_time() / 1000000; });
+  metrics.addHistogram("genset_loop_tick_seconds", "Duration of the control loop ticks.", tickStats.tickTime);
+  metrics.addHistogram("genset_loop_lateness_seconds", "How late repeated and delayed control loop callbacks fired.", tickStats.lateness);
+}
+
+/**
+ * Submits a START (coil 0) or STOP (coil 1) intent written by a Modbus TCP client.
+ *
+ * @param coil The coil written ON.
+ */
+void onModbusCoil(uint16_t coil) {
+  Command command = {coil == 0 ? COMMAND_START : COMMAND_STOP, COMMAND_SOURCE_MODBUS, hal::nowMicros()};
+  if (queueCommand(command) == 0) logMessage("[MODBUS] Command queue full, ignoring coil " + String(coil));
+}
+
+/**
+ * Applies a command received on <prefix>/command/<command> via MQTT.
  *
- * The function is called every 1000ms to poll the MODBUS data.
+ * @param command start, stop or allowStart.
+ * @param payload Ignored for start and stop, 1/0, true/false or ON/OFF for allowStart.
+ * @param result Receives the outcome, published to <prefix>/command/result.
+ * @param resultSize Size of result.
  */
-/*void queryModbus() {
-    modbus.begin(&Serial1, MODBUS_BAUDRATE, SERIAL_8N1);
-    modbus.readHoldingRegisters(1, 0x1000, 4); // Device ID 1, start address 0x1000, read 4 registers
-    gensetData.engine_hours = modbus.getResponseBuffer(0);
-    gensetData.battery_voltage = modbus.getResponseBuffer(1);
-    gensetData.engine_rpm = modbus.getResponseBuffer(2);
-    gensetData.generator_load = modbus.getResponseBuffer(3);
-}*/
-
-// Function to log messages
+void onMqttCommand(const char* command, const char* payload, char* result, size_t resultSize) {
+  bool start = strcmp(command, "start") == 0;
+  if (start || strcmp(command, "stop") == 0) {
+    uint32_t id = queueCommand({start ? COMMAND_START : COMMAND_STOP, COMMAND_SOURCE_MQTT, hal::nowMicros()});
+    if (id == 0) snprintf(result, resultSize, "%s ignored, control queue is full", command);
+    else snprintf(result, resultSize, "%s queued with id %u", command, (unsigned)id);
+    return;
+  }
+
+  if (strcmp(command, "allowStart") == 0) {
+    bool allow = strcmp(payload, "1") == 0 || strcasecmp(payload, "true") == 0 || strcasecmp(payload, "on") == 0;
+    if (!allow && strcmp(payload, "0") != 0 && strcasecmp(payload, "false") != 0 && strcasecmp(payload, "off") != 0) {
+      snprintf(result, resultSize, "allowStart expects 1/0, true/false or ON/OFF");
+      return;
+    }
+    uint32_t id = queueSetting(TRACE_SETTING_ALLOW_START, allow, COMMAND_SOURCE_MQTT);
+    if (id == 0) {
+      snprintf(result, resultSize, "allowStart ignored, control queue is full");
+      return;
+    }
+    // Like /disallowStart, a running generator is stopped as well
+    if (!allow && queueCommand({COMMAND_STOP, COMMAND_SOURCE_MQTT, hal::nowMicros()}) == 0) {
+      snprintf(result, resultSize, "startup disable queued, but the control queue is full");
+      return;
+    }
+    snprintf(result, resultSize, "allowStart queued with id %u", (unsigned)id);
+    return;
+  }
+
+  snprintf(result, resultSize, "unknown command %s", command);
+}
+
+// Function to log messages, hands the message over to the log task
 void logMessage(const String& msg) {
   // remove unnecessary newlines
-  auto message = msg.endsWith("\n") ? msg.substring(0, msg.length() - 1) : msg;
+  size_t length = msg.endsWith("\n") ? msg.length() - 1 : msg.length();
 
-  // Add the new message to the buffer
-  logBuffer.push_back(message);
+  metrics.logLines.fetch_add(1, std::memory_order_relaxed);
 
-  // Remove the oldest entry if the buffer exceeds the maximum size
-  if (logBuffer.size() > LOG_BUFFER_MAX_SIZE) {
-    logBuffer.pop_front();
+  LogLine line;
+  strlcpy(line.text, msg.c_str(), min(length + 1, sizeof(line.text)));
+  while (!logQueue.push(line)) {
+    // The control task never waits, neither does the log task for itself
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    if (logTaskHandle == nullptr || self == logTaskHandle || self == controlTaskHandle) {
+      metrics.logDropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    vTaskDelay(1);
   }
+  if (logTaskHandle) xTaskNotifyGive(logTaskHandle);
+}
+
+/**
+ * The log task, writes the queued log lines to the log buffer, the serial
+ * console and the syslog queue. Runs on core 0 with a low priority.
+ */
+void logTask(void* parameter) {
+  LogLine line;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    while (logQueue.pop(line)) {
+      // Add the new message to the buffer
+      xSemaphoreTake(logMutex, portMAX_DELAY);
+      logBuffer.push_back(line.text);
+
+      // Remove the oldest entry if the buffer exceeds the maximum size
+      if (logBuffer.size() > LOG_BUFFER_MAX_SIZE) {
+        logBuffer.pop_front();
+      }
+      xSemaphoreGive(logMutex);
+
+      // Queue it for the syslog collector, sent by the syslog task
+      remoteSyslog.log(line.text);
 
-  // Print to Serial for debugging
-  Serial.println(message);
+      // Print to Serial for debugging
+      Serial.println(line.text);
+    }
+  }
 }
 
 // WiFi connection setup
@@ -206,136 +480,98 @@ void setupWiFi() {
 }
 
 /**
- * Sets the power-up duration for the generator.
- *
- * Stores the specified duration in non-volatile storage (NVS) under the 
- * "powerUpDuration" key and logs the operation.
+ * Sets the MQTT broker connection and reconnects the MQTT client.
  *
- * @param duration The duration in milliseconds for which the K1 relay should be turned on.
- * @return true if the duration was successfully written to NVS, false otherwise.
+ * @param settings The broker settings, an empty host disables MQTT.
+ * @return true if the settings were successfully written to NVS.
  */
-bool setPowerUpDuration(uint32_t duration) {
+bool setMqttSettings(const MqttSettings& settings) {
+  mqttSettings = settings;
+  mqttClient.configure(settings);
   if (preferences.begin(NVS_GENSET_CONTROL, false)) {
-    bool success = preferences.putUInt("powerUpDuration", duration);
-    powerUpDuration = duration;  // Move this BEFORE return
-    logMessage("[NVS] Power up duration set to " + String(duration));
+    bool success = preferences.putBytes("mqtt", &settings, sizeof(settings)) == sizeof(settings);
+    logMessage("[NVS] MQTT broker set to '" + String(settings.host) + ":" + String(settings.port) + "'");
     preferences.end();
     return success;
   } else {
     return false;
   }
 }
+
 /**
- * Retrieves the power-up duration from non-volatile storage (NVS).
+ * Gets the MQTT broker connection from NVS, setting the global mqttSettings
+ * variable to the result and returning it.
  *
- * This function accesses the NVS to obtain the stored duration for which the K1 relay should be 
- * activated to start the generator. If no value has been stored previously, it returns the default
- * power-up duration defined in the global variable `powerUpDuration`.
- *
- * @return The duration in milliseconds for which the K1 relay is to be turned on, or 0 if the 
- *         NVS could not be accessed.
+ * @return The broker settings, MQTT is disabled if none were stored.
  */
-uint32_t getPowerUpDuration() {
+MqttSettings getMqttSettings() {
+  mqttSettings = {};
+  mqttSettings.port = 1883;
+  strlcpy(mqttSettings.prefix, "genset", sizeof(mqttSettings.prefix));
   if (preferences.begin(NVS_GENSET_CONTROL, true)) {
-    powerUpDuration = preferences.getUInt("powerUpDuration", powerUpDuration);
-    logMessage("[NVS] Loaded power up duration from NVS: " + String(powerUpDuration));
+    MqttSettings stored;
+    if (preferences.getBytesLength("mqtt") == sizeof(stored)
+        && preferences.getBytes("mqtt", &stored, sizeof(stored)) == sizeof(stored)) {
+      mqttSettings = stored;
+      logMessage("[NVS] Loaded MQTT broker from NVS: '" + String(mqttSettings.host) + ":" + String(mqttSettings.port) + "'");
+    }
     preferences.end();
   }
-  return powerUpDuration;  // Always return the value
+  return mqttSettings;
 }
 
 /**
- * Sets the power-down duration for the generator.
- *
- * Stores the specified duration in non-volatile storage (NVS) under the
- * "powerDownDuration" key and logs the operation.
+ * Sets the syslog collector that receives all log messages.
  *
- * @param duration The duration in milliseconds for which the K2 relay should be turned on.
- * @return true if the duration was successfully written to NVS, false otherwise.
+ * @param settings The collector, an empty host disables forwarding.
+ * @return true if the settings were successfully written to NVS.
  */
-bool setPowerDownDuration(uint32_t duration) {
+bool setSyslogSettings(const SyslogSettings& settings) {
+  syslogSettings = settings;
+  remoteSyslog.configure(settings);
   if (preferences.begin(NVS_GENSET_CONTROL, false)) {
-    bool success = preferences.putUInt("powerDownDuration", duration);
-    logMessage("[NVS] Power down duration set to " + String(duration));
+    bool success = preferences.putBytes("syslog", &settings, sizeof(settings)) == sizeof(settings);
+    logMessage("[NVS] Syslog collector set to '" + String(settings.host) + ":" + String(settings.port) + "'");
     preferences.end();
     return success;
   } else {
     return false;
   }
-  powerDownDuration = duration;
 }
 
 /**
- * Retrieves the power-down duration from non-volatile storage (NVS).
+ * Gets the syslog collector from NVS, setting the global syslogSettings
+ * variable to the result and returning it.
  *
- * This function accesses the NVS to obtain the stored duration for which the K2 relay should be 
- * activated to stop the generator. If no value has been stored previously, it returns the default
- * power-down duration defined in the global variable `powerDownDuration`.
- *
- * @return The duration in milliseconds for which the K2 relay is to be turned on, or 0 if the 
- *         NVS could not be accessed.
+ * @return The collector, forwarding is disabled if none was stored.
  */
-uint32_t getPowerDownDuration() {
-  if (preferences.begin(NVS_GENSET_CONTROL, true)) {
-    uint32_t duration = preferences.getUInt("powerDownDuration", powerDownDuration);
-    logMessage("[NVS] Loaded power down duration from NVS: " + String(duration));
-    preferences.end();
-    return duration;
-  } else {
-    return 0;
-  }
-}
-
-// Set whether the generator is allowed to start.
-//
-// This setting is stored in the non-volatile storage (NVS)
-//
-// @param state Whether the generator is allowed to start.
-// @return true if the setting was successfully written to NVS.
-bool setAllowStart(bool state) {
-  if (preferences.begin(NVS_GENSET_CONTROL, false)) {
-    bool success = preferences.putBool("allowStart", state);
-    logMessage("[NVS] Start allowance set to " + String(state));
-    allowStart = state;
-    preferences.end();
-    return success;
-  } else {
-    return false;
-  }
-}
-
-  /**
-   * Gets whether the generator is allowed to start from NVS, setting the 
-   * global allowStart variable to the result and returning it.
-   *
-   * @return true if the generator is allowed to start, false otherwise
-   */
-bool getAllowStart() {
+SyslogSettings getSyslogSettings() {
+  syslogSettings = {};
+  syslogSettings.port = 514;
   if (preferences.begin(NVS_GENSET_CONTROL, true)) {
-    allowStart = preferences.getBool("allowStart", true);
-    logMessage("[NVS] Loaded start allowance from NVS: " + String(allowStart));
+    SyslogSettings stored;
+    if (preferences.getBytesLength("syslog") == sizeof(stored)
+        && preferences.getBytes("syslog", &stored, sizeof(stored)) == sizeof(stored)) {
+      syslogSettings = stored;
+      logMessage("[NVS] Loaded syslog collector from NVS: '" + String(syslogSettings.host) + ":" + String(syslogSettings.port) + "'");
+    }
     preferences.end();
-    return allowStart;
-  } else {
-    return false;
   }
+  return syslogSettings;
 }
 
-  /**
-   * Sets the retry count of the generator to the given value.
-   *
-   * The retry count is the number of times the generator will be restarted after
-   * a failure before giving up. This value is stored in the non-volatile storage
-   * (NVS) and can be retrieved with getRetryCount.
-   *
-   * @param count The number of times the generator should be restarted before giving up.
-   * @return true if the setting was successfully written to NVS.
-   */
-bool setRetryCount(uint8_t count) {
+/**
+ * Sets the endpoint that receives the webhooks of state transitions.
+ *
+ * @param settings The endpoint, an empty URL disables webhooks.
+ * @return true if the settings were successfully written to NVS.
+ */
+bool setWebhookSettings(const WebhookSettings& settings) {
+  webhookSettings = settings;
+  webhooks.configure(settings);
   if (preferences.begin(NVS_GENSET_CONTROL, false)) {
-    bool success = preferences.putUInt("retryCount", count);
-    logMessage("[NVS] Retry count set to " + String(count));
-    retryCount = count;
+    bool success = preferences.putBytes("webhook", &settings, sizeof(settings)) == sizeof(settings);
+    logMessage("[NVS] Webhook set to '" + String(settings.url) + "'");
     preferences.end();
     return success;
   } else {
@@ -343,110 +579,35 @@ bool setRetryCount(uint8_t count) {
   }
 }
 
-  /**
-   * Gets the retry count from NVS, setting the global retryCount variable to the result
-   * and returning it.
-   *
-   * The retry count is the number of times the generator will be restarted after
-   * a failure before giving up. This value can be changed with setRetryCount.
-   *
-   * @return The number of times the generator should be restarted before giving up.
-   */
-uint8_t getRetryCount() {
+/**
+ * Gets the webhook endpoint from NVS, setting the global webhookSettings
+ * variable to the result and returning it.
+ *
+ * @return The endpoint, webhooks are disabled if none was stored.
+ */
+WebhookSettings getWebhookSettings() {
+  webhookSettings = {};
+  webhookSettings.events = Webhooks::ALL_EVENTS;
   if (preferences.begin(NVS_GENSET_CONTROL, true)) {
-    retryCount = (uint8_t)preferences.getUInt("retryCount", 3);
-    logMessage("[NVS] Loaded retry count from NVS: " + String(retryCount));
-    preferences.end();
-    return retryCount;
-  } else {
-    return 0;
-  }
-}
-
-void checkGeneratorStateAndRetry() {
-  if (allowStart && runningState == LOW && lastStartState == HIGH) {
-    // Generator should be running, but it's not. Retry until retryCount is reached
-    if (retryStartCount < retryCount) {
-      retryStartCount++;
-      logMessage("[CONTROL] Generator is not running. Retrying... (" + String(retryStartCount) + "/" + String(retryCount) + ")");
-      startGenerator();
-
-      // Retry if the generator is not running
-      event_loop.onDelay(15000, checkGeneratorStateAndRetry);
+    WebhookSettings stored;
+    if (preferences.getBytesLength("webhook") == sizeof(stored)
+        && preferences.getBytes("webhook", &stored, sizeof(stored)) == sizeof(stored)) {
+      webhookSettings = stored;
+      logMessage("[NVS] Loaded webhook from NVS: '" + String(webhookSettings.url) + "'");
     }
+    preferences.end();
   }
+  return webhookSettings;
 }
 
-// Start the generator by turning on the K1 relay for the configured duration
-void startGenerator() {
-  if (allowStart == false) {
-    logMessage("[CONTROL] Generator is not allowed to start. Ignoring START signal");
-    return;
-  }
-  
-  // Prevent starting while stopping
-  if (generatorStopping) {
-    logMessage("[CONTROL] Generator is currently shutting down. Ignoring START signal");
-    return;
-  }
-  
-  // Prevent multiple start operations
-  if (generatorStarting) {
-    logMessage("[CONTROL] Generator start already in progress, ignoring duplicate request");
-    return;
-  }
-    
-  generatorStarting = true;
-  logMessage("[CONTROL] Starting generator...");
-  digitalWrite(RELAY_K1, HIGH); // Turn on K1 relay
-  
-  event_loop.onDelay(powerUpDuration, []() {
-    digitalWrite(RELAY_K1, LOW);  // Turn off K1 relay
-    logMessage("[CONTROL] Generator started");
-    generatorStarting = false;  // Reset flag after completion
-  });
-
-  // Retry if the generator is not running
-  event_loop.onDelay(15000, checkGeneratorStateAndRetry);
-
-  digitalWrite(LED, HIGH);
-  event_loop.onDelay(2500, []() { digitalWrite(LED, LOW); });
-}
-
-// Stop the generator by turning on the K2 relay for the configured duration
-void stopGenerator() {
-  // Prevent multiple stop operations
-  if (generatorStopping) {
-    logMessage("[CONTROL] Generator stop already in progress, ignoring duplicate request");
-    return;
-  }
-
-  // Cancel any pending start operations
-  if (generatorStarting) {
-    generatorStarting = false;
-    digitalWrite(RELAY_K1, LOW);  // Ensure K1 is off
-  }
-  
-  generatorStopping = true;
-  logMessage("[CONTROL] Stopping generator...");
-  digitalWrite(RELAY_K2, HIGH); // Turn on K2 relay
-  digitalWrite(RELAY_K1, LOW);  // Turn off K1 relay (in case it was on)
-  
-  event_loop.onDelay(powerDownDuration, []() {
-    digitalWrite(RELAY_K2, LOW);  // Turn off K2 relay
-    logMessage("[CONTROL] Generator stopped");
-    generatorStopping = false;  // Reset flag after completion
-  });
-  
-  digitalWrite(LED, HIGH);
-  event_loop.onDelay(2500, []() { digitalWrite(LED, LOW); });
-}
-
-// Setup web server
-void setupWebServer() {
-  // Main control page
-  webServer.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
-    String html = R"html(
+/**
+ * Renders the main control page.
+ *
+ * @param status Snapshot of the generator state to render.
+ * @return The complete HTML page.
+ */
+String renderMainPage(const GensetStatus& status) {
+  String html = R"html(
 <!DOCTYPE html>
 <html lang="de">
 <head>
@@ -511,34 +672,63 @@ void setupWebServer() {
 <body>
   <h1>Genset Control</h1>
   <h2>Controls</h2>
+  <p>Generator is )html" + String(status.starting ? "starting" : status.stopping ? "stopping" : status.running ? "running" : "not running") + R"html(</p>
 )html";
-    if (!allowStart) {
-      html += R"html(
+  if (!status.allowStart) {
+    html += R"html(
   <button disabled>Start Generator</button>
   <button disabled>Stop Generator</button>
   <h2>Settings</h2>
   <button onclick="fetch('/allowStart').then(() => location.reload())">Startup disabled<br>click to enable</button>
 )html";
-    } else {
-      html += R"html(
+  } else {
+    html += R"html(
   <button onclick="fetch('/start').then(() => location.reload())">Start Generator</button>
   <button onclick="fetch('/stop').then(() => location.reload())">Stop Generator</button>
   <h2>Settings</h2>
   <button class="red" onclick="fetch('/disallowStart').then(() => location.reload())">Startup is enabled, click to disable</button>
 )html";
-    }
-    html += R"html(
+  }
+  html += R"html(
     <br>
-  <input type="number" id="retryCountInput" placeholder="Retry count" value=")html" + String(retryCount)+ R"html(">
+  <input type="number" id="retryCountInput" placeholder="Retry count" value=")html" + String(status.retryCount)+ R"html(">
   <button onclick="fetch('/setRetryCount?count=' + document.getElementById('retryCountInput').value).then(() => location.reload())">Set retry count</button>
   <br>
-  <input type="number" id="powerUpDurationInput" placeholder="Power up duration" value=")html" + String(powerUpDuration)+ R"html(">
+  <input type="number" id="powerUpDurationInput" placeholder="Power up duration" value=")html" + String(status.powerUpDuration)+ R"html(">
   <button onclick="fetch('/setPowerUpDuration?duration=' + document.getElementById('powerUpDurationInput').value).then(() => location.reload())">Set power up duration</button>
   <br>
-  <input type="number" id="powerDownDurationInput" placeholder="Power down duration" value=")html" + String(powerDownDuration)+ R"html(">
+  <input type="number" id="powerDownDurationInput" placeholder="Power down duration" value=")html" + String(status.powerDownDuration)+ R"html(">
   <button onclick="fetch('/setPowerDownDuration?duration=' + document.getElementById('powerDownDurationInput').value).then(() => location.reload())">Set power down duration</button>
+  <br>
+  <input type="number" id="noStartTimeoutInput" placeholder="No-start timeout" value=")html" + String(status.noStartTimeout)+ R"html(">
+  <button onclick="fetch('/setNoStartTimeout?timeout=' + document.getElementById('noStartTimeoutInput').value).then(() => location.reload())">Set no-start timeout</button>
+  <br>
+  <input type="number" id="stopConfirmDurationInput" placeholder="Stop confirm duration" value=")html" + String(status.stopConfirmDuration)+ R"html(">
+  <button onclick="fetch('/setStopConfirmDuration?duration=' + document.getElementById('stopConfirmDurationInput').value).then(() => location.reload())">Set stop confirm duration</button>
+  <br>
+  <input type="number" id="stopRetryCountInput" placeholder="Stop retry count" value=")html" + String(status.stopRetryCount)+ R"html(">
+  <button onclick="fetch('/setStopRetryCount?count=' + document.getElementById('stopRetryCountInput').value).then(() => location.reload())">Set stop retry count</button>
+  <br>
 )html";
+  if (status.startMode == START_MODE_UNTIL_RUNNING) {
     html += R"html(
+  <button onclick="fetch('/setStartMode?mode=0').then(() => location.reload())">Cranking until running<br>click to use fixed duration</button>
+)html";
+  } else {
+    html += R"html(
+  <button onclick="fetch('/setStartMode?mode=1').then(() => location.reload())">Cranking for fixed duration<br>click to crank until running</button>
+)html";
+  }
+  if (status.stopMode == STOP_MODE_UNTIL_STOPPED) {
+    html += R"html(
+  <button onclick="fetch('/setStopMode?mode=0').then(() => location.reload())">Stopping until confirmed<br>click to use fixed duration</button>
+)html";
+  } else {
+    html += R"html(
+  <button onclick="fetch('/setStopMode?mode=1').then(() => location.reload())">Stopping for fixed duration<br>click to stop until confirmed</button>
+)html";
+  }
+  html += R"html(
   <h2>Log</h2>
   <div class="logbox" id="logBox">loading...</div>
   <script>
@@ -554,7 +744,43 @@ void setupWebServer() {
 </body>
 </html>
 )html";
-    request->send(200, "text/html", html);
+  return html;
+}
+
+/**
+ * Renders the log, newest entry first.
+ *
+ * @return All log entries separated by newlines.
+ */
+String renderLog() {
+  String html = "";
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  for (auto it = logBuffer.rbegin(); it != logBuffer.rend(); ++it) {
+      html += *it + "\n";
+  }
+  xSemaphoreGive(logMutex);
+  return html;
+}
+
+// Setup web server
+void setupWebServer() {
+#ifdef GENSET_TRACE
+  // Time spent in the handlers, see /perfTrace
+  webServer.addMiddleware([](AsyncWebServerRequest*, ArMiddlewareNext next) {
+    PERF_SCOPE("http");
+    next();
+  });
+#endif
+
+  // Requests per route for /metrics, URLs without a handler are counted together
+  webServer.addMiddleware([](AsyncWebServerRequest* request, ArMiddlewareNext next) {
+    next();
+    metrics.countRequest(request->url().c_str(), !request->hasAttribute("notFound"));
+  });
+
+  // Main control page
+  webServer.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
+    request->send(200, "text/html", renderMainPage(gensetStatus.read()));
   });
 
   webServer.on("/setRetryCount", HTTP_GET, [](AsyncWebServerRequest* request) {
@@ -567,58 +793,482 @@ void setupWebServer() {
       request->send(400, "text/plain", "Count must be between 0 and 10");
       return;
     }
-    retryCount = count;
-    setRetryCount(retryCount);
-    request->send(200, "text/plain", "Retry count set to " + String(count));
+    sendQueued(request, queueSetting(TRACE_SETTING_RETRY_COUNT, count, COMMAND_SOURCE_HTTP),
+               "Retry count " + String(count));
   });
 
   webServer.on("/setPowerUpDuration", HTTP_GET, [](AsyncWebServerRequest* request) {
-    String duration = request->getParam("duration")->value();
-    setPowerUpDuration(duration.toInt());
-    request->send(200, "text/plain", "Power up duration set to " + duration);
+    if (!request->hasParam("duration")) {
+      request->send(400, "text/plain", "Missing duration parameter");
+      return;
+    }
+    long duration = request->getParam("duration")->value().toInt();
+    uint32_t noStartTimeout = gensetStatus.read().noStartTimeout;
+    if (duration < 0 || duration > (long)noStartTimeout) {
+      request->send(400, "text/plain", "Duration must not be longer than the no-start timeout of " + String(noStartTimeout) + " ms");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_POWER_UP_DURATION, duration, COMMAND_SOURCE_HTTP),
+               "Power up duration " + String(duration));
   });
 
   webServer.on("/setPowerDownDuration", HTTP_GET, [](AsyncWebServerRequest* request) {
-    String duration = request->getParam("duration")->value();
-    setPowerDownDuration(duration.toInt());
-    request->send(200, "text/plain", "Power down duration set to " + duration);
+    if (!request->hasParam("duration")) {
+      request->send(400, "text/plain", "Missing duration parameter");
+      return;
+    }
+    long duration = request->getParam("duration")->value().toInt();
+    if (duration < 0) {
+      request->send(400, "text/plain", "Duration must not be negative");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_POWER_DOWN_DURATION, duration, COMMAND_SOURCE_HTTP),
+               "Power down duration " + String(duration));
+  });
+
+  webServer.on("/setNoStartTimeout", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("timeout")) {
+      request->send(400, "text/plain", "Missing timeout parameter");
+      return;
+    }
+    long timeout = request->getParam("timeout")->value().toInt();
+    if (timeout < 1000 || timeout > 120000) {
+      request->send(400, "text/plain", "Timeout must be between 1000 and 120000 ms");
+      return;
+    }
+    uint32_t powerUpDuration = gensetStatus.read().powerUpDuration;
+    if (timeout < (long)powerUpDuration) {
+      request->send(400, "text/plain", "Timeout must not be shorter than the power up duration of " + String(powerUpDuration) + " ms");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_NO_START_TIMEOUT, timeout, COMMAND_SOURCE_HTTP),
+               "No-start timeout " + String(timeout));
+  });
+
+  webServer.on("/setStartMode", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("mode")) {
+      request->send(400, "text/plain", "Missing mode parameter");
+      return;
+    }
+    int mode = request->getParam("mode")->value().toInt();
+    if (mode != START_MODE_FIXED && mode != START_MODE_UNTIL_RUNNING) {
+      request->send(400, "text/plain", "Mode must be 0 (fixed) or 1 (until running)");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_START_MODE, mode, COMMAND_SOURCE_HTTP), "Start mode " + String(mode));
+  });
+
+  webServer.on("/setStopMode", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("mode")) {
+      request->send(400, "text/plain", "Missing mode parameter");
+      return;
+    }
+    int mode = request->getParam("mode")->value().toInt();
+    if (mode != STOP_MODE_FIXED && mode != STOP_MODE_UNTIL_STOPPED) {
+      request->send(400, "text/plain", "Mode must be 0 (fixed) or 1 (until stopped)");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_STOP_MODE, mode, COMMAND_SOURCE_HTTP), "Stop mode " + String(mode));
+  });
+
+  webServer.on("/setStopConfirmDuration", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("duration")) {
+      request->send(400, "text/plain", "Missing duration parameter");
+      return;
+    }
+    long duration = request->getParam("duration")->value().toInt();
+    if (duration < 100 || duration > 60000) {
+      request->send(400, "text/plain", "Duration must be between 100 and 60000 ms");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_STOP_CONFIRM_DURATION, duration, COMMAND_SOURCE_HTTP),
+               "Stop confirm duration " + String(duration));
+  });
+
+  webServer.on("/setStopRetryCount", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("count")) {
+      request->send(400, "text/plain", "Missing count parameter");
+      return;
+    }
+    int count = request->getParam("count")->value().toInt();
+    if (count < 0 || count > 10) {
+      request->send(400, "text/plain", "Count must be between 0 and 10");
+      return;
+    }
+    sendQueued(request, queueSetting(TRACE_SETTING_STOP_RETRY_COUNT, count, COMMAND_SOURCE_HTTP),
+               "Stop retry count " + String(count));
   });
 
   webServer.on("/allowStart", HTTP_GET, [](AsyncWebServerRequest* request) {
-    setAllowStart(true);
-    request->send(200, "text/plain", "Startup enabled");
+    sendQueued(request, queueSetting(TRACE_SETTING_ALLOW_START, true, COMMAND_SOURCE_HTTP), "Startup enable");
   });
 
   webServer.on("/disallowStart", HTTP_GET, [](AsyncWebServerRequest* request) {
-    setAllowStart(false);
-    stopGenerator();
-    request->send(200, "text/plain", "Startup disabled");
+    // The stop command is queued after the setting, so the control task applies both in order
+    if (queueSetting(TRACE_SETTING_ALLOW_START, false, COMMAND_SOURCE_HTTP) == 0) {
+      request->send(503, "text/plain", "Control queue is full");
+      return;
+    }
+    uint32_t id = queueCommand({COMMAND_STOP, COMMAND_SOURCE_HTTP, hal::nowMicros()});
+    if (id == 0) {
+      request->send(503, "text/plain", "Startup disable queued, but the control queue is full");
+      return;
+    }
+    request->send(200, "text/plain", "Startup disable queued, stop command queued with id " + String(id));
   });
 
-  webServer.on("/log", HTTP_GET, [](AsyncWebServerRequest* request) {
-    String html = "";
-    // Display log entries
-    for (auto it = logBuffer.rbegin(); it != logBuffer.rend(); ++it) {
-        html += *it + "\n";
+  webServer.on("/status", HTTP_GET, [](AsyncWebServerRequest* request) {
+    GensetStatus status = gensetStatus.read();
+    JsonDocument doc;
+    doc["changedAt"] = status.changedAt;
+    doc["lastCommandId"] = status.lastCommandId;
+    doc["running"] = status.running;
+    doc["startSignal"] = status.startSignal;
+    doc["stopSignal"] = status.stopSignal;
+    doc["relayK1"] = status.relayK1;
+    doc["relayK2"] = status.relayK2;
+    doc["starting"] = status.starting;
+    doc["stopping"] = status.stopping;
+    doc["allowStart"] = status.allowStart;
+    doc["retryStartCount"] = status.retryStartCount;
+    doc["retryStopCount"] = status.retryStopCount;
+    doc["startMode"] = status.startMode;
+    doc["stopMode"] = status.stopMode;
+    doc["retryCount"] = status.retryCount;
+    doc["stopRetryCount"] = status.stopRetryCount;
+    doc["powerUpDuration"] = status.powerUpDuration;
+    doc["powerDownDuration"] = status.powerDownDuration;
+    doc["noStartTimeout"] = status.noStartTimeout;
+    doc["stopConfirmDuration"] = status.stopConfirmDuration;
+    if (status.intentCommand != INTENT_NONE) {
+      doc["intent"] = status.intentCommand == COMMAND_START ? "start" : "stop";
+      doc["intentSource"] = commandSourceName((CommandSource)status.intentSource);
+    }
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/startStats", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    startStats.toJson(doc.to<JsonObject>());
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/modbus", HTTP_GET, [](AsyncWebServerRequest* request) {
+    ModbusSnapshot snapshot = modbusPoller.snapshot();
+    uint32_t now = hal::now();
+    JsonDocument doc;
+    doc["transactions"] = snapshot.transactions;
+    doc["failures"] = snapshot.failures;
+    doc["registersRead"] = snapshot.registersRead;
+    doc["busUtilization"] = now > 0 ? (float)snapshot.busTime / now : 0;
+    doc["tcpClients"] = modbusTcp.clients();
+    doc["tcpRequests"] = modbusTcp.requests();
+    JsonObject registers = doc["registers"].to<JsonObject>();
+    for (uint8_t i = 0; i < modbusPoller.registerCount(); i++) {
+      const ModbusRegister& reg = modbusPoller.registers()[i];
+      JsonObject entry = registers[reg.name].to<JsonObject>();
+      entry["address"] = reg.address;
+      entry["period"] = reg.period;
+      entry["errors"] = snapshot.errors[i];
+      if (snapshot.updatedAt[i] != 0) {
+        entry["value"] = snapshot.values[i];
+        entry["age"] = now - snapshot.updatedAt[i];
+      } else {
+        entry["value"] = nullptr;
+      }
+    }
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  // Run state, relay activity and polled registers, ?res=raw|minute|hour&from=<s since boot>&format=json|binary
+  webServer.on("/history", HTTP_GET, [](AsyncWebServerRequest* request) {
+    History::Resolution resolution = History::RESOLUTION_RAW;
+    if (request->hasParam("res")) {
+      String res = request->getParam("res")->value();
+      if (res == "minute") resolution = History::RESOLUTION_MINUTE;
+      else if (res == "hour") resolution = History::RESOLUTION_HOUR;
+      else if (res != "raw") {
+        request->send(400, "text/plain", "Resolution must be raw, minute or hour");
+        return;
+      }
+    }
+    uint32_t from = request->hasParam("from") ? request->getParam("from")->value().toInt() : 0;
+    bool binary = request->hasParam("format") && request->getParam("format")->value() == "binary";
+    auto historyExport = std::make_shared<History::Export>(history, resolution, from, binary);
+    AsyncWebServerResponse* response = request->beginChunkedResponse(binary ? "application/octet-stream" : "application/json",
+      [historyExport](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+        return historyExport->read(buffer, maxLen);
+      });
+    request->send(response);
+  });
+
+  // Prometheus text format, rendered line by line while the response is sent
+  webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest* request) {
+    auto metricsExport = std::make_shared<Metrics::Export>(metrics);
+    AsyncWebServerResponse* response = request->beginChunkedResponse("text/plain; version=0.0.4",
+      [metricsExport](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+        return metricsExport->read(buffer, maxLen);
+      });
+    request->send(response);
+  });
+
+  webServer.on("/mqtt", HTTP_GET, [](AsyncWebServerRequest* request) {
+    MqttSettings settings = mqttSettings;
+    JsonDocument doc;
+    doc["host"] = settings.host;
+    doc["port"] = settings.port;
+    doc["prefix"] = settings.prefix;
+    doc["user"] = settings.user;
+    doc["connected"] = mqttClient.connected();
+    doc["published"] = mqttClient.published();
+    doc["dropped"] = mqttClient.dropped();
+    doc["commands"] = mqttClient.received();
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/syslog", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    doc["host"] = syslogSettings.host;
+    doc["port"] = syslogSettings.port;
+    doc["lines"] = remoteSyslog.sent();
+    doc["datagrams"] = remoteSyslog.datagrams();
+    doc["dropped"] = remoteSyslog.dropped();
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  // ?host=&port=, an empty host disables forwarding
+  webServer.on("/setSyslog", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("host")) {
+      request->send(400, "text/plain", "Missing host parameter");
+      return;
+    }
+    SyslogSettings settings = syslogSettings;
+    int port = request->hasParam("port") ? request->getParam("port")->value().toInt() : settings.port;
+    if (port < 1 || port > 65535) {
+      request->send(400, "text/plain", "Port must be between 1 and 65535");
+      return;
+    }
+    strlcpy(settings.host, request->getParam("host")->value().c_str(), sizeof(settings.host));
+    settings.port = port;
+    setSyslogSettings(settings);
+    request->send(200, "text/plain", settings.host[0] ? "Syslog collector set to " + String(settings.host) + ":" + String(port)
+                                                       : String("Syslog forwarding disabled"));
+  });
+
+  webServer.on("/webhook", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    doc["url"] = webhookSettings.url;
+    JsonArray events = doc["events"].to<JsonArray>();
+    for (uint8_t i = 0; i < WEBHOOK_EVENT_COUNT; i++) {
+      if (i != WEBHOOK_TEST && (webhookSettings.events & (1 << i))) events.add(webhookEventName((WebhookEvent)i));
+    }
+    doc["queued"] = webhooks.queued();
+    doc["delivered"] = webhooks.delivered();
+    doc["failed"] = webhooks.failed();
+    doc["lastStatus"] = webhooks.lastStatus();
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  // ?url=&events=started,start_failed,stopped,fault, an empty url disables webhooks
+  webServer.on("/setWebhook", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("url")) {
+      request->send(400, "text/plain", "Missing url parameter");
+      return;
+    }
+    WebhookSettings settings = webhookSettings;
+    String url = request->getParam("url")->value();
+    char host[64], path[96];
+    uint16_t port;
+    if (!url.isEmpty() && (url.length() >= sizeof(settings.url)
+                           || !Webhooks::parseUrl(url.c_str(), host, sizeof(host), port, path, sizeof(path)))) {
+      request->send(400, "text/plain", "URL must be http://host[:port]/path");
+      return;
+    }
+    if (request->hasParam("events")) {
+      String names = request->getParam("events")->value() + ",";
+      settings.events = 1 << WEBHOOK_TEST;
+      for (int start = 0, end; (end = names.indexOf(',', start)) >= 0; start = end + 1) {
+        String name = names.substring(start, end);
+        uint8_t i = 0;
+        while (i < WEBHOOK_EVENT_COUNT && name != webhookEventName((WebhookEvent)i)) i++;
+        if (i == WEBHOOK_EVENT_COUNT && !name.isEmpty()) {
+          request->send(400, "text/plain", "Unknown event '" + name + "'");
+          return;
+        }
+        if (i < WEBHOOK_EVENT_COUNT) settings.events |= 1 << i;
+      }
+    }
+    strlcpy(settings.url, url.c_str(), sizeof(settings.url));
+    setWebhookSettings(settings);
+    request->send(200, "text/plain", settings.url[0] ? "Webhook set to " + url : String("Webhooks disabled"));
+  });
+
+  webServer.on("/testWebhook", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (webhookSettings.url[0] == '\0') {
+      request->send(400, "text/plain", "No webhook configured");
+      return;
+    }
+    webhooks.fire(WEBHOOK_TEST, "Requested via /testWebhook");
+    request->send(200, "text/plain", "Test event queued, see /webhook for the result");
+  });
+
+  // ?host=&port=&prefix=&user=&password=, an empty host disables MQTT
+  webServer.on("/setMqtt", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("host")) {
+      request->send(400, "text/plain", "Missing host parameter");
+      return;
+    }
+    MqttSettings settings = mqttSettings;
+    int port = request->hasParam("port") ? request->getParam("port")->value().toInt() : settings.port;
+    if (port < 1 || port > 65535) {
+      request->send(400, "text/plain", "Port must be between 1 and 65535");
+      return;
+    }
+    String prefix = request->hasParam("prefix") ? request->getParam("prefix")->value() : String(settings.prefix);
+    if (prefix.isEmpty() || prefix.indexOf('+') >= 0 || prefix.indexOf('#') >= 0 || prefix.endsWith("/")) {
+      request->send(400, "text/plain", "Prefix must be a topic without wildcards and trailing slash");
+      return;
+    }
+    strlcpy(settings.host, request->getParam("host")->value().c_str(), sizeof(settings.host));
+    settings.port = port;
+    strlcpy(settings.prefix, prefix.c_str(), sizeof(settings.prefix));
+    if (request->hasParam("user")) strlcpy(settings.user, request->getParam("user")->value().c_str(), sizeof(settings.user));
+    if (request->hasParam("password")) {
+      strlcpy(settings.password, request->getParam("password")->value().c_str(), sizeof(settings.password));
+    }
+    setMqttSettings(settings);
+    request->send(200, "text/plain", settings.host[0] ? "MQTT broker set to " + String(settings.host) + ":" + String(port)
+                                                       : String("MQTT disabled"));
+  });
+
+  webServer.on("/heap", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    heapMonitor.toJson(doc.to<JsonObject>());
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/latency", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    for (uint8_t i = 0; i < COMMAND_SOURCE_COUNT; i++) {
+      if (i == COMMAND_SOURCE_INTERNAL) continue;
+      commandLatency[i].toJson(doc[commandSourceName((CommandSource)i)].to<JsonObject>());
     }
-    request->send(200, "text/plain", html);
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/tickStats", HTTP_GET, [](AsyncWebServerRequest* request) {
+    JsonDocument doc;
+    tickStats.toJson(doc.to<JsonObject>());
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  });
+
+  webServer.on("/resetTickStats", HTTP_GET, [](AsyncWebServerRequest* request) {
+    tickStats.requestReset();
+    request->send(200, "text/plain", "Tick statistics cleared");
+  });
+
+  // Binary GPIO trace for tools/trace_replay, see gpio_trace_format.h
+  webServer.on("/gpioTrace", HTTP_GET, [](AsyncWebServerRequest* request) {
+    auto traceExport = std::make_shared<GpioTrace::Export>(gpioTrace);
+    AsyncWebServerResponse* response = request->beginChunkedResponse("application/octet-stream",
+      [traceExport](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+        return traceExport->read(buffer, maxLen);
+      });
+    response->addHeader("Content-Disposition", "attachment; filename=\"genset-trace.bin\"");
+    request->send(response);
+  });
+
+#ifdef GENSET_TRACE
+  // Chrome Trace Event JSON of the control path, open it in ui.perfetto.dev
+  webServer.on("/perfTrace", HTTP_GET, [](AsyncWebServerRequest* request) {
+    auto traceExport = std::make_shared<PerfTrace::Export>(perfTrace);
+    AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
+      [traceExport](uint8_t* buffer, size_t maxLen, size_t) -> size_t {
+        return traceExport->read(buffer, maxLen);
+      });
+    response->addHeader("Content-Disposition", "attachment; filename=\"genset-perf.json\"");
+    request->send(response);
+  });
+
+  webServer.on("/resetPerfTrace", HTTP_GET, [](AsyncWebServerRequest* request) {
+    perfTrace.reset();
+    request->send(200, "text/plain", "Performance trace cleared");
+  });
+#endif
+
+  webServer.on("/resetGpioTrace", HTTP_GET, [](AsyncWebServerRequest* request) {
+    gpioTrace.reset();
+    request->send(200, "text/plain", "GPIO trace cleared");
+  });
+
+  webServer.on("/resetStartStats", HTTP_GET, [](AsyncWebServerRequest* request) {
+    uint32_t id = queueCommand({COMMAND_RESET_START_STATS, COMMAND_SOURCE_HTTP, hal::nowMicros()});
+    if (id == 0) {
+      request->send(503, "text/plain", "Control queue is full");
+      return;
+    }
+    request->send(200, "text/plain", "Start statistics reset queued with id " + String(id));
+  });
+
+  webServer.on("/log", HTTP_GET, [](AsyncWebServerRequest* request) {
+    request->send(200, "text/plain", renderLog());
   });
 
   // Start Generator action
   webServer.on("/start", HTTP_GET, [](AsyncWebServerRequest* request) {
+    Command command = {COMMAND_START, COMMAND_SOURCE_HTTP, hal::nowMicros()};
     logMessage("Start Generator button clicked");
-    startGenerator();  // Call the start generator function
-    request->send(200, "text/plain", "Start command received");
+    uint32_t id = queueCommand(command);  // Handed over to the control task
+    if (id == 0) {
+      request->send(503, "text/plain", "Control queue is full");
+      return;
+    }
+    request->send(200, "text/plain", "Start command queued with id " + String(id));
   });
 
   // Stop Generator action
   webServer.on("/stop", HTTP_GET, [](AsyncWebServerRequest* request) {
+    Command command = {COMMAND_STOP, COMMAND_SOURCE_HTTP, hal::nowMicros()};
     logMessage("Stop Generator button clicked");
-    stopGenerator();  // Call the stop generator function
-    request->send(200, "text/plain", "Stop command received");
+    uint32_t id = queueCommand(command);  // Handed over to the control task
+    if (id == 0) {
+      request->send(503, "text/plain", "Control queue is full");
+      return;
+    }
+    request->send(200, "text/plain", "Stop command queued with id " + String(id));
+  });
+
+  // State of a queued command
+  webServer.on("/command", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (!request->hasParam("id")) {
+      request->send(400, "text/plain", "Missing id parameter");
+      return;
+    }
+    uint32_t id = request->getParam("id")->value().toInt();
+    bool applied = id != 0 && (int32_t)(gensetStatus.read().lastCommandId - id) >= 0;
+    request->send(200, "text/plain", applied ? "applied" : "queued");
   });
 
   webServer.onNotFound([](AsyncWebServerRequest *request) {
+    request->setAttribute("notFound", true);
     request->send(404, "text/plain", "Not found");
   });
 
@@ -626,218 +1276,85 @@ void setupWebServer() {
   logMessage("[STATUS] Web server started");
 }
 
-  /**
-   * This function is used to debounce the RUNNING_SIGNAL pin.
-   * It checks for state changes and after a short delay (DEBOUNCE_DELAY) will update the runningState variable.
-   * It also logs each state change to the serial console.
-   */
-void checkRunningSignal() {
-  static unsigned long lastChangeTime = 0;
-  static bool lastReading = LOW;
-  static bool stableState = LOW;
-  const unsigned long DEBOUNCE_DELAY = 50;
-  
-  if (runningSignalChanged) {
-    runningSignalChanged = false;
-    unsigned long currentTime = millis();
-    bool currentReading = digitalRead(RUNNING_SIGNAL);
-    
-    if (currentReading != lastReading) {
-      lastChangeTime = currentTime;
-      lastReading = currentReading;
-    }
-    
-    if ((currentTime - lastChangeTime) > DEBOUNCE_DELAY) {
-      if (stableState != lastReading) {
-        stableState = lastReading;
-        runningState = stableState;
-        
-        if (runningState == HIGH) {
-          logMessage("[SIGNAL] Genset is running - signal HIGH");
-        } else {
-          logMessage("[SIGNAL] Genset is not running - signal LOW");
-        }
-      }
-    }
+/**
+ * Answers a request whose change was handed over to the control task.
+ *
+ * @param request The request.
+ * @param id ID returned by queueCommand(), 0 if the queue was full.
+ * @param what The queued change, e.g. "Retry count 3".
+ */
+void sendQueued(AsyncWebServerRequest* request, uint32_t id, const String& what) {
+  if (id == 0) {
+    request->send(503, "text/plain", "Control queue is full");
+    return;
   }
+  request->send(200, "text/plain", what + " queued with id " + String(id));
 }
 
-// Check for transitions on the START and STOP signals to control the generator.
-//
-// This function is meant to be called frequently, such as in loop().
-//
-// The function detects the following signal transitions:
-//   - POWER-UP: START signal transition from LOW to HIGH
-//   - POWER-DOWN: START signal transition from HIGH to LOW
-//
-// When a transition is detected, the corresponding function is called:
-//   - POWER-UP: startGenerator()
-//   - POWER-DOWN: stopGenerator()
-//
-// The last state of the START and STOP signals is stored in the variables
-// lastStartState and lastStopState, respectively.
-void checkForSignals() {
-  // Debounce variables
-  static unsigned long lastStartChangeTime = 0;
-  static unsigned long lastStopChangeTime = 0;
-  static bool lastStartReading = LOW;
-  static bool lastStopReading = LOW;
-  static bool stableStartState = LOW;
-  static bool stableStopState = LOW;
-  static bool initialized = false;
-  const unsigned long DEBOUNCE_DELAY = 50; // ms
-  
-  // Initialize static variables on first run
-  if (!initialized) {
-    initialized = true;
-    // Read current states to initialize properly
-    bool currentStart = digitalRead(START_SIGNAL);
-    bool currentStop = digitalRead(STOP_SIGNAL);
-    
-    lastStartReading = currentStart;
-    lastStopReading = currentStop;
-    stableStartState = currentStart;
-    stableStopState = currentStop;
-    
-    logMessage("[INIT] checkForSignals initialized with START: " + String(currentStart) + 
-               ", STOP: " + String(currentStop));
-    return; // Skip first iteration
-  }
+/**
+ * The generator control task.
+ *
+ * Owns the event loop and all control state, it is the only consumer of the
+ * command queue. Sleeps up to one RTOS tick or until queueCommand() wakes it,
+ * so commands are applied right away and the event loop is still ticked
+ * every millisecond.
+ */
+void controlTask(void* parameter) {
+  for (;;) {
+    // Do not continue regular operation as long as a OTA is running
+    // Reason: Background workload can cause upgrade issues that we want to avoid!
+    if (otaWebUpdater->otaIsRunning) { vTaskDelay(pdMS_TO_TICKS(50)); continue; }
 
-  unsigned long currentTime = millis();
-  bool currentStartState = digitalRead(START_SIGNAL);
-  bool currentStopState = digitalRead(STOP_SIGNAL);
-  
-  // Debounce START signal
-  if (currentStartState != lastStartReading) {
-    lastStartChangeTime = currentTime;
-    lastStartReading = currentStartState;
-  }
-  if ((currentTime - lastStartChangeTime) > DEBOUNCE_DELAY) {
-    stableStartState = lastStartReading;
-  }
-  
-  // Debounce STOP signal  
-  if (currentStopState != lastStopReading) {
-    lastStopChangeTime = currentTime;
-    lastStopReading = currentStopState;
-  }
-  if ((currentTime - lastStopChangeTime) > DEBOUNCE_DELAY) {
-    stableStopState = lastStopReading;
-  }
-  
-  // Use stable states for the rest of the logic
-  currentStartState = stableStartState;
-  currentStopState = stableStopState;
-  
-  // If the STOP signal is HIGH, ignore the START signal
-  if (currentStopState == HIGH && currentStartState == HIGH) {
-    logMessage("[WARN] Generator stopped by priority STOP signal, ignoring simultaneous START signal");
-    return;
-  }
+    ulTaskNotifyTake(pdTRUE, 1);
+    tickControl();
 
-  // Detect STOP signal transition from LOW to HIGH (rising edge only)
-  if (currentStopState == HIGH && lastStopState == LOW) {
-    logMessage("[STATUS] STOP signal detected");
-    stopGenerator();
-    lastStartState = LOW;  // Reset start state when stopping
-    lastStopState = currentStopState;
-    return;
-  }
+    if (MODBUS_ENABLED) pollModbus();
 
-  // Detect START signal transition from LOW to HIGH
-  if (currentStartState == HIGH && lastStartState == LOW && !generatorStopping) { 
-    logMessage("[STATUS] START signal detected");
-    retryStartCount = 0;  // reset retry count
-    startGenerator();
+    publishControlStatus();
   }
-  
-  // Always update states at the end
-  lastStartState = currentStartState;
-  lastStopState = currentStopState;
 }
 
 /**
- * Interrupt service routine to read the current state of the RUNNING signal
- * and log the state. Updates the runningState variable with the current
- * digital reading from the RUNNING_SIGNAL pin.
+ * Publishes the control state and notifies the readers that push it on changes.
+ * Must only be called by the control task.
  */
-void IRAM_ATTR receiveRunningSignal() {
-  runningSignalChanged = true;
-}
-
-// Interrupt service routine to read the current state of the LED and log it.
-void IRAM_ATTR receiveLEDStatus() {
-  ledState = digitalRead(LED);
+void publishControlStatus() {
+  if (!publishStatus()) return;
+  publishModbusImage();
+  mqttClient.notify();
+  statusBeacon.notify();
 }
 
 /**
- * This function monitors the state of the LED and logs any changes.
- * It uses a static variable to track the last logged state of the LED.
- * If the current state differs from the last logged state, it updates
- * the last logged state and logs the new state to the serial console.
+ * Reports a transition of the generator as webhook, called by the control code.
+ *
+ * @param event The transition.
+ * @param detail Human readable detail.
  */
-
-void checkLEDStatus() {
-  static bool lastLoggedLedState = LOW;
-  
-  if (ledState != lastLoggedLedState) {
-    lastLoggedLedState = ledState;
-    logMessage("[LED] Current state: " + String(ledState));
-  }
-}
-
-void initializeStates() {
-  // Read actual pin states with debouncing
-  delay(100); // Allow pins to stabilize after boot
-  
-  // Read multiple times to ensure stable reading
-  bool startReading = LOW;
-  bool stopReading = LOW;
-  bool runningReading = LOW;
-  
-  for (int i = 0; i < 5; i++) {
-    startReading = digitalRead(START_SIGNAL);
-    stopReading = digitalRead(STOP_SIGNAL);
-    runningReading = digitalRead(RUNNING_SIGNAL);
-    delay(10);
-  }
-  
-  // Initialize global states to match actual pin states
-  lastStartState = startReading;
-  lastStopState = stopReading;
-  runningState = runningReading;
-  
-  logMessage("[INIT] Initial states - START: " + String(lastStartState) + 
-             ", STOP: " + String(lastStopState) + 
-             ", RUNNING: " + String(runningState));
+void fireEvent(WebhookEvent event, const String& detail) {
+  webhooks.fire(event, detail.c_str());
 }
 
 void setup() {
+  logMutex = xSemaphoreCreateMutex();
+
   // Initialize serial monitor
   Serial.begin(115200);
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK_SIZE, nullptr, 1, &logTaskHandle, 0);
+
+  // Forward the log to a syslog collector, lines are queued until WiFi is up
+  remoteSyslog.begin(MDNS_NAME);
+  remoteSyslog.configure(getSyslogSettings());
   logMessage("\n\n==== starting ESP32 setup() ====");
   logMessage("Firmware build date: " + String(__DATE__) + " " + String(__TIME__));
   logMessage("Firmware Version: " + String(AUTO_FW_VERSION) + " (" + String(AUTO_FW_DATE) + ")");
   logMessage("[STATUS] Initializing...");
   
-  // Configure pins
-  pinMode(RELAY_K1, OUTPUT);
-  pinMode(RELAY_K2, OUTPUT);
-  pinMode(LED, OUTPUT);
-  pinMode(START_SIGNAL, INPUT_PULLDOWN);
-  pinMode(STOP_SIGNAL, INPUT_PULLDOWN);
-  pinMode(RUNNING_SIGNAL, INPUT_PULLDOWN);
-
-  // Initialize all relays and LED
-  digitalWrite(RELAY_K1, LOW);
-  digitalWrite(RELAY_K2, LOW);
-  digitalWrite(LED, HIGH);
-
-  initializeStates();
+  setupControl();
 
-  attachInterrupt(RUNNING_SIGNAL, receiveRunningSignal, CHANGE);
-  attachInterrupt(LED, receiveLEDStatus, CHANGE);
+#ifdef GENSET_BENCHMARK
+  runBenchmarks();
+#endif
 
   logMessage("[STATUS] Booting...");
   
@@ -845,8 +1362,29 @@ void setup() {
   setupWiFi();
 
   // Start the web server
+  registerMetrics();
   setupWebServer();
 
+  // Start the Modbus TCP server
+  modbusTcp.begin(onModbusCoil);
+  logMessage("[MODBUS] Modbus TCP server started on port 502");
+
+  // Start the MQTT client, it connects once a broker is configured
+  static char mqttClientId[32];
+  snprintf(mqttClientId, sizeof(mqttClientId), "%s-%06x", MDNS_NAME, (unsigned)(ESP.getEfuseMac() >> 24) & 0xFFFFFF);
+  mqttClient.begin(mqttClientId, onMqttCommand);
+  mqttClient.configure(getMqttSettings());
+
+  // Start the webhook dispatcher, it sends once an endpoint is configured
+  webhooks.begin(MDNS_NAME);
+  webhooks.configure(getWebhookSettings());
+
+  // Start the status beacon for passive displays
+  if (BEACON_ENABLED) {
+    statusBeacon.begin(BEACON_GROUP, BEACON_PORT, fillStatusBeacon);
+    logMessage("[BEACON] Status beacon multicast to " + BEACON_GROUP.toString() + ":" + String(BEACON_PORT));
+  }
+
   otaWebUpdater = new MyOtaWebUpdater();
   otaWebUpdater->setBaseUrl(OTA_BASE_URL);
   otaWebUpdater->setFirmware(AUTO_FW_DATE, AUTO_FW_VERSION);
@@ -854,44 +1392,41 @@ void setup() {
   otaWebUpdater->attachWebServer(&webServer);
   otaWebUpdater->attachUI();
 
-  // Load from NVS
-  allowStart = getAllowStart();
-  retryCount = getRetryCount();
-  powerUpDuration = getPowerUpDuration();
-  powerDownDuration = getPowerDownDuration();
-  
+  // Load the settings from NVS and start the control callbacks
+  startControl();
+
   // Initialize the MODBUS connection
-//   if (MODBUS_ENABLED) {
-//     Serial1.begin(MODBUS_BAUDRATE, SERIAL_8N1, MODBUS_RX, MODBUS_TX);
-//     logMessage("[MODBUS] Initialized MODBUS connection");
-
-    // Poll MODBUS data every 1000ms
-//     event_loop.onRepeat(1000, queryModbus);
-//   }
-
-  // Check for START/STOP signals every 50ms
-  event_loop.onDelay(5, receiveRunningSignal);
-  event_loop.onRepeat(50, checkForSignals);
-  event_loop.onRepeat(10, checkRunningSignal);
-  event_loop.onRepeat(100, checkLEDStatus);
-  
-  // Boot sequence, blinking the LED 3 times
-  for (uint8_t i = 0; i < 5; i++) {
-    auto delay = 100 + i * 500;
-    event_loop.onDelay(delay, []() { 
-      if(digitalRead(LED) == LOW) {
-        digitalWrite(LED, HIGH); 
-      } else {
-        digitalWrite(LED, LOW); 
-      }
+  if (MODBUS_ENABLED) {
+    Serial1.begin(MODBUS_BAUDRATE, SERIAL_8N1, MODBUS_RX, MODBUS_TX);
+    // Wake up the control task when bytes arrived or the line went idle
+    Serial1.onReceive([]() {
+      if (controlTaskHandle) xTaskNotifyGive(controlTaskHandle);
     });
+    logMessage("[MODBUS] Initialized MODBUS connection");
   }
+
+  // Channels of the history, in the order sampleHistory() fills them
+  history.addChannel("running");
+  history.addChannel("relayK1");
+  history.addChannel("relayK2");
+  if (MODBUS_ENABLED) {
+    for (uint8_t i = 0; i < modbusPoller.registerCount(); i++) history.addChannel(modbusPoller.registers()[i].name);
+  }
+
+  tickStats.onRepeat(event_loop, 1000, "publishModbusImage", publishModbusImage);
+  tickStats.onRepeat(event_loop, 1000, "sampleHistory", sampleHistory);
+
+  // Watch the heap and the task stacks for slow degradation
+  heapMonitor.begin();
+
+  // From here on, only the control task touches the event loop and the control state
+  publishControlStatus();
+  xTaskCreatePinnedToCore(controlTask, "control", CONTROL_TASK_STACK_SIZE, nullptr,
+                          CONTROL_TASK_PRIORITY, &controlTaskHandle, CONTROL_TASK_CORE);
+  logMessage("[STATUS] Control task started on core " + String(CONTROL_TASK_CORE));
 }
 
 void loop() {
-  // Do not continue regular operation as long as a OTA is running
-  // Reason: Background workload can cause upgrade issues that we want to avoid!
-  if (otaWebUpdater->otaIsRunning) { yield(); delay(50); return; };
-
-  event_loop.tick();
+  // Everything runs in the control task and the network tasks
+  vTaskDelete(NULL);
 }
@@ -0,0 +1,146 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * RAM backed replacement for Preferences with the subset of its API used by the firmware.
+ *
+ * Used by the benchmark build (GENSET_BENCHMARK), so the settings code paths can be
+ * measured without the flash timing and without wearing out the flash. All instances
+ * share one table, like Preferences instances share the NVS partition. Nothing
+ * survives a reboot.
+ */
+class MemorySettingsStore {
+  public:
+    bool begin(const char* name, bool readOnly = false, const char* partitionLabel = nullptr) {
+      (void)partitionLabel;
+      strlcpy(nvsNamespace, name, sizeof(nvsNamespace));
+      this->readOnly = readOnly;
+      opened = true;
+      return true;
+    }
+
+    void end() { opened = false; }
+
+    size_t putBool(const char* key, bool value) { return putScalar(key, value, sizeof(uint8_t)); }
+    size_t putUChar(const char* key, uint8_t value) { return putScalar(key, value, sizeof(value)); }
+    size_t putUShort(const char* key, uint16_t value) { return putScalar(key, value, sizeof(value)); }
+    size_t putUInt(const char* key, uint32_t value) { return putScalar(key, value, sizeof(value)); }
+
+    bool getBool(const char* key, bool defaultValue = false) { return getScalar(key, defaultValue); }
+    uint8_t getUChar(const char* key, uint8_t defaultValue = 0) { return getScalar(key, defaultValue); }
+    uint16_t getUShort(const char* key, uint16_t defaultValue = 0) { return getScalar(key, defaultValue); }
+    uint32_t getUInt(const char* key, uint32_t defaultValue = 0) { return getScalar(key, defaultValue); }
+
+    size_t putBytes(const char* key, const void* value, size_t length) {
+      if (!opened || readOnly || value == nullptr || length == 0) return 0;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, true);
+      if (entry == nullptr) return 0;
+      uint8_t* blob = (uint8_t*)realloc(entry->blob, length);
+      if (blob == nullptr) return 0;
+      memcpy(blob, value, length);
+      entry->blob = blob;
+      entry->length = length;
+      return length;
+    }
+
+    size_t getBytesLength(const char* key) {
+      if (!opened) return 0;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, false);
+      return entry != nullptr && entry->blob != nullptr ? entry->length : 0;
+    }
+
+    size_t getBytes(const char* key, void* buffer, size_t maxLength) {
+      if (!opened) return 0;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, false);
+      if (entry == nullptr || entry->blob == nullptr || entry->length > maxLength) return 0;
+      memcpy(buffer, entry->blob, entry->length);
+      return entry->length;
+    }
+
+    bool remove(const char* key) {
+      if (!opened || readOnly) return false;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, false);
+      if (entry == nullptr) return false;
+      free(entry->blob);
+      *entry = {};
+      return true;
+    }
+
+  private:
+    // Same limits as NVS
+    static constexpr size_t NAME_LENGTH = 16;
+    static constexpr size_t MAX_ENTRIES = 32;
+
+    struct Entry {
+      char nvsNamespace[NAME_LENGTH];
+      char key[NAME_LENGTH];
+      uint32_t scalar;
+      uint8_t* blob;
+      size_t length;
+      bool used;
+    };
+
+    static Entry* entries() {
+      static Entry table[MAX_ENTRIES] = {};
+      return table;
+    }
+
+    static std::mutex& mutex() {
+      static std::mutex lock;
+      return lock;
+    }
+
+    // Must be called with the mutex held
+    Entry* find(const char* key, bool create) {
+      Entry* unused = nullptr;
+      for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        Entry& entry = entries()[i];
+        if (!entry.used) {
+          if (unused == nullptr) unused = &entry;
+          continue;
+        }
+        if (strcmp(entry.nvsNamespace, nvsNamespace) == 0 && strncmp(entry.key, key, NAME_LENGTH - 1) == 0) return &entry;
+      }
+      if (!create || unused == nullptr) return nullptr;
+      strlcpy(unused->nvsNamespace, nvsNamespace, NAME_LENGTH);
+      strlcpy(unused->key, key, NAME_LENGTH);
+      unused->used = true;
+      return unused;
+    }
+
+    size_t putScalar(const char* key, uint32_t value, size_t length) {
+      if (!opened || readOnly) return 0;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, true);
+      if (entry == nullptr) return 0;
+      entry->scalar = value;
+      return length;
+    }
+
+    template <typename T>
+    T getScalar(const char* key, T defaultValue) {
+      if (!opened) return defaultValue;
+      std::lock_guard<std::mutex> lock(mutex());
+      Entry* entry = find(key, false);
+      return entry != nullptr ? (T)entry->scalar : defaultValue;
+    }
+
+    char nvsNamespace[NAME_LENGTH] = {};
+    bool readOnly = false;
+    bool opened = false;
+};
@@ -0,0 +1,147 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "metrics.h"
+
+Metrics metrics;
+
+// Histogram buckets are rendered up to le = 2^k - 1 us, from 3 us to about 2 s
+static const uint8_t FIRST_HISTOGRAM_BIT = 2;
+static const uint8_t LAST_HISTOGRAM_BIT = 21;
+
+static const char* typeName(MetricType type) {
+  return type == METRIC_COUNTER ? "counter" : "gauge";
+}
+
+void Metrics::add(const char* name, MetricType type, const char* help, const std::atomic<uint32_t>& value,
+                  const char* labels, uint16_t divisor) {
+  if (valueCount == MAX_VALUES) return;
+  values[valueCount++] = {name, help, labels, type, divisor, &value, nullptr};
+}
+
+void Metrics::add(const char* name, MetricType type, const char* help, Read read, const char* labels, uint16_t divisor) {
+  if (valueCount == MAX_VALUES) return;
+  values[valueCount++] = {name, help, labels, type, divisor, nullptr, read};
+}
+
+void Metrics::addHistogram(const char* name, const char* help, const LogHistogram& histogram) {
+  if (histogramCount == MAX_HISTOGRAMS) return;
+  histograms[histogramCount++] = {name, help, &histogram};
+}
+
+void Metrics::countRequest(const char* url, bool routed) {
+  uint8_t route = MAX_ROUTES;
+  for (uint8_t i = 0; routed && i < routeCount && route == MAX_ROUTES; i++) {
+    if (strncmp(routes[i], url, ROUTE_LENGTH - 1) == 0) route = i;
+  }
+  if (routed && route == MAX_ROUTES && routeCount < MAX_ROUTES) {
+    // The route becomes a label value, quotes and backslashes would need escaping
+    strlcpy(routes[routeCount], url, ROUTE_LENGTH);
+    for (char* c = routes[routeCount]; *c; c++) {
+      if (*c == '"' || *c == '\\' || *c < ' ') *c = '_';
+    }
+    route = routeCount++;
+  }
+  requests[route].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Renders the next line into pending, returns false once everything was rendered
+bool Metrics::Export::renderNext() {
+  int length = -1;
+  while (length < 0) {
+    switch (stage) {
+      case 0:  // Counters and gauges
+        length = renderValue();
+        break;
+      case 1:  // Histograms
+        length = renderHistogram();
+        break;
+      case 2:  // HTTP requests per route
+        length = renderRoute();
+        break;
+      default:
+        return false;
+    }
+    if (length < 0) {
+      stage++;
+      index = 0;
+      step = 0;
+    }
+  }
+  pendingLength = min((size_t)length, sizeof(pending) - 1);
+  pendingOffset = 0;
+  return true;
+}
+
+// Renders the next value including the header of its family, -1 after the last one
+int Metrics::Export::renderValue() {
+  if (index == metrics.valueCount) return -1;
+  const Value& value = metrics.values[index++];
+  int length = 0;
+  if (index == 1 || strcmp(metrics.values[index - 2].name, value.name) != 0) {
+    length = snprintf(pending, sizeof(pending), "# HELP %s %s\n# TYPE %s %s\n",
+                      value.name, value.help, value.name, typeName(value.type));
+    if (length < 0 || length >= (int)sizeof(pending)) return 0;
+  }
+
+  uint32_t number = value.value ? value.value->load(std::memory_order_relaxed) : value.read();
+  char text[16];
+  if (value.divisor == 1000) snprintf(text, sizeof(text), "%u.%03u", (unsigned)(number / 1000), (unsigned)(number % 1000));
+  else snprintf(text, sizeof(text), "%u", (unsigned)(number / value.divisor));
+  bool labeled = value.labels != nullptr;
+  return length + snprintf(pending + length, sizeof(pending) - length, "%s%s%s%s %s\n", value.name,
+                           labeled ? "{" : "", labeled ? value.labels : "", labeled ? "}" : "", text);
+}
+
+// Renders the next line of a histogram, -1 after the last histogram
+int Metrics::Export::renderHistogram() {
+  if (index == metrics.histogramCount) return -1;
+  const Histogram& entry = metrics.histograms[index];
+  const LogHistogram& histogram = *entry.histogram;
+  const uint8_t buckets = LAST_HISTOGRAM_BIT - FIRST_HISTOGRAM_BIT + 1;
+
+  if (step == 0) {
+    step++;
+    bucket = 0;
+    cumulative = 0;
+    return snprintf(pending, sizeof(pending), "# HELP %s %s\n# TYPE %s histogram\n", entry.name, entry.help, entry.name);
+  }
+  if (step <= buckets) {
+    uint32_t le = (1u << (FIRST_HISTOGRAM_BIT + step - 1)) - 1;
+    for (; bucket < LogHistogram::BUCKETS && LogHistogram::bucketUpperBound(bucket) <= le; bucket++) {
+      cumulative += histogram.bucketCount(bucket);
+    }
+    step++;
+    return snprintf(pending, sizeof(pending), "%s_bucket{le=\"%u.%06u\"} %u\n", entry.name,
+                    (unsigned)(le / 1000000), (unsigned)(le % 1000000), (unsigned)cumulative);
+  }
+
+  // +Inf and _count have to match the buckets, the count may already be one record ahead
+  for (; bucket < LogHistogram::BUCKETS; bucket++) cumulative += histogram.bucketCount(bucket);
+  // Like the count, the sum may already include one record more than the buckets
+  uint64_t sum = histogram.sum();
+  index++;
+  step = 0;
+  return snprintf(pending, sizeof(pending), "%s_bucket{le=\"+Inf\"} %u\n%s_sum %u.%06u\n%s_count %u\n",
+                  entry.name, (unsigned)cumulative, entry.name, (unsigned)(sum / 1000000), (unsigned)(sum % 1000000),
+                  entry.name, (unsigned)cumulative);
+}
+
+// Renders the next route, -1 after "other"
+int Metrics::Export::renderRoute() {
+  if (step == 0) {
+    step++;
+    return snprintf(pending, sizeof(pending), "# HELP genset_http_requests_total HTTP requests by route.\n"
+                                              "# TYPE genset_http_requests_total counter\n");
+  }
+  if (index > metrics.routeCount) return -1;
+  uint8_t route = index < metrics.routeCount ? index : MAX_ROUTES;
+  index++;
+  return snprintf(pending, sizeof(pending), "genset_http_requests_total{route=\"%s\"} %u\n",
+                  route < MAX_ROUTES ? metrics.routes[route] : "other",
+                  (unsigned)metrics.requests[route].load(std::memory_order_relaxed));
+}
@@ -0,0 +1,147 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include "histogram.h"
+#include "util.h"
+
+enum MetricType : uint8_t {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+};
+
+/**
+ * Counters of the control path and the registry of everything served by /metrics
+ * in the Prometheus text format.
+ *
+ * The counters are plain atomics, incrementing one costs the same as incrementing
+ * an integer. Other values are registered once at boot, either as a reference to an
+ * atomic or as a function reading the value when it is scraped. Nothing is collected
+ * in between, a scrape renders one line at a time into the chunked response.
+ *
+ * Values registered one after the other with the same name form one metric family,
+ * they only differ in their labels.
+ */
+class Metrics {
+  public:
+    static constexpr uint8_t MAX_VALUES = 32;
+    static constexpr uint8_t MAX_HISTOGRAMS = 4;
+    static constexpr uint8_t MAX_ROUTES = 48;        // Further URLs are counted as route "other"
+    static constexpr uint8_t ROUTE_LENGTH = 32;
+
+    using Read = uint32_t (*)();
+
+    // Control path, written by the control task
+    std::atomic<uint32_t> startAttempts{0};       // K1 closings, including retries
+    std::atomic<uint32_t> startRetries{0};
+    std::atomic<uint32_t> stopCommands{0};
+    std::atomic<uint32_t> stopRetries{0};
+    std::atomic<uint32_t> runningTransitions{0};  // Debounced RUNNING edges
+    std::atomic<uint32_t> relayOnTime[2] = {};    // ms K1 and K2 were closed
+    std::atomic<uint32_t> logLines{0};
+    std::atomic<uint32_t> logDropped{0};          // Lines the log queue had no room for
+
+    /**
+     * Adds the time since the last call to the on-time of the closed relays.
+     * Must only be called by the control task.
+     */
+    void addRelayTime(bool k1, bool k2, uint32_t now) {
+      uint32_t elapsed = relayTimeAt == 0 ? 0 : now - relayTimeAt;
+      relayTimeAt = now;
+      if (k1) relayOnTime[0].fetch_add(elapsed, std::memory_order_relaxed);
+      if (k2) relayOnTime[1].fetch_add(elapsed, std::memory_order_relaxed);
+    }
+
+    /**
+     * Registers a value read from an atomic, only during setup().
+     *
+     * @param name Metric name, must be a string literal like all other parameters.
+     * @param type Counter or gauge.
+     * @param help Description of the metric family.
+     * @param value The value.
+     * @param labels Labels without braces, e.g. "relay=\"k1\"", or nullptr.
+     * @param divisor The value is rendered divided by 1 or 1000, e.g. for ms as s.
+     */
+    void add(const char* name, MetricType type, const char* help, const std::atomic<uint32_t>& value,
+             const char* labels = nullptr, uint16_t divisor = 1);
+
+    // Registers a value read by a function when scraped, see above
+    void add(const char* name, MetricType type, const char* help, Read read,
+             const char* labels = nullptr, uint16_t divisor = 1);
+
+    /**
+     * Registers a histogram of microseconds, rendered in seconds.
+     *
+     * @param name Metric name without the _bucket, _sum and _count suffixes.
+     * @param help Description of the histogram.
+     * @param histogram The histogram.
+     */
+    void addHistogram(const char* name, const char* help, const LogHistogram& histogram);
+
+    /**
+     * Counts a HTTP request, must only be called by the AsyncTCP task.
+     *
+     * @param url Path of the request.
+     * @param routed false if no handler was registered for it.
+     */
+    void countRequest(const char* url, bool routed);
+
+    /**
+     * Renders all metrics in the Prometheus text format in small fragments.
+     */
+    class Export : public ChunkedExport<256> {
+      public:
+        explicit Export(const Metrics& metrics) : metrics(metrics) {}
+
+      private:
+        bool renderNext() override;
+        int renderValue();
+        int renderHistogram();
+        int renderRoute();
+
+        const Metrics& metrics;
+        uint8_t stage = 0;
+        uint8_t index = 0;
+        uint8_t step = 0;
+        uint8_t bucket = 0;
+        uint32_t cumulative = 0;
+    };
+
+  private:
+    struct Value {
+      const char* name;
+      const char* help;
+      const char* labels;
+      MetricType type;
+      uint16_t divisor;
+      const std::atomic<uint32_t>* value;
+      Read read;
+    };
+
+    struct Histogram {
+      const char* name;
+      const char* help;
+      const LogHistogram* histogram;
+    };
+
+    uint32_t relayTimeAt = 0;
+
+    Value values[MAX_VALUES] = {};
+    uint8_t valueCount = 0;
+    Histogram histograms[MAX_HISTOGRAMS] = {};
+    uint8_t histogramCount = 0;
+
+    // Only used by the AsyncTCP task
+    char routes[MAX_ROUTES][ROUTE_LENGTH] = {};
+    uint8_t routeCount = 0;
+    std::atomic<uint32_t> requests[MAX_ROUTES + 1] = {};  // The last one counts "other"
+};
+
+extern Metrics metrics;
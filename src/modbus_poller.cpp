@@ -0,0 +1,101 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "modbus_poller.h"
+#include "util.h"
+
+ModbusPoller::ModbusPoller(ModbusRtuMaster& master, const ModbusRegister* registers, uint8_t count, uint32_t spacingMs)
+    : master(master), map(registers), count(count < ModbusSnapshot::MAX_REGISTERS ? count : ModbusSnapshot::MAX_REGISTERS),
+      spacing(spacingMs) {
+  // Insertion sort, the map is small and sorted once
+  for (uint8_t i = 0; i < this->count; i++) {
+    uint8_t j = i;
+    for (; j > 0; j--) {
+      const ModbusRegister& a = map[order[j - 1]];
+      const ModbusRegister& b = map[i];
+      uint32_t keyA = ((uint32_t)a.unit << 24) | ((uint32_t)a.function << 16) | a.address;
+      uint32_t keyB = ((uint32_t)b.unit << 24) | ((uint32_t)b.function << 16) | b.address;
+      if (keyA <= keyB) break;
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+}
+
+bool ModbusPoller::adjacent(uint8_t lower, uint8_t upper) const {
+  const ModbusRegister& a = map[order[lower]];
+  const ModbusRegister& b = map[order[upper]];
+  return a.unit == b.unit && a.function == b.function && a.address + 1 == b.address;
+}
+
+bool ModbusPoller::worthReading(uint8_t index, uint32_t nowMs) const {
+  return reached(nowMs, due[index] - map[index].period / 2);
+}
+
+bool ModbusPoller::poll(uint32_t nowMs, uint32_t nowUs) {
+  if (count == 0) return false;
+  if (!started) {
+    for (uint8_t i = 0; i < count; i++) due[order[i]] = nowMs + i * spacing;
+    nextTransactionAt = nowMs;
+    started = true;
+  }
+
+  bool completed = master.poll(nowUs);
+  if (completed) complete(nowMs);
+  if (master.busy() || !reached(nowMs, nextTransactionAt)) return completed;
+
+  // The most overdue register
+  int best = -1;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t index = order[i];
+    if (!reached(nowMs, due[index])) continue;
+    if (best < 0 || (int32_t)(due[index] - due[order[best]]) < 0) best = i;
+  }
+  if (best < 0) return completed;
+
+  // Grow the block with neighbours that are worth reading early
+  uint8_t first = best, last = best;
+  while (last - first + 1 < MAX_BLOCK) {
+    if (first > 0 && adjacent(first - 1, first) && worthReading(order[first - 1], nowMs)) first--;
+    else if (last + 1 < count && adjacent(last, last + 1) && worthReading(order[last + 1], nowMs)) last++;
+    else break;
+  }
+
+  const ModbusRegister& start = map[order[first]];
+  uint8_t length = last - first + 1;
+  bool requested = start.function == ModbusRtuMaster::FUNCTION_READ_INPUT_REGISTERS
+                       ? master.readInputRegisters(start.unit, start.address, length, nowUs)
+                       : master.readHoldingRegisters(start.unit, start.address, length, nowUs);
+  if (requested) {
+    blockFirst = first;
+    blockLast = last;
+    transactionAt = nowMs;
+    nextTransactionAt = nowMs + spacing;
+  }
+  return completed;
+}
+
+void ModbusPoller::complete(uint32_t nowMs) {
+  bool ok = master.result() == MODBUS_OK;
+  current.transactions++;
+  current.busTime += nowMs - transactionAt;
+  if (ok) current.registersRead += master.registerCount();
+  else current.failures++;
+
+  for (uint8_t i = blockFirst; i <= blockLast; i++) {
+    uint8_t index = order[i];
+    if (ok) {
+      current.values[index] = master.registers()[i - blockFirst];
+      current.updatedAt[index] = nowMs ? nowMs : 1;
+      due[index] = nowMs + map[index].period;
+    } else {
+      current.errors[index]++;
+      due[index] = nowMs + (map[index].period < RETRY_DELAY ? map[index].period : RETRY_DELAY);
+    }
+  }
+  published.write(current);
+}
@@ -0,0 +1,97 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+#include "modbus_rtu.h"
+#include "seqlock.h"
+
+// A register to poll and how fresh it has to be
+struct ModbusRegister {
+  const char* name;
+  uint8_t unit;      // Unit ID of the slave
+  uint8_t function;  // ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS or FUNCTION_READ_INPUT_REGISTERS
+  uint16_t address;
+  uint32_t period;   // ms between two reads
+};
+
+/**
+ * Last values of all polled registers, published by ModbusPoller.
+ */
+struct ModbusSnapshot {
+  static constexpr uint8_t MAX_REGISTERS = 32;
+
+  uint16_t values[MAX_REGISTERS];
+  uint32_t updatedAt[MAX_REGISTERS];  // millis() of the last successful read, 0 if never read
+  uint16_t errors[MAX_REGISTERS];     // Failed reads since boot
+  uint32_t transactions;              // Completed transactions
+  uint32_t failures;                  // Transactions without a valid response
+  uint32_t registersRead;             // Registers read by successful transactions
+  uint32_t busTime;                   // ms the bus was busy with transactions
+};
+
+/**
+ * Polls a register map through a ModbusRtuMaster, every register at its own period.
+ *
+ * The most overdue register is read first. Registers next to it (same unit and function,
+ * consecutive addresses) are read in the same transaction if they are at least half their
+ * period old, so registers stored together are read together and share the cost of a
+ * transaction. Transactions are at least spacingMs apart to leave room on the bus, and the
+ * first reads are staggered by the same spacing instead of starting all at once.
+ *
+ * poll() has to be called from the task that owns the master, snapshot() from any task.
+ */
+class ModbusPoller {
+  public:
+    static constexpr uint8_t MAX_BLOCK = 32;      // Registers per transaction
+    static constexpr uint32_t RETRY_DELAY = 5000; // ms until a failed register is read again
+
+    /**
+     * @param master The Modbus master, used exclusively by the poller.
+     * @param registers The register map, must stay valid. Addresses must be unique.
+     * @param count Number of registers, at most ModbusSnapshot::MAX_REGISTERS.
+     * @param spacingMs Minimum time between the start of two transactions.
+     */
+    ModbusPoller(ModbusRtuMaster& master, const ModbusRegister* registers, uint8_t count, uint32_t spacingMs = 20);
+
+    /**
+     * Processes the response of the running transaction and starts the next one when due.
+     *
+     * @param nowMs millis().
+     * @param nowUs micros().
+     * @return true if a transaction completed, its result is available from the master.
+     */
+    bool poll(uint32_t nowMs, uint32_t nowUs);
+
+    // Returns a consistent copy of the last values
+    ModbusSnapshot snapshot() const { return published.read(); }
+
+    const ModbusRegister* registers() const { return map; }
+    uint8_t registerCount() const { return count; }
+
+  private:
+    bool adjacent(uint8_t lower, uint8_t upper) const;
+    bool worthReading(uint8_t index, uint32_t nowMs) const;
+    void complete(uint32_t nowMs);
+
+    ModbusRtuMaster& master;
+    const ModbusRegister* map;
+    uint8_t count;
+    uint32_t spacing;
+
+    uint8_t order[ModbusSnapshot::MAX_REGISTERS];  // Indexes sorted by unit, function and address
+    uint32_t due[ModbusSnapshot::MAX_REGISTERS];   // millis() of the next read, by index
+    bool started = false;
+    uint32_t nextTransactionAt = 0;
+    uint32_t transactionAt = 0;
+    uint8_t blockFirst = 0;  // Positions in order of the running transaction
+    uint8_t blockLast = 0;
+
+    ModbusSnapshot current = {};
+    Seqlock<ModbusSnapshot> published;
+};
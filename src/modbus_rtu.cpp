@@ -0,0 +1,130 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "modbus_rtu.h"
+#include "crc16.h"
+
+uint16_t modbusCrc16(const uint8_t* data, size_t length) {
+  return crc16::sliced(data, length);
+}
+
+// Time passed since a time stamp, correct across the wrap of micros()
+static inline uint32_t elapsed(uint32_t now, uint32_t since) {
+  return now - since;
+}
+
+ModbusRtuMaster::ModbusRtuMaster(ModbusPort& port, uint32_t baudrate, uint32_t responseTimeoutMs)
+    : port(port), responseTimeout(responseTimeoutMs * 1000) {
+  charTime = (10 * 1000000UL + baudrate - 1) / baudrate;
+  // The specification recommends a fixed 1750 us above 19200 baud
+  frameGap = baudrate > 19200 ? 1750 : (35 * charTime + 9) / 10;
+}
+
+bool ModbusRtuMaster::readHoldingRegisters(uint8_t unit, uint16_t address, uint8_t count, uint32_t now) {
+  if (count == 0 || count > MAX_REGISTERS) return false;
+  return begin(unit, FUNCTION_READ_HOLDING_REGISTERS, address, count, 5 + 2 * count, now);
+}
+
+bool ModbusRtuMaster::readInputRegisters(uint8_t unit, uint16_t address, uint8_t count, uint32_t now) {
+  if (count == 0 || count > MAX_REGISTERS) return false;
+  return begin(unit, FUNCTION_READ_INPUT_REGISTERS, address, count, 5 + 2 * count, now);
+}
+
+bool ModbusRtuMaster::writeSingleRegister(uint8_t unit, uint16_t address, uint16_t value, uint32_t now) {
+  return begin(unit, FUNCTION_WRITE_SINGLE_REGISTER, address, value, 8, now);
+}
+
+bool ModbusRtuMaster::begin(uint8_t unit, uint8_t function, uint16_t address, uint16_t value, uint8_t expectedLength,
+                            uint32_t now) {
+  if (state != IDLE || unit == 0 || unit > 247) return false;
+  request[0] = unit;
+  request[1] = function;
+  request[2] = address >> 8;
+  request[3] = address & 0xFF;
+  request[4] = value >> 8;
+  request[5] = value & 0xFF;
+  uint16_t crc = modbusCrc16(request, 6);
+  request[6] = crc & 0xFF;
+  request[7] = crc >> 8;
+
+  expected = expectedLength;
+  received = 0;
+  valueCount = 0;
+  requestedAt = now;
+  state = WAIT_SILENCE;
+  return true;
+}
+
+bool ModbusRtuMaster::poll(uint32_t now) {
+  while (port.available() > 0) {
+    int byte = port.read();
+    if (byte < 0) break;
+    lastByteAt = now;
+    // Noise, or the rest of a frame that came too late, only delays the next request
+    if (state != WAIT_RESPONSE) continue;
+    response[received++] = byte;
+    if (received == expected || (received == 5 && (response[1] & 0x80))) return complete(parse(), now);
+  }
+
+  switch (state) {
+    case WAIT_SILENCE:
+      // The line never went silent or the transmit buffer stayed full
+      if (elapsed(now, requestedAt) >= responseTimeout) return complete(MODBUS_TIMEOUT, now);
+      if (elapsed(now, lastByteAt) >= frameGap && port.write(request, sizeof(request)) == sizeof(request)) {
+        sentAt = now;
+        state = WAIT_RESPONSE;
+      }
+      return false;
+    case WAIT_RESPONSE:
+      // A gap of 3.5 characters ends the frame
+      if (received > 0 && elapsed(now, lastByteAt) >= frameGap) return complete(parse(), now);
+      if (elapsed(now, sentAt) >= (sizeof(request) + expected) * charTime + responseTimeout) {
+        return complete(received > 0 ? parse() : MODBUS_TIMEOUT, now);
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+bool ModbusRtuMaster::complete(ModbusResult result, uint32_t now) {
+  lastResult = result;
+  lastDuration = elapsed(now, requestedAt);
+  state = IDLE;
+  return true;
+}
+
+ModbusResult ModbusRtuMaster::parse() {
+  bool exception = received == 5 && (response[1] & 0x80);
+  if (received != expected && !exception) return MODBUS_INVALID_RESPONSE;
+  // The CRC over a frame including its own CRC is 0
+  if (crc16::sliced(response, received) != 0) return MODBUS_CRC_ERROR;
+  if (response[0] != request[0]) return MODBUS_INVALID_RESPONSE;
+
+  if (exception) {
+    if (response[1] != (request[1] | 0x80)) return MODBUS_INVALID_RESPONSE;
+    lastException = response[2];
+    return MODBUS_EXCEPTION;
+  }
+  if (response[1] != request[1]) return MODBUS_INVALID_RESPONSE;
+
+  if (request[1] == FUNCTION_WRITE_SINGLE_REGISTER) {
+    // The slave echoes the request
+    for (uint8_t i = 2; i < 6; i++) {
+      if (response[i] != request[i]) return MODBUS_INVALID_RESPONSE;
+    }
+    values[0] = (response[4] << 8) | response[5];
+    valueCount = 1;
+    return MODBUS_OK;
+  }
+
+  uint8_t count = (expected - 5) / 2;
+  if (response[2] != 2 * count) return MODBUS_INVALID_RESPONSE;
+  for (uint8_t i = 0; i < count; i++) values[i] = (response[3 + 2 * i] << 8) | response[4 + 2 * i];
+  valueCount = count;
+  return MODBUS_OK;
+}
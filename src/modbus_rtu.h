@@ -0,0 +1,167 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Result of a Modbus transaction
+enum ModbusResult : uint8_t {
+  MODBUS_OK = 0,
+  MODBUS_TIMEOUT = 1,           // No complete response within the response timeout
+  MODBUS_CRC_ERROR = 2,         // Response with a wrong checksum
+  MODBUS_EXCEPTION = 3,         // The slave answered with an exception code
+  MODBUS_INVALID_RESPONSE = 4,  // Wrong unit, function, length or a truncated frame
+  MODBUS_RESULT_COUNT
+};
+
+inline const char* modbusResultName(ModbusResult result) {
+  switch (result) {
+    case MODBUS_OK: return "ok";
+    case MODBUS_TIMEOUT: return "timeout";
+    case MODBUS_CRC_ERROR: return "crc error";
+    case MODBUS_EXCEPTION: return "exception";
+    case MODBUS_INVALID_RESPONSE: return "invalid response";
+    default: return "unknown";
+  }
+}
+
+/**
+ * Calculates the Modbus RTU checksum (CRC-16, polynomial 0xA001 reflected, initial value 0xFFFF).
+ *
+ * @param data The bytes to check.
+ * @param length Number of bytes.
+ * @return The CRC, sent low byte first.
+ */
+uint16_t modbusCrc16(const uint8_t* data, size_t length);
+
+/**
+ * Byte stream of the RS485 transceiver. Neither method may block.
+ */
+class ModbusPort {
+  public:
+    virtual ~ModbusPort() = default;
+    // Number of received bytes that can be read
+    virtual int available() = 0;
+    // Next received byte, -1 if there is none
+    virtual int read() = 0;
+    // Queues bytes for sending, returns the number of bytes accepted
+    virtual size_t write(const uint8_t* data, size_t length) = 0;
+};
+
+/**
+ * Asynchronous Modbus RTU master.
+ *
+ * A request only queues the frame for sending and poll() advances the transaction with the
+ * bytes that arrived in the meantime, so the caller is never blocked for a round trip.
+ * Frames are delimited as in the Modbus serial line specification: a request is only sent
+ * after 3.5 characters of silence, a response is complete when it has the expected length
+ * or the line stays silent for 3.5 characters. Every transaction ends after the response
+ * timeout plus the transmission time of request and response at the latest.
+ *
+ * Time stamps are micros(), all methods have to be called from the same task.
+ */
+class ModbusRtuMaster {
+  public:
+    static constexpr uint8_t MAX_REGISTERS = 125;
+    static constexpr uint8_t FUNCTION_READ_HOLDING_REGISTERS = 0x03;
+    static constexpr uint8_t FUNCTION_READ_INPUT_REGISTERS = 0x04;
+    static constexpr uint8_t FUNCTION_WRITE_SINGLE_REGISTER = 0x06;
+
+    /**
+     * @param port The serial port, 8N1 at the given baud rate.
+     * @param baudrate Used to calculate the character and inter-frame times.
+     * @param responseTimeoutMs Time the slave has to answer after the request was sent.
+     */
+    ModbusRtuMaster(ModbusPort& port, uint32_t baudrate, uint32_t responseTimeoutMs = 200);
+
+    /**
+     * Starts reading holding registers (function 0x03).
+     *
+     * @param unit Unit ID of the slave, 1..247.
+     * @param address First register address.
+     * @param count Number of registers, 1..MAX_REGISTERS.
+     * @param now micros().
+     * @return false if a transaction is in progress or the arguments are invalid.
+     */
+    bool readHoldingRegisters(uint8_t unit, uint16_t address, uint8_t count, uint32_t now);
+
+    // Starts reading input registers (function 0x04), see readHoldingRegisters()
+    bool readInputRegisters(uint8_t unit, uint16_t address, uint8_t count, uint32_t now);
+
+    // Starts writing a single register (function 0x06), see readHoldingRegisters()
+    bool writeSingleRegister(uint8_t unit, uint16_t address, uint16_t value, uint32_t now);
+
+    /**
+     * Sends the pending request and processes received bytes, never blocks.
+     *
+     * @param now micros().
+     * @return true once when a transaction has completed, result() and registers() are valid until the next request.
+     */
+    bool poll(uint32_t now);
+
+    bool busy() const { return state != IDLE; }
+    ModbusResult result() const { return lastResult; }
+    // Exception code of the slave if result() is MODBUS_EXCEPTION
+    uint8_t exceptionCode() const { return lastException; }
+    // Registers read by the last transaction, or the written value
+    const uint16_t* registers() const { return values; }
+    uint8_t registerCount() const { return valueCount; }
+    // Duration of the last transaction from the request until the response, in us
+    uint32_t duration() const { return lastDuration; }
+
+    uint32_t characterTime() const { return charTime; }
+    uint32_t interFrameTime() const { return frameGap; }
+
+  private:
+    enum State : uint8_t { IDLE, WAIT_SILENCE, WAIT_RESPONSE };
+
+    bool begin(uint8_t unit, uint8_t function, uint16_t address, uint16_t value, uint8_t expectedLength, uint32_t now);
+    bool complete(ModbusResult result, uint32_t now);
+    ModbusResult parse();
+
+    ModbusPort& port;
+    uint32_t charTime;    // us per character, 10 bits
+    uint32_t frameGap;    // us of silence between frames
+    uint32_t responseTimeout;
+
+    State state = IDLE;
+    uint8_t request[8];
+    uint8_t response[5 + 2 * MAX_REGISTERS];
+    uint8_t expected = 0;
+    uint8_t received = 0;
+    uint32_t lastByteAt = 0;   // Last byte received
+    uint32_t requestedAt = 0;
+    uint32_t sentAt = 0;
+
+    ModbusResult lastResult = MODBUS_OK;
+    uint8_t lastException = 0;
+    uint16_t values[MAX_REGISTERS] = {};
+    uint8_t valueCount = 0;
+    uint32_t lastDuration = 0;
+};
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+// ModbusPort on an Arduino Stream, e.g. a HardwareSerial
+class StreamModbusPort : public ModbusPort {
+  public:
+    explicit StreamModbusPort(Stream& stream) : stream(stream) {}
+    int available() override { return stream.available(); }
+    int read() override { return stream.read(); }
+    size_t write(const uint8_t* data, size_t length) override {
+      // Only whole frames, a partial write would block on the next one
+      if (stream.availableForWrite() < (int)length) return 0;
+      return stream.write(data, length);
+    }
+
+  private:
+    Stream& stream;
+};
+#endif
@@ -0,0 +1,178 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "modbus_tcp.h"
+
+void logMessage(const String& message);
+
+// Modbus exception codes
+static constexpr uint8_t ILLEGAL_FUNCTION = 0x01;
+static constexpr uint8_t ILLEGAL_DATA_ADDRESS = 0x02;
+static constexpr uint8_t ILLEGAL_DATA_VALUE = 0x03;
+
+static inline uint16_t word(const uint8_t* data) {
+  return (data[0] << 8) | data[1];
+}
+
+void ModbusTcpServer::begin(CoilHandler onCoil) {
+  coilHandler = onCoil;
+  server.onClient([](void* arg, AsyncClient* client) {
+    static_cast<ModbusTcpServer*>(arg)->accept(client);
+  }, this);
+  server.setNoDelay(true);
+  server.begin();
+}
+
+void ModbusTcpServer::accept(AsyncClient* client) {
+  Connection* connection = nullptr;
+  for (Connection& slot : connections) {
+    if (slot.client == nullptr) {
+      connection = &slot;
+      break;
+    }
+  }
+  if (connection == nullptr) {
+    logMessage("[MODBUS] Too many Modbus TCP clients, rejecting " + client->remoteIP().toString());
+    client->onDisconnect([](void*, AsyncClient* client) { delete client; }, nullptr);
+    client->close(true);
+    return;
+  }
+
+  connection->server = this;
+  connection->client = client;
+  connection->length = 0;
+  connected.fetch_add(1, std::memory_order_relaxed);
+  client->setRxTimeout(IDLE_TIMEOUT);
+  client->setNoDelay(true);
+  client->onData([](void* arg, AsyncClient*, void* data, size_t length) {
+    Connection* connection = static_cast<Connection*>(arg);
+    connection->server->receive(*connection, static_cast<const uint8_t*>(data), length);
+  }, connection);
+  client->onTimeout([](void*, AsyncClient* client, uint32_t) {
+    client->close();
+  }, nullptr);
+  client->onDisconnect([](void* arg, AsyncClient* client) {
+    Connection* connection = static_cast<Connection*>(arg);
+    connection->client = nullptr;
+    connection->server->connected.fetch_sub(1, std::memory_order_relaxed);
+    delete client;
+  }, connection);
+}
+
+void ModbusTcpServer::receive(Connection& connection, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    size_t take = min(length, (size_t)(MAX_FRAME - connection.length));
+    memcpy(connection.request + connection.length, data, take);
+    connection.length += take;
+    data += take;
+    length -= take;
+
+    // Answer every complete frame, requests may be pipelined
+    while (connection.length >= 8) {
+      uint16_t frameLength = 6 + word(connection.request + 4);
+      if (word(connection.request + 2) != 0 || frameLength < 8 || frameLength > MAX_FRAME) {
+        connection.client->close();
+        return;
+      }
+      if (connection.length < frameLength) break;
+
+      size_t responseLength = handle(connection.request, frameLength, connection.response);
+      if (connection.client->space() < responseLength
+          || connection.client->add((const char*)connection.response, responseLength) != responseLength) {
+        // The client does not read its responses
+        connection.client->close();
+        return;
+      }
+      connection.client->send();
+
+      connection.length -= frameLength;
+      memmove(connection.request, connection.request + frameLength, connection.length);
+    }
+  }
+}
+
+size_t ModbusTcpServer::exception(uint8_t* response, uint8_t function, uint8_t code) {
+  response[4] = 0;
+  response[5] = 3;
+  response[7] = function | 0x80;
+  response[8] = code;
+  return 9;
+}
+
+size_t ModbusTcpServer::handle(const uint8_t* frame, size_t length, uint8_t* response) {
+  handled.fetch_add(1, std::memory_order_relaxed);
+  // Transaction ID, protocol ID and unit ID are echoed
+  memcpy(response, frame, 4);
+  response[6] = frame[6];
+  uint8_t function = frame[7];
+  const uint8_t* pdu = frame + 7;
+  size_t pduLength = length - 7;
+
+  size_t responseLength;
+  switch (function) {
+    case 0x01:    // Read coils
+    case 0x03:    // Read holding registers
+    case 0x04: {  // Read input registers
+      if (pduLength != 5) return exception(response, function, ILLEGAL_DATA_VALUE);
+      uint16_t address = word(pdu + 1);
+      uint16_t count = word(pdu + 3);
+      uint16_t available = function == 0x01 ? ModbusRegisterImage::COILS
+                           : function == 0x03 ? ModbusRegisterImage::HOLDING_REGISTERS
+                                              : ModbusRegisterImage::INPUT_REGISTERS;
+      if (count == 0 || count > (function == 0x01 ? 2000 : 125)) return exception(response, function, ILLEGAL_DATA_VALUE);
+      if ((uint32_t)address + count > available) return exception(response, function, ILLEGAL_DATA_ADDRESS);
+
+      ModbusRegisterImage image = published.read();
+      response[7] = function;
+      if (function == 0x01) {
+        response[8] = 1;
+        response[9] = (image.coils >> address) & ((1 << count) - 1);
+        responseLength = 10;
+      } else {
+        const uint8_t* registers = function == 0x03 ? image.holding : image.input;
+        response[8] = 2 * count;
+        memcpy(response + 9, registers + 2 * address, 2 * count);
+        responseLength = 9 + 2 * count;
+      }
+      break;
+    }
+    case 0x05: {  // Write single coil
+      if (pduLength != 5) return exception(response, function, ILLEGAL_DATA_VALUE);
+      uint16_t address = word(pdu + 1);
+      uint16_t value = word(pdu + 3);
+      if (value != 0xFF00 && value != 0x0000) return exception(response, function, ILLEGAL_DATA_VALUE);
+      if (address >= ModbusRegisterImage::COILS) return exception(response, function, ILLEGAL_DATA_ADDRESS);
+      if (value == 0xFF00 && coilHandler) coilHandler(address);
+      memcpy(response + 7, pdu, 5);  // Echo of the request
+      responseLength = 12;
+      break;
+    }
+    case 0x0F: {  // Write multiple coils
+      if (pduLength < 7) return exception(response, function, ILLEGAL_DATA_VALUE);
+      uint16_t address = word(pdu + 1);
+      uint16_t count = word(pdu + 3);
+      uint8_t bytes = pdu[5];
+      if (count == 0 || count > 1968 || bytes != (count + 7) / 8 || pduLength != 6u + bytes) {
+        return exception(response, function, ILLEGAL_DATA_VALUE);
+      }
+      if ((uint32_t)address + count > ModbusRegisterImage::COILS) return exception(response, function, ILLEGAL_DATA_ADDRESS);
+      for (uint16_t i = 0; i < count; i++) {
+        if (((pdu[6 + i / 8] >> (i % 8)) & 1) && coilHandler) coilHandler(address + i);
+      }
+      memcpy(response + 7, pdu, 5);  // Function, address and count
+      responseLength = 12;
+      break;
+    }
+    default:
+      return exception(response, function, ILLEGAL_FUNCTION);
+  }
+
+  uint16_t mbapLength = responseLength - 6;
+  response[4] = mbapLength >> 8;
+  response[5] = mbapLength & 0xFF;
+  return responseLength;
+}
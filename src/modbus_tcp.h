@@ -0,0 +1,126 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <atomic>
+#include "seqlock.h"
+
+/**
+ * Register image served by the Modbus TCP server, encoded big endian exactly as sent.
+ *
+ * Input registers (function 0x04):
+ *   0 running, 1 START signal, 2 STOP signal, 3 relay K1, 4 relay K2, 5 starting, 6 stopping,
+ *   7 start retries, 8 stop retries, 9 effective intent (0 none, 1 start, 2 stop),
+ *   10 source of the intent (0xFFFF none), 11-12 uptime in seconds (high word first),
+ *   16.. polled generator registers in the order of the register map,
+ *   32.. age of the polled registers in seconds (0xFFFF if never read)
+ *
+ * Holding registers (function 0x03, read only):
+ *   0 allow start, 1 start mode, 2 stop mode, 3 retry count, 4 stop retry count,
+ *   5-6 power up duration, 7-8 power down duration, 9-10 no start timeout,
+ *   11-12 stop confirm duration (ms, high word first)
+ *
+ * Coils (functions 0x01, 0x05 and 0x0F):
+ *   0 START, 1 STOP. Reads return whether the effective intent is START or STOP,
+ *   writing ON submits a START or STOP intent, writing OFF has no effect.
+ */
+struct ModbusRegisterImage {
+  static constexpr uint16_t INPUT_REGISTERS = 48;
+  static constexpr uint16_t HOLDING_REGISTERS = 16;
+  static constexpr uint16_t COILS = 2;
+  static constexpr uint16_t INPUT_TELEMETRY = 16;
+  static constexpr uint16_t INPUT_TELEMETRY_AGE = 32;
+  static constexpr uint16_t TELEMETRY_REGISTERS = 16;
+
+  uint8_t input[2 * INPUT_REGISTERS];
+  uint8_t holding[2 * HOLDING_REGISTERS];
+  uint8_t coils;  // Bit per coil
+
+  void setInput(uint16_t address, uint16_t value) { encode(input, address, value); }
+  void setInput32(uint16_t address, uint32_t value) {
+    encode(input, address, value >> 16);
+    encode(input, address + 1, value & 0xFFFF);
+  }
+  void setHolding(uint16_t address, uint16_t value) { encode(holding, address, value); }
+  void setHolding32(uint16_t address, uint32_t value) {
+    encode(holding, address, value >> 16);
+    encode(holding, address + 1, value & 0xFFFF);
+  }
+
+  private:
+    static void encode(uint8_t* registers, uint16_t address, uint16_t value) {
+      registers[2 * address] = value >> 8;
+      registers[2 * address + 1] = value & 0xFF;
+    }
+};
+
+/**
+ * Modbus TCP server answering from a register image.
+ *
+ * The control task publishes the image whenever the state changes, requests are answered
+ * from a consistent copy of it in the AsyncTCP task without assembling any values. Every
+ * connection uses one of MAX_CLIENTS preallocated slots with its own request and response
+ * buffer, so requests do not allocate memory. Requests may be pipelined and split across
+ * TCP segments, any unit ID is accepted.
+ */
+class ModbusTcpServer {
+  public:
+    static constexpr uint8_t MAX_CLIENTS = 8;
+    static constexpr uint16_t MAX_FRAME = 260;     // MBAP header and the largest PDU
+    static constexpr uint32_t IDLE_TIMEOUT = 60;   // s without a request until a connection is closed
+
+    // Called in the AsyncTCP task for every coil written ON
+    using CoilHandler = void (*)(uint16_t coil);
+
+    explicit ModbusTcpServer(uint16_t port = 502) : server(port) {}
+
+    /**
+     * Starts listening.
+     *
+     * @param onCoil Called when a coil is written ON.
+     */
+    void begin(CoilHandler onCoil);
+
+    // Replaces the served image, must only be called by the control task
+    void publish(const ModbusRegisterImage& image) { published.write(image); }
+
+    /**
+     * Answers a single Modbus TCP frame.
+     *
+     * @param frame MBAP header and PDU of the request.
+     * @param length Length of the frame.
+     * @param response Receives the response frame, at least MAX_FRAME bytes.
+     * @return Length of the response.
+     */
+    size_t handle(const uint8_t* frame, size_t length, uint8_t* response);
+
+    uint8_t clients() const { return connected.load(std::memory_order_relaxed); }
+    uint32_t requests() const { return handled.load(std::memory_order_relaxed); }
+
+  private:
+    struct Connection {
+      ModbusTcpServer* server;
+      AsyncClient* client;
+      uint16_t length;
+      uint8_t request[MAX_FRAME];
+      uint8_t response[MAX_FRAME];
+    };
+
+    void accept(AsyncClient* client);
+    void receive(Connection& connection, const uint8_t* data, size_t length);
+    size_t exception(uint8_t* response, uint8_t function, uint8_t code);
+
+    AsyncServer server;
+    CoilHandler coilHandler = nullptr;
+    Connection connections[MAX_CLIENTS] = {};
+    std::atomic<uint8_t> connected{0};
+    std::atomic<uint32_t> handled{0};
+    Seqlock<ModbusRegisterImage> published;
+};
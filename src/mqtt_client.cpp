@@ -0,0 +1,496 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "mqtt_client.h"
+#include "command.h"
+#include "util.h"
+
+void logMessage(const String& message);
+
+MqttClient mqttClient;
+
+static const uint32_t TASK_STACK_SIZE = 4096;
+static const UBaseType_t TASK_PRIORITY = 1;
+static const BaseType_t TASK_CORE = 0;  // Next to async_tcp, away from the control task
+
+// MQTT control packet types
+static constexpr uint8_t CONNECT = 1;
+static constexpr uint8_t CONNACK = 2;
+static constexpr uint8_t PUBLISH = 3;
+static constexpr uint8_t SUBSCRIBE = 8;
+static constexpr uint8_t SUBACK = 9;
+static constexpr uint8_t PINGREQ = 12;
+
+// Topics below <prefix>/state/, in the order of stateValues
+static const char* const STATE_TOPIC_NAMES[] = {
+  "running", "startSignal", "stopSignal", "relayK1", "relayK2", "starting", "stopping", "allowStart",
+  "retryStartCount", "retryStopCount", "startMode", "stopMode", "retryCount", "stopRetryCount",
+  "powerUpDuration", "powerDownDuration", "noStartTimeout", "stopConfirmDuration", "intent", "intentSource",
+};
+static_assert(sizeof(STATE_TOPIC_NAMES) / sizeof(STATE_TOPIC_NAMES[0]) == MqttClient::STATE_TOPICS, "state topics");
+
+namespace mqtt {
+
+// Appends the fields of a packet, remembers if the buffer was too small
+class PacketWriter {
+  public:
+    PacketWriter(uint8_t* buffer, size_t size) : buffer(buffer), size(size) {}
+
+    void byte(uint8_t value) {
+      if (length < size) buffer[length] = value;
+      length++;
+    }
+    void word(uint16_t value) {
+      byte(value >> 8);
+      byte(value & 0xFF);
+    }
+    void bytes(const char* data, size_t count) {
+      if (length + count <= size) memcpy(buffer + length, data, count);
+      length += count;
+    }
+    void string(const char* value) {
+      size_t count = strlen(value);
+      word(count);
+      bytes(value, count);
+    }
+    // Fixed header with the remaining length of a packet
+    void header(uint8_t type, uint8_t flags, uint32_t remaining) {
+      byte((type << 4) | flags);
+      do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        byte(remaining > 0 ? digit | 0x80 : digit);
+      } while (remaining > 0);
+    }
+    size_t finish() const { return length <= size ? length : 0; }
+
+  private:
+    uint8_t* buffer;
+    size_t size;
+    size_t length = 0;
+};
+
+size_t encodeConnect(uint8_t* buffer, size_t size, const char* clientId, const char* user, const char* password,
+                     const char* willTopic, const char* willMessage, uint16_t keepAlive) {
+  bool credentials = user[0] != '\0';
+  uint32_t remaining = 10 + 2 + strlen(clientId) + 2 + strlen(willTopic) + 2 + strlen(willMessage);
+  if (credentials) remaining += 2 + strlen(user) + 2 + strlen(password);
+
+  PacketWriter writer(buffer, size);
+  writer.header(CONNECT, 0, remaining);
+  writer.string("MQTT");
+  writer.byte(4);  // Protocol level 3.1.1
+  // Clean session, last will retained with QoS 0, optionally user name and password
+  writer.byte(0x02 | 0x04 | 0x20 | (credentials ? 0xC0 : 0));
+  writer.word(keepAlive);
+  writer.string(clientId);
+  writer.string(willTopic);
+  writer.string(willMessage);
+  if (credentials) {
+    writer.string(user);
+    writer.string(password);
+  }
+  return writer.finish();
+}
+
+size_t encodePublish(uint8_t* buffer, size_t size, const char* topic, const char* payload, bool retain) {
+  size_t payloadLength = strlen(payload);
+  PacketWriter writer(buffer, size);
+  writer.header(PUBLISH, retain ? 1 : 0, 2 + strlen(topic) + payloadLength);
+  writer.string(topic);
+  writer.bytes(payload, payloadLength);
+  return writer.finish();
+}
+
+size_t encodeSubscribe(uint8_t* buffer, size_t size, uint16_t packetId, const char* filter) {
+  PacketWriter writer(buffer, size);
+  writer.header(SUBSCRIBE, 0x02, 2 + 2 + strlen(filter) + 1);
+  writer.word(packetId);
+  writer.string(filter);
+  writer.byte(0);  // QoS 0
+  return writer.finish();
+}
+
+size_t encodePingRequest(uint8_t* buffer, size_t size) {
+  PacketWriter writer(buffer, size);
+  writer.header(PINGREQ, 0, 0);
+  return writer.finish();
+}
+
+}  // namespace mqtt
+
+void MqttClient::begin(const char* id, CommandHandler onCommand) {
+  clientId = id;
+  commandHandler = onCommand;
+  client.setNoDelay(true);
+  client.onConnect([](void* arg, AsyncClient*) {
+    MqttClient* self = static_cast<MqttClient*>(arg);
+    self->state.store(STATE_TCP_CONNECTED, std::memory_order_relaxed);
+    self->notify();
+  }, this);
+  client.onDisconnect([](void* arg, AsyncClient*) { static_cast<MqttClient*>(arg)->disconnected(); }, this);
+  client.onError([](void* arg, AsyncClient*, int8_t) { static_cast<MqttClient*>(arg)->disconnected(); }, this);
+  client.onData([](void* arg, AsyncClient*, void* data, size_t length) {
+    static_cast<MqttClient*>(arg)->receive(static_cast<const uint8_t*>(data), length);
+  }, this);
+  // Acknowledged data makes room for queued messages
+  client.onAck([](void* arg, AsyncClient*, size_t, uint32_t) { static_cast<MqttClient*>(arg)->notify(); }, this);
+  xTaskCreatePinnedToCore(taskMain, "mqtt", TASK_STACK_SIZE, this, TASK_PRIORITY, &task, TASK_CORE);
+}
+
+void MqttClient::configure(const MqttSettings& newSettings) {
+  portENTER_CRITICAL(&lock);
+  settings = newSettings;
+  reconfigure = true;
+  portEXIT_CRITICAL(&lock);
+  notify();
+}
+
+bool MqttClient::publish(const char* topic, const char* payload, Priority priority, bool retain) {
+  Message message;
+  strlcpy(message.topic, topic, sizeof(message.topic));
+  strlcpy(message.payload, payload, sizeof(message.payload));
+  message.priority = priority;
+  message.retain = retain;
+
+  bool accepted = true;
+  portENTER_CRITICAL(&lock);
+  // A queued state topic is replaced by its newer value
+  for (uint8_t i = 0; priority == PRIORITY_TELEMETRY && i < queueCount; i++) {
+    Message& queued = queue[(queueHead + i) % QUEUE_CAPACITY];
+    if (queued.priority == PRIORITY_TELEMETRY && strcmp(queued.topic, message.topic) == 0) {
+      memcpy(queued.payload, message.payload, sizeof(message.payload));
+      portEXIT_CRITICAL(&lock);
+      return true;
+    }
+  }
+  if (queueCount == QUEUE_CAPACITY) {
+    // Drop the oldest state topic, or the oldest command result if there is none
+    int victim = -1;
+    for (uint8_t i = 0; i < queueCount && victim < 0; i++) {
+      if (queue[(queueHead + i) % QUEUE_CAPACITY].priority == PRIORITY_TELEMETRY) victim = i;
+    }
+    if (victim < 0 && priority == PRIORITY_TELEMETRY) {
+      accepted = false;
+    } else {
+      for (uint8_t i = victim < 0 ? 0 : victim; i + 1 < queueCount; i++) {
+        queue[(queueHead + i) % QUEUE_CAPACITY] = queue[(queueHead + i + 1) % QUEUE_CAPACITY];
+      }
+      queueCount--;
+    }
+    discarded.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (accepted) {
+    queue[(queueHead + queueCount) % QUEUE_CAPACITY] = message;
+    queueCount++;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if (accepted) notify();
+  return accepted;
+}
+
+void MqttClient::taskMain(void* parameter) {
+  static_cast<MqttClient*>(parameter)->run();
+}
+
+void MqttClient::run() {
+  for (;;) {
+    uint32_t now = millis();
+    uint32_t wait = maintain(now);
+    if (state.load(std::memory_order_relaxed) == STATE_CONNECTED) {
+      enqueueChanges();
+      flush(now);
+    }
+    ulTaskNotifyTake(pdTRUE, wait == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait) + 1);
+  }
+}
+
+// Connects, reconnects and keeps the connection alive, returns ms until it has to be called again
+uint32_t MqttClient::maintain(uint32_t now) {
+  portENTER_CRITICAL(&lock);
+  bool changed = reconfigure;
+  reconfigure = false;
+  portEXIT_CRITICAL(&lock);
+
+  State current = state.load(std::memory_order_relaxed);
+  if (changed) {
+    reconnectDelay = MIN_RECONNECT_DELAY;
+    reconnectAt = now;
+    if (current != STATE_DISCONNECTED) {
+      client.close(true);
+      return 10;
+    }
+  }
+
+  switch (current) {
+    case STATE_DISCONNECTED: {
+      if (attempting) {
+        attempting = false;
+        if (established) {
+          logMessage("[MQTT] Connection to the broker lost");
+          reconnectDelay = MIN_RECONNECT_DELAY;
+        }
+        established = false;
+        reconnectAt = now + reconnectDelay;
+        reconnectDelay = min(reconnectDelay * 2, MAX_RECONNECT_DELAY);
+      }
+      if (!reached(now, reconnectAt)) return reconnectAt - now;
+
+      MqttSettings copy;
+      portENTER_CRITICAL(&lock);
+      copy = settings;
+      portEXIT_CRITICAL(&lock);
+      if (copy.host[0] == '\0') return UINT32_MAX;  // Disabled, wait for configure()
+
+      strlcpy(topicPrefix, copy.prefix, sizeof(topicPrefix));
+      attempting = true;
+      attemptAt = now;
+      state.store(STATE_CONNECTING, std::memory_order_relaxed);
+      if (!client.connect(copy.host, copy.port)) state.store(STATE_DISCONNECTED, std::memory_order_relaxed);
+      return 0;
+    }
+
+    case STATE_TCP_CONNECTED: {
+      MqttSettings copy;
+      portENTER_CRITICAL(&lock);
+      copy = settings;
+      portEXIT_CRITICAL(&lock);
+
+      char willTopic[sizeof(topicPrefix) + 8];
+      snprintf(willTopic, sizeof(willTopic), "%s/status", topicPrefix);
+      uint8_t packet[MAX_PACKET];
+      size_t length = mqtt::encodeConnect(packet, sizeof(packet), clientId, copy.user, copy.password,
+                                          willTopic, "offline", KEEP_ALIVE);
+      lastReceivedAt.store(now, std::memory_order_relaxed);
+      state.store(STATE_WAIT_CONNACK, std::memory_order_relaxed);
+      if (length == 0 || !sendPacket(packet, length, now)) {
+        client.close(true);
+        return 10;
+      }
+      client.send();
+      return CONNECT_TIMEOUT;
+    }
+
+    case STATE_CONNECTING:
+    case STATE_WAIT_CONNACK:
+      if (reached(now, attemptAt + CONNECT_TIMEOUT)) {
+        logMessage("[MQTT] Broker did not accept the connection in time");
+        client.close(true);
+        return 10;
+      }
+      return attemptAt + CONNECT_TIMEOUT - now;
+
+    case STATE_CONNECTED: {
+      uint8_t packet[MAX_PACKET];
+      if (!established) {
+        established = true;
+        reconnectDelay = MIN_RECONNECT_DELAY;
+        memset(stateValues, 0, sizeof(stateValues));  // Publish every state topic again
+        logMessage("[MQTT] Connected to the broker");
+
+        char filter[sizeof(topicPrefix) + 16];
+        snprintf(filter, sizeof(filter), "%s/command/+", topicPrefix);
+        size_t length = mqtt::encodeSubscribe(packet, sizeof(packet), 1, filter);
+        if (length == 0 || !sendPacket(packet, length, now)) {
+          client.close(true);
+          return 10;
+        }
+        publish("status", "online", PRIORITY_COMMAND, true);
+      }
+
+      uint32_t lastReceived = lastReceivedAt.load(std::memory_order_relaxed);
+      if (reached(now, lastReceived + KEEP_ALIVE * 1500)) {
+        logMessage("[MQTT] Broker stopped answering");
+        client.close(true);
+        return 10;
+      }
+      if (reached(now, lastSentAt + KEEP_ALIVE * 500)) {
+        size_t length = mqtt::encodePingRequest(packet, sizeof(packet));
+        if (sendPacket(packet, length, now)) client.send();
+      }
+      return lastSentAt + KEEP_ALIVE * 500 - now;
+    }
+  }
+  return 0;
+}
+
+// Queues every state topic whose value differs from the one queued last
+void MqttClient::enqueueChanges() {
+  GensetStatus status = gensetStatus.read();
+  uint32_t numbers[] = {
+    status.running, status.startSignal, status.stopSignal, status.relayK1, status.relayK2, status.starting,
+    status.stopping, status.allowStart, status.retryStartCount, status.retryStopCount, status.startMode,
+    status.stopMode, status.retryCount, status.stopRetryCount, status.powerUpDuration, status.powerDownDuration,
+    status.noStartTimeout, status.stopConfirmDuration,
+  };
+  char values[STATE_TOPICS][sizeof(stateValues[0])];
+  for (uint8_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+    snprintf(values[i], sizeof(values[i]), "%u", (unsigned)numbers[i]);
+  }
+  strlcpy(values[18], status.intentCommand == INTENT_NONE ? "none"
+                      : status.intentCommand == COMMAND_START ? "start" : "stop", sizeof(values[18]));
+  strlcpy(values[19], status.intentSource == INTENT_NONE ? "none"
+                      : commandSourceName((CommandSource)status.intentSource), sizeof(values[19]));
+
+  for (uint8_t i = 0; i < STATE_TOPICS; i++) {
+    if (strcmp(values[i], stateValues[i]) == 0) continue;
+    char topic[sizeof(Message::topic)];
+    snprintf(topic, sizeof(topic), "state/%s", STATE_TOPIC_NAMES[i]);
+    // A dropped value is queued again on the next call
+    if (publish(topic, values[i], PRIORITY_TELEMETRY, true)) strlcpy(stateValues[i], values[i], sizeof(stateValues[i]));
+  }
+}
+
+// Sends queued messages as long as the connection has room for them
+void MqttClient::flush(uint32_t now) {
+  bool added = false;
+  for (;;) {
+    Message message;
+    portENTER_CRITICAL(&lock);
+    bool any = queueCount > 0;
+    if (any) message = queue[queueHead];
+    portEXIT_CRITICAL(&lock);
+    if (!any) break;
+
+    char topic[sizeof(topicPrefix) + sizeof(Message::topic)];
+    snprintf(topic, sizeof(topic), "%s/%s", topicPrefix, message.topic);
+    uint8_t packet[MAX_PACKET];
+    size_t length = mqtt::encodePublish(packet, sizeof(packet), topic, message.payload, message.retain);
+    if (length > 0 && client.space() < length) break;  // onAck wakes the task up again
+
+    portENTER_CRITICAL(&lock);
+    // The head may have been replaced by a newer value meanwhile, it is sent next time
+    bool unchanged = queueCount > 0 && memcmp(&queue[queueHead], &message, sizeof(message)) == 0;
+    if (unchanged) {
+      queueHead = (queueHead + 1) % QUEUE_CAPACITY;
+      queueCount--;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (!unchanged) continue;
+    if (length == 0) {
+      discarded.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    if (!sendPacket(packet, length, now)) break;
+    sent.fetch_add(1, std::memory_order_relaxed);
+    added = true;
+  }
+  if (added) client.send();
+}
+
+bool MqttClient::sendPacket(const uint8_t* packet, size_t length, uint32_t now) {
+  if (client.space() < length || client.add((const char*)packet, length) != length) return false;
+  lastSentAt = now;
+  return true;
+}
+
+// Called in the AsyncTCP task when the connection ended or could not be established
+void MqttClient::disconnected() {
+  rxLength = 0;
+  rxSkip = 0;
+  state.store(STATE_DISCONNECTED, std::memory_order_relaxed);
+  notify();
+}
+
+void MqttClient::receive(const uint8_t* data, size_t length) {
+  lastReceivedAt.store(millis(), std::memory_order_relaxed);
+  while (length > 0) {
+    if (rxSkip > 0) {
+      size_t skip = min(rxSkip, length);
+      rxSkip -= skip;
+      data += skip;
+      length -= skip;
+      continue;
+    }
+    size_t take = min(length, MAX_PACKET - rxLength);
+    memcpy(rx + rxLength, data, take);
+    rxLength += take;
+    data += take;
+    length -= take;
+
+    // Handle every complete packet
+    while (rxLength >= 2) {
+      uint32_t remaining = 0;
+      size_t header = 0;
+      for (size_t i = 0; i < 4 && 1 + i < rxLength; i++) {
+        remaining |= (uint32_t)(rx[1 + i] & 0x7F) << (7 * i);
+        if (!(rx[1 + i] & 0x80)) {
+          header = 2 + i;
+          break;
+        }
+      }
+      if (header == 0) {
+        if (rxLength >= 5) client.close(true);  // Malformed remaining length
+        break;
+      }
+      size_t total = header + remaining;
+      if (total > MAX_PACKET) {
+        // Too large to buffer, e.g. a big retained message, skipped
+        rxSkip = total - rxLength;
+        rxLength = 0;
+        break;
+      }
+      if (rxLength < total) break;
+      handlePacket(rx, header, total);
+      rxLength -= total;
+      memmove(rx, rx + total, rxLength);
+    }
+  }
+}
+
+void MqttClient::handlePacket(const uint8_t* packet, size_t header, size_t length) {
+  switch (packet[0] >> 4) {
+    case CONNACK:
+      if (length >= header + 2 && packet[header + 1] == 0) {
+        state.store(STATE_CONNECTED, std::memory_order_relaxed);
+        notify();
+      } else {
+        logMessage("[MQTT] Broker refused the connection, return code " + String(length >= header + 2 ? packet[header + 1] : 0));
+        client.close(true);
+      }
+      break;
+
+    case SUBACK:
+      if (length >= header + 3 && packet[header + 2] == 0x80) logMessage("[MQTT] Broker refused the command subscription");
+      break;
+
+    case PUBLISH: {
+      uint8_t flags = packet[0] & 0x0F;
+      if (flags & 0x01) break;  // Retained, a stale command must not be applied
+      if (length < header + 2) break;
+      size_t topicLength = (packet[header] << 8) | packet[header + 1];
+      size_t offset = header + 2 + topicLength + (((flags >> 1) & 0x03) ? 2 : 0);
+      if (offset > length) break;
+
+      // Only <prefix>/command/+ is subscribed, the last level is the command
+      const char* topic = (const char*)packet + header + 2;
+      const char* command = topic;
+      for (size_t i = 0; i < topicLength; i++) {
+        if (topic[i] == '/') command = topic + i + 1;
+      }
+      char name[24];
+      char payload[48];
+      size_t nameLength = min((size_t)(topic + topicLength - command), sizeof(name) - 1);
+      size_t payloadLength = min(length - offset, sizeof(payload) - 1);
+      memcpy(name, command, nameLength);
+      name[nameLength] = '\0';
+      memcpy(payload, packet + offset, payloadLength);
+      payload[payloadLength] = '\0';
+      if (strcmp(name, "result") == 0 || commandHandler == nullptr) break;  // Our own results
+
+      char result[sizeof(Message::payload)];
+      commandHandler(name, payload, result, sizeof(result));
+      commands.fetch_add(1, std::memory_order_relaxed);
+      publish("command/result", result, PRIORITY_COMMAND, false);
+      break;
+    }
+
+    default:
+      break;  // PINGRESP
+  }
+}
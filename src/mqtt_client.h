@@ -0,0 +1,170 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <atomic>
+#include "status.h"
+
+// Broker connection, persisted in NVS
+struct MqttSettings {
+  char host[64];      // Empty disables MQTT
+  uint16_t port;
+  char prefix[32];    // Prefix of all topics, e.g. "genset"
+  char user[32];      // Empty connects without credentials
+  char password[64];
+};
+
+/**
+ * Encoders of the MQTT 3.1.1 control packets sent by the client. Every function
+ * returns the length of the packet, or 0 if it does not fit into the buffer.
+ */
+namespace mqtt {
+
+size_t encodeConnect(uint8_t* buffer, size_t size, const char* clientId, const char* user, const char* password,
+                     const char* willTopic, const char* willMessage, uint16_t keepAlive);
+size_t encodePublish(uint8_t* buffer, size_t size, const char* topic, const char* payload, bool retain);
+size_t encodeSubscribe(uint8_t* buffer, size_t size, uint16_t packetId, const char* filter);
+size_t encodePingRequest(uint8_t* buffer, size_t size);
+
+}  // namespace mqtt
+
+/**
+ * MQTT client publishing the generator state as retained topics and receiving commands.
+ *
+ * Topics below the configured prefix:
+ *   <prefix>/status            "online" or "offline" (last will), retained
+ *   <prefix>/state/<name>      every field of GensetStatus, retained, published when it changes
+ *   <prefix>/command/<name>    subscribed: start, stop, allowStart (payload 1/0, true/false, ON/OFF)
+ *   <prefix>/command/result    outcome of the last command
+ *
+ * The control task only calls notify() after it published a new gensetStatus. The client
+ * runs in its own task on core 0, compares the newest status with what it sent, so a burst
+ * of changes results in one publish per changed topic. Packets wait in a bounded queue until
+ * the TCP connection has room for them. A queued state topic is replaced by its newer value,
+ * and when the queue is full the oldest state topic is dropped before any command result.
+ * Everything is sent with QoS 0, retained commands are ignored so a stale "start" on the
+ * broker cannot start the generator after a reboot.
+ */
+class MqttClient {
+  public:
+    static constexpr uint8_t QUEUE_CAPACITY = 32;
+    static constexpr uint16_t KEEP_ALIVE = 60;               // s
+    static constexpr uint32_t MIN_RECONNECT_DELAY = 1000;    // ms, doubled after every failed attempt
+    static constexpr uint32_t MAX_RECONNECT_DELAY = 60000;   // ms
+    static constexpr size_t MAX_PACKET = 256;                // Outgoing packets and buffered incoming packets
+    static constexpr uint32_t CONNECT_TIMEOUT = 10000;       // ms until the broker has to accept the connection
+    static constexpr uint8_t STATE_TOPICS = 20;
+
+    enum Priority : uint8_t {
+      PRIORITY_TELEMETRY = 0,  // State topics, dropped first
+      PRIORITY_COMMAND = 1,    // Command results and availability
+    };
+
+    /**
+     * Called in the AsyncTCP task for every message on a command topic.
+     *
+     * @param command Last level of the topic, e.g. "start".
+     * @param payload The payload, NUL terminated.
+     * @param result Receives the text published to <prefix>/command/result.
+     * @param resultSize Size of result.
+     */
+    using CommandHandler = void (*)(const char* command, const char* payload, char* result, size_t resultSize);
+
+    /**
+     * Starts the client task, it connects once settings with a host are configured.
+     *
+     * @param clientId MQTT client ID, must stay valid.
+     * @param onCommand Called for received commands.
+     */
+    void begin(const char* clientId, CommandHandler onCommand);
+
+    // Replaces the broker settings and reconnects, can be called from any task
+    void configure(const MqttSettings& settings);
+
+    // Tells the client that gensetStatus changed, cheap enough for the control task
+    void notify() { if (task) xTaskNotifyGive(task); }
+
+    /**
+     * Queues a message, can be called from any task.
+     *
+     * @param topic Topic below the prefix.
+     * @param payload The payload.
+     * @param priority Which messages are dropped first when the queue is full.
+     * @param retain Retained by the broker.
+     * @return false if the message was dropped.
+     */
+    bool publish(const char* topic, const char* payload, Priority priority, bool retain);
+
+    bool connected() const { return state.load(std::memory_order_relaxed) == STATE_CONNECTED; }
+    uint32_t published() const { return sent.load(std::memory_order_relaxed); }
+    uint32_t dropped() const { return discarded.load(std::memory_order_relaxed); }
+    uint32_t received() const { return commands.load(std::memory_order_relaxed); }
+
+  private:
+    enum State : uint8_t {
+      STATE_DISCONNECTED,
+      STATE_CONNECTING,    // Waiting for TCP
+      STATE_TCP_CONNECTED, // CONNECT not sent yet
+      STATE_WAIT_CONNACK,
+      STATE_CONNECTED,
+    };
+
+    struct Message {
+      char topic[32];
+      char payload[48];
+      Priority priority;
+      bool retain;
+    };
+
+    static void taskMain(void* parameter);
+    void run();
+    uint32_t maintain(uint32_t now);
+    void enqueueChanges();
+    void flush(uint32_t now);
+    bool sendPacket(const uint8_t* packet, size_t length, uint32_t now);
+    void disconnected();
+    void receive(const uint8_t* data, size_t length);
+    void handlePacket(const uint8_t* packet, size_t header, size_t length);
+
+    TaskHandle_t task = nullptr;
+    AsyncClient client;
+    const char* clientId = "";
+    CommandHandler commandHandler = nullptr;
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;  // Guards settings and the queue
+    MqttSettings settings = {};
+    bool reconfigure = false;
+    Message queue[QUEUE_CAPACITY] = {};
+    uint8_t queueHead = 0;
+    uint8_t queueCount = 0;
+
+    // Only used by the client task
+    char topicPrefix[sizeof(MqttSettings::prefix)] = {};
+    char stateValues[STATE_TOPICS][12] = {};  // Last queued payload per state topic
+    bool attempting = false;   // A connection was started and has not ended yet
+    bool established = false;  // The broker accepted the current connection
+    uint32_t attemptAt = 0;
+    uint32_t reconnectAt = 0;
+    uint32_t reconnectDelay = MIN_RECONNECT_DELAY;
+    uint32_t lastSentAt = 0;
+    std::atomic<uint32_t> lastReceivedAt{0};
+
+    // Only used by the AsyncTCP task
+    uint8_t rx[MAX_PACKET] = {};
+    size_t rxLength = 0;
+    size_t rxSkip = 0;
+
+    std::atomic<State> state{STATE_DISCONNECTED};
+    std::atomic<uint32_t> sent{0};
+    std::atomic<uint32_t> discarded{0};
+    std::atomic<uint32_t> commands{0};
+};
+
+extern MqttClient mqttClient;
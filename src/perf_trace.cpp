@@ -0,0 +1,97 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#ifdef GENSET_TRACE
+
+#include "perf_trace.h"
+#include "hal.h"
+
+#if !(defined(AUTO_FW_VERSION))
+  #define AUTO_FW_VERSION "0.0.0-dev"
+#endif
+
+PerfTrace perfTrace;
+
+void IRAM_ATTR PerfTrace::record(const char* name, char phase, uint32_t value) {
+  uint8_t core = xPortGetCoreID();
+  portENTER_CRITICAL_SAFE(&lock);
+  // Checked under the lock, an export never sees a record change
+  if (exports.load(std::memory_order_relaxed) != 0) {
+    portEXIT_CRITICAL_SAFE(&lock);
+    return;
+  }
+  records[head] = {hal::nowMicros(), name, phase, core, 0, value};
+  head = (head + 1) % CAPACITY;
+  if (count < CAPACITY) count++;
+  portEXIT_CRITICAL_SAFE(&lock);
+}
+
+void PerfTrace::reset() {
+  portENTER_CRITICAL(&lock);
+  count = 0;
+  portEXIT_CRITICAL(&lock);
+}
+
+PerfTrace::Export::Export(PerfTrace& trace) : trace(trace) {
+  trace.exports.fetch_add(1, std::memory_order_relaxed);
+  portENTER_CRITICAL(&trace.lock);
+  count = trace.count;
+  first = (trace.head + CAPACITY - count) % CAPACITY;
+  portEXIT_CRITICAL(&trace.lock);
+  if (count > 0) lastAt = trace.records[first].at;
+}
+
+PerfTrace::Export::~Export() {
+  trace.exports.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Renders the next JSON fragment into pending, returns false once everything was rendered
+bool PerfTrace::Export::renderNext() {
+  int length = 0;
+  switch (stage) {
+    case 0:
+      length = snprintf(pending, sizeof(pending),
+                        "{\"displayTimeUnit\":\"ms\",\"traceEvents\":["
+                        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"genset-control %s\"}}",
+                        AUTO_FW_VERSION);
+      stage++;
+      break;
+    case 1:
+    case 2:
+      length = snprintf(pending, sizeof(pending),
+                        ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"core %u\"}}",
+                        stage - 1, stage - 1);
+      stage++;
+      break;
+    case 3: {
+      if (index == count) {
+        length = snprintf(pending, sizeof(pending), "]}");
+        stage++;
+        break;
+      }
+      const Record& record = trace.records[(first + index++) % CAPACITY];
+      elapsed += (uint32_t)(record.at - lastAt);
+      lastAt = record.at;
+      if (record.phase == 'i') {
+        length = snprintf(pending, sizeof(pending),
+                          ",{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%u}}",
+                          record.name, (unsigned long long)elapsed, record.core, (unsigned)record.value);
+      } else {
+        length = snprintf(pending, sizeof(pending), ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u}",
+                          record.name, record.phase, (unsigned long long)elapsed, record.core);
+      }
+      break;
+    }
+    default:
+      return false;
+  }
+  pendingLength = length < 0 ? 0 : min((size_t)length, sizeof(pending) - 1);
+  pendingOffset = 0;
+  return true;
+}
+
+#endif
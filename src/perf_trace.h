@@ -0,0 +1,106 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+/**
+ * Trace points of the control path, exported as Chrome Trace Event JSON via /perfTrace
+ * and viewable in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ *   PERF_SCOPE("name")                 duration from here to the end of the scope
+ *   PERF_INSTANT("name")               point in time, e.g. an ISR entry
+ *   PERF_INSTANT_VALUE("name", value)  point in time with a value, e.g. a new level
+ *
+ * Names must be string literals. Tracing is only compiled in with -D GENSET_TRACE (see the
+ * esp32dev-trace environment), otherwise the macros expand to nothing.
+ */
+#ifdef GENSET_TRACE
+
+#include <Arduino.h>
+#include <atomic>
+#include "util.h"
+
+class PerfTrace {
+  public:
+    static constexpr size_t CAPACITY = 2048;  // 32 KiB
+
+    struct Record {
+      uint32_t at;       // micros()
+      const char* name;
+      char phase;        // 'B'egin, 'E'nd or 'i'nstant
+      uint8_t core;
+      uint16_t reserved;
+      uint32_t value;
+    };
+
+    /**
+     * Appends an event, overwriting the oldest one if the buffer is full.
+     * Safe to call from any task and from ISRs.
+     *
+     * @param name Name of the event, must be a string literal.
+     * @param phase 'B', 'E' or 'i'.
+     * @param value Shown as argument of instant events.
+     */
+    void IRAM_ATTR record(const char* name, char phase, uint32_t value);
+
+    // Discards all events
+    void reset();
+
+    /**
+     * Renders the events as Chrome Trace Event JSON in pieces, so the web server can
+     * stream it. Recording is paused as long as an export exists.
+     */
+    class Export : public ChunkedExport<160> {
+      public:
+        explicit Export(PerfTrace& trace);
+        ~Export();
+
+      private:
+        bool renderNext() override;
+
+        PerfTrace& trace;
+        size_t first;
+        size_t count;
+        size_t index = 0;
+        uint8_t stage = 0;
+        uint32_t lastAt = 0;
+        uint64_t elapsed = 0;  // us since the oldest event
+    };
+
+  private:
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    Record records[CAPACITY] = {};
+    size_t head = 0;
+    size_t count = 0;
+    std::atomic<uint8_t> exports{0};
+};
+
+extern PerfTrace perfTrace;
+
+// Records the begin and end of the enclosing scope
+class PerfScope {
+  public:
+    explicit PerfScope(const char* name) : name(name) { perfTrace.record(name, 'B', 0); }
+    ~PerfScope() { perfTrace.record(name, 'E', 0); }
+
+  private:
+    const char* name;
+};
+
+#define PERF_CONCAT_(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_SCOPE(name) PerfScope PERF_CONCAT(perfScope, __LINE__)(name)
+#define PERF_INSTANT(name) perfTrace.record(name, 'i', 0)
+#define PERF_INSTANT_VALUE(name, value) perfTrace.record(name, 'i', value)
+
+#else
+
+#define PERF_SCOPE(name) do {} while (0)
+#define PERF_INSTANT(name) do {} while (0)
+#define PERF_INSTANT_VALUE(name, value) do {} while (0)
+
+#endif
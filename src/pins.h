@@ -0,0 +1,18 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+// Pin definitions
+#define RELAY_K1 16
+#define RELAY_K2 17
+#define LED 23
+#define RUNNING_SIGNAL 25
+#define START_SIGNAL 26
+#define STOP_SIGNAL 27
+#define MODBUS_TX 32  // RS485 transceiver
+#define MODBUS_RX 33
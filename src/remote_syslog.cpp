@@ -0,0 +1,178 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "remote_syslog.h"
+#include <WiFi.h>
+#include <time.h>
+
+RemoteSyslog remoteSyslog;
+
+static const uint32_t TASK_STACK_SIZE = 4096;
+static const UBaseType_t TASK_PRIORITY = 1;
+static const BaseType_t TASK_CORE = 0;  // Next to the network stack, away from the control task
+
+static const uint8_t FACILITY_LOCAL0 = 16;
+static const time_t VALID_TIME = 1700000000;  // The system time was set if it is later than this
+
+void RemoteSyslog::begin(const char* name) {
+  hostname = name;
+  xTaskCreatePinnedToCore(taskMain, "syslog", TASK_STACK_SIZE, this, TASK_PRIORITY, &task, TASK_CORE);
+}
+
+void RemoteSyslog::configure(const SyslogSettings& settings) {
+  bool enable = settings.host[0] != '\0';
+  portENTER_CRITICAL(&lock);
+  collector = settings;
+  reconfigure = true;
+  if (!enable) {
+    head = 0;
+    used = 0;
+  }
+  portEXIT_CRITICAL(&lock);
+  enabled.store(enable, std::memory_order_relaxed);
+  if (task) xTaskNotifyGive(task);
+}
+
+void RemoteSyslog::copyIn(size_t offset, const void* data, size_t length) {
+  offset %= QUEUE_SIZE;
+  size_t first = min(length, QUEUE_SIZE - offset);
+  memcpy(ring + offset, data, first);
+  memcpy(ring, (const uint8_t*)data + first, length - first);
+}
+
+void RemoteSyslog::copyOut(size_t offset, void* data, size_t length) const {
+  offset %= QUEUE_SIZE;
+  size_t first = min(length, QUEUE_SIZE - offset);
+  memcpy(data, ring + offset, first);
+  memcpy((uint8_t*)data + first, ring, length - first);
+}
+
+void RemoteSyslog::log(const String& line, Severity severity) {
+  if (!enabled.load(std::memory_order_relaxed)) return;
+  if (task != nullptr && xTaskGetCurrentTaskHandle() == task) return;  // Never log about sending logs
+
+  Header header = {millis(), (uint16_t)min(line.length(), MAX_LINE), severity};
+  bool queued = false;
+  portENTER_CRITICAL(&lock);
+  if (used + sizeof(header) + header.length <= QUEUE_SIZE) {
+    copyIn(head + used, &header, sizeof(header));
+    copyIn(head + used + sizeof(header), line.c_str(), header.length);
+    used += sizeof(header) + header.length;
+    queued = true;
+  }
+  portEXIT_CRITICAL(&lock);
+
+  if (!queued) drops.fetch_add(1, std::memory_order_relaxed);
+  else if (task) xTaskNotifyGive(task);
+}
+
+// Takes the oldest line off the ring, text receives at least MAX_LINE + 1 bytes
+bool RemoteSyslog::pop(Header& header, char* text) {
+  portENTER_CRITICAL(&lock);
+  bool any = used > 0;
+  if (any) {
+    copyOut(head, &header, sizeof(header));
+    copyOut(head + sizeof(header), text, header.length);
+    head = (head + sizeof(header) + header.length) % QUEUE_SIZE;
+    used -= sizeof(header) + header.length;
+  }
+  portEXIT_CRITICAL(&lock);
+  if (any) text[header.length] = '\0';
+  return any;
+}
+
+// Renders a line as RFC 5424 message, returns its length
+size_t RemoteSyslog::format(char* buffer, size_t size, const Header& header, const char* text, uint32_t now) {
+  // The tag of "[MODBUS] Generator ..." becomes the MSGID
+  char msgid[33] = "-";
+  const char* message = text;
+  const char* end = text[0] == '[' ? strchr(text, ']') : nullptr;
+  if (end != nullptr && end - text - 1 > 0 && end - text - 1 < (int)sizeof(msgid)) {
+    memcpy(msgid, text + 1, end - text - 1);
+    msgid[end - text - 1] = '\0';
+    for (char* c = msgid; *c; c++) {
+      if (*c <= ' ' || *c > '~') *c = '_';  // MSGID is PRINTUSASCII
+    }
+    message = end + 1;
+    while (*message == ' ') message++;
+  }
+
+  char timestamp[32] = "-";
+  time_t wallClock = time(nullptr);
+  if (wallClock > VALID_TIME) {
+    uint32_t age = now - header.at;
+    int64_t at = (int64_t)wallClock * 1000 - age;
+    time_t seconds = at / 1000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    size_t length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(timestamp + length, sizeof(timestamp) - length, ".%03uZ", (unsigned)(at % 1000));
+  }
+
+  int length = snprintf(buffer, size, "<%u>1 %s %s genset - %s [meta sequenceId=\"%u\" sysUpTime=\"%u\"] %s",
+                        FACILITY_LOCAL0 * 8 + header.severity, timestamp, hostname, msgid,
+                        (unsigned)++sequence, (unsigned)(header.at / 10), message);
+  return length < 0 ? 0 : min((size_t)length, size - 1);
+}
+
+bool RemoteSyslog::send(const char* datagram, size_t length) {
+  if (udp.writeTo((const uint8_t*)datagram, length, address, port) != length) return false;
+  packets.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void RemoteSyslog::taskMain(void* parameter) {
+  static_cast<RemoteSyslog*>(parameter)->run();
+}
+
+void RemoteSyslog::run() {
+  char text[MAX_LINE + 1];
+  char message[MAX_LINE + 192];  // Fits into one datagram of an Ethernet/WiFi MTU
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    vTaskDelay(pdMS_TO_TICKS(BATCH_DELAY));  // Let the rest of a burst arrive
+
+    portENTER_CRITICAL(&lock);
+    bool changed = reconfigure;
+    reconfigure = false;
+    SyslogSettings settings = collector;
+    portEXIT_CRITICAL(&lock);
+    if (changed || !resolved) {
+      port = settings.port;
+      resolved = settings.host[0] != '\0' && WiFi.isConnected() && WiFi.hostByName(settings.host, address) == 1;
+      if (!resolved) {
+        // Keep the lines until the collector can be reached, the ring bounds the memory
+        if (settings.host[0] != '\0') {
+          vTaskDelay(pdMS_TO_TICKS(1000));
+          xTaskNotifyGive(task);
+        }
+        continue;
+      }
+    }
+
+    uint32_t dropped = drops.load(std::memory_order_relaxed);
+    if (dropped != reportedDrops) {
+      Header header = {millis(), 0, SEVERITY_WARNING};
+      snprintf(text, sizeof(text), "[SYSLOG] %u lines dropped", (unsigned)(dropped - reportedDrops));
+      if (send(message, format(message, sizeof(message), header, text, millis()))) reportedDrops = dropped;
+    }
+
+    // One message per datagram, a collector reads every datagram as a single message
+    Header header;
+    while (pop(header, text)) {
+      if (!send(message, format(message, sizeof(message), header, text, millis()))) {
+        // Resolve the collector again, the lines still queued are sent afterwards
+        drops.fetch_add(1, std::memory_order_relaxed);
+        resolved = false;
+        xTaskNotifyGive(task);
+        break;
+      }
+      lines.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
@@ -0,0 +1,108 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncUDP.h>
+#include <atomic>
+
+// Syslog collector, persisted in NVS
+struct SyslogSettings {
+  char host[64];  // Host name or IP address, empty disables forwarding
+  uint16_t port;  // UDP port, usually 514
+};
+
+/**
+ * Forwards log lines to a syslog collector as RFC 5424 messages over UDP.
+ *
+ * log() only copies the line into a bounded byte ring and wakes up the syslog task, it
+ * never touches the network. When the ring is full or a datagram cannot be sent the line
+ * is dropped and counted, the number of dropped lines is reported in the next message.
+ * The task waits BATCH_DELAY after the first line, so a burst of lines is sent together,
+ * each message in its own datagram as RFC 5426 requires.
+ *
+ * A message looks like
+ *   <134>1 - genset-control genset - MODBUS [meta sequenceId="12" sysUpTime="1234"] Generator controller is responding
+ * with the tag of the line ("[MODBUS] ...") as MSGID. The timestamp is only set once the
+ * system time is known, otherwise the collector stamps the message on arrival.
+ */
+class RemoteSyslog {
+  public:
+    static constexpr size_t QUEUE_SIZE = 4096;      // Bytes of queued lines
+    static constexpr size_t MAX_LINE = 240;         // Longer lines are truncated
+    static constexpr uint32_t BATCH_DELAY = 100;    // ms to collect lines before sending
+
+    enum Severity : uint8_t {
+      SEVERITY_ERROR = 3,
+      SEVERITY_WARNING = 4,
+      SEVERITY_NOTICE = 5,
+      SEVERITY_INFO = 6,
+    };
+
+    /**
+     * Starts the syslog task.
+     *
+     * @param hostname HOSTNAME of the messages, must stay valid.
+     */
+    void begin(const char* hostname);
+
+    // Replaces the collector, can be called from any task
+    void configure(const SyslogSettings& settings);
+
+    /**
+     * Queues a line, can be called from any task besides the syslog task itself.
+     *
+     * @param line The log line.
+     * @param severity Syslog severity.
+     */
+    void log(const String& line, Severity severity = SEVERITY_INFO);
+
+    uint32_t sent() const { return lines.load(std::memory_order_relaxed); }
+    uint32_t datagrams() const { return packets.load(std::memory_order_relaxed); }
+    uint32_t dropped() const { return drops.load(std::memory_order_relaxed); }
+
+  private:
+    struct Header {
+      uint32_t at;       // millis() when the line was logged
+      uint16_t length;
+      uint8_t severity;
+    };
+
+    static void taskMain(void* parameter);
+    void run();
+    bool pop(Header& header, char* text);
+    void copyIn(size_t offset, const void* data, size_t length);
+    void copyOut(size_t offset, void* data, size_t length) const;
+    size_t format(char* buffer, size_t size, const Header& header, const char* text, uint32_t now);
+    bool send(const char* datagram, size_t length);
+
+    TaskHandle_t task = nullptr;
+    AsyncUDP udp;
+    const char* hostname = "-";
+    std::atomic<bool> enabled{false};
+
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;  // Guards the ring and the collector
+    uint8_t ring[QUEUE_SIZE] = {};
+    size_t head = 0;  // Offset of the oldest line
+    size_t used = 0;
+    SyslogSettings collector = {};
+    bool reconfigure = false;
+
+    // Only used by the syslog task
+    IPAddress address;
+    uint16_t port = 0;
+    bool resolved = false;
+    uint32_t sequence = 0;
+    uint32_t reportedDrops = 0;
+
+    std::atomic<uint32_t> lines{0};
+    std::atomic<uint32_t> packets{0};
+    std::atomic<uint32_t> drops{0};
+};
+
+extern RemoteSyslog remoteSyslog;
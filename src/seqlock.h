@@ -0,0 +1,71 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <atomic>
+#include <string.h>
+#include <stdint.h>
+#include <type_traits>
+
+/**
+ * Single-writer sequence lock publishing a copy of T to any number of readers.
+ *
+ * The writer never waits. Readers retry while a write is in progress and always
+ * get a consistent copy, no reader can block the writer or another reader.
+ * The value is stored as atomic words, so a reader racing with the writer only
+ * sees a torn copy that it then discards.
+ *
+ * @tparam T Trivially copyable type to publish.
+ */
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+  public:
+    Seqlock() {
+      T empty{};
+      write(empty);
+    }
+
+    // Publishes a new value, must only be called by the single writer
+    void write(const T& value) {
+      uint32_t words[WORDS] = {};
+      memcpy(words, &value, sizeof(T));
+
+      uint32_t seq = sequence.load(std::memory_order_relaxed);
+      sequence.store(seq + 1, std::memory_order_relaxed);  // Odd: write in progress
+      std::atomic_thread_fence(std::memory_order_release);
+      for (size_t i = 0; i < WORDS; i++) data[i].store(words[i], std::memory_order_relaxed);
+      sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    // Returns a consistent copy of the last published value
+    T read() const {
+      uint32_t words[WORDS];
+      uint32_t before, after;
+      do {
+        before = sequence.load(std::memory_order_acquire);
+        for (size_t i = 0; i < WORDS; i++) words[i] = data[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+      } while ((before & 1) || before != after);
+
+      T value;
+      memcpy(&value, words, sizeof(T));
+      return value;
+    }
+
+    // Changes with every write, readers can use it to detect new values cheaply
+    uint32_t version() const { return sequence.load(std::memory_order_acquire) >> 1; }
+
+  private:
+    static constexpr size_t WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint32_t> data[WORDS];
+};
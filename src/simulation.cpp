@@ -0,0 +1,140 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#if defined(GENSET_NATIVE) && !defined(PIO_UNIT_TESTING)
+
+/**
+ * Cycles the generator for days of virtual time and reports what the control code did,
+ * the program of the native environment:
+ *
+ *   pio run -e native && .pio/build/native/program --days 28
+ *
+ * Every cycle holds the hardwired START for --run-minutes, releases it and pulses STOP
+ * for 2 seconds, then rests for --rest-minutes. The engine fires --crank-ms after K1
+ * closed and dies --coast-ms after K2 closed, every --fail-every-th attempt does not fire.
+ *
+ * Options:
+ *   --days N  --run-minutes N  --rest-minutes N  --crank-ms N  --coast-ms N
+ *   --fail-every N (0: never)  --verbose
+ */
+
+#include <chrono>
+#include <inttypes.h>
+#include "pins.h"
+#include "simulator.h"
+
+// Engine reacting to the relays, checked every 10 ms of virtual time unless the control code is idle
+struct Engine {
+  uint32_t crankMs = 1500;
+  uint32_t coastMs = 1000;
+  uint32_t failEvery = 0;
+
+  uint32_t attempts = 0;
+  uint32_t fired = 0;
+  uint64_t crankingSince = 0;  // us, 0 while K1 is open
+  uint64_t stoppingSince = 0;  // us, 0 while K2 is open
+  bool failing = false;
+
+  void follow() {
+    uint64_t now = hal::nowMicros64();
+    bool k1 = hal::readPin(RELAY_K1);
+    bool k2 = hal::readPin(RELAY_K2);
+    bool running = hal::readPin(RUNNING_SIGNAL);
+
+    if (k1 && crankingSince == 0) {
+      crankingSince = now;
+      attempts++;
+      failing = failEvery != 0 && attempts % failEvery == 0;
+    } else if (!k1) {
+      crankingSince = 0;
+    }
+    if (k2 && stoppingSince == 0) stoppingSince = now;
+    else if (!k2) stoppingSince = 0;
+
+    if (!running && crankingSince != 0 && !failing && now - crankingSince >= (uint64_t)crankMs * 1000) {
+      fired++;
+      simulator.setInput(RUNNING_SIGNAL, HIGH);
+    } else if (running && stoppingSince != 0 && now - stoppingSince >= (uint64_t)coastMs * 1000) {
+      simulator.setInput(RUNNING_SIGNAL, LOW);
+    }
+  }
+
+  // Runs the control code for the given time in ms while following the relays
+  void run(uint32_t ms) {
+    uint64_t until = hal::nowMicros64() + (uint64_t)ms * 1000;
+    while (hal::nowMicros64() < until) {
+      // Nothing to follow while the control code is idle
+      simulator.runUntil(min(until, max(simulator.idleUntil(), hal::nowMicros64() + 10000)));
+      follow();
+    }
+  }
+};
+
+static uint32_t eventCounts[WEBHOOK_EVENT_COUNT] = {};
+
+static void countEvent(WebhookEvent event, const String&) {
+  eventCounts[event]++;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s [--days N] [--run-minutes N] [--rest-minutes N] [--crank-ms N] [--coast-ms N]\n"
+          "          [--fail-every N] [--verbose]\n",
+          program);
+}
+
+int main(int argc, char** argv) {
+  uint32_t days = 7;
+  uint32_t runMinutes = 60;
+  uint32_t restMinutes = 180;
+  Engine engine;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (strcmp(arg, "--verbose") == 0) { simulator.verbose = true; continue; }
+    if (value == nullptr) { usage(argv[0]); return 2; }
+    if (strcmp(arg, "--days") == 0) days = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--run-minutes") == 0) runMinutes = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--rest-minutes") == 0) restMinutes = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--crank-ms") == 0) engine.crankMs = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--coast-ms") == 0) engine.coastMs = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--fail-every") == 0) engine.failEvery = strtoul(value, nullptr, 10);
+    else { usage(argv[0]); return 2; }
+    i++;
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  simulator.onEvent = countEvent;
+  simulator.begin();
+  simulator.run(1000);
+
+  uint64_t end = (uint64_t)days * 24 * 3600 * 1000000;
+  uint32_t cycles = 0;
+  while (hal::nowMicros64() < end) {
+    simulator.setInput(START_SIGNAL, HIGH);
+    engine.run(runMinutes * 60 * 1000);
+    simulator.setInput(START_SIGNAL, LOW);
+    engine.run(1000);
+    simulator.setInput(STOP_SIGNAL, HIGH);
+    engine.run(2000);
+    simulator.setInput(STOP_SIGNAL, LOW);
+    engine.run(restMinutes * 60 * 1000);
+    cycles++;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  printf("simulated %.1f days in %.2f s (%.0fx real time), %" PRIu64 " control loop iterations\n",
+         hal::nowMicros64() / 86400e6, seconds, hal::nowMicros64() / 1e6 / seconds, simulator.steps());
+  printf("cycles %u, crank attempts %u, fired %u\n", cycles, engine.attempts, engine.fired);
+  for (uint8_t i = 0; i < WEBHOOK_EVENT_COUNT; i++) {
+    if (eventCounts[i] != 0) printf("event %s: %u\n", webhookEventName((WebhookEvent)i), eventCounts[i]);
+  }
+  return 0;
+}
+
+#endif
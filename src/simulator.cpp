@@ -0,0 +1,97 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#ifdef GENSET_NATIVE
+
+#include "simulator.h"
+
+Simulator simulator;
+
+void logMessage(const String& message) {
+  if (!simulator.verbose) return;
+  uint64_t now = hal::nowMicros64();
+  printf("%10llu.%03llu %s\n", (unsigned long long)(now / 1000000), (unsigned long long)(now / 1000 % 1000), message.c_str());
+}
+
+void fireEvent(WebhookEvent event, const String& detail) {
+  if (simulator.onEvent != nullptr) simulator.onEvent(event, detail);
+}
+
+void Simulator::begin() {
+  setupControl();
+  startControl();
+  inputChangedAt = hal::nowMicros64();  // The first calls initialize the debouncing
+  step();
+}
+
+void Simulator::runUntil(uint64_t micros) {
+  for (;;) {
+    fastForward(micros);
+    uint64_t next = min(event_loop.nextDueMicros(), micros);
+    hal::advanceTo(next);
+    step();
+    if (next >= micros) return;
+  }
+}
+
+void Simulator::setInput(uint8_t pin, bool level) {
+  hal::setInput(pin, level);
+  inputChangedAt = hal::nowMicros64();
+  step();
+}
+
+uint32_t Simulator::queue(CommandType type, CommandSource source) {
+  uint32_t id = queueCommand({type, source, hal::nowMicros(), 0, 0});
+  step();
+  return id;
+}
+
+uint32_t Simulator::set(TraceSetting setting, uint32_t value) {
+  uint32_t id = queueSetting(setting, value, COMMAND_SOURCE_INTERNAL);
+  step();
+  return id;
+}
+
+void Simulator::takeOverSetting(TraceSetting setting, uint32_t value) {
+  switch (setting) {
+    case TRACE_SETTING_ALLOW_START: allowStart = value != 0; break;
+    case TRACE_SETTING_START_MODE: startMode = value; break;
+    case TRACE_SETTING_STOP_MODE: stopMode = value; break;
+    case TRACE_SETTING_RETRY_COUNT: retryCount = value; break;
+    case TRACE_SETTING_STOP_RETRY_COUNT: stopRetryCount = value; break;
+    case TRACE_SETTING_POWER_UP_DURATION: powerUpDuration = value; break;
+    case TRACE_SETTING_POWER_DOWN_DURATION: powerDownDuration = value; break;
+    case TRACE_SETTING_NO_START_TIMEOUT: noStartTimeout = value; break;
+    case TRACE_SETTING_STOP_CONFIRM_DURATION: stopConfirmDuration = value; break;
+    default: return;
+  }
+  gpioTrace.record(TRACE_SETTING, setting, value);
+}
+
+uint64_t Simulator::idleUntil() const {
+  uint64_t now = hal::nowMicros64();
+  if (generatorStarting || generatorStopping || runningSignalChanged || now - inputChangedAt < SETTLE_TIME) return now;
+  // A delayed callback, e.g. a retry, or an expiring intent handing over to a newer one may act
+  uint32_t expiry = arbiter.msUntilExpiry(hal::now());
+  return min(event_loop.nextDelayMicros(), expiry == UINT32_MAX ? UINT64_MAX : now + (uint64_t)expiry * 1000);
+}
+
+// Skips the repeated callbacks up to the given time if they have nothing to do until then
+void Simulator::fastForward(uint64_t micros) {
+  if (!skipIdle) return;
+  micros = min(micros, idleUntil());
+  if (micros > event_loop.nextDueMicros()) event_loop.fastForward(micros);
+}
+
+// One iteration of the control task
+void Simulator::step() {
+  tickControl();
+  publishStatus();
+  stepCount++;
+}
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include "control.h"
+
+/**
+ * Runs the control code of control.cpp on the host against the virtual clock and
+ * GPIO model of hal_native.h, only part of the native build (GENSET_NATIVE).
+ *
+ * The simulator takes the place of setup() and the control task. It does not tick
+ * through idle time, the clock jumps straight to the next due callback of the event
+ * loop. While the control code is idle (inputs settled, no relay engaged) the repeated
+ * callbacks have nothing to do and are skipped up to the next delayed callback, input
+ * change or intent expiry, so a simulated week takes well below a second.
+ * Between two steps the caller drives the inputs, queues commands and observes the
+ * relays through hal::readPin().
+ *
+ * The control code keeps its state in globals and static locals, there is one
+ * simulation per process.
+ */
+class Simulator {
+  public:
+    using EventObserver = void (*)(WebhookEvent event, const String& detail);
+
+    // Logs the control code with the virtual time to stdout
+    bool verbose = false;
+
+    // Called for every webhook event of the control code
+    EventObserver onEvent = nullptr;
+
+    // Skips the repeated callbacks while the control code is idle, see above
+    bool skipIdle = true;
+
+    /**
+     * Boots the control code like setup() at the current virtual time, with the default
+     * settings. The repeated callbacks start 150 ms later, after the inputs settled.
+     */
+    void begin();
+
+    // Runs the control loop until the virtual clock reached the given time in us
+    void runUntil(uint64_t micros);
+
+    // Runs the control loop for the given time in ms
+    void run(uint32_t ms) { runUntil(hal::nowMicros64() + (uint64_t)ms * 1000); }
+
+    // Drives an input pin and lets the control task react to the interrupt
+    void setInput(uint8_t pin, bool level);
+
+    /**
+     * Queues a command and lets the control task apply it.
+     *
+     * @return The ID of the command, or 0 if the queue is full.
+     */
+    uint32_t queue(CommandType type, CommandSource source);
+
+    // Changes a setting through the command queue, like the web UI
+    uint32_t set(TraceSetting setting, uint32_t value);
+
+    // Sets a setting without validation and without writing NVS, e.g. to replay a trace
+    void takeOverSetting(TraceSetting setting, uint32_t value);
+
+    /**
+     * Returns until when the control code is idle: the inputs settled and no relay is
+     * engaged, only an input change, a delayed callback or an expiring intent can make it
+     * act. The current time if it is not idle, UINT64_MAX if nothing is pending.
+     */
+    uint64_t idleUntil() const;
+
+    // Iterations of the control loop so far
+    uint64_t steps() const { return stepCount; }
+
+  private:
+    static constexpr uint64_t SETTLE_TIME = 250000;  // us after an input change, beyond debounce delay and polling
+
+    void step();
+    void fastForward(uint64_t micros);
+
+    uint64_t stepCount = 0;
+    uint64_t inputChangedAt = 0;
+};
+
+extern Simulator simulator;
@@ -0,0 +1,165 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "start_stats.h"
+#include "hal.h"
+
+void logMessage(const String& message);
+
+StartStats::Persisted StartStats::persisted;
+
+void StartStats::begin(const char* ns) {
+  nvsNamespace = ns;
+
+  hal::SettingsStore preferences;
+  if (!preferences.begin(nvsNamespace, false)) {
+    logMessage("[STATS] Unable to open NVS, start statistics are not persisted");
+    return;
+  }
+  bootCount = preferences.getUShort("bootCount", 0) + 1;
+  preferences.putUShort("bootCount", bootCount);
+
+  size_t length = preferences.getBytesLength("startStats");
+  if (length == sizeof(Persisted) && preferences.getBytes("startStats", &persisted, sizeof(Persisted)) == sizeof(Persisted)
+      && persisted.version == PERSISTED_VERSION) {
+    memcpy(recent.history, persisted.history, sizeof(recent.history));
+    recent.head = persisted.historyHead % HISTORY_SIZE;
+    recent.size = std::min<uint8_t>(persisted.historySize, HISTORY_SIZE);
+    published.write(recent);
+    for (uint8_t i = 0; i < RETRY_BUCKETS; i++) retries[i] = persisted.retries[i];
+    for (uint8_t i = 0; i < START_OUTCOME_COUNT; i++) outcomes[i] = persisted.outcomes[i];
+    latency.importState(persisted.latency);
+    crank.importState(persisted.crank);
+    timeToRun.importState(persisted.timeToRun);
+    logMessage("[STATS] Loaded " + String(latency.count()) + " start cycles from NVS");
+  } else if (length > 0) {
+    logMessage("[STATS] Ignoring incompatible start statistics in NVS");
+  }
+  preferences.end();
+}
+
+void StartStats::beginCycle(uint32_t latencyMs, unsigned long relayAt) {
+  if (active) return;  // Retries belong to the running cycle
+  active = true;
+  current = {};
+  current.bootCount = bootCount;
+  current.timeToRunMs = UINT16_MAX;
+  current.latencyMs = std::min<uint32_t>(latencyMs, UINT16_MAX);
+  latency.record(latencyMs);
+  firstRelayAt = relayAt;
+  crankTotal = 0;
+}
+
+void StartStats::addCrank(uint32_t crankMs) {
+  if (active) crankTotal += crankMs;
+}
+
+void StartStats::addRetry() {
+  if (active && current.retries < UINT8_MAX) current.retries++;
+}
+
+void StartStats::running(unsigned long now) {
+  if (!active) return;
+  uint32_t timeToRunMs = now - firstRelayAt;
+  current.timeToRunMs = std::min<uint32_t>(timeToRunMs, UINT16_MAX - 1);
+  timeToRun.record(timeToRunMs);
+  finish(START_OUTCOME_SUCCESS);
+}
+
+void StartStats::finish(StartOutcome outcome) {
+  if (!active) return;
+  active = false;
+
+  current.outcome = outcome;
+  current.uptime = hal::now() / 1000;
+  current.crankMs = std::min<uint32_t>(crankTotal, UINT16_MAX);
+  if (crankTotal > 0) crank.record(crankTotal);
+  retries[std::min<uint8_t>(current.retries, RETRY_BUCKETS - 1)]++;
+  outcomes[outcome]++;
+
+  recent.history[recent.head] = current;
+  recent.head = (recent.head + 1) % HISTORY_SIZE;
+  if (recent.size < HISTORY_SIZE) recent.size++;
+  published.write(recent);
+  dirty = true;
+}
+
+bool StartStats::save() {
+  if (!dirty || nvsNamespace == nullptr) return true;
+
+  persisted.version = PERSISTED_VERSION;
+  persisted.bootCount = bootCount;
+  persisted.historyHead = recent.head;
+  persisted.historySize = recent.size;
+  memcpy(persisted.history, recent.history, sizeof(recent.history));
+  for (uint8_t i = 0; i < RETRY_BUCKETS; i++) persisted.retries[i] = retries[i];
+  for (uint8_t i = 0; i < START_OUTCOME_COUNT; i++) persisted.outcomes[i] = outcomes[i];
+  latency.exportState(persisted.latency);
+  crank.exportState(persisted.crank);
+  timeToRun.exportState(persisted.timeToRun);
+
+  hal::SettingsStore preferences;
+  if (!preferences.begin(nvsNamespace, false)) return false;
+  bool success = preferences.putBytes("startStats", &persisted, sizeof(Persisted)) == sizeof(Persisted);
+  preferences.end();
+  if (success) {
+    dirty = false;
+    logMessage("[STATS] Start statistics saved to NVS");
+  }
+  return success;
+}
+
+void StartStats::reset() {
+  recent.head = 0;
+  recent.size = 0;
+  published.write(recent);
+  for (auto& value : retries) value = 0;
+  for (auto& value : outcomes) value = 0;
+  latency.reset();
+  crank.reset();
+  timeToRun.reset();
+
+  hal::SettingsStore preferences;
+  if (nvsNamespace != nullptr && preferences.begin(nvsNamespace, false)) {
+    preferences.remove("startStats");
+    preferences.end();
+  }
+  dirty = false;
+  logMessage("[STATS] Start statistics cleared");
+}
+
+void StartStats::toJson(JsonObject json) const {
+  json["bootCount"] = bootCount;
+
+  JsonObject outcome = json["outcomes"].to<JsonObject>();
+  outcome["success"] = outcomes[START_OUTCOME_SUCCESS].load();
+  outcome["failed"] = outcomes[START_OUTCOME_FAILED].load();
+  outcome["aborted"] = outcomes[START_OUTCOME_ABORTED].load();
+
+  JsonArray retryCounts = json["retries"].to<JsonArray>();
+  for (uint8_t i = 0; i < RETRY_BUCKETS; i++) retryCounts.add(retries[i].load());
+
+  latency.toJson(json["latencyMs"].to<JsonObject>());
+  crank.toJson(json["crankMs"].to<JsonObject>());
+  timeToRun.toJson(json["timeToRunMs"].to<JsonObject>());
+
+  // Most recent cycle first
+  Recent cycles = published.read();
+  JsonArray recentCycles = json["recent"].to<JsonArray>();
+  for (uint8_t i = 0; i < cycles.size; i++) {
+    const StartAttempt& attempt = cycles.history[(cycles.head + HISTORY_SIZE - 1 - i) % HISTORY_SIZE];
+    JsonObject entry = recentCycles.add<JsonObject>();
+    entry["boot"] = attempt.bootCount;
+    entry["uptime"] = attempt.uptime;
+    entry["latencyMs"] = attempt.latencyMs;
+    entry["crankMs"] = attempt.crankMs;
+    if (attempt.timeToRunMs != UINT16_MAX) entry["timeToRunMs"] = attempt.timeToRunMs;
+    entry["retries"] = attempt.retries;
+    entry["outcome"] = attempt.outcome == START_OUTCOME_SUCCESS ? "success"
+                     : attempt.outcome == START_OUTCOME_FAILED ? "failed" : "aborted";
+  }
+}
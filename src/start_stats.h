@@ -0,0 +1,124 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include "histogram.h"
+#include "seqlock.h"
+
+// Result of a start cycle (the first attempt and all of its retries)
+enum StartOutcome : uint8_t {
+  START_OUTCOME_SUCCESS = 0,  // RUNNING went HIGH
+  START_OUTCOME_FAILED = 1,   // No RUNNING signal after all retries
+  START_OUTCOME_ABORTED = 2,  // Stopped or disallowed before the generator was running
+  START_OUTCOME_COUNT
+};
+
+// Compact record of a single start cycle
+struct StartAttempt {
+  uint32_t uptime;       // Seconds since boot when the cycle ended
+  uint16_t bootCount;    // Boot the cycle belongs to
+  uint16_t latencyMs;    // START edge or web request to K1 closing
+  uint16_t crankMs;      // Total time K1 was closed over all attempts
+  uint16_t timeToRunMs;  // First K1 closing to RUNNING HIGH, 0xFFFF if it never came
+  uint8_t retries;       // Retries used
+  uint8_t outcome;       // StartOutcome
+};
+
+/**
+ * Records every start cycle and keeps rolling histograms of the latency, the
+ * cranking time and the time until the generator reports RUNNING.
+ *
+ * All methods except toJson() and outcomeCount() have to be called from the control loop.
+ * The counters and histograms are atomics and the ring of recent cycles is published
+ * through a Seqlock after every change, so toJson() can run in the web server task.
+ * The histograms and the recent cycles are persisted to NVS by save().
+ */
+class StartStats {
+  public:
+    static constexpr uint8_t HISTORY_SIZE = 32;
+    static constexpr uint8_t RETRY_BUCKETS = 11;  // 0..10 retries, the maximum retry count
+
+    /**
+     * Loads the persisted statistics and increments the boot counter.
+     *
+     * @param nvsNamespace The NVS namespace to use.
+     */
+    void begin(const char* nvsNamespace);
+
+    // A start cycle begins, relayAt is the millis() timestamp K1 was closed
+    void beginCycle(uint32_t latencyMs, unsigned long relayAt);
+    // K1 was open again after the given cranking time
+    void addCrank(uint32_t crankMs);
+    // Another attempt of the current cycle was made
+    void addRetry();
+    // RUNNING went HIGH, ends the cycle successfully
+    void running(unsigned long now);
+    // Ends the current cycle, does nothing if no cycle is active
+    void finish(StartOutcome outcome);
+
+    bool inCycle() const { return active; }
+
+    // Cycles that ended with the given outcome since the statistics were reset
+    const std::atomic<uint32_t>& outcomeCount(StartOutcome outcome) const { return outcomes[outcome]; }
+
+    /**
+     * Writes the statistics to NVS if they changed since the last call.
+     *
+     * @return true if nothing had to be written or the write succeeded.
+     */
+    bool save();
+
+    // Clears all statistics, RAM and NVS
+    void reset();
+
+    void toJson(JsonObject json) const;
+
+  private:
+    struct Persisted {
+      uint8_t version;
+      uint16_t bootCount;
+      uint8_t historyHead;
+      uint8_t historySize;
+      StartAttempt history[HISTORY_SIZE];
+      uint32_t retries[RETRY_BUCKETS];
+      uint32_t outcomes[START_OUTCOME_COUNT];
+      LogHistogram::State latency;
+      LogHistogram::State crank;
+      LogHistogram::State timeToRun;
+    };
+    static constexpr uint8_t PERSISTED_VERSION = 1;
+    static Persisted persisted;  // Too large for the stack, only used from the control loop
+
+    // Ring of the most recent cycles
+    struct Recent {
+      StartAttempt history[HISTORY_SIZE];
+      uint8_t head;  // Next slot to write
+      uint8_t size;
+    };
+
+    const char* nvsNamespace = nullptr;
+    bool dirty = false;
+    uint16_t bootCount = 0;
+
+    Recent recent = {};         // Only used by the control loop
+    Seqlock<Recent> published;  // Copy of recent for the readers
+    std::atomic<uint32_t> retries[RETRY_BUCKETS] = {};
+    std::atomic<uint32_t> outcomes[START_OUTCOME_COUNT] = {};
+    LogHistogram latency;
+    LogHistogram crank;
+    LogHistogram timeToRun;
+
+    // Current cycle
+    bool active = false;
+    StartAttempt current = {};
+    unsigned long firstRelayAt = 0;
+    uint32_t crankTotal = 0;
+};
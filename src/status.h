@@ -0,0 +1,55 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include "seqlock.h"
+
+/**
+ * Consistent view of the generator state and settings.
+ *
+ * Published by the control task through gensetStatus whenever something changed.
+ * Every reader (web UI, HTTP API, metrics, ...) takes a copy with gensetStatus.read()
+ * instead of reading the control globals one at a time.
+ */
+struct GensetStatus {
+  uint32_t changedAt;         // millis() of the last change
+  uint32_t lastCommandId;     // ID of the last applied queued command
+
+  // Signals and relays
+  bool running;
+  bool startSignal;
+  bool stopSignal;
+  bool relayK1;
+  bool relayK2;
+
+  // Control state
+  bool starting;
+  bool stopping;
+  bool allowStart;
+  uint8_t retryStartCount;
+  uint8_t retryStopCount;
+
+  // Settings
+  uint8_t startMode;
+  uint8_t stopMode;
+  uint8_t retryCount;
+  uint8_t stopRetryCount;
+  uint32_t powerUpDuration;
+  uint32_t powerDownDuration;
+  uint32_t noStartTimeout;
+  uint32_t stopConfirmDuration;
+
+  // Effective intent of all command sources, INTENT_NONE if there is none
+  uint8_t intentCommand;      // CommandType
+  uint8_t intentSource;       // CommandSource
+};
+
+const uint8_t INTENT_NONE = 0xFF;
+
+extern Seqlock<GensetStatus> gensetStatus;
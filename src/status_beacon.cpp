@@ -0,0 +1,48 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "status_beacon.h"
+
+StatusBeacon statusBeacon;
+
+static const uint32_t TASK_STACK_SIZE = 3072;
+static const UBaseType_t TASK_PRIORITY = 1;
+static const BaseType_t TASK_CORE = 0;  // Next to the network stack, away from the control task
+
+void StatusBeacon::begin(const IPAddress& multicastGroup, uint16_t multicastPort, Fill fillPacket) {
+  group = multicastGroup;
+  port = multicastPort;
+  fill = fillPacket;
+  xTaskCreatePinnedToCore(taskMain, "beacon", TASK_STACK_SIZE, this, TASK_PRIORITY, &task, TASK_CORE);
+}
+
+void StatusBeacon::taskMain(void* parameter) {
+  static_cast<StatusBeacon*>(parameter)->run();
+}
+
+void StatusBeacon::run() {
+  for (;;) {
+    // Woken up by notify(), or after the heartbeat interval without change
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HEARTBEAT_INTERVAL));
+    bool change = changed.exchange(false, std::memory_order_relaxed);
+
+    StatusBeaconPacket packet = {};
+    fill(packet);
+    memcpy(packet.magic, "GSTB", sizeof(packet.magic));
+    packet.version = STATUS_BEACON_VERSION;
+    packet.reason = change ? STATUS_BEACON_CHANGE : STATUS_BEACON_HEARTBEAT;
+    packet.sequence = sequence.load(std::memory_order_relaxed);
+    // Fails while WiFi is down, the next change or heartbeat sends the current state again
+    if (udp.writeTo((const uint8_t*)&packet, sizeof(packet), group, port) == sizeof(packet)) {
+      sequence.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      failures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(MIN_SPACING));
+  }
+}
@@ -0,0 +1,63 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncUDP.h>
+#include <atomic>
+#include "status_beacon_format.h"
+
+/**
+ * Multicasts a StatusBeaconPacket whenever the state changes and as a heartbeat.
+ *
+ * Any number of displays can follow the generator by joining the group, without a
+ * connection or request each. The control task only calls notify(), a small task on
+ * core 0 fills and sends the datagram, so changes arriving while a datagram is sent
+ * are coalesced into the next one. Datagrams are at least MIN_SPACING apart.
+ */
+class StatusBeacon {
+  public:
+    static constexpr uint32_t HEARTBEAT_INTERVAL = 10000;  // ms without change until a datagram is repeated
+    static constexpr uint32_t MIN_SPACING = 50;            // ms between two datagrams
+
+    // Fills everything of a packet besides the header, called in the beacon task
+    using Fill = void (*)(StatusBeaconPacket& packet);
+
+    /**
+     * Starts the beacon task.
+     *
+     * @param group Multicast group to send to.
+     * @param port UDP port of the listeners.
+     * @param fill Fills the state into a packet.
+     */
+    void begin(const IPAddress& group, uint16_t port, Fill fill);
+
+    // Requests a datagram for a state change, cheap enough for the control task
+    void notify() {
+      changed.store(true, std::memory_order_relaxed);
+      if (task) xTaskNotifyGive(task);
+    }
+
+    uint32_t sent() const { return sequence.load(std::memory_order_relaxed); }
+    uint32_t failed() const { return failures.load(std::memory_order_relaxed); }
+
+  private:
+    static void taskMain(void* parameter);
+    void run();
+
+    TaskHandle_t task = nullptr;
+    AsyncUDP udp;
+    IPAddress group;
+    uint16_t port = 0;
+    Fill fill = nullptr;
+    std::atomic<bool> changed{false};
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint32_t> failures{0};
+};
+
+extern StatusBeacon statusBeacon;
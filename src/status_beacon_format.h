@@ -0,0 +1,61 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Datagram of the UDP status beacon, shared by the firmware and tools/beacon_listen.cpp.
+ *
+ * Every datagram is one StatusBeaconPacket, all values little endian. The layout only
+ * grows at the end, listeners accept longer datagrams of the same version and ignore the
+ * rest. Bump STATUS_BEACON_VERSION on every incompatible change.
+ */
+
+const uint8_t STATUS_BEACON_VERSION = 1;
+
+// Why a datagram was sent
+enum StatusBeaconReason : uint8_t {
+  STATUS_BEACON_HEARTBEAT = 0,  // Nothing changed since the last datagram
+  STATUS_BEACON_CHANGE = 1,     // The generator state or a setting changed
+};
+
+// StatusBeaconPacket::flags
+const uint16_t STATUS_BEACON_RUNNING = 0x0001;
+const uint16_t STATUS_BEACON_START_SIGNAL = 0x0002;
+const uint16_t STATUS_BEACON_STOP_SIGNAL = 0x0004;
+const uint16_t STATUS_BEACON_RELAY_K1 = 0x0008;
+const uint16_t STATUS_BEACON_RELAY_K2 = 0x0010;
+const uint16_t STATUS_BEACON_STARTING = 0x0020;
+const uint16_t STATUS_BEACON_STOPPING = 0x0040;
+const uint16_t STATUS_BEACON_ALLOW_START = 0x0080;
+
+const uint8_t STATUS_BEACON_TELEMETRY = 8;
+
+struct __attribute__((packed)) StatusBeaconPacket {
+  char magic[4];            // "GSTB"
+  uint8_t version;          // STATUS_BEACON_VERSION
+  uint8_t reason;           // StatusBeaconReason
+  uint16_t flags;           // STATUS_BEACON_* bits
+  uint32_t sequence;        // Incremented for every datagram, gaps are lost datagrams
+  uint32_t uptime;          // s since boot
+  uint32_t changedAgo;      // ms since the last state change
+  uint8_t retryStartCount;
+  uint8_t retryStopCount;
+  uint8_t intentCommand;    // CommandType, 0xFF if there is no intent
+  uint8_t intentSource;     // CommandSource, 0xFF if there is no intent
+  uint8_t startMode;
+  uint8_t stopMode;
+  uint8_t retryCount;
+  uint8_t stopRetryCount;
+  uint8_t telemetryCount;   // Polled registers in telemetry, in the order of the register map
+  uint8_t telemetryFresh;   // Bit per register, set if it was read within two periods
+  uint16_t reserved;
+  uint16_t telemetry[STATUS_BEACON_TELEMETRY];
+};
+static_assert(sizeof(StatusBeaconPacket) == 48, "status beacon layout");
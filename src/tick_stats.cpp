@@ -0,0 +1,106 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "tick_stats.h"
+#include "hal.h"
+#include "perf_trace.h"
+
+void logMessage(const String& message);
+
+void TickStats::begin() {
+  cyclesPerMicro = ESP.getCpuFreqMHz();
+}
+
+reactesp::RepeatEvent* TickStats::onRepeat(reactesp::EventLoop& eventLoop, uint32_t interval, const char* name,
+                                           std::function<void()> callback) {
+  CallbackStats* stats = add(name, false, interval);
+  if (stats == nullptr) return eventLoop.onRepeat(interval, callback);
+  stats->lastRunAt = hal::nowMicros();
+
+  return eventLoop.onRepeat(interval, [this, stats, callback]() {
+    uint32_t now = hal::nowMicros();
+    uint32_t late = now - stats->lastRunAt;
+    late = late > stats->interval * 1000 ? late - stats->interval * 1000 : 0;
+    stats->lastRunAt = now;
+    measure(stats, late, callback);
+  });
+}
+
+reactesp::DelayEvent* TickStats::onDelay(reactesp::EventLoop& eventLoop, uint32_t delay, const char* name,
+                                         std::function<void()> callback) {
+  CallbackStats* stats = add(name, true, delay);
+  if (stats == nullptr) return eventLoop.onDelay(delay, callback);
+  stats->interval = delay;
+  uint32_t dueAt = hal::nowMicros() + delay * 1000;
+
+  return eventLoop.onDelay(delay, [this, stats, dueAt, callback]() {
+    int32_t late = hal::nowMicros() - dueAt;
+    measure(stats, late > 0 ? late : 0, callback);
+  });
+}
+
+// Returns the statistics of a callback, delayed callbacks of the same name share them
+TickStats::CallbackStats* TickStats::add(const char* name, bool delayed, uint32_t interval) {
+  for (uint8_t i = 0; delayed && i < callbackCount; i++) {
+    if (callbacks[i].delayed && strcmp(callbacks[i].name, name) == 0) return &callbacks[i];
+  }
+  if (callbackCount >= MAX_CALLBACKS) {
+    logMessage("[TICK] Too many instrumented callbacks, not measuring " + String(name));
+    return nullptr;
+  }
+  CallbackStats* stats = &callbacks[callbackCount++];
+  stats->name = name;
+  stats->delayed = delayed;
+  stats->interval = interval;
+  return stats;
+}
+
+void TickStats::measure(CallbackStats* stats, uint32_t late, const std::function<void()>& callback) {
+  lateness.record(late);
+  if (late > stats->maxLateness.load(std::memory_order_relaxed)) stats->maxLateness.store(late, std::memory_order_relaxed);
+
+  uint32_t start = ESP.getCycleCount();
+  {
+    PERF_SCOPE(stats->name);
+    callback();
+  }
+  uint32_t duration = (ESP.getCycleCount() - start) / cyclesPerMicro;
+  if (duration > stats->maxDuration.load(std::memory_order_relaxed)) stats->maxDuration.store(duration, std::memory_order_relaxed);
+  stats->calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TickStats::applyReset() {
+  resetRequested.store(false, std::memory_order_relaxed);
+  tickTime.reset();
+  lateness.reset();
+  for (uint8_t i = 0; i < callbackCount; i++) {
+    callbacks[i].calls.store(0, std::memory_order_relaxed);
+    callbacks[i].maxDuration.store(0, std::memory_order_relaxed);
+    callbacks[i].maxLateness.store(0, std::memory_order_relaxed);
+  }
+}
+
+void TickStats::toJson(JsonObject json) const {
+  tickTime.toJson(json["tickUs"].to<JsonObject>());
+  lateness.toJson(json["latenessUs"].to<JsonObject>());
+
+  const CallbackStats* worst = nullptr;
+  JsonArray list = json["callbacks"].to<JsonArray>();
+  for (uint8_t i = 0; i < callbackCount; i++) {
+    const CallbackStats& stats = callbacks[i];
+    JsonObject entry = list.add<JsonObject>();
+    entry["name"] = stats.name;
+    entry[stats.delayed ? "delayMs" : "intervalMs"] = stats.interval;
+    entry["calls"] = stats.calls.load(std::memory_order_relaxed);
+    entry["maxUs"] = stats.maxDuration.load(std::memory_order_relaxed);
+    entry["maxLateUs"] = stats.maxLateness.load(std::memory_order_relaxed);
+    if (worst == nullptr || stats.maxDuration.load(std::memory_order_relaxed) > worst->maxDuration.load(std::memory_order_relaxed)) {
+      worst = &stats;
+    }
+  }
+  if (worst != nullptr) json["worst"] = worst->name;
+}
@@ -0,0 +1,93 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ReactESP.h>
+#include <atomic>
+#include "histogram.h"
+
+/**
+ * Measures the duration of every event loop tick and of every instrumented
+ * callback using the CPU cycle counter, and how late timed callbacks fire.
+ *
+ * beginTick(), endTick() and the callbacks run in the control loop, which is the
+ * only writer. Readers may render the statistics at any time, a reset is only
+ * requested and applied by the writer on the next tick.
+ */
+class TickStats {
+  public:
+    static constexpr uint8_t MAX_CALLBACKS = 16;
+
+    // Statistics of one instrumented callback, delayed callbacks share them by name
+    struct CallbackStats {
+      const char* name = nullptr;
+      bool delayed = false;           // Registered with onDelay()
+      uint32_t interval = 0;          // ms, the last delay of delayed callbacks
+      uint32_t lastRunAt = 0;         // micros() of the last call of repeated callbacks
+      std::atomic<uint32_t> calls{0};
+      std::atomic<uint32_t> maxDuration{0};  // us
+      std::atomic<uint32_t> maxLateness{0};  // us
+    };
+
+    void begin();
+
+    /**
+     * Registers a repeated callback like EventLoop::onRepeat() but measures
+     * its duration and how late it fires compared to its interval.
+     *
+     * @param eventLoop The event loop to register the callback with.
+     * @param interval The interval in milliseconds.
+     * @param name Name of the callback, must be a string literal.
+     * @param callback The callback.
+     */
+    reactesp::RepeatEvent* onRepeat(reactesp::EventLoop& eventLoop, uint32_t interval, const char* name,
+                                    std::function<void()> callback);
+
+    /**
+     * Schedules a callback like EventLoop::onDelay() but measures its duration
+     * and how late it fires compared to its delay. All callbacks scheduled with
+     * the same name are counted together.
+     *
+     * @param eventLoop The event loop to schedule the callback with.
+     * @param delay The delay in milliseconds.
+     * @param name Name of the callback, must be a string literal.
+     * @param callback The callback.
+     */
+    reactesp::DelayEvent* onDelay(reactesp::EventLoop& eventLoop, uint32_t delay, const char* name,
+                                  std::function<void()> callback);
+
+    inline void beginTick() {
+      tickStart = ESP.getCycleCount();
+    }
+
+    inline void endTick() {
+      tickTime.record((ESP.getCycleCount() - tickStart) / cyclesPerMicro);
+      if (resetRequested.load(std::memory_order_acquire)) applyReset();
+    }
+
+    // Clears all statistics on the next tick
+    void requestReset() { resetRequested.store(true, std::memory_order_release); }
+
+    void toJson(JsonObject json) const;
+
+    LogHistogram tickTime;   // Duration of a whole tick in us
+    LogHistogram lateness;   // How late repeated and delayed callbacks fired in us
+
+  private:
+    CallbackStats* add(const char* name, bool delayed, uint32_t interval);
+    void measure(CallbackStats* stats, uint32_t late, const std::function<void()>& callback);
+    void applyReset();
+
+    uint32_t cyclesPerMicro = 240;
+    uint32_t tickStart = 0;
+    std::atomic<bool> resetRequested{false};
+    CallbackStats callbacks[MAX_CALLBACKS];
+    uint8_t callbackCount = 0;
+};
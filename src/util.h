@@ -0,0 +1,61 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Whether a millis() or micros() time stamp has been reached, correct across the wrap
+inline bool reached(uint32_t now, uint32_t at) {
+  return (int32_t)(now - at) >= 0;
+}
+
+/**
+ * Base of the exports that render a large response in small fragments, so the web server
+ * can stream it with a chunked response instead of holding all of it in RAM.
+ *
+ * renderNext() renders the next fragment into pending and sets pendingLength and
+ * pendingOffset, read() hands the fragments out in pieces of any size.
+ *
+ * @tparam SIZE Size of the largest fragment.
+ */
+template <size_t SIZE>
+class ChunkedExport {
+  public:
+    virtual ~ChunkedExport() = default;
+
+    /**
+     * Renders the next part of the export.
+     *
+     * @param buffer Receives the data.
+     * @param maxLength Size of the buffer.
+     * @return Number of bytes written, 0 when the export is complete.
+     */
+    size_t read(uint8_t* buffer, size_t maxLength) {
+      size_t written = 0;
+      while (written < maxLength) {
+        if (pendingOffset == pendingLength) {
+          if (!renderNext()) break;
+        }
+        size_t length = pendingLength - pendingOffset < maxLength - written ? pendingLength - pendingOffset : maxLength - written;
+        memcpy(buffer + written, pending + pendingOffset, length);
+        pendingOffset += length;
+        written += length;
+      }
+      return written;
+    }
+
+  protected:
+    // Renders the next fragment into pending, returns false once everything was rendered
+    virtual bool renderNext() = 0;
+
+    char pending[SIZE];
+    size_t pendingLength = 0;
+    size_t pendingOffset = 0;
+};
@@ -0,0 +1,31 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <stdint.h>
+
+// Transitions that fire a webhook, the value is the bit in WebhookSettings::events
+enum WebhookEvent : uint8_t {
+  WEBHOOK_STARTED = 0,       // RUNNING went HIGH
+  WEBHOOK_START_FAILED = 1,  // No RUNNING signal after the last start retry
+  WEBHOOK_STOPPED = 2,       // RUNNING went LOW
+  WEBHOOK_FAULT = 3,         // The generator did not stop
+  WEBHOOK_TEST = 4,          // Requested via /testWebhook
+  WEBHOOK_EVENT_COUNT
+};
+
+inline const char* webhookEventName(WebhookEvent event) {
+  switch (event) {
+    case WEBHOOK_STARTED: return "started";
+    case WEBHOOK_START_FAILED: return "start_failed";
+    case WEBHOOK_STOPPED: return "stopped";
+    case WEBHOOK_FAULT: return "fault";
+    case WEBHOOK_TEST: return "test";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,301 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include "webhooks.h"
+#include "util.h"
+
+void logMessage(const String& message);
+
+Webhooks webhooks;
+
+static const uint32_t TASK_STACK_SIZE = 4096;
+static const UBaseType_t TASK_PRIORITY = 1;
+static const BaseType_t TASK_CORE = 0;  // Next to async_tcp, away from the control task
+
+// Copies text into a JSON string literal without the quotes
+static void escapeJson(const char* text, char* buffer, size_t size) {
+  size_t length = 0;
+  for (; *text && length + 2 < size; text++) {
+    if (*text == '"' || *text == '\\') buffer[length++] = '\\';
+    buffer[length++] = (uint8_t)*text < ' ' ? ' ' : *text;
+  }
+  buffer[length] = '\0';
+}
+
+bool Webhooks::parseUrl(const char* url, char* host, size_t hostSize, uint16_t& port, char* path, size_t pathSize) {
+  static const char SCHEME[] = "http://";
+  if (strncasecmp(url, SCHEME, sizeof(SCHEME) - 1) != 0) return false;
+  const char* start = url + sizeof(SCHEME) - 1;
+  const char* end = start + strcspn(start, ":/");
+  if (end == start || (size_t)(end - start) >= hostSize) return false;
+  memcpy(host, start, end - start);
+  host[end - start] = '\0';
+
+  port = 80;
+  if (*end == ':') {
+    char* digitsEnd;
+    unsigned long value = strtoul(end + 1, &digitsEnd, 10);
+    if (digitsEnd == end + 1 || value < 1 || value > 65535 || (*digitsEnd != '\0' && *digitsEnd != '/')) return false;
+    port = value;
+    end = digitsEnd;
+  }
+  return strlcpy(path, *end ? end : "/", pathSize) < pathSize;
+}
+
+void Webhooks::begin(const char* device) {
+  deviceName = device;
+  client.setNoDelay(true);
+  client.onConnect([](void* arg, AsyncClient*) {
+    Webhooks* self = static_cast<Webhooks*>(arg);
+    State expected = STATE_CONNECTING;
+    self->state.compare_exchange_strong(expected, STATE_CONNECTED, std::memory_order_relaxed);
+    self->notify();
+  }, this);
+  client.onDisconnect([](void* arg, AsyncClient*) { static_cast<Webhooks*>(arg)->closed(); }, this);
+  client.onError([](void* arg, AsyncClient*, int8_t) { static_cast<Webhooks*>(arg)->closed(); }, this);
+  client.onData([](void* arg, AsyncClient*, void* data, size_t length) {
+    static_cast<Webhooks*>(arg)->receive(static_cast<const uint8_t*>(data), length);
+  }, this);
+  xTaskCreatePinnedToCore(taskMain, "webhook", TASK_STACK_SIZE, this, TASK_PRIORITY, &task, TASK_CORE);
+}
+
+void Webhooks::configure(const WebhookSettings& newSettings) {
+  portENTER_CRITICAL(&lock);
+  settings = newSettings;
+  reconfigure = true;
+  if (settings.url[0] == '\0') queueCount = 0;  // Nowhere to send them anymore
+  portEXIT_CRITICAL(&lock);
+  notify();
+}
+
+void Webhooks::fire(WebhookEvent event, const char* message) {
+  Entry entry = {};
+  entry.event = event;
+  entry.count = 1;
+  entry.uptime = esp_timer_get_time() / 1000000;
+  entry.nextAttemptAt = millis();
+  strlcpy(entry.message, message, sizeof(entry.message));
+
+  portENTER_CRITICAL(&lock);
+  // The test event ignores the event selection, it checks the endpoint
+  if (settings.url[0] == '\0' || (event != WEBHOOK_TEST && !(settings.events & (1 << event)))) {
+    portEXIT_CRITICAL(&lock);
+    return;
+  }
+  // Merge into the same event if it still waits, the attempt in progress is left alone
+  for (uint8_t i = 0; i < queueCount; i++) {
+    Entry& queued = queue[i];
+    if (queued.event == event && queued.id != sendingId) {
+      if (queued.count < UINT16_MAX) queued.count++;
+      queued.uptime = entry.uptime;
+      memcpy(queued.message, entry.message, sizeof(entry.message));
+      // A failed entry becomes a new event: not a retry the receiver may ignore, sent without backoff
+      if (queued.attempts > 0) {
+        queued.id = nextId++;
+        queued.attempts = 0;
+        queued.nextAttemptAt = entry.nextAttemptAt;
+      }
+      portEXIT_CRITICAL(&lock);
+      notify();
+      return;
+    }
+  }
+  entry.id = nextId++;
+  queue[queueCount++] = entry;
+  portEXIT_CRITICAL(&lock);
+  notify();
+}
+
+uint8_t Webhooks::queued() const {
+  portENTER_CRITICAL(&lock);
+  uint8_t count = queueCount;
+  portEXIT_CRITICAL(&lock);
+  return count;
+}
+
+void Webhooks::taskMain(void* parameter) {
+  static_cast<Webhooks*>(parameter)->run();
+}
+
+void Webhooks::run() {
+  for (;;) {
+    uint32_t wait = maintain(millis());
+    ulTaskNotifyTake(pdTRUE, wait == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait) + 1);
+  }
+}
+
+// Drives the current attempt or starts the next one, returns ms until it has to be called again
+uint32_t Webhooks::maintain(uint32_t now) {
+  portENTER_CRITICAL(&lock);
+  bool changed = reconfigure;
+  reconfigure = false;
+  WebhookSettings copy = settings;
+  portEXIT_CRITICAL(&lock);
+
+  State current = state.load(std::memory_order_relaxed);
+  if (changed) {
+    valid = parseUrl(copy.url, host, sizeof(host), port, path, sizeof(path));
+    if (current != STATE_IDLE && current != STATE_CLOSED) {
+      client.close(true);
+      return 10;
+    }
+  }
+
+  switch (current) {
+    case STATE_IDLE: {
+      if (!valid) return UINT32_MAX;  // Disabled, wait for configure()
+
+      // The first event that is due, or the time until one will be
+      uint32_t wait = UINT32_MAX;
+      portENTER_CRITICAL(&lock);
+      for (uint8_t i = 0; i < queueCount && sendingId == 0; i++) {
+        if (reached(now, queue[i].nextAttemptAt)) sendingId = queue[i].id;
+        else wait = min(wait, queue[i].nextAttemptAt - now);
+      }
+      bool due = sendingId != 0;
+      portEXIT_CRITICAL(&lock);
+      if (!due) return wait;
+
+      statusLength = 0;
+      responseStatus.store(0, std::memory_order_relaxed);
+      attemptAt = now;
+      state.store(STATE_CONNECTING, std::memory_order_relaxed);
+      if (!client.connect(host, port)) state.store(STATE_CLOSED, std::memory_order_relaxed);
+      return 0;
+    }
+
+    case STATE_CONNECTED: {
+      Entry entry;
+      bool found = false;
+      portENTER_CRITICAL(&lock);
+      for (uint8_t i = 0; i < queueCount && !found; i++) {
+        if (queue[i].id == sendingId) {
+          entry = queue[i];
+          found = true;
+        }
+      }
+      portEXIT_CRITICAL(&lock);
+
+      char request[512];
+      size_t length = found ? renderRequest(request, sizeof(request), entry) : 0;
+      state.store(STATE_WAIT_RESPONSE, std::memory_order_relaxed);
+      if (length == 0 || client.space() < length || client.add(request, length) != length) {
+        client.close(true);
+        return 10;
+      }
+      client.send();
+      return REQUEST_TIMEOUT;
+    }
+
+    case STATE_CONNECTING:
+    case STATE_WAIT_RESPONSE:
+      // The status line is all we need, the rest of the response is not waited for
+      if (responseStatus.load(std::memory_order_relaxed) != 0 || reached(now, attemptAt + REQUEST_TIMEOUT)) {
+        client.close(true);
+        // Nothing to close while the host name is still resolved
+        State expected = current;
+        state.compare_exchange_strong(expected, STATE_CLOSED, std::memory_order_relaxed);
+        return 0;
+      }
+      return attemptAt + REQUEST_TIMEOUT - now;
+
+    case STATE_CLOSED:
+      finishAttempt(now);
+      return 0;
+  }
+  return 0;
+}
+
+// Removes a delivered event, or schedules its retry
+void Webhooks::finishAttempt(uint32_t now) {
+  int16_t status = responseStatus.load(std::memory_order_relaxed);
+  bool success = status >= 200 && status < 300;
+  lastResult.store(status == 0 ? -1 : status, std::memory_order_relaxed);
+
+  Entry entry;
+  bool found = false;
+  bool remove = false;
+  portENTER_CRITICAL(&lock);
+  for (uint8_t i = 0; i < queueCount && !found; i++) {
+    if (queue[i].id != sendingId) continue;
+    found = true;
+    queue[i].attempts++;
+    remove = success || queue[i].attempts >= MAX_ATTEMPTS;
+    if (!remove) queue[i].nextAttemptAt = now + min(MIN_RETRY_DELAY << (queue[i].attempts - 1), MAX_RETRY_DELAY);
+    entry = queue[i];
+    if (remove) {
+      memmove(&queue[i], &queue[i + 1], (queueCount - i - 1) * sizeof(Entry));
+      queueCount--;
+    }
+  }
+  sendingId = 0;
+  portEXIT_CRITICAL(&lock);
+  state.store(STATE_IDLE, std::memory_order_relaxed);
+  if (!found) return;  // Cleared by configure() meanwhile
+
+  String result = status == 0 ? String("endpoint unreachable") : "HTTP " + String(status);
+  if (success) {
+    deliveries.fetch_add(1, std::memory_order_relaxed);
+  } else if (remove) {
+    failures.fetch_add(1, std::memory_order_relaxed);
+    logMessage("[WEBHOOK] Giving up on '" + String(webhookEventName(entry.event)) + "' after " + String(entry.attempts) +
+               " attempts (" + result + ")");
+  } else if (entry.attempts == 1) {
+    logMessage("[WEBHOOK] Sending '" + String(webhookEventName(entry.event)) + "' failed (" + result + "), retrying");
+  }
+}
+
+size_t Webhooks::renderRequest(char* buffer, size_t size, const Entry& entry) {
+  char message[2 * sizeof(Entry::message)];
+  escapeJson(entry.message, message, sizeof(message));
+  char body[320];
+  int bodyLength = snprintf(body, sizeof(body),
+                            "{\"event\":\"%s\",\"id\":%u,\"device\":\"%s\",\"uptime\":%u,\"count\":%u,\"attempt\":%u,\"message\":\"%s\"}",
+                            webhookEventName(entry.event), (unsigned)entry.id, deviceName, (unsigned)entry.uptime,
+                            entry.count, entry.attempts + 1, message);
+  if (bodyLength < 0 || (size_t)bodyLength >= sizeof(body)) return 0;
+
+  char hostHeader[sizeof(host) + 6];
+  if (port == 80) strlcpy(hostHeader, host, sizeof(hostHeader));
+  else snprintf(hostHeader, sizeof(hostHeader), "%s:%u", host, port);
+  int length = snprintf(buffer, size,
+                        "POST %s HTTP/1.1\r\n"
+                        "Host: %s\r\n"
+                        "User-Agent: genset-control\r\n"
+                        "Content-Type: application/json\r\n"
+                        "Content-Length: %d\r\n"
+                        "X-Genset-Event-Id: %u\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "%s",
+                        path, hostHeader, bodyLength, (unsigned)entry.id, body);
+  return length < 0 || (size_t)length >= size ? 0 : length;
+}
+
+// Called in the AsyncTCP task, only the status code of the response is evaluated
+void Webhooks::receive(const uint8_t* data, size_t length) {
+  if (responseStatus.load(std::memory_order_relaxed) != 0) return;
+  size_t take = min(length, sizeof(statusLine) - 1 - statusLength);
+  memcpy(statusLine + statusLength, data, take);
+  statusLength += take;
+  if (statusLength < sizeof(statusLine) - 1) return;
+
+  // "HTTP/1.1 200"
+  statusLine[statusLength] = '\0';
+  int status = strncmp(statusLine, "HTTP/1.", 7) == 0 ? atoi(statusLine + 9) : 0;
+  responseStatus.store(status >= 100 && status <= 999 ? status : 999, std::memory_order_relaxed);
+  notify();
+}
+
+// Called in the AsyncTCP task when the connection ended or could not be established
+void Webhooks::closed() {
+  State current = state.load(std::memory_order_relaxed);
+  while ((current == STATE_CONNECTING || current == STATE_CONNECTED || current == STATE_WAIT_RESPONSE)
+         && !state.compare_exchange_weak(current, STATE_CLOSED, std::memory_order_relaxed)) {
+  }
+  notify();
+}
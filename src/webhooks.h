@@ -0,0 +1,145 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <atomic>
+#include "webhook_event.h"
+
+// Webhook endpoint, persisted in NVS
+struct WebhookSettings {
+  char url[128];   // http://host[:port]/path, empty disables webhooks
+  uint8_t events;  // Bit per WebhookEvent
+};
+
+/**
+ * Posts state transitions as JSON to a HTTP endpoint.
+ *
+ * fire() only puts the event into a bounded queue and wakes up the webhook task, so
+ * the control task never waits for the network. The task on core 0 sends the events
+ * one at a time over a single connection, a dead endpoint therefore holds at most one
+ * socket. A failed event is retried with exponential backoff and dropped after
+ * MAX_ATTEMPTS; events that became due are sent in queue order, a new event does not
+ * wait for the backoff of an older one.
+ *
+ * An event that fires again while the same event is still waiting in the queue is
+ * merged into it, its count tells how often it happened. This also bounds the queue, a
+ * flapping RUNNING signal cannot fill it. If the waiting entry already failed, the merge
+ * turns it into a new event with a new id that is sent right away. Every event carries an id
+ * (in the body and the X-Genset-Event-Id header), a receiver can use it to ignore a
+ * retry of an event it already got but could not acknowledge in time.
+ *
+ * Only plain http:// is supported.
+ */
+class Webhooks {
+  public:
+    static constexpr uint8_t QUEUE_CAPACITY = 8;
+    static constexpr uint8_t MAX_ATTEMPTS = 8;
+    static constexpr uint32_t MIN_RETRY_DELAY = 1000;    // ms, doubled after every failed attempt
+    static constexpr uint32_t MAX_RETRY_DELAY = 60000;   // ms
+    static constexpr uint32_t REQUEST_TIMEOUT = 5000;    // ms for connecting and the response status line
+    static constexpr uint8_t ALL_EVENTS = (1 << WEBHOOK_EVENT_COUNT) - 1;
+
+    /**
+     * Splits a webhook URL into its parts.
+     *
+     * @param url The URL, only http:// is accepted.
+     * @param host Receives the host name or address.
+     * @param hostSize Size of host.
+     * @param port Receives the port, 80 if the URL has none.
+     * @param path Receives the path including the query, "/" if the URL has none.
+     * @param pathSize Size of path.
+     * @return false if the URL is invalid or does not fit.
+     */
+    static bool parseUrl(const char* url, char* host, size_t hostSize, uint16_t& port, char* path, size_t pathSize);
+
+    /**
+     * Starts the webhook task.
+     *
+     * @param device Device name sent with every event, must stay valid.
+     */
+    void begin(const char* device);
+
+    // Replaces the endpoint, can be called from any task
+    void configure(const WebhookSettings& settings);
+
+    /**
+     * Queues an event, cheap enough for the control task.
+     *
+     * @param event The transition.
+     * @param message Human readable details, truncated to 63 characters.
+     */
+    void fire(WebhookEvent event, const char* message);
+
+    uint8_t queued() const;
+    uint32_t delivered() const { return deliveries.load(std::memory_order_relaxed); }
+    uint32_t failed() const { return failures.load(std::memory_order_relaxed); }
+    int16_t lastStatus() const { return lastResult.load(std::memory_order_relaxed); }
+
+  private:
+    enum State : uint8_t {
+      STATE_IDLE,
+      STATE_CONNECTING,     // Waiting for TCP
+      STATE_CONNECTED,      // Request not sent yet
+      STATE_WAIT_RESPONSE,
+      STATE_CLOSED,         // The connection ended, the attempt has to be evaluated
+    };
+
+    struct Entry {
+      uint32_t id;
+      WebhookEvent event;
+      uint8_t attempts;
+      uint16_t count;           // Occurrences merged into this entry
+      uint32_t uptime;          // s since boot of the last occurrence
+      uint32_t nextAttemptAt;   // millis()
+      char message[64];
+    };
+
+    static void taskMain(void* parameter);
+    void run();
+    uint32_t maintain(uint32_t now);
+    void finishAttempt(uint32_t now);
+    size_t renderRequest(char* buffer, size_t size, const Entry& entry);
+    void receive(const uint8_t* data, size_t length);
+    void closed();
+    void notify() { if (task) xTaskNotifyGive(task); }
+
+    TaskHandle_t task = nullptr;
+    AsyncClient client;
+    const char* deviceName = "";
+
+    mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;  // Guards settings and the queue
+    WebhookSettings settings = {};
+    bool reconfigure = false;
+    // Every event is queued at most once besides the one being sent, so the queue cannot overflow
+    static_assert(QUEUE_CAPACITY > WEBHOOK_EVENT_COUNT, "webhook queue capacity");
+    Entry queue[QUEUE_CAPACITY] = {};
+    uint8_t queueCount = 0;
+    uint32_t nextId = 1;
+    uint32_t sendingId = 0;     // Entry of the current attempt, never merged into
+
+    // Only used by the webhook task
+    char host[64] = {};
+    char path[96] = {};
+    uint16_t port = 80;
+    bool valid = false;
+    uint32_t attemptAt = 0;
+
+    // Only used by the AsyncTCP task during an attempt
+    char statusLine[13] = {};
+    size_t statusLength = 0;
+
+    std::atomic<State> state{STATE_IDLE};
+    std::atomic<int16_t> responseStatus{0};
+    std::atomic<int16_t> lastResult{0};  // HTTP status of the last attempt, -1 if the endpoint was unreachable
+    std::atomic<uint32_t> deliveries{0};
+    std::atomic<uint32_t> failures{0};
+};
+
+extern Webhooks webhooks;
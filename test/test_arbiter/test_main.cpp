@@ -0,0 +1,112 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include <unity.h>
+#include "arbiter.h"
+#include "pins.h"
+#include "simulator.h"
+
+// Falling back to an older intent must never start or stop the generator, see CommandArbiter::nextAction()
+
+static Command command(CommandType type, CommandSource source) {
+  return {type, source, 0, 0, 0};
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Web START, hardwired STOP pulse: releasing STOP must not act on the stale web START
+void test_released_stop_does_not_restart() {
+  CommandArbiter arbiter;
+  arbiter.submit(command(COMMAND_START, COMMAND_SOURCE_HTTP), 0);
+  const CommandArbiter::Intent* action = arbiter.nextAction(0);
+  TEST_ASSERT_NOT_NULL(action);
+  TEST_ASSERT_EQUAL(COMMAND_START, action->command.type);
+
+  arbiter.submit(command(COMMAND_STOP, COMMAND_SOURCE_GPIO), 1000);
+  action = arbiter.nextAction(1000);
+  TEST_ASSERT_NOT_NULL(action);
+  TEST_ASSERT_EQUAL(COMMAND_STOP, action->command.type);
+
+  // The web START was dropped when the hardwired STOP overrode it
+  arbiter.clear(COMMAND_SOURCE_GPIO);
+  TEST_ASSERT_NULL(arbiter.resolve(2000));
+  TEST_ASSERT_NULL(arbiter.nextAction(2000));
+
+  // A new web START acts again
+  arbiter.submit(command(COMMAND_START, COMMAND_SOURCE_HTTP), 3000);
+  action = arbiter.nextAction(3000);
+  TEST_ASSERT_NOT_NULL(action);
+  TEST_ASSERT_EQUAL(COMMAND_START, action->command.type);
+}
+
+// Web STOP while the hardwired START is held: the expiry of the web STOP must not start the generator
+void test_expired_stop_does_not_start() {
+  CommandArbiter arbiter;
+  arbiter.submit(command(COMMAND_START, COMMAND_SOURCE_GPIO), 0);
+  TEST_ASSERT_NOT_NULL(arbiter.nextAction(0));
+
+  arbiter.submit(command(COMMAND_STOP, COMMAND_SOURCE_HTTP), 1000);
+  const CommandArbiter::Intent* action = arbiter.nextAction(1000);
+  TEST_ASSERT_NOT_NULL(action);
+  TEST_ASSERT_EQUAL(COMMAND_STOP, action->command.type);
+
+  uint32_t expired = 1000 + CommandArbiter::OVERRIDE_TTL;
+  TEST_ASSERT_EQUAL(COMMAND_SOURCE_GPIO, arbiter.resolve(expired)->command.source);
+  TEST_ASSERT_NULL(arbiter.nextAction(expired));
+}
+
+static uint32_t starterClosings = 0;
+static bool starterClosed = false;
+
+// Runs the control code while the engine follows the relays: it fires when K1 closes and dies when K2 closes
+static void runEngine(uint32_t ms) {
+  uint64_t until = hal::nowMicros64() + (uint64_t)ms * 1000;
+  while (hal::nowMicros64() < until) {
+    simulator.runUntil(min(until, hal::nowMicros64() + 10000));
+    if (hal::readPin(RELAY_K1) && !starterClosed) starterClosings++;
+    starterClosed = hal::readPin(RELAY_K1);
+    if (starterClosed) simulator.setInput(RUNNING_SIGNAL, HIGH);
+    if (hal::readPin(RELAY_K2)) simulator.setInput(RUNNING_SIGNAL, LOW);
+  }
+}
+
+// Both sequences against the control code, the starter must not close on the fallback
+void test_control_does_not_act_on_fallback() {
+  simulator.begin();
+  runEngine(1000);
+
+  simulator.queue(COMMAND_START, COMMAND_SOURCE_HTTP);
+  runEngine(powerUpDuration + 1000);
+  TEST_ASSERT_EQUAL(1, starterClosings);
+  TEST_ASSERT_TRUE(hal::readPin(RUNNING_SIGNAL));
+
+  simulator.setInput(STOP_SIGNAL, HIGH);
+  runEngine(1000);
+  simulator.setInput(STOP_SIGNAL, LOW);
+  runEngine(powerDownDuration + noStartTimeout);
+  TEST_ASSERT_FALSE(hal::readPin(RUNNING_SIGNAL));
+  TEST_ASSERT_EQUAL(1, starterClosings);
+
+  simulator.setInput(START_SIGNAL, HIGH);
+  runEngine(powerUpDuration + 1000);
+  TEST_ASSERT_EQUAL(2, starterClosings);
+  TEST_ASSERT_TRUE(hal::readPin(RUNNING_SIGNAL));
+
+  simulator.queue(COMMAND_STOP, COMMAND_SOURCE_HTTP);
+  runEngine(CommandArbiter::OVERRIDE_TTL + 60000);
+  TEST_ASSERT_FALSE(hal::readPin(RUNNING_SIGNAL));
+  TEST_ASSERT_EQUAL(2, starterClosings);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_released_stop_does_not_restart);
+  RUN_TEST(test_expired_stop_does_not_start);
+  RUN_TEST(test_control_does_not_act_on_fallback);
+  return UNITY_END();
+}
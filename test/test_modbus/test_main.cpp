@@ -0,0 +1,333 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+#include <unity.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include "crc16.h"
+#include "modbus_poller.h"
+#include "modbus_rtu.h"
+
+// The Modbus RTU master and the poller against a simulated slave on a virtual serial line,
+// including slaves that misbehave. The line delivers every byte one character time after the
+// previous one, the master is polled at a fixed interval of virtual time like in the control task.
+
+static const uint32_t BAUDRATE = 19200;
+static const uint32_t POLL_US = 1000;
+static const uint32_t RESPONSE_TIMEOUT_MS = 200;
+static const uint32_t CHARACTER_US = (10 * 1000000UL + BAUDRATE - 1) / BAUDRATE;
+
+// How the simulated slave answers a request
+enum Behaviour {
+  ANSWER,
+  SILENT,           // No response at all
+  EXCEPTION,        // Exception 0x02, illegal data address
+  CORRUPT_CRC,      // Last byte of the response flipped
+  TRUNCATED,        // Only the first bytes of the response
+  WRONG_UNIT,       // Response from another unit
+  SLOW,             // Pause of 1.5 characters inside the response, still within the frame
+  SPLIT,            // Pause of splitPause inside the response, which ends the frame
+  NOISE_BEFORE,     // Line noise right before the request
+  LATE,             // Response after the response timeout
+  BEHAVIOUR_COUNT
+};
+
+static const char* behaviourName(int behaviour) {
+  static const char* names[] = {"answer", "silent", "exception", "corrupt crc", "truncated",
+                                "wrong unit", "slow", "split", "noise before", "late"};
+  return names[behaviour];
+}
+
+// Both ends of the serial line plus the slave, in virtual time
+class SimulatedLine : public ModbusPort {
+  public:
+    SimulatedLine(uint32_t charTime, uint32_t responseTimeoutUs) : charTime(charTime), responseTimeout(responseTimeoutUs) {
+      for (uint16_t i = 0; i < 256; i++) registers[i] = 0x1000 + i * 7;
+    }
+
+    uint64_t now = 0;
+    Behaviour behaviour = ANSWER;
+    uint32_t responseDelay = 5000;   // Slave processing time after the end of the request
+    uint32_t truncateAt = 3;
+    uint32_t splitPause = 0;          // Has to be longer than the inter-frame gap plus the poll interval
+    uint16_t registers[256];
+
+    // Bytes the master can read now
+    int available() override {
+      int count = 0;
+      for (const auto& byte : toMaster) {
+        if (byte.first > now) break;
+        count++;
+      }
+      return count;
+    }
+
+    int read() override {
+      if (toMaster.empty() || toMaster.front().first > now) return -1;
+      int byte = toMaster.front().second;
+      toMaster.pop_front();
+      return byte;
+    }
+
+    size_t write(const uint8_t* data, size_t length) override {
+      // The transmitter is free once the previous frame was sent
+      if (now < txFreeAt) return 0;
+      uint64_t end = now + length * charTime;
+      txFreeAt = end;
+      respond(std::vector<uint8_t>(data, data + length), end);
+      return length;
+    }
+
+    // Time the last queued byte reaches the master
+    uint64_t quietAt() const { return toMaster.empty() ? 0 : toMaster.back().first; }
+
+    // Line noise reaching the master at the given time
+    void noise(uint64_t at, size_t count) {
+      for (size_t i = 0; i < count; i++) queue(at + i * charTime, 0xA5 ^ (uint8_t)i);
+    }
+
+  private:
+    void queue(uint64_t at, uint8_t byte) {
+      // Keep the bytes in time order, a byte can not overtake the previous one on the line
+      if (!toMaster.empty() && toMaster.back().first + charTime > at) at = toMaster.back().first + charTime;
+      toMaster.push_back({at, byte});
+    }
+
+    void respond(const std::vector<uint8_t>& request, uint64_t end) {
+      if (behaviour == SILENT || request.size() != 8) return;
+      if (modbusCrc16(request.data(), 6) != (request[6] | (request[7] << 8))) return;
+
+      uint8_t unit = request[0], function = request[1];
+      uint16_t address = (request[2] << 8) | request[3];
+      uint16_t value = (request[4] << 8) | request[5];
+      std::vector<uint8_t> response = {behaviour == WRONG_UNIT ? (uint8_t)(unit + 1) : unit, function};
+      if (behaviour == EXCEPTION) {
+        response[1] |= 0x80;
+        response.push_back(0x02);
+      } else if (function == ModbusRtuMaster::FUNCTION_WRITE_SINGLE_REGISTER) {
+        registers[address & 0xFF] = value;
+        response.insert(response.end(), request.begin() + 2, request.begin() + 6);
+      } else {
+        response.push_back(value * 2);
+        for (uint16_t i = 0; i < value; i++) {
+          uint16_t reg = registers[(address + i) & 0xFF];
+          response.push_back(reg >> 8);
+          response.push_back(reg & 0xFF);
+        }
+      }
+      uint16_t crc = modbusCrc16(response.data(), response.size());
+      response.push_back(crc & 0xFF);
+      response.push_back(crc >> 8);
+      if (behaviour == CORRUPT_CRC) response.back() ^= 0x01;
+      if (behaviour == TRUNCATED) response.resize(std::min<size_t>(truncateAt, response.size()));
+
+      uint64_t at = end + (behaviour == LATE ? responseTimeout + response.size() * charTime + 100000 : responseDelay);
+      for (size_t i = 0; i < response.size(); i++) {
+        if (i == response.size() / 2 && behaviour == SLOW) at += charTime * 3 / 2;
+        if (i == response.size() / 2 && behaviour == SPLIT) at += splitPause;
+        queue(at, response[i]);
+        at += charTime;
+      }
+    }
+
+    uint32_t charTime;
+    uint32_t responseTimeout;
+    uint64_t txFreeAt = 0;
+    std::deque<std::pair<uint64_t, uint8_t>> toMaster;
+};
+
+// Polls the master until the transaction ends, the virtual clock advances by POLL_US per poll
+static ModbusResult run(ModbusRtuMaster& master, SimulatedLine& line) {
+  while (!master.poll((uint32_t)line.now)) line.now += POLL_US;
+  return master.result();
+}
+
+// Upper bound of a transaction: request, response timeout, longest response, frame gap and polling
+static uint32_t bound(const ModbusRtuMaster& master, uint8_t count) {
+  return RESPONSE_TIMEOUT_MS * 1000 + (8 + 5 + 2 * count) * master.characterTime() + master.interFrameTime() + 2 * POLL_US;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Check values of the Modbus specification
+void test_crc_check_values() {
+  const uint8_t digits[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  const uint8_t frame[] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x0A};
+  TEST_ASSERT_EQUAL_HEX16(0x4B37, modbusCrc16(digits, sizeof(digits)));
+  TEST_ASSERT_EQUAL_HEX16(0xCDC5, modbusCrc16(frame, sizeof(frame)));  // Sent as C5 CD
+  TEST_ASSERT_EQUAL_HEX16(0x4B37, crc16::bitwise(digits, sizeof(digits)));
+  TEST_ASSERT_EQUAL_HEX16(0x4B37, crc16::table(digits, sizeof(digits)));
+  TEST_ASSERT_EQUAL_HEX16(0x4B37, crc16::sliced(digits, sizeof(digits)));
+  TEST_ASSERT_EQUAL_HEX16(0xCDC5, crc16::sliced(frame, sizeof(frame)));
+}
+
+// All CRC variants agree on random data, also when continued in pieces
+void test_crc_variants_agree() {
+  std::mt19937_64 random(1);
+  std::vector<uint8_t> data(300);
+  for (int run = 0; run < 20000; run++) {
+    size_t length = random() % data.size();
+    for (size_t i = 0; i < length; i++) data[i] = random();
+    uint16_t expected = crc16::bitwise(data.data(), length);
+    size_t split = length ? random() % length : 0;
+    std::string what = std::to_string(length) + " bytes, split after " + std::to_string(split);
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE(expected, crc16::table(data.data(), length), what.c_str());
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE(expected, crc16::sliced(data.data(), length), what.c_str());
+    TEST_ASSERT_EQUAL_HEX16_MESSAGE(expected, crc16::sliced(data.data() + split, length - split, crc16::sliced(data.data(), split)),
+                                    what.c_str());
+  }
+}
+
+// Every kind of slave ends the transaction with the expected result within its time bound
+void test_rtu_scenarios() {
+  SimulatedLine line(CHARACTER_US, RESPONSE_TIMEOUT_MS * 1000);
+  ModbusRtuMaster master(line, BAUDRATE, RESPONSE_TIMEOUT_MS);
+  line.splitPause = master.interFrameTime() + 2 * POLL_US;
+
+  struct Scenario {
+    Behaviour behaviour;
+    ModbusResult expected;
+  };
+  const Scenario scenarios[] = {
+    {ANSWER, MODBUS_OK},
+    {SILENT, MODBUS_TIMEOUT},
+    {EXCEPTION, MODBUS_EXCEPTION},
+    {CORRUPT_CRC, MODBUS_CRC_ERROR},
+    {TRUNCATED, MODBUS_INVALID_RESPONSE},
+    {WRONG_UNIT, MODBUS_INVALID_RESPONSE},
+    {SLOW, MODBUS_OK},
+    {SPLIT, MODBUS_INVALID_RESPONSE},
+    {NOISE_BEFORE, MODBUS_OK},
+    {LATE, MODBUS_TIMEOUT},
+  };
+  for (const Scenario& scenario : scenarios) {
+    const char* name = behaviourName(scenario.behaviour);
+    line.behaviour = scenario.behaviour;
+    line.now += 10000;
+    if (scenario.behaviour == NOISE_BEFORE) line.noise(line.now, 4);
+    TEST_ASSERT_TRUE_MESSAGE(master.readHoldingRegisters(1, 0x1000, 4, (uint32_t)line.now), name);
+    TEST_ASSERT_FALSE(master.readHoldingRegisters(1, 0x1000, 4, (uint32_t)line.now));  // Busy
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(modbusResultName(scenario.expected), modbusResultName(run(master, line)), name);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(bound(master, 4), master.duration(), name);
+    if (scenario.expected == MODBUS_OK) {
+      TEST_ASSERT_EQUAL_MESSAGE(4, master.registerCount(), name);
+      for (uint8_t i = 0; i < 4; i++) TEST_ASSERT_EQUAL_HEX16_MESSAGE(line.registers[i], master.registers()[i], name);
+    }
+    if (scenario.expected == MODBUS_EXCEPTION) TEST_ASSERT_EQUAL(0x02, master.exceptionCode());
+    // Let the rest of a late or split response pass
+    line.now += RESPONSE_TIMEOUT_MS * 1000 + 200000;
+  }
+}
+
+// Writing a register and reading it back, the largest read and the requests the master refuses
+void test_rtu_write_and_limits() {
+  SimulatedLine line(CHARACTER_US, RESPONSE_TIMEOUT_MS * 1000);
+  ModbusRtuMaster master(line, BAUDRATE, RESPONSE_TIMEOUT_MS);
+
+  TEST_ASSERT_TRUE(master.writeSingleRegister(1, 0x0010, 0xBEEF, (uint32_t)line.now));
+  TEST_ASSERT_EQUAL(MODBUS_OK, run(master, line));
+  TEST_ASSERT_EQUAL_HEX16(0xBEEF, master.registers()[0]);
+  TEST_ASSERT_TRUE(master.readInputRegisters(1, 0x0010, 1, (uint32_t)line.now));
+  TEST_ASSERT_EQUAL(MODBUS_OK, run(master, line));
+  TEST_ASSERT_EQUAL_HEX16(0xBEEF, master.registers()[0]);
+
+  TEST_ASSERT_TRUE(master.readHoldingRegisters(1, 0, ModbusRtuMaster::MAX_REGISTERS, (uint32_t)line.now));
+  TEST_ASSERT_EQUAL(MODBUS_OK, run(master, line));
+  TEST_ASSERT_EQUAL(ModbusRtuMaster::MAX_REGISTERS, master.registerCount());
+
+  TEST_ASSERT_FALSE(master.readHoldingRegisters(1, 0, 0, (uint32_t)line.now));
+  TEST_ASSERT_FALSE(master.readHoldingRegisters(1, 0, ModbusRtuMaster::MAX_REGISTERS + 1, (uint32_t)line.now));
+  TEST_ASSERT_FALSE(master.readHoldingRegisters(0, 0, 1, (uint32_t)line.now));  // Broadcast
+}
+
+// Random slaves and poll jitter, back to back, across the wrap of micros()
+void test_rtu_random_slaves() {
+  SimulatedLine line(CHARACTER_US, RESPONSE_TIMEOUT_MS * 1000);
+  ModbusRtuMaster master(line, BAUDRATE, RESPONSE_TIMEOUT_MS);
+  line.splitPause = master.interFrameTime() + 2 * POLL_US;
+  std::mt19937_64 random(1);
+
+  line.now = 0xFFFFFFFFULL - 5000000;
+  for (int run = 0; run < 20000; run++) {
+    line.behaviour = (Behaviour)(random() % BEHAVIOUR_COUNT);
+    line.responseDelay = random() % 50000;
+    line.truncateAt = 1 + random() % 6;
+    uint8_t count = 1 + random() % 16;
+    // A late response would be taken as the answer to the next request, Modbus RTU can not tell them apart
+    line.now = std::max(line.now, line.quietAt() + master.interFrameTime());
+    uint32_t noise = 0;
+    if (random() % 4 == 0) {
+      line.noise(line.now, 1 + random() % 3);
+      noise = 3 * master.characterTime() + master.interFrameTime();
+    }
+    const char* name = behaviourName(line.behaviour);
+    TEST_ASSERT_TRUE_MESSAGE(master.readHoldingRegisters(1, random() % 200, count, (uint32_t)line.now), name);
+    while (!master.poll((uint32_t)line.now)) line.now += 1 + random() % (2 * POLL_US);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(bound(master, count) + 2 * POLL_US + noise, master.duration(), name);
+    if (line.behaviour == ANSWER) TEST_ASSERT_EQUAL_STRING(modbusResultName(MODBUS_OK), modbusResultName(master.result()));
+    if (master.result() == MODBUS_OK) TEST_ASSERT_EQUAL_MESSAGE(count, master.registerCount(), name);
+  }
+}
+
+// The register map of src/main.cpp for two virtual hours with 2% of the transactions unanswered,
+// every register is read at its period
+void test_poller_reads_register_map() {
+  SimulatedLine line(CHARACTER_US, RESPONSE_TIMEOUT_MS * 1000);
+  ModbusRtuMaster master(line, BAUDRATE, RESPONSE_TIMEOUT_MS);
+  std::mt19937_64 random(1);
+
+  const ModbusRegister gensetRegisters[] = {
+    {"engine_hours", 1, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1000, 3600000},
+    {"battery_voltage", 1, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1001, 10000},
+    {"engine_rpm", 1, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1002, 1000},
+    {"generator_load", 1, ModbusRtuMaster::FUNCTION_READ_HOLDING_REGISTERS, 0x1003, 1000},
+  };
+  const uint8_t REGISTERS = sizeof(gensetRegisters) / sizeof(gensetRegisters[0]);
+  ModbusPoller poller(master, gensetRegisters, REGISTERS);
+
+  line.now = 1000000;
+  uint64_t endAt = line.now + 2 * 3600ULL * 1000000;
+  uint64_t lastRead[REGISTERS] = {}, maxInterval[REGISTERS] = {};
+  uint32_t unanswered = 0;
+  ModbusSnapshot previous = {};
+  while (line.now < endAt) {
+    if (!master.busy()) line.behaviour = random() % 50 == 0 ? SILENT : ANSWER;
+    if (poller.poll((uint32_t)(line.now / 1000), (uint32_t)line.now)) {
+      ModbusSnapshot snapshot = poller.snapshot();
+      if (master.result() != MODBUS_OK) unanswered++;
+      for (uint8_t i = 0; i < REGISTERS; i++) {
+        if (snapshot.updatedAt[i] == previous.updatedAt[i]) continue;
+        if (lastRead[i] != 0) maxInterval[i] = std::max(maxInterval[i], line.now - lastRead[i]);
+        lastRead[i] = line.now;
+        TEST_ASSERT_EQUAL_HEX16_MESSAGE(line.registers[gensetRegisters[i].address & 0xFF], snapshot.values[i], gensetRegisters[i].name);
+      }
+      previous = snapshot;
+    }
+    line.now += POLL_US;
+  }
+
+  for (uint8_t i = 0; i < REGISTERS; i++) {
+    // A failed read is repeated after the retry delay
+    uint64_t allowed = (gensetRegisters[i].period + ModbusPoller::RETRY_DELAY) * 1000ULL + bound(master, 4) + REGISTERS * 20000;
+    TEST_ASSERT_TRUE_MESSAGE(lastRead[i] != 0 && maxInterval[i] <= allowed, gensetRegisters[i].name);
+  }
+  TEST_ASSERT_EQUAL(unanswered, poller.snapshot().failures);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_crc_check_values);
+  RUN_TEST(test_crc_variants_agree);
+  RUN_TEST(test_rtu_scenarios);
+  RUN_TEST(test_rtu_write_and_limits);
+  RUN_TEST(test_rtu_random_slaves);
+  RUN_TEST(test_poller_reads_register_map);
+  return UNITY_END();
+}
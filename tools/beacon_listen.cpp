@@ -0,0 +1,175 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+
+/**
+ * Joins the multicast group of the status beacon and prints every datagram.
+ *
+ * Build and run on a PC in the same network:
+ *   c++ -O2 -std=c++17 -o beacon_listen tools/beacon_listen.cpp
+ *   ./beacon_listen
+ *
+ * Lost datagrams are reported from gaps in the sequence numbers, a sequence number
+ * that went backwards is reported as a reboot of the controller.
+ *
+ * Options:
+ *   --group ADDRESS   Multicast group (default 239.255.71.83)
+ *   --port N          UDP port (default 4783)
+ *   --interface IP    Address of the local interface to join on (default any)
+ *   --count N         Exit after N datagrams
+ *   --changes         Only print datagrams sent for a state change
+ *
+ * Exit code 0 after --count datagrams, 2 on invalid arguments or socket errors.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+
+#include "../src/status_beacon_format.h"
+
+static const char* const COMMAND_NAMES[] = {"start", "stop"};
+static const char* const SOURCE_NAMES[] = {"gpio", "http", "modbus", "mqtt", "internal"};
+
+struct Sender {
+  uint32_t nextSequence = 0;
+  uint64_t received = 0;
+  uint64_t lost = 0;
+};
+
+static void usage() {
+  fprintf(stderr, "usage: beacon_listen [--group ADDRESS] [--port N] [--interface IP] [--count N] [--changes]\n");
+}
+
+static std::string describe(const StatusBeaconPacket& packet) {
+  char text[512];
+  int length = snprintf(text, sizeof(text), "%-8s %s%s%s%s%s%s%s%s retries %u/%u",
+                        packet.reason == STATUS_BEACON_CHANGE ? "change" : "heartbeat",
+                        packet.flags & STATUS_BEACON_RUNNING ? "RUNNING" : "stopped",
+                        packet.flags & STATUS_BEACON_STARTING ? " starting" : "",
+                        packet.flags & STATUS_BEACON_STOPPING ? " stopping" : "",
+                        packet.flags & STATUS_BEACON_START_SIGNAL ? " START" : "",
+                        packet.flags & STATUS_BEACON_STOP_SIGNAL ? " STOP" : "",
+                        packet.flags & STATUS_BEACON_RELAY_K1 ? " K1" : "",
+                        packet.flags & STATUS_BEACON_RELAY_K2 ? " K2" : "",
+                        packet.flags & STATUS_BEACON_ALLOW_START ? "" : " start-disabled",
+                        packet.retryStartCount, packet.retryStopCount);
+  if (packet.intentCommand < 2) {
+    length += snprintf(text + length, sizeof(text) - length, " intent %s by %s", COMMAND_NAMES[packet.intentCommand],
+                       packet.intentSource < 5 ? SOURCE_NAMES[packet.intentSource] : "unknown");
+  }
+  length += snprintf(text + length, sizeof(text) - length, " changed %.1fs ago", packet.changedAgo / 1000.0);
+  for (uint8_t i = 0; i < packet.telemetryCount && i < STATUS_BEACON_TELEMETRY; i++) {
+    bool fresh = packet.telemetryFresh & (1 << i);
+    length += snprintf(text + length, sizeof(text) - length, i == 0 ? " telemetry %u%s" : ",%u%s",
+                       packet.telemetry[i], fresh ? "" : "?");
+  }
+  return text;
+}
+
+int main(int argc, char** argv) {
+  const char* groupAddress = "239.255.71.83";
+  const char* interfaceAddress = "0.0.0.0";
+  int port = 4783;
+  long count = -1;
+  bool changesOnly = false;
+
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--group") == 0 && hasValue) groupAddress = argv[++i];
+    else if (strcmp(argv[i], "--port") == 0 && hasValue) port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--interface") == 0 && hasValue) interfaceAddress = argv[++i];
+    else if (strcmp(argv[i], "--count") == 0 && hasValue) count = atol(argv[++i]);
+    else if (strcmp(argv[i], "--changes") == 0) changesOnly = true;
+    else {
+      usage();
+      return 2;
+    }
+  }
+
+  ip_mreq membership = {};
+  if (port < 1 || port > 65535 || inet_pton(AF_INET, groupAddress, &membership.imr_multiaddr) != 1
+      || inet_pton(AF_INET, interfaceAddress, &membership.imr_interface) != 1) {
+    usage();
+    return 2;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));  // Several listeners on one PC
+#endif
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_port = htons(port);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (fd < 0 || bind(fd, (sockaddr*)&local, sizeof(local)) != 0
+      || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+    perror("beacon_listen");
+    return 2;
+  }
+  printf("Listening on %s:%d\n", groupAddress, port);
+
+  std::map<uint32_t, Sender> senders;
+  for (long received = 0; count < 0 || received < count;) {
+    uint8_t buffer[1500];
+    sockaddr_in from = {};
+    socklen_t fromLength = sizeof(from);
+    ssize_t length = recvfrom(fd, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromLength);
+    if (length < 0) {
+      perror("recvfrom");
+      return 2;
+    }
+
+    char source[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from.sin_addr, source, sizeof(source));
+    StatusBeaconPacket packet;
+    if ((size_t)length < sizeof(packet) || memcmp(buffer, "GSTB", 4) != 0) {
+      printf("%s: ignoring %zd bytes, not a status beacon\n", source, length);
+      continue;
+    }
+    memcpy(&packet, buffer, sizeof(packet));
+    if (packet.version != STATUS_BEACON_VERSION) {
+      printf("%s: ignoring beacon version %u\n", source, packet.version);
+      continue;
+    }
+    received++;
+
+    Sender& sender = senders[from.sin_addr.s_addr];
+    if (sender.received > 0 && packet.sequence < sender.nextSequence) {
+      printf("%s: controller rebooted\n", source);
+    } else if (sender.received > 0 && packet.sequence > sender.nextSequence) {
+      sender.lost += packet.sequence - sender.nextSequence;
+      printf("%s: %u datagrams lost\n", source, packet.sequence - sender.nextSequence);
+    }
+    sender.nextSequence = packet.sequence + 1;
+    sender.received++;
+    if (changesOnly && packet.reason != STATUS_BEACON_CHANGE) continue;
+
+    time_t now = time(nullptr);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&now));
+    printf("%s %s #%u up %us %s\n", clock, source, packet.sequence, packet.uptime, describe(packet).c_str());
+    fflush(stdout);
+  }
+
+  for (const auto& entry : senders) {
+    in_addr address = {entry.first};
+    printf("%s: %llu received, %llu lost\n", inet_ntoa(address), (unsigned long long)entry.second.received,
+           (unsigned long long)entry.second.lost);
+  }
+  close(fd);
+  return 0;
+}
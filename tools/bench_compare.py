@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""
+Compares the results of two benchmark runs of the esp32dev-bench firmware.
+
+Capture the serial output of each firmware version, e.g. with
+    pio device monitor -e esp32dev-bench | tee bench-new.log
+and compare it against an older capture:
+    tools/bench_compare.py bench-old.log bench-new.log
+
+Only lines starting with "BENCH " are evaluated, everything else is ignored.
+"""
+
+import json
+import sys
+
+PREFIX = "BENCH "
+
+def load(path):
+    results = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            index = line.find(PREFIX)
+            if index < 0:
+                continue
+            try:
+                result = json.loads(line[index + len(PREFIX):])
+            except json.JSONDecodeError:
+                continue
+            results[result["name"]] = result
+    return results
+
+def change(old, new):
+    if old == 0:
+        return "n/a"
+    return "%+.1f%%" % ((new - old) * 100.0 / old)
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: %s <old capture> <new capture>" % sys.argv[0], file=sys.stderr)
+        return 2
+
+    old = load(sys.argv[1])
+    new = load(sys.argv[2])
+    if not old or not new:
+        print("no BENCH lines found", file=sys.stderr)
+        return 1
+
+    print("%-30s %12s %12s %9s %10s %10s" % ("benchmark", "old ns/op", "new ns/op", "change", "old alloc", "new alloc"))
+    for name in sorted(set(old) | set(new)):
+        a = old.get(name)
+        b = new.get(name)
+        if a is None or b is None:
+            print("%-30s %s" % (name, "only in " + ("new" if a is None else "old")))
+            continue
+        print("%-30s %12d %12d %9s %10.2f %10.2f" % (
+            name, a["nsPerOp"], b["nsPerOp"], change(a["nsPerOp"], b["nsPerOp"]),
+            a["allocsPerOp"], b["allocsPerOp"]))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
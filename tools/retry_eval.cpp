@@ -0,0 +1,419 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+
+/**
+ * Monte-Carlo evaluation of start retry policies against a stochastic generator model.
+ *
+ * The start cycles run through the control code of src/control.cpp in the simulator of
+ * the native build (see src/simulator.h), so the policies are evaluated against the
+ * firmware itself. Build and run on the PC, after `pio run -e native` fetched ArduinoJson:
+ *   c++ -O2 -std=gnu++17 -D GENSET_NATIVE -I native -I src -I .pio/libdeps/native/ArduinoJson/src \
+ *     -o retry_eval tools/retry_eval.cpp src/control.cpp src/gpio_trace.cpp src/hal_native.cpp \
+ *     src/metrics.cpp src/simulator.cpp src/start_stats.cpp src/tick_stats.cpp
+ *   ./retry_eval --cycles 10000
+ *
+ * Every start cycle raises the hardwired START input and answers the K1 edges of the
+ * control code with the generator model below, by raising RUNNING once the engine fired.
+ * A cycle ends when the generator runs and the starter is released, or when the control
+ * code reports start_failed. Each policy is a combination of start mode, retry count,
+ * power-up duration and no-start timeout, all combinations of the given lists are
+ * evaluated. Combinations the firmware rejects (power-up longer than the timeout) are skipped.
+ *
+ * The control code runs once per process, the cycles are spread over --jobs forked
+ * workers that each boot one simulation and take over the settings of every policy.
+ *
+ * Generator model, per start cycle:
+ *   - cold start with probability --cold-probability, multiplying the crank-to-fire time
+ *     by --cold-factor and adding --cold-failure to the failure probability
+ *   - crank-to-fire time is log-normal around --fire-median-ms with --fire-sigma
+ *   - every attempt fails independently with --failure-probability
+ *   - the battery sags by --sag-per-second volts per second of cranking and recovers by
+ *     --recovery-per-second while resting, a lower voltage slows cranking and makes
+ *     failures more likely, below --min-voltage the starter cannot crank the engine
+ *
+ * Options:
+ *   --modes fixed,until  --retries 0,1,2,3  --power-up 3000,5000  --timeout 15000
+ *   --cycles N (per policy)  --jobs N  --seed N  --csv
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "pins.h"
+#include "simulator.h"
+
+struct GeneratorModel {
+  double fireMedianMs = 2000;
+  double fireSigma = 0.35;
+  double failureProbability = 0.03;
+  double coldProbability = 0.3;
+  double coldFactor = 2.0;
+  double coldFailure = 0.10;
+  double restVoltage = 12.7;
+  double minVoltage = 9.6;
+  double sagPerSecond = 0.12;      // V per second of cranking
+  double recoveryPerSecond = 0.02; // V per second of rest
+  double failurePerVolt = 0.15;    // Added failure probability per volt of sag
+  int64_t horizonUs = 30LL * 60 * 1000000;  // Give up simulating after 30 minutes
+};
+
+struct Policy {
+  uint8_t startMode;
+  uint32_t retryCount;
+  uint32_t powerUpDuration;
+  uint32_t noStartTimeout;
+};
+
+// Histogram with 100 ms buckets for times up to the horizon, plain data to be shared with the workers
+struct TimeHistogram {
+  static constexpr int64_t BUCKET_US = 100000;
+  static constexpr size_t BUCKETS = 18001;
+  uint64_t buckets[BUCKETS] = {};
+
+  void record(int64_t us) { buckets[std::min<size_t>(us / BUCKET_US, BUCKETS - 1)]++; }
+
+  void merge(const TimeHistogram& other) {
+    for (size_t i = 0; i < BUCKETS; i++) buckets[i] += other.buckets[i];
+  }
+
+  // Upper bound of the bucket holding the percentile, in seconds
+  double percentile(double p) const {
+    uint64_t total = 0;
+    for (uint64_t count : buckets) total += count;
+    if (total == 0) return NAN;
+    uint64_t rank = (uint64_t)ceil(p * total), seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= std::max<uint64_t>(rank, 1)) return (i + 1) * BUCKET_US / 1e6;
+    }
+    return NAN;
+  }
+};
+
+struct Result {
+  uint64_t cycles = 0;
+  uint64_t successes = 0;
+  uint64_t attempts = 0;
+  double crankSeconds = 0;
+  double cycleSeconds = 0;
+  double maxContinuousCrank = 0;
+  TimeHistogram timeToPower;
+  TimeHistogram crankPerCycle;
+
+  void merge(const Result& other) {
+    cycles += other.cycles;
+    successes += other.successes;
+    attempts += other.attempts;
+    crankSeconds += other.crankSeconds;
+    cycleSeconds += other.cycleSeconds;
+    maxContinuousCrank = std::max(maxContinuousCrank, other.maxContinuousCrank);
+    timeToPower.merge(other.timeToPower);
+    crankPerCycle.merge(other.crankPerCycle);
+  }
+};
+
+struct Edge {
+  int64_t at;
+  bool level;
+};
+
+// What the control code did during the current cycle, in us since the START edge
+static int64_t cycleBegin = 0;
+static std::vector<Edge> starterEdges;
+static int64_t startedAt = -1;
+static int64_t failedAt = -1;
+
+static int64_t sinceBegin() { return (int64_t)hal::nowMicros64() - cycleBegin; }
+
+static void observeRecord(const TraceRecord& record) {
+  if (record.event == TRACE_OUTPUT && record.arg == TRACE_CHANNEL_K1) {
+    starterEdges.push_back({(int64_t)record.at - cycleBegin, record.value != 0});
+  }
+}
+
+static void observeEvent(WebhookEvent event, const String&) {
+  if (event == WEBHOOK_STARTED && startedAt < 0) startedAt = sinceBegin();
+  if (event == WEBHOOK_START_FAILED && failedAt < 0) failedAt = sinceBegin();
+}
+
+static void applyPolicy(const Policy& policy) {
+  simulator.takeOverSetting(TRACE_SETTING_ALLOW_START, 1);
+  simulator.takeOverSetting(TRACE_SETTING_START_MODE, policy.startMode);
+  simulator.takeOverSetting(TRACE_SETTING_RETRY_COUNT, policy.retryCount);
+  simulator.takeOverSetting(TRACE_SETTING_POWER_UP_DURATION, policy.powerUpDuration);
+  simulator.takeOverSetting(TRACE_SETTING_NO_START_TIMEOUT, policy.noStartTimeout);
+}
+
+/**
+ * Simulates one start cycle from the START edge until the generator runs or the
+ * control code gives up, then releases START and stops the engine again.
+ */
+static void simulateCycle(const GeneratorModel& generator, std::mt19937_64& random, Result& result) {
+  const int64_t STEP_US = 10000;        // The engine reacts to a closed starter within one RUNNING poll
+  const uint64_t REST_US = 1000000;
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> normal(0, 1);
+
+  // Every cycle starts on a full second, at the same phase of the control timers
+  cycleBegin = (hal::nowMicros64() + REST_US) / 1000000 * 1000000 + 1000000;
+  simulator.runUntil(cycleBegin);
+  starterEdges.clear();
+  startedAt = failedAt = -1;
+
+  bool cold = uniform(random) < generator.coldProbability;
+  double voltage = generator.restVoltage;
+  int64_t crankStart = 0, restStart = 0, end = 0, crankTotal = 0;
+  int64_t fireAt = INT64_MAX;
+  bool fired = false;
+  size_t seen = 0;
+
+  simulator.setInput(START_SIGNAL, HIGH);
+  for (;;) {
+    for (; seen < starterEdges.size(); seen++) {
+      const Edge& edge = starterEdges[seen];
+      if (edge.level) {
+        // New attempt, the battery recovered while resting
+        result.attempts++;
+        crankStart = edge.at;
+        if (restStart > 0) voltage = std::min(generator.restVoltage, voltage + generator.recoveryPerSecond * (edge.at - restStart) / 1e6);
+
+        double sag = generator.restVoltage - voltage;
+        double failure = generator.failureProbability + (cold ? generator.coldFailure : 0) + generator.failurePerVolt * sag;
+        if (!fired && voltage >= generator.minVoltage && uniform(random) >= failure) {
+          double speed = (voltage - generator.minVoltage) / (generator.restVoltage - generator.minVoltage);
+          double fireMs = generator.fireMedianMs * exp(generator.fireSigma * normal(random)) * (cold ? generator.coldFactor : 1)
+                          / std::max(speed, 0.05);
+          fireAt = edge.at + (int64_t)(fireMs * 1000);
+        }
+      } else {
+        int64_t crank = edge.at - crankStart;
+        crankTotal += crank;
+        result.maxContinuousCrank = std::max(result.maxContinuousCrank, crank / 1e6);
+        voltage -= generator.sagPerSecond * crank / 1e6;
+        restStart = edge.at;
+        fireAt = INT64_MAX;
+      }
+    }
+
+    int64_t now = sinceBegin();
+    bool cranking = hal::readPin(RELAY_K1);
+    if (fired && startedAt >= 0 && !cranking) {
+      end = std::max(startedAt, restStart);
+      break;
+    }
+    if (failedAt >= 0 || now >= generator.horizonUs) {
+      end = failedAt >= 0 ? failedAt : generator.horizonUs;
+      break;
+    }
+    // The engine fires if the starter is still cranking when the fire time is reached
+    if (now >= fireAt && cranking) {
+      fired = true;
+      fireAt = INT64_MAX;
+      simulator.setInput(RUNNING_SIGNAL, HIGH);
+      continue;
+    }
+    simulator.runUntil(cycleBegin + std::min(fireAt, now + STEP_US));
+  }
+
+  if (startedAt >= 0) {
+    result.successes++;
+    result.timeToPower.record(startedAt);
+  }
+  result.cycles++;
+  result.crankSeconds += crankTotal / 1e6;
+  result.cycleSeconds += std::max<int64_t>(end, 1) / 1e6;
+  result.crankPerCycle.record(crankTotal);
+
+  // Release START before the engine stops, so a pending no-start check does not retry
+  simulator.setInput(START_SIGNAL, LOW);
+  simulator.run(200);
+  if (fired) simulator.setInput(RUNNING_SIGNAL, LOW);
+}
+
+static std::vector<uint32_t> parseList(const char* text) {
+  std::vector<uint32_t> values;
+  for (const char* p = text; *p;) {
+    values.push_back(strtoul(p, (char**)&p, 10));
+    if (*p == ',') p++;
+    else if (*p) break;
+  }
+  return values;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr,
+          "usage: %s [--modes fixed,until] [--retries 0,1,2,3] [--power-up 3000,5000] [--timeout 15000]\n"
+          "          [--cycles N] [--jobs N] [--seed N] [--csv] [generator model options, see source]\n",
+          name);
+}
+
+int main(int argc, char** argv) {
+  std::vector<uint8_t> modes = {START_MODE_FIXED, START_MODE_UNTIL_RUNNING};
+  std::vector<uint32_t> retries = {0, 1, 2, 3};
+  std::vector<uint32_t> powerUps = {3000, 5000, 8000};
+  std::vector<uint32_t> timeouts = {10000, 15000, 30000};
+  uint64_t cycles = 10000;
+  unsigned jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  uint64_t seed = 1;
+  bool csv = false;
+  GeneratorModel generator;
+
+  struct { const char* name; double* value; } doubles[] = {
+    {"--fire-median-ms", &generator.fireMedianMs}, {"--fire-sigma", &generator.fireSigma},
+    {"--failure-probability", &generator.failureProbability}, {"--cold-probability", &generator.coldProbability},
+    {"--cold-factor", &generator.coldFactor}, {"--cold-failure", &generator.coldFailure},
+    {"--rest-voltage", &generator.restVoltage}, {"--min-voltage", &generator.minVoltage},
+    {"--sag-per-second", &generator.sagPerSecond}, {"--recovery-per-second", &generator.recoveryPerSecond},
+    {"--failure-per-volt", &generator.failurePerVolt},
+  };
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool consumed = true;
+    if (strcmp(arg, "--csv") == 0) { csv = true; consumed = false; }
+    else if (value == nullptr) { usage(argv[0]); return 2; }
+    else if (strcmp(arg, "--modes") == 0) {
+      modes.clear();
+      if (strstr(value, "fixed")) modes.push_back(START_MODE_FIXED);
+      if (strstr(value, "until")) modes.push_back(START_MODE_UNTIL_RUNNING);
+    }
+    else if (strcmp(arg, "--retries") == 0) retries = parseList(value);
+    else if (strcmp(arg, "--power-up") == 0) powerUps = parseList(value);
+    else if (strcmp(arg, "--timeout") == 0) timeouts = parseList(value);
+    else if (strcmp(arg, "--cycles") == 0) cycles = std::max(1ULL, strtoull(value, nullptr, 10));
+    else if (strcmp(arg, "--jobs") == 0) jobs = std::max(1ul, strtoul(value, nullptr, 10));
+    else if (strcmp(arg, "--seed") == 0) seed = strtoull(value, nullptr, 10);
+    else {
+      bool known = false;
+      for (auto& option : doubles) {
+        if (strcmp(arg, option.name) == 0) {
+          *option.value = atof(value);
+          known = true;
+        }
+      }
+      if (!known) { usage(argv[0]); return 2; }
+    }
+    if (consumed) i++;
+  }
+
+  std::vector<Policy> policies;
+  for (uint8_t mode : modes)
+    for (uint32_t retryCount : retries)
+      for (uint32_t powerUp : powerUps)
+        for (uint32_t timeout : timeouts) {
+          // Rejected by setPowerUpDuration()
+          if (powerUp <= timeout) policies.push_back({mode, retryCount, powerUp, timeout});
+        }
+  if (policies.empty()) { usage(argv[0]); return 2; }
+
+  // Work is split in chunks, each with its own deterministic random stream. The results
+  // are written by the workers to shared memory, only the touched pages are allocated.
+  const uint64_t CHUNK = 1000;
+  uint64_t chunksPerPolicy = (cycles + CHUNK - 1) / CHUNK;
+  uint64_t chunks = chunksPerPolicy * policies.size();
+  size_t sharedSize = sizeof(std::atomic<uint64_t>) + chunks * sizeof(Result);
+  void* shared = mmap(nullptr, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    return 2;
+  }
+  std::atomic<uint64_t>* nextChunk = new (shared) std::atomic<uint64_t>(0);
+  Result* results = new (nextChunk + 1) Result[chunks];
+
+  auto started = std::chrono::steady_clock::now();
+  fflush(stdout);
+  for (unsigned job = 0; job < jobs; job++) {
+    pid_t child = fork();
+    if (child < 0) {
+      perror("fork");
+      return 2;
+    }
+    if (child > 0) continue;
+
+    gpioTrace.observer = observeRecord;
+    simulator.onEvent = observeEvent;
+    simulator.begin();
+    for (uint64_t chunk = (*nextChunk)++; chunk < chunks; chunk = (*nextChunk)++) {
+      applyPolicy(policies[chunk / chunksPerPolicy]);
+      uint64_t first = (chunk % chunksPerPolicy) * CHUNK;
+      uint64_t count = std::min(CHUNK, cycles - first);
+      std::mt19937_64 random(seed * 0x9E3779B97F4A7C15ULL + chunk % chunksPerPolicy);
+      for (uint64_t i = 0; i < count; i++) simulateCycle(generator, random, results[chunk]);
+    }
+    _exit(0);
+  }
+  bool failed = false;
+  int status;
+  for (unsigned job = 0; job < jobs; job++) {
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = true;
+  }
+  if (failed) {
+    fprintf(stderr, "a worker failed\n");
+    return 2;
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  // Same random streams for every policy, so policies are compared on the same starts
+  std::vector<std::pair<Policy, Result>> rows;
+  for (size_t p = 0; p < policies.size(); p++) {
+    Result total;
+    for (uint64_t c = 0; c < chunksPerPolicy; c++) total.merge(results[p * chunksPerPolicy + c]);
+    rows.push_back({policies[p], total});
+  }
+  std::stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+    double sa = (double)a.second.successes / a.second.cycles, sb = (double)b.second.successes / b.second.cycles;
+    if (sa != sb) return sa > sb;
+    return a.second.timeToPower.percentile(0.95) < b.second.timeToPower.percentile(0.95);
+  });
+
+  if (csv) {
+    printf("mode,retryCount,powerUpDuration,noStartTimeout,cycles,success,attemptsPerCycle,crankSecondsPerCycle,"
+           "crankSecondsP99,maxContinuousCrank,starterDuty,timeToPowerP50,timeToPowerP95\n");
+  } else {
+    printf("%-6s %7s %8s %8s %8s %8s %9s %9s %8s %7s %8s %8s\n", "mode", "retries", "powerUp", "timeout", "success",
+           "attempts", "crank s", "crank p99", "max s", "duty", "ttp p50", "ttp p95");
+  }
+  for (const auto& row : rows) {
+    const Policy& policy = row.first;
+    const Result& result = row.second;
+    double success = (double)result.successes / result.cycles;
+    double attempts = (double)result.attempts / result.cycles;
+    double crank = result.crankSeconds / result.cycles;
+    double duty = result.crankSeconds / result.cycleSeconds;
+    const char* mode = policy.startMode == START_MODE_UNTIL_RUNNING ? "until" : "fixed";
+    if (csv) {
+      printf("%s,%u,%u,%u,%" PRIu64 ",%.6f,%.4f,%.3f,%.1f,%.1f,%.4f,%.1f,%.1f\n", mode, policy.retryCount,
+             policy.powerUpDuration, policy.noStartTimeout, result.cycles, success, attempts, crank,
+             result.crankPerCycle.percentile(0.99), result.maxContinuousCrank, duty, result.timeToPower.percentile(0.5),
+             result.timeToPower.percentile(0.95));
+    } else {
+      printf("%-6s %7u %8u %8u %7.3f%% %8.2f %9.2f %9.1f %8.1f %6.1f%% %7.1fs %7.1fs\n", mode, policy.retryCount,
+             policy.powerUpDuration, policy.noStartTimeout, success * 100, attempts, crank,
+             result.crankPerCycle.percentile(0.99), result.maxContinuousCrank, duty * 100,
+             result.timeToPower.percentile(0.5), result.timeToPower.percentile(0.95));
+    }
+  }
+  fprintf(stderr, "%" PRIu64 " start cycles of %zu policies in %.2f s on %u workers (%.0f cycles/s)\n",
+          cycles * policies.size(), policies.size(), elapsed, jobs, cycles * policies.size() / elapsed);
+  return 0;
+}
@@ -0,0 +1,333 @@
+/**
+ * Genset control
+ * (c) 2024 Martin Verges
+ *
+ * Licensed under CC BY-NC-SA 4.0
+ * (Attribution-NonCommercial-ShareAlike 4.0 International)
+**/
+
+/**
+ * Replays a GPIO trace downloaded from /gpioTrace against the control code and checks
+ * that the recorded relay edges match the replayed ones.
+ *
+ * The control code of src/control.cpp runs in the simulator of the native build (see
+ * src/simulator.h), so a trace is always replayed against the firmware itself and can be
+ * bisected by building the tool from each firmware version. Build and run on the PC, after
+ * `pio run -e native` fetched ArduinoJson:
+ *   c++ -O2 -std=gnu++17 -D GENSET_NATIVE -I native -I src -I .pio/libdeps/native/ArduinoJson/src \
+ *     -o trace_replay tools/trace_replay.cpp src/control.cpp src/gpio_trace.cpp src/hal_native.cpp \
+ *     src/metrics.cpp src/simulator.cpp src/start_stats.cpp src/tick_stats.cpp
+ *   ./trace_replay genset-trace.bin
+ *
+ * The raw input edges of the trace drive the input pins, intents of the web UI, Modbus
+ * and MQTT are queued as commands and setting changes are taken over, all at their
+ * recorded time. Everything else, the debounce decisions, the hardwired intents and the
+ * relays, is produced by the control code and compared with the trace: a relay edge that
+ * differs is an error, a debounce decision that differs a warning.
+ *
+ * The timers of the control code are aligned with the device using the first debounce
+ * decision of START or STOP, which is taken on the 50 ms grid of checkForSignals().
+ *
+ * Running the control code costs throughput compared to a model of it: while an input is
+ * being debounced or a relay is engaged, the control loop ticks through every callback
+ * like on the device. Idle time in between is skipped (see Simulator::idleUntil()), so a
+ * dense trace replays at about 50k events/s and a mostly idle one at millions of times
+ * real time.
+ *
+ * Options:
+ *   --tolerance-ms N  Allowed difference between replayed and recorded edges (default 25)
+ *   --repeat N        Replay N times and report the throughput, for long captures
+ *   --verbose         Print every record and the log of the control code
+ *
+ * Exit code 0 if the trace matches, 1 on mismatches, 2 on invalid input.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "pins.h"
+#include "simulator.h"
+
+// Delay of the first checkForSignals() after Simulator::begin(), see startControl()
+static const uint64_t FIRST_SIGNAL_CHECK = 200000;  // us
+static const uint64_t SIGNAL_CHECK_INTERVAL = 50000;
+
+static const uint8_t INPUT_PINS[] = {START_SIGNAL, STOP_SIGNAL, RUNNING_SIGNAL};  // By TraceChannel
+
+struct Edge {
+  uint64_t at;
+  bool level;
+};
+
+struct Issue {
+  uint64_t at;
+  bool error;
+  std::string text;
+};
+
+// Edges of the relays (TRACE_OUTPUT) and of the debounced inputs (TRACE_DEBOUNCED) by TraceChannel
+struct Edges {
+  std::vector<Edge> relays[TRACE_CHANNEL_COUNT];
+  std::vector<Edge> debounced[TRACE_CHANNEL_COUNT];
+
+  void add(const TraceRecord& record) {
+    if (record.arg >= TRACE_CHANNEL_COUNT) return;
+    if (record.event == TRACE_OUTPUT) relays[record.arg].push_back({record.at, record.value != 0});
+    if (record.event == TRACE_DEBOUNCED) debounced[record.arg].push_back({record.at, record.value != 0});
+  }
+};
+
+static Edges replayed;
+static uint64_t replayedFrom = 0;
+
+static void collect(const TraceRecord& record) {
+  // The initial decisions of a replay that does not start at boot were not recorded
+  if (record.at >= replayedFrom) replayed.add(record);
+}
+
+static const char* channelName(uint8_t channel) {
+  static const char* names[] = {"START", "STOP", "RUNNING", "K1", "K2"};
+  return channel < TRACE_CHANNEL_COUNT ? names[channel] : "?";
+}
+
+static const char* levelName(bool level) { return level ? "HIGH" : "LOW"; }
+
+static std::string seconds(uint64_t t) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.3fs", t / 1e6);
+  return buffer;
+}
+
+static bool load(const char* path, TraceFileHeader& header, std::vector<TraceRecord>& records) {
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+  bool ok = fread(&header, sizeof(header), 1, file) == 1;
+  if (!ok || memcmp(header.magic, "GTRC", 4) != 0) {
+    fprintf(stderr, "%s: not a GPIO trace\n", path);
+    ok = false;
+  } else if (header.version != TRACE_FORMAT_VERSION || header.recordSize != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: unsupported trace format version %u\n", path, header.version);
+    ok = false;
+  } else {
+    records.resize(header.count);
+    if (fread(records.data(), sizeof(TraceRecord), header.count, file) != header.count) {
+      fprintf(stderr, "%s: truncated, expected %" PRIu32 " records\n", path, header.count);
+      ok = false;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+/**
+ * Time to boot the simulator at, so its checkForSignals() runs on the same 50 ms grid as
+ * on the device and before the first record that is replayed.
+ */
+static uint64_t bootTime(const std::vector<TraceRecord>& records, bool sinceBoot) {
+  if (records.empty()) return 0;
+  uint64_t first = records[0].at;
+  for (const TraceRecord& record : records) {
+    if (record.event != TRACE_DEBOUNCED || record.arg > TRACE_CHANNEL_STOP) continue;
+    // A boot trace contains the initial decisions of the first checkForSignals()
+    if (sinceBoot) return record.at >= FIRST_SIGNAL_CHECK ? record.at - FIRST_SIGNAL_CHECK : 0;
+    // Otherwise boot on its grid, with the initial decisions before the first record
+    uint64_t checks = (record.at - first) / SIGNAL_CHECK_INTERVAL + 1;
+    uint64_t before = FIRST_SIGNAL_CHECK + checks * SIGNAL_CHECK_INTERVAL;
+    return record.at >= before ? record.at - before : 0;
+  }
+  return first >= 1000000 ? first - 1000000 : 0;
+}
+
+/**
+ * Replays the trace in this process, the control code can only run once per process.
+ *
+ * @return The issues found, sorted by time.
+ */
+static std::vector<Issue> replay(const TraceFileHeader& header, const std::vector<TraceRecord>& records,
+                                 uint64_t tolerance) {
+  std::vector<Issue> issues;
+  bool sinceBoot = header.flags & TRACE_FLAG_SINCE_BOOT;
+  uint64_t boot = bootTime(records, sinceBoot);
+
+  // Everything before the boot of the simulator is its initial state
+  uint8_t levels = header.baseLevels;
+  uint32_t settings[TRACE_SETTING_COUNT];
+  memcpy(settings, header.baseSettings, sizeof(settings));
+  size_t next = 0;
+  for (; next < records.size() && records[next].at < boot; next++) {
+    const TraceRecord& record = records[next];
+    if (record.event == TRACE_INPUT && record.arg <= TRACE_CHANNEL_RUNNING) {
+      levels = (levels & ~(1 << record.arg)) | ((record.value & 1) << record.arg);
+    } else if (record.event == TRACE_SETTING && record.arg < TRACE_SETTING_COUNT) {
+      settings[record.arg] = record.value;
+    }
+  }
+
+  Edges recorded;
+  for (size_t i = next; i < records.size(); i++) recorded.add(records[i]);
+
+  replayed = {};
+  replayedFrom = sinceBoot || next == records.size() ? 0 : records[next].at;
+  gpioTrace.observer = collect;
+  for (uint8_t channel = 0; channel <= TRACE_CHANNEL_RUNNING; channel++) {
+    hal::setInput(INPUT_PINS[channel], (levels >> channel) & 1);
+  }
+  hal::advanceTo(boot);
+  simulator.begin();
+  // A boot trace records the settings loaded from NVS, otherwise its base settings apply
+  if (!sinceBoot) {
+    for (uint8_t i = 0; i < TRACE_SETTING_COUNT; i++) simulator.takeOverSetting((TraceSetting)i, settings[i]);
+  }
+
+  for (; next < records.size(); next++) {
+    const TraceRecord& record = records[next];
+    simulator.runUntil(record.at);
+    switch (record.event) {
+      case TRACE_INPUT:
+        if (record.arg <= TRACE_CHANNEL_RUNNING) simulator.setInput(INPUT_PINS[record.arg], record.value & 1);
+        break;
+      case TRACE_INTENT:
+        // Hardwired intents follow from the inputs, the others were queued commands
+        if (record.arg == COMMAND_SOURCE_GPIO || record.arg >= COMMAND_SOURCE_COUNT) break;
+        if (record.value == COMMAND_START || record.value == COMMAND_STOP) {
+          simulator.queue((CommandType)record.value, (CommandSource)record.arg);
+        }
+        break;
+      case TRACE_SETTING:
+        if (record.arg < TRACE_SETTING_COUNT) simulator.takeOverSetting((TraceSetting)record.arg, record.value);
+        break;
+      default:
+        break;
+    }
+  }
+  simulator.runUntil(std::max(header.capturedAt, hal::nowMicros64()));
+  gpioTrace.observer = nullptr;
+
+  // Everything after the first mismatch of a relay is out of sync
+  for (uint8_t channel : {TRACE_CHANNEL_K1, TRACE_CHANNEL_K2}) {
+    const std::vector<Edge>& want = recorded.relays[channel];
+    const std::vector<Edge>& got = replayed.relays[channel];
+    for (size_t i = 0; i < std::max(want.size(), got.size()); i++) {
+      if (i >= want.size()) {
+        issues.push_back({got[i].at, true, std::string("replay switched ") + channelName(channel) + " " + levelName(got[i].level)
+                          + ", not recorded"});
+      } else if (i >= got.size()) {
+        issues.push_back({want[i].at, true, std::string("recorded ") + channelName(channel) + " " + levelName(want[i].level)
+                          + ", not replayed"});
+      } else if (want[i].level != got[i].level || std::max(want[i].at, got[i].at) - std::min(want[i].at, got[i].at) > tolerance) {
+        issues.push_back({want[i].at, true, std::string("recorded ") + channelName(channel) + " " + levelName(want[i].level)
+                          + " at " + seconds(want[i].at) + ", replayed " + levelName(got[i].level) + " at " + seconds(got[i].at)});
+      } else {
+        continue;
+      }
+      break;
+    }
+  }
+  for (uint8_t channel = 0; channel <= TRACE_CHANNEL_RUNNING; channel++) {
+    const std::vector<Edge>& want = recorded.debounced[channel];
+    const std::vector<Edge>& got = replayed.debounced[channel];
+    for (size_t i = 0; i < std::max(want.size(), got.size()); i++) {
+      if (i < want.size() && i < got.size() && want[i].level == got[i].level
+          && std::max(want[i].at, got[i].at) - std::min(want[i].at, got[i].at) <= tolerance) {
+        continue;
+      }
+      uint64_t at = i < want.size() ? want[i].at : got[i].at;
+      std::string text = std::string(channelName(channel)) + " debounced ";
+      text += i < want.size() ? std::string("to ") + levelName(want[i].level) + " at " + seconds(want[i].at) : "nothing";
+      text += " on the device, ";
+      text += i < got.size() ? std::string("to ") + levelName(got[i].level) + " at " + seconds(got[i].at) : "nothing";
+      issues.push_back({at, false, text + " in the replay"});
+      break;
+    }
+  }
+  std::stable_sort(issues.begin(), issues.end(), [](const Issue& a, const Issue& b) { return a.at < b.at; });
+  return issues;
+}
+
+static void printRecord(const TraceRecord& record) {
+  static const char* events[] = {"input", "debounced", "intent", "output", "setting"};
+  printf("%12s %-9s arg=%-3u value=%" PRIu32 "\n", seconds(record.at).c_str(),
+         record.event < 5 ? events[record.event] : "?", record.arg, record.value);
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [--tolerance-ms N] [--repeat N] [--verbose] trace.bin\n", program);
+}
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  uint64_t toleranceMs = 25;
+  long repeat = 1;
+  bool verbose = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--tolerance-ms") == 0 && i + 1 < argc) toleranceMs = strtoull(argv[++i], nullptr, 10);
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) repeat = std::max(1L, atol(argv[++i]));
+    else if (strcmp(argv[i], "--verbose") == 0) verbose = true;
+    else if (path == nullptr && argv[i][0] != '-') path = argv[i];
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == nullptr) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  TraceFileHeader header;
+  std::vector<TraceRecord> records;
+  if (!load(path, header, records)) return 2;
+
+  printf("Firmware %.*s, %" PRIu32 " records, %" PRIu32 " dropped\n", (int)sizeof(header.firmware), header.firmware,
+         header.count, header.dropped);
+  if (!(header.flags & TRACE_FLAG_SINCE_BOOT)) {
+    printf("Trace does not start at boot, the control state before the first record is assumed idle\n");
+  }
+  if (verbose) {
+    for (const TraceRecord& record : records) printRecord(record);
+  }
+
+  // Additional runs for the throughput each get a fresh copy of the control code
+  auto started = std::chrono::steady_clock::now();
+  fflush(stdout);
+  for (long run = 1; run < repeat; run++) {
+    pid_t child = fork();
+    if (child == 0) {
+      replay(header, records, toleranceMs * 1000);
+      _exit(0);
+    }
+    if (child < 0 || waitpid(child, nullptr, 0) != child) {
+      perror("fork");
+      return 2;
+    }
+  }
+  simulator.verbose = verbose;
+  std::vector<Issue> issues = replay(header, records, toleranceMs * 1000);
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  size_t errors = 0;
+  for (const Issue& issue : issues) {
+    if (issue.error) errors++;
+    printf("%12s %s: %s\n", seconds(issue.at).c_str(), issue.error ? "ERROR" : "warning", issue.text.c_str());
+  }
+
+  printf("K1 edges: %zu, K2 edges: %zu, %s\n", replayed.relays[TRACE_CHANNEL_K1].size(),
+         replayed.relays[TRACE_CHANNEL_K2].size(), errors == 0 ? "outputs match" : "outputs DIFFER");
+  if (elapsed > 0) {
+    printf("Replayed %.0f events in %.3f s (%.0f events/s, %.0fx real time)\n", (double)records.size() * repeat, elapsed,
+           records.size() * repeat / elapsed,
+           records.empty() ? 0.0 : (header.capturedAt - records[0].at) / 1e6 * repeat / elapsed);
+  }
+  return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for a webhook receiver, prints every event posted by the controller.
+
+Run it on a PC in the same network and point the controller at it:
+    tools/webhook_sink.py --port 8080
+    curl 'http://genset-control.local/setWebhook?url=http://<pc>:8080/hook'
+    curl 'http://genset-control.local/testWebhook'
+
+With --fail N the first N requests are answered with 500, to watch the retries and
+their backoff. Retries of an already received event (same X-Genset-Event-Id) are
+marked as duplicate.
+"""
+
+import argparse
+import json
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print webhooks of the genset controller")
+    parser.add_argument("--port", type=int, default=8080, help="TCP port to listen on (default 8080)")
+    parser.add_argument("--fail", type=int, default=0, help="answer the first N requests with 500")
+    args = parser.parse_args()
+
+    state = {"failures": args.fail, "seen": set(), "last": {}}
+
+    class Handler(BaseHTTPRequestHandler):
+        def do_POST(self):
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+            event_id = self.headers.get("X-Genset-Event-Id", "?")
+            try:
+                event = json.loads(body)
+            except json.JSONDecodeError:
+                event = {"raw": body.decode(errors="replace")}
+
+            now = time.monotonic()
+            previous = state["last"].get(event_id)
+            state["last"][event_id] = now
+            since = " %.1fs after the previous attempt" % (now - previous) if previous else ""
+            if state["failures"] > 0:
+                state["failures"] -= 1
+                status = 500
+            else:
+                status = 200
+            duplicate = " duplicate" if event_id in state["seen"] else ""
+            if status == 200:
+                state["seen"].add(event_id)
+
+            print("%s %s -> %d%s%s %s" % (time.strftime("%H:%M:%S"), self.client_address[0], status, duplicate,
+                                          since, json.dumps(event)))
+            sys.stdout.flush()
+            self.send_response(status)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+
+        def log_message(self, format, *args):
+            pass  # One line per event is printed above
+
+    server = HTTPServer(("", args.port), Handler)
+    print("Listening on port %d" % args.port)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()